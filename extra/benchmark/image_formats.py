@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# Shifter, Copyright (c) 2016, The Regents of the University of California,
+# through Lawrence Berkeley National Laboratory (subject to receipt of any
+# required approvals from the U.S. Dept. of Energy).  All rights reserved.
+#
+# See LICENSE for full text.
+
+"""
+Compare squashfs and erofs images built by the gateway converters.
+
+A synthetic python-style tree (many small modules plus a few large shared
+objects) is converted with converters.convert for each format, which gives
+the import cost (build seconds and image size).  Run as root with loop
+device support and --mount to also time a cold container start: each image
+is loop mounted, the page cache dropped, and the startup files (the
+interpreter, shared objects and the first modules of every package) are
+read, followed by a random read of every file.  Run with PYTHONPATH pointing
+at the imagegw directory, e.g.
+
+    PYTHONPATH=imagegw extra/benchmark/image_formats.py -p 200 --mount
+"""
+
+import argparse
+import os
+import random
+import shutil
+import subprocess
+import tempfile
+import time
+
+from shifter_imagegw import converters
+
+
+def make_tree(path, packages, modules):
+    """Write the image tree and return its files, startup files first."""
+    startup = []
+    others = []
+    libdir = os.path.join(path, 'usr/lib')
+    os.makedirs(os.path.join(path, 'usr/bin'))
+    os.makedirs(libdir)
+    for name, size in (('usr/bin/python3', 4 << 20),
+                       ('usr/lib/libpython3.so', 16 << 20),
+                       ('usr/lib/libtorch.so', 64 << 20)):
+        with open(os.path.join(path, name), 'wb') as out_fp:
+            out_fp.write(os.urandom(size // 2) + b'\0' * (size // 2))
+        startup.append(name)
+    sitedir = 'usr/lib/python3/site-packages'
+    for pidx in range(packages):
+        pkg = os.path.join(sitedir, 'pkg%d' % pidx)
+        os.makedirs(os.path.join(path, pkg))
+        for midx in range(modules):
+            name = os.path.join(pkg, 'mod%d.py' % midx)
+            with open(os.path.join(path, name), 'w') as out_fp:
+                out_fp.write('# module %d.%d\n' % (pidx, midx))
+                for fidx in range(40):
+                    out_fp.write('def f%d(x):\n    return x * %d\n' %
+                                 (fidx, midx))
+            (startup if midx < 2 else others).append(name)
+    return startup, others
+
+
+def read_files(root, files):
+    start = time.time()
+    for name in files:
+        with open(os.path.join(root, name), 'rb') as in_fp:
+            while in_fp.read(1 << 20):
+                pass
+    return time.time() - start
+
+
+def time_mounted(image, fmt, startup, others):
+    """Mount the image and time cold reads of the startup files."""
+    mnt = tempfile.mkdtemp()
+    subprocess.check_call(['mount', '-o', 'loop,ro', '-t', fmt, image, mnt])
+    try:
+        subprocess.check_call(['sync'])
+        with open('/proc/sys/vm/drop_caches', 'w') as out_fp:
+            out_fp.write('3\n')
+        start = read_files(mnt, startup)
+        shuffled = list(others)
+        random.Random(0).shuffle(shuffled)
+        rand = read_files(mnt, shuffled)
+    finally:
+        subprocess.call(['umount', mnt])
+        os.rmdir(mnt)
+    return start, rand
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('-p', '--packages', type=int, default=100)
+    parser.add_argument('-m', '--modules', type=int, default=50,
+                        help='modules per package')
+    parser.add_argument('-f', '--formats', default='squashfs,erofs')
+    parser.add_argument('--mount', action='store_true',
+                        help='also time cold reads from the mounted image')
+    args = parser.parse_args()
+
+    workdir = tempfile.mkdtemp()
+    try:
+        for fmt in args.formats.split(','):
+            tree = os.path.join(workdir, 'tree')
+            startup, others = make_tree(tree, args.packages, args.modules)
+            image = os.path.join(workdir, 'image.%s' % fmt)
+            start = time.time()
+            # the converter removes the tree once the image is built
+            if not converters.convert(fmt, tree, image):
+                print('%s: conversion failed' % fmt)
+                shutil.rmtree(tree, ignore_errors=True)
+                continue
+            build = time.time() - start
+            line = '%s: files=%d build_seconds=%.2f bytes=%d' % \
+                   (fmt, len(startup) + len(others), build,
+                    os.stat(image).st_size)
+            if args.mount:
+                cold, rand = time_mounted(image, fmt, startup, others)
+                line += ' startup_seconds=%.2f random_read_seconds=%.2f' % \
+                        (cold, rand)
+            print(line)
+            os.unlink(image)
+            shutil.rmtree(tree, ignore_errors=True)
+    finally:
+        shutil.rmtree(workdir)
+
+
+if __name__ == '__main__':
+    main()
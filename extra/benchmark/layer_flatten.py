@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# Shifter, Copyright (c) 2016, The Regents of the University of California,
+# through Lawrence Berkeley National Laboratory (subject to receipt of any
+# required approvals from the U.S. Dept. of Energy).  All rights reserved.
+#
+# See LICENSE for full text.
+
+"""
+Time DockerV2Handle.extract_docker_layers on synthetic multi-layer images.
+
+Each layer adds new files, rewrites a share of the files of the layer below
+it and deletes a share of them with whiteouts, so the flattening engine has
+real shadowing work to do.  Run with PYTHONPATH pointing at the imagegw
+directory of the tree to measure, e.g. to compare two checkouts:
+
+    PYTHONPATH=old/imagegw extra/benchmark/layer_flatten.py -l 20 -f 20000
+    PYTHONPATH=new/imagegw extra/benchmark/layer_flatten.py -l 20 -f 20000
+"""
+
+import argparse
+import io
+import os
+import shutil
+import tarfile
+import tempfile
+import time
+
+from shifter_imagegw import dockerv2
+
+
+def make_layers(cachedir, nlayers, nfiles, rewrite, delete):
+    """Write the layer tarballs and return the layer chain, eldest first."""
+    chain = None
+    links = []
+    total = 0
+    payload = b'x' * 64
+    for idx in range(nlayers):
+        digest = 'sha256:%064d' % idx
+        path = os.path.join(cachedir, '%s.tar' % digest)
+        with tarfile.open(path, 'w:gz', compresslevel=1) as tfp:
+            def add(name, data=None):
+                info = tarfile.TarInfo(name)
+                if data is None:
+                    info.type = tarfile.DIRTYPE
+                    info.mode = 0o755
+                    tfp.addfile(info)
+                else:
+                    info.size = len(data)
+                    info.mode = 0o644
+                    tfp.addfile(info, io.BytesIO(data))
+            add('layer%d' % idx)
+            add('shared')
+            for fidx in range(nfiles):
+                add('layer%d/f%d' % (idx, fidx), payload)
+            if idx > 0:
+                for fidx in range(int(nfiles * rewrite)):
+                    add('layer%d/f%d' % (idx - 1, fidx), payload)
+                for fidx in range(int(nfiles * (1 - delete)), nfiles):
+                    add('layer%d/.wh.f%d' % (idx - 1, fidx), b'')
+            add('shared/version', b'%d' % idx)
+            total += len(tfp.getmembers())
+        links.append(digest)
+    for digest in reversed(links):
+        chain = {'fsLayer': {'blobSum': digest}, 'child': chain}
+    return chain, total
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('-l', '--layers', type=int, default=10)
+    parser.add_argument('-f', '--files', type=int, default=10000,
+                        help='new files per layer')
+    parser.add_argument('-r', '--rewrite', type=float, default=0.3,
+                        help='share of the previous layer rewritten')
+    parser.add_argument('-d', '--delete', type=float, default=0.1,
+                        help='share of the previous layer whited out')
+    args = parser.parse_args()
+
+    workdir = tempfile.mkdtemp()
+    try:
+        cachedir = os.path.join(workdir, 'cache')
+        expanddir = os.path.join(workdir, 'expand')
+        os.mkdir(cachedir)
+        os.mkdir(expanddir)
+        chain, total = make_layers(cachedir, args.layers, args.files,
+                                   args.rewrite, args.delete)
+
+        handle = dockerv2.DockerV2Handle('bench/flatten:latest',
+                                         {'baseUrl': 'http://localhost'},
+                                         cachedir=cachedir)
+        handle.eldest = chain
+        start = time.time()
+        handle.extract_docker_layers(expanddir)
+        elapsed = time.time() - start
+
+        nfiles = sum(len(files) + len(dirs)
+                     for _, dirs, files in os.walk(expanddir))
+        print('layers=%d members=%d extracted_paths=%d seconds=%.2f' %
+              (args.layers, total, nfiles, elapsed))
+    finally:
+        shutil.rmtree(workdir)
+
+
+if __name__ == '__main__':
+    main()
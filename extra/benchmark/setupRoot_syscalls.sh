@@ -0,0 +1,67 @@
+#!/bin/bash
+## Count the system calls made by setupRoot for a single container setup.
+##
+## Usage: setupRoot_syscalls.sh [-n runs] <setupRoot> [<setupRoot> ...] -- <setupRoot args>
+##
+## Each setupRoot binary (e.g. one built before and one after a change) is run
+## under strace in a private mount namespace with the given arguments, for
+## example "-U 1000 -G 1000 -u user docker ubuntu:16.04".  The setup is torn
+## down by the namespace exit.  Totals and the metadata-heavy calls are
+## averaged over the runs and reported per binary.  Must be run as root on a
+## node with shifter configured.
+
+runs=3
+if [ "$1" == "-n" ]; then
+    runs="$2"
+    shift 2
+fi
+
+binaries=()
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    binaries+=("$1")
+    shift
+done
+shift
+if [ ${#binaries[@]} -eq 0 ] || [ $# -eq 0 ]; then
+    echo "Usage: $0 [-n runs] <setupRoot> [<setupRoot> ...] -- <setupRoot args>" >&2
+    exit 1
+fi
+if ! command -v strace > /dev/null; then
+    echo "strace is required" >&2
+    exit 1
+fi
+
+tmpdir=$(mktemp -d)
+trap 'rm -rf "$tmpdir"' EXIT
+
+calls="total openat getdents64 newfstatat statx lstat stat mount execve clone"
+printf "%-40s" "setupRoot"
+for call in $calls; do
+    printf " %10s" "$call"
+done
+printf "\n"
+
+for binary in "${binaries[@]}"; do
+    declare -A sums=()
+    for run in $(seq 1 "$runs"); do
+        out="$tmpdir/strace.$run"
+        if ! unshare -m strace -f -c -o "$out" "$binary" "$@" > /dev/null 2>&1; then
+            echo "$binary failed, see: unshare -m $binary $*" >&2
+            exit 1
+        fi
+        for call in $calls; do
+            if [ "$call" == "total" ]; then
+                count=$(awk '$1 ~ /^[0-9.]+$/ && $NF != "total" { s += $4 } END { print s }' "$out")
+            else
+                count=$(awk -v c="$call" '$NF == c { print $4 }' "$out")
+            fi
+            sums[$call]=$(( ${sums[$call]:-0} + ${count:-0} ))
+        done
+    done
+    printf "%-40s" "$binary"
+    for call in $calls; do
+        printf " %10d" $(( ${sums[$call]} / runs ))
+    done
+    printf "\n"
+    unset sums
+done
@@ -22,6 +22,7 @@ This module provides the REST API for the image gateway.
 """
 
 import json
+import hashlib
 import os
 import sys
 import logging
@@ -110,18 +111,60 @@ def create_response(rec):
     return resp
 
 
+def record_etag(rec):
+    """
+    Entity tag of an image record.  It changes when the image is re-pulled
+    or its tags or ACLs change.
+    """
+    version = hashlib.sha1()
+    for field in ('last_pull', 'tag', 'userACL', 'groupACL', 'private'):
+        version.update(repr(rec.get(field)).encode('utf-8'))
+    return '"%s-%s"' % (rec.get('id'), version.hexdigest()[:16])
+
+
+def etag_matches(request, etag):
+    """ Check an If-None-Match request header against etag """
+    header = request.headers.get('if-none-match')
+    if header is None:
+        return False
+    for candidate in header.split(','):
+        candidate = candidate.strip()
+        if candidate.startswith('W/'):
+            candidate = candidate[2:]
+        if candidate == etag or candidate == '*':
+            return True
+    return False
+
+
 # List images
-# This will list the images for a system
+# This will list the images for a system.  The optional query arguments
+# prefix, user and since filter the listing; with limit it is returned in
+# pages, and the "next" cursor of a page is passed as after to get the next.
 @app.route('/api/list/<system>/', methods=["GET"])
 def imglist(request, system):
     """ List images for a specific system. """
     auth = request.headers.get(AUTH_HEADER)
     logger.debug("list system=%s" % (system))
+    try:
+        limit = int(request.args.get('limit', '0'))
+        user = request.args.get('user')
+        if user is not None:
+            user = int(user)
+        since = request.args.get('since')
+        if since is not None:
+            since = float(since)
+    except ValueError:
+        return not_found(request, 'invalid list arguments')
+    prefix = request.args.get('prefix')
+    after = request.args.get('after')
     try:
         session = mgr.new_session(auth, system)
-        records = mgr.imglist(session, system)
+        records = mgr.imglist(session, system, prefix=prefix, user=user,
+                              since=since, limit=limit, after=after)
         if records is None:
             return not_found(request, 'image not found')
+    except ValueError:
+        return not_found(request, 'invalid list arguments')
     except OSError:
         logger.warning('Bad session or system')
         return not_found(request, 'Bad session or system')
@@ -132,6 +175,8 @@ def imglist(request, system):
     for rec in records:
         images.append(create_response(rec))
     resp = {'list': images}
+    if limit > 0 and len(records) == limit:
+        resp['next'] = mgr.list_cursor(records[-1])
     return jsonify(resp)
 
 
@@ -158,7 +203,65 @@ def lookup(request, system, imgtype, tag):
     except:
         logger.exception('Exception in lookup')
         return not_found(request, '%s %s' % (sys.exc_type, sys.exc_value))
-    return jsonify(create_response(rec))
+    etag = record_etag(rec)
+    if etag_matches(request, etag):
+        return response.HTTPResponse(status=304, headers={'ETag': etag})
+    return jsonify(create_response(rec), headers={'ETag': etag})
+
+
+def batch_images(request):
+    """
+    Parse the "images" list of a batch request body.  Each image is given
+    as type:tag.  Returns a list of (name, imgtype, tag) or None if the
+    request is malformed.
+    """
+    try:
+        data = request.json
+    except:
+        return None
+    if not isinstance(data, dict) or not isinstance(data.get('images'), list):
+        return None
+    images = []
+    for name in data['images']:
+        if not isinstance(name, str) or name.find(':') == -1:
+            return None
+        imgtype, tag = name.split(':', 1)
+        if (imgtype == "docker" or imgtype == "custom") and \
+                tag.find(':') == -1:
+            tag = '%s:latest' % (tag)
+        images.append((name, imgtype, tag))
+    return images
+
+
+# Batch lookup
+# This will lookup several images in one request.  The body is a JSON object
+# with an "images" list of type:tag strings; the response has one entry per
+# image, either the image record or an error.
+@app.route('/api/lookup/<system>/', methods=["POST"])
+def lookup_batch(request, system):
+    """ Lookup several images for a system and return their records """
+    auth = request.headers.get(AUTH_HEADER)
+    images = batch_images(request)
+    if images is None:
+        return not_found(request, 'invalid image list')
+    logger.debug('lookup batch system=%s count=%d' % (system, len(images)))
+    try:
+        session = mgr.new_session(auth, system)
+        recs = mgr.lookup_batch(session, system,
+                                [{'itype': imgtype, 'tag': tag}
+                                 for _, imgtype, tag in images])
+    except:
+        logger.exception('Exception in batch lookup')
+        return not_found(request, '%s' % (sys.exc_info()[1]))
+    resp = []
+    for (name, _, _), rec in zip(images, recs):
+        if rec is None:
+            resp.append({'image': name, 'error': 'image not found'})
+        else:
+            entry = create_response(rec)
+            entry['image'] = name
+            resp.append(entry)
+    return jsonify({'images': resp})
 
 
 # Get Metrics
@@ -180,6 +283,38 @@ def metrics(request, system):
     return jsonify(recs)
 
 
+# Get layer cache statistics
+# This will return the hit/miss/eviction counters of the layer cache.
+@app.route('/api/cachestats/<system>/', methods=["GET"])
+def cachestats(request, system):
+    """ Return the layer cache statistics """
+    auth = request.headers.get(AUTH_HEADER)
+    logger.debug('cachestats system=%s auth=%s' % (system, auth))
+    try:
+        session = mgr.new_session(auth, system)
+        resp = mgr.get_cache_stats(session, system)
+    except:
+        logger.exception('Exception in cachestats')
+        return not_found(request, '%s %s' % (sys.exc_type, sys.exc_value))
+    return jsonify(resp)
+
+
+# Get worker statistics
+# This will return the queue depths and timings of the pull stages.
+@app.route('/api/workerstats/<system>/', methods=["GET"])
+def workerstats(request, system):
+    """ Return the pull pipeline statistics """
+    auth = request.headers.get(AUTH_HEADER)
+    logger.debug('workerstats system=%s auth=%s' % (system, auth))
+    try:
+        session = mgr.new_session(auth, system)
+        resp = mgr.get_worker_stats(session, system)
+    except:
+        logger.exception('Exception in workerstats')
+        return not_found(request, '%s %s' % (sys.exc_type, sys.exc_value))
+    return jsonify({'stages': resp})
+
+
 # Pull image
 # This will pull the requested image.
 @app.route('/api/pull/<system>/<imgtype>/<tag:path>/', methods=["POST"])
@@ -222,6 +357,43 @@ def pull(request, system, imgtype, tag):
     return jsonify(create_response(rec))
 
 
+# Batch pull
+# This will pull several images in one request.  The body is like the one of
+# a batch lookup, optionally with allowed_uids and allowed_gids applied to all
+# images.
+@app.route('/api/pull/<system>/', methods=["POST"])
+def pull_batch(request, system):
+    """ Pull several images for a system. """
+    auth = request.headers.get(AUTH_HEADER)
+    images = batch_images(request)
+    if images is None:
+        return not_found(request, 'invalid image list')
+    data = request.json
+    logger.debug('pull batch system=%s count=%d' % (system, len(images)))
+    try:
+        session = mgr.new_session(auth, system)
+    except:
+        logger.exception('Exception in batch pull')
+        return not_found(request, '%s' % (sys.exc_info()[1]))
+    resp = []
+    for name, imgtype, tag in images:
+        i = {'system': system, 'itype': imgtype, 'tag': tag}
+        try:
+            if 'allowed_uids' in data:
+                i['userACL'] = list(map(lambda x: int(x),
+                                   data['allowed_uids'].split(',')))
+            if 'allowed_gids' in data:
+                i['groupACL'] = list(map(lambda x: int(x),
+                                    data['allowed_gids'].split(',')))
+            entry = create_response(mgr.pull(session, i))
+        except:
+            logger.exception('Exception in batch pull of %s' % (name))
+            entry = {'error': '%s' % (sys.exc_info()[1])}
+        entry['image'] = name
+        resp.append(entry)
+    return jsonify({'images': resp})
+
+
 # Import image
 # This will import the requested image from a file path on the system.
 @app.route('/api/doimport/<system>/<imgtype>/<tag:path>/', methods=["POST"])
@@ -23,12 +23,140 @@ Convert module that handles converting an unpacked image into a compatibable
 format for shifter.
 """
 
+import fnmatch
 import os
 import subprocess
 import shutil
 import tempfile
 from shifter_imagegw.util import program_exists, rmtree
 
+# mksquashfs sort priorities, files with higher priorities are placed first
+_PROFILE_PRIORITY = 32767
+_HEURISTIC_PRIORITY = 16384
+# Files commonly read when a container starts, relative to the image root.
+# Earlier patterns are placed first.
+_STARTUP_PATTERNS = [
+    'etc/ld.so.cache',
+    'lib*/ld-*.so*',
+    'lib*/*/ld-*.so*',
+    'usr/lib*/ld-*.so*',
+    'usr/lib*/*/ld-*.so*',
+    'bin/sh',
+    'bin/bash',
+    'usr/bin/env',
+    'usr/bin/bash',
+    'usr/bin/python*',
+    'usr/local/bin/python*',
+    'etc/passwd',
+    'etc/group',
+    'etc/nsswitch.conf',
+    'lib*/libc.so*',
+    'lib*/*/libc.so*',
+    'usr/lib*/libc.so*',
+    'usr/lib*/*/libc.so*',
+    'lib*/lib*.so*',
+    'lib*/*/lib*.so*',
+    'usr/lib*/libpython*.so*',
+    'usr/lib*/*/libpython*.so*',
+    'usr/local/lib/libpython*.so*',
+]
+# Modules the python interpreter imports before running anything
+_PYTHON_STARTUP = [
+    'site.py', 'os.py', 'stat.py', 'abc.py', 'codecs.py', 'io.py',
+    'posixpath.py', 'genericpath.py', '_collections_abc.py',
+    '_sitebuiltins.py', 'encodings/__init__.py', 'encodings/aliases.py',
+    'encodings/utf_8.py', 'encodings/latin_1.py',
+    'site-packages/*.pth',
+]
+_PYTHON_LIBS = ['usr/lib/python*', 'usr/local/lib/python*',
+                'opt/conda/lib/python*']
+
+
+def _is_image_file(expand_path, path):
+    """
+    Check that path is a regular file inside the image, reached without
+    following symlinks (which may point outside of the image).
+    """
+    full = expand_path
+    for part in path.split('/'):
+        full = os.path.join(full, part)
+        if os.path.islink(full):
+            return False
+    return os.path.isfile(full)
+
+
+def _image_files(expand_path, pattern):
+    """
+    Regular files in the image matching a pattern relative to its root, in
+    sorted order.
+    """
+    paths = ['']
+    for part in pattern.split('/'):
+        matches = []
+        for path in paths:
+            dirname = os.path.join(expand_path, path)
+            if path != '' and (os.path.islink(dirname) or
+                               not os.path.isdir(dirname)):
+                continue
+            try:
+                names = sorted(os.listdir(dirname))
+            except OSError:
+                continue
+            for name in fnmatch.filter(names, part):
+                matches.append(os.path.join(path, name))
+        paths = matches
+    return [path for path in paths if _is_image_file(expand_path, path)]
+
+
+def startup_sort_list(expand_path, profile=None):
+    """
+    Build the mksquashfs sort list placing startup-critical files at the
+    front of the image.  profile is a list of paths recorded from earlier
+    runs of the image, most important first, which are placed before the
+    files found by the built-in heuristics (dynamic loader, shell, libc and
+    other shared libraries in lib, the python interpreter and the modules it
+    imports at startup).  Returns a list of (path, priority).
+    """
+    entries = []
+    seen = set()
+
+    def add(path, priority):
+        path = os.path.normpath(path.lstrip('/'))
+        # the sort file has one "path priority" entry per line
+        if path in seen or path.startswith('..') or \
+                len(path.split()) != 1 or \
+                not _is_image_file(expand_path, path):
+            return
+        seen.add(path)
+        entries.append((path, priority))
+
+    for idx, path in enumerate(profile or []):
+        add(path.strip(), max(_PROFILE_PRIORITY - idx, _HEURISTIC_PRIORITY))
+    patterns = list(_STARTUP_PATTERNS)
+    for pylib in _PYTHON_LIBS:
+        for module in _PYTHON_STARTUP:
+            patterns.append('%s/%s' % (pylib, module))
+            if module.endswith('.py'):
+                dirname, name = os.path.split(module[:-3])
+                patterns.append(os.path.join(pylib, dirname, '__pycache__',
+                                             '%s.*.pyc' % name))
+    for idx, pattern in enumerate(patterns):
+        for path in _image_files(expand_path, pattern):
+            add(path, _HEURISTIC_PRIORITY - 1 - idx)
+    return entries
+
+
+def _write_sort_file(expand_path, profile):
+    """ write the startup sort list to a temporary file for -sort """
+    entries = startup_sort_list(expand_path, profile)
+    if len(entries) == 0:
+        return None
+    (fdesc, sort_path) = tempfile.mkstemp(suffix='.sort')
+    with os.fdopen(fdesc, 'w') as sort_fp:
+        for path, priority in entries:
+            sort_fp.write('%s %d\n' % (path, priority))
+    return sort_path
+
 
 def generate_ext4_image(expand_path, image_path, options):
     """
@@ -60,9 +188,13 @@ def generate_cramfs_image(expand_path, image_path, options):
     return True
 
 
-def generate_squashfs_image(expand_path, image_path, options):
+def generate_squashfs_image(expand_path, image_path, options,
+                            startup_profile=None):
     """
     Creates a SquashFS based image
+    If startup_profile is not None (a list of paths, possibly empty), files
+    read at container start are packed together at the front of the image
+    (see startup_sort_list).
     """
     # This will raise an exception if mksquashfs tool is not found
     # it should be handled by the calling function
@@ -70,11 +202,20 @@ def generate_squashfs_image(expand_path, image_path, options):
 
     cmd = ["mksquashfs", expand_path, image_path, "-all-root"]
 
+    sort_path = None
+    if startup_profile is not None:
+        sort_path = _write_sort_file(expand_path, startup_profile)
+        if sort_path is not None:
+            cmd.extend(['-sort', sort_path])
     if options is not None:
         cmd.extend(options)
     else:
         cmd.append('-no-xattrs')
-    ret = subprocess.call(cmd)
+    try:
+        ret = subprocess.call(cmd)
+    finally:
+        if sort_path is not None:
+            os.unlink(sort_path)
     if ret != 0:
         # error handling
         pass
@@ -86,15 +227,65 @@ def generate_squashfs_image(expand_path, image_path, options):
     return True
 
 
-def convert(fmt, expand_path, image_path, options=None):
-    """ do the conversion """
-    if os.path.exists(image_path):
-        return True
+def generate_erofs_image(expand_path, image_path, options):
+    """
+    Creates an EROFS based image.  options replace the default compression
+    (lz4hc), e.g. ["-zlzma"] or ["-zlz4hc,12", "-Ededupe"].
+    """
+    program_exists('mkfs.erofs')
 
-    (dirname, fname) = os.path.split(image_path)
-    (temp_fd, temp_path) = tempfile.mkstemp('.partial', fname, dirname)
-    os.close(temp_fd)
-    os.unlink(temp_path)
+    cmd = ["mkfs.erofs", "--all-root"]
+
+    if options is not None:
+        cmd.extend(options)
+    else:
+        cmd.append('-zlz4hc')
+    cmd.extend([image_path, expand_path])
+    ret = subprocess.call(cmd)
+    try:
+        rmtree(expand_path)
+    except:
+        pass
+
+    return ret == 0
+
+
+def generate_squashfs_image_from_tar(write_tar, image_path, options):
+    """
+    Creates a SquashFS based image from a tar stream.  write_tar is called
+    with a file object and must write the complete tar stream to it; the
+    stream is piped straight into mksquashfs (4.6 or later) in tar input
+    mode, so no expanded directory tree is needed.
+    """
+    program_exists('mksquashfs')
+
+    cmd = ["mksquashfs", "-", image_path, "-tar", "-all-root"]
+
+    if options is not None:
+        cmd.extend(options)
+    else:
+        cmd.append('-no-xattrs')
+    proc = subprocess.Popen(cmd, stdin=subprocess.PIPE)
+    try:
+        write_tar(proc.stdin)
+    except BrokenPipeError:
+        # mksquashfs exited early, its return code tells why
+        pass
+    except:
+        proc.kill()
+        proc.wait()
+        raise
+    finally:
+        try:
+            proc.stdin.close()
+        except BrokenPipeError:
+            pass
+    ret = proc.wait()
+    return ret == 0
+
+
+def _format_options(fmt, options):
+    """ select the converter options for a format """
     opts = None
     if options is not None and fmt in options:
         if isinstance(options[fmt], str):
@@ -103,13 +294,78 @@ def convert(fmt, expand_path, image_path, options=None):
             opts = options[fmt]
         else:
             raise ValueError("options for format should be a string or list")
+    return opts
+
+
+def _temp_image_path(image_path):
+    """ pick an unused temporary name next to image_path """
+    (dirname, fname) = os.path.split(image_path)
+    (temp_fd, temp_path) = tempfile.mkstemp('.partial', fname, dirname)
+    os.close(temp_fd)
+    os.unlink(temp_path)
+    return temp_path
+
+
+def convert_stream(fmt, write_tar, image_path, options=None):
+    """
+    do the conversion from a tar stream produced by write_tar (see
+    generate_squashfs_image_from_tar), without an expanded image
+    """
+    if os.path.exists(image_path):
+        return True
+
+    temp_path = _temp_image_path(image_path)
+    opts = _format_options(fmt, options)
+
+    try:
+        if fmt == 'squashfs':
+            success = generate_squashfs_image_from_tar(write_tar, temp_path,
+                                                       opts)
+        else:
+            raise NotImplementedError("%s does not support tar input" % fmt)
+    except:
+        if os.path.exists(temp_path):
+            os.unlink(temp_path)
+        raise
+
+    if not success:
+        if os.path.exists(temp_path):
+            os.unlink(temp_path)
+        return False
+    try:
+        os.rename(temp_path, image_path)
+    except:
+        return False
+    return True
+
+
+def supports_stream(fmt):
+    """ True if the format can be generated from a tar stream """
+    return fmt == 'squashfs'
+
+
+def convert(fmt, expand_path, image_path, options=None,
+            startup_profile=None):
+    """
+    do the conversion
+    startup_profile enables startup ordering for squashfs images, see
+    generate_squashfs_image
+    """
+    if os.path.exists(image_path):
+        return True
+
+    temp_path = _temp_image_path(image_path)
+    opts = _format_options(fmt, options)
 
     try:
         success = False
         if fmt == 'squashfs':
-            success = generate_squashfs_image(expand_path, temp_path, opts)
+            success = generate_squashfs_image(expand_path, temp_path, opts,
+                                              startup_profile)
         elif fmt == 'cramfs':
             success = generate_cramfs_image(expand_path, temp_path, opts)
+        elif fmt == 'erofs':
+            success = generate_erofs_image(expand_path, temp_path, opts)
         elif fmt == 'ext4':
             success = generate_ext4_image(expand_path, temp_path, opts)
         elif fmt == 'mock':
@@ -127,6 +383,8 @@ def convert(fmt, expand_path, image_path, options=None):
         raise
 
     if not success:
+        if os.path.exists(temp_path):
+            os.unlink(temp_path)
         return False
     try:
         os.rename(temp_path, image_path)
@@ -166,6 +424,11 @@ def writemeta(fmt, meta, metafile):
                 meta_fd.write("ENV: %s\n" % (keyval))
         if 'user' in meta:
             meta_fd.write("USER: %s\n" % meta['user'])
+        if meta.get('digest'):
+            meta_fd.write("DIGEST: %s\n" % meta['digest'])
+        if meta.get('digest_chunks'):
+            meta_fd.write("DIGEST_CHUNKS: %s\n" %
+                          ','.join(meta['digest_chunks']))
         meta_fd.close()
     # Some error must have occurred
     return True
@@ -29,10 +29,13 @@ import json
 import os
 import stat
 import re
-from subprocess import Popen, PIPE
+from subprocess import Popen
 import base64
-import tempfile
 import socket
+import fcntl
+import threading
+from concurrent.futures import ThreadPoolExecutor
+from shifter_imagegw.layercache import LayerCache
 #from .tarfilemp import tarfile
 import tarfile
 
@@ -40,6 +43,14 @@ import tarfile
 _EMPTY_TAR_SHA256 = \
     'sha256:a3ed95caeb02ffe68cdd9fd84406680ae93d633cb16422d00e8a7c22955b46d4'
 
+# Defaults for concurrent layer downloads
+_DEFAULT_LAYER_CONCURRENCY = 4
+_DEFAULT_MAX_CONNECTIONS = 4
+
+# Errors seen when reusing a keep-alive connection the server has closed
+_STALE_CONN_ERRORS = (http.client.RemoteDisconnected, http.client.BadStatusLine,
+                      ConnectionResetError, BrokenPipeError)
+
 # Option to use a SOCKS proxy
 if 'all_proxy' in os.environ:
     import socks
@@ -166,6 +177,103 @@ def _setup_http_conn(url, cacert=None):
     return conn
 
 
+# Connection slots are shared by every handle in the process so that the
+# limit applies per registry (or blob storage host) across concurrent pulls.
+# When locations sharing a host set different maxConnections, the smallest
+# one applies.
+_HOST_SLOTS = {}
+_HOST_SLOTS_LOCK = threading.Lock()
+
+
+class _HostSlots(object):
+    """Connection slots of one host; the limit only ever goes down."""
+
+    def __init__(self, limit):
+        self.limit = limit
+        self.in_use = 0
+        self.cond = threading.Condition()
+
+    def acquire(self):
+        with self.cond:
+            while self.in_use >= self.limit:
+                self.cond.wait()
+            self.in_use += 1
+
+    def release(self):
+        with self.cond:
+            self.in_use -= 1
+            self.cond.notify()
+
+    def restrict(self, limit):
+        with self.cond:
+            self.limit = min(self.limit, limit)
+
+
+def _host_key(url):
+    """Return scheme://netloc for a url."""
+    target = urllib.parse.urlparse(url)
+    return '%s://%s' % (target.scheme, target.netloc)
+
+
+class _ConnectionPool(object):
+    """
+    Keep-alive HTTP connections for layer downloads.  At most max_conn
+    connections are in use per host at a time, and connections are handed
+    back out once a response has been fully read instead of reconnecting.
+    """
+
+    def __init__(self, cacert=None, max_conn=_DEFAULT_MAX_CONNECTIONS):
+        self.cacert = cacert
+        self.max_conn = max_conn
+        self.idle = {}
+        self.lock = threading.Lock()
+
+    def _slot(self, key):
+        with _HOST_SLOTS_LOCK:
+            if key not in _HOST_SLOTS:
+                _HOST_SLOTS[key] = _HostSlots(self.max_conn)
+            slots = _HOST_SLOTS[key]
+        slots.restrict(self.max_conn)
+        return slots
+
+    def acquire(self, url):
+        """
+        Wait for a free slot for the host and return (conn, reused).
+        """
+        key = _host_key(url)
+        self._slot(key).acquire()
+        with self.lock:
+            idle = self.idle.get(key)
+            if idle:
+                return (idle.pop(), True)
+        try:
+            conn = _setup_http_conn(url, self.cacert)
+        except Exception:
+            self._slot(key).release()
+            raise
+        if conn is None:
+            self._slot(key).release()
+        return (conn, False)
+
+    def release(self, url, conn, reuse=True):
+        """Return a connection and its slot, closing it unless reusable."""
+        key = _host_key(url)
+        if reuse:
+            with self.lock:
+                self.idle.setdefault(key, []).append(conn)
+        else:
+            conn.close()
+        self._slot(key).release()
+
+    def close(self):
+        """Close all idle connections."""
+        with self.lock:
+            for conns in self.idle.values():
+                for conn in conns:
+                    conn.close()
+            self.idle = {}
+
+
 def _construct_image_metadata(manifest):
     """Perform introspection and analysis of docker manifest."""
     if manifest is None:
@@ -223,6 +331,195 @@ def _construct_image_metadata(manifest):
     return (no_parent, curr,)
 
 
+def _new_layer_hash(layer):
+    """Return a hash object for the digest algorithm of a blob."""
+    hash_type = layer.split(':', 1)[0]
+    try:
+        return hashlib.new(hash_type)
+    except ValueError:
+        raise ValueError('Unsupported digest algorithm: %s' % hash_type)
+
+
+def _hash_fd(hasher, fdesc, length=None):
+    """Add the first length bytes (or all) of an open file to hasher."""
+    readsz = 4 * 1024 * 1024
+    pos = 0
+    while length is None or pos < length:
+        size = readsz if length is None else min(readsz, length - pos)
+        buff = os.pread(fdesc, size, pos)
+        if not buff:
+            break
+        hasher.update(buff)
+        pos += len(buff)
+    if length is not None and pos < length:
+        raise ValueError('Short read while hashing')
+
+
+def _verified_stamp(layer, filename):
+    """Identify a blob file by digest, inode, size and mtime."""
+    fstat = os.stat(filename)
+    return '%s %d %d %d' % (layer, fstat.st_ino, fstat.st_size,
+                            fstat.st_mtime_ns)
+
+
+def _is_verified(layer, filename):
+    """
+    Check the <blob>.tar.verified sidecar, written once the file's digest
+    was verified, against the file's current identity.
+    """
+    try:
+        with open('%s.verified' % filename) as in_fp:
+            return in_fp.read().strip() == _verified_stamp(layer, filename)
+    except (IOError, OSError):
+        return False
+
+
+def _record_verified(layer, filename):
+    """Write the verification sidecar for a blob file."""
+    sidecar = '%s.verified' % filename
+    temp = '%s.%d.%d' % (sidecar, os.getpid(), threading.get_ident())
+    try:
+        with open(temp, 'w') as out_fp:
+            out_fp.write('%s\n' % _verified_stamp(layer, filename))
+        os.rename(temp, sidecar)
+    except (IOError, OSError):
+        # only an optimization, the blob gets hashed again next time
+        if os.path.exists(temp):
+            os.unlink(temp)
+
+
+class _PathNode(object):
+    """Node of the path trie used by _flatten_layers."""
+    __slots__ = ('children', 'claim', 'whiteout', 'opaque')
+
+    def __init__(self):
+        self.children = {}
+        # type of the entry a younger layer provides at this path, if any
+        self.claim = None
+        # a younger layer deleted this path (and everything below it)
+        self.whiteout = False
+        # a younger layer hides everything below this path
+        self.opaque = False
+
+
+_CLAIM_DIR = 'dir'
+_CLAIM_OTHER = 'other'
+_WHITEOUT_PREFIX = '.wh.'
+_OPAQUE_WHITEOUT = '.wh..wh..opq'
+
+
+def _layer_member_allowed(name):
+    """Screen out members that must never be extracted."""
+    if name.startswith('/') or '..' in name.split('/'):
+        return False
+    if name == 'dev/' or name.startswith('dev/'):
+        return False
+    return True
+
+
+def _flatten_layers(layer_members):
+    """
+    Select the members to extract from each layer.
+
+    layer_members is a list of TarInfo lists, eldest layer first.  Layers are
+    walked once from youngest to eldest while a trie records the paths younger
+    layers provide, delete (whiteouts) or mask (opaque directories).  A member
+    is selected only if no younger layer shadows it, so every path in the
+    flattened image is extracted exactly once.  Returns the selected members
+    per layer, in the same order as layer_members.
+    """
+    root = _PathNode()
+    selected = [None] * len(layer_members)
+    for idx in range(len(layer_members) - 1, -1, -1):
+        keep = []
+        whiteouts = []
+        opaques = []
+        # later duplicates in a tar file replace earlier ones
+        for member in reversed(layer_members[idx]):
+            if member.name[0:2] == './':
+                member.name = member.name[2:]
+            name = member.name.rstrip('/')
+            if len(name) == 0 or not _layer_member_allowed(member.name):
+                continue
+            parts = name.split('/')
+            if parts[-1].startswith(_WHITEOUT_PREFIX):
+                # whiteouts only apply to older layers
+                if parts[-1] == _OPAQUE_WHITEOUT:
+                    opaques.append(parts[:-1])
+                elif len(parts[-1]) > len(_WHITEOUT_PREFIX):
+                    whiteouts.append(parts[:-1] +
+                                     [parts[-1][len(_WHITEOUT_PREFIX):]])
+                continue
+
+            # walk the path, stopping if a younger layer shadows it
+            node = root
+            shadowed = False
+            for part in parts[:-1]:
+                if node.opaque:
+                    shadowed = True
+                    break
+                node = node.children.get(part)
+                if node is None:
+                    break
+                if node.whiteout or node.claim == _CLAIM_OTHER:
+                    shadowed = True
+                    break
+            if shadowed:
+                continue
+            if node is not None:
+                if node.opaque:
+                    continue
+                node = node.children.get(parts[-1])
+                if node is not None and \
+                        (node.whiteout or node.claim is not None):
+                    continue
+
+            # claim the path for this member
+            node = root
+            for part in parts:
+                node = node.children.setdefault(part, _PathNode())
+            node.claim = _CLAIM_DIR if member.isdir() else _CLAIM_OTHER
+            keep.append(member)
+
+        for parts in whiteouts:
+            node = root
+            for part in parts:
+                node = node.children.setdefault(part, _PathNode())
+            node.whiteout = True
+        for parts in opaques:
+            node = root
+            for part in parts:
+                node = node.children.setdefault(part, _PathNode())
+            node.opaque = True
+        keep.reverse()
+        selected[idx] = keep
+    return selected
+
+
+def _stream_tarinfo(member, source):
+    """
+    Build the TarInfo for member in a flattened tar stream, taking the type
+    and content of source (a hard link target when the link is unresolvable)
+    and applying the a+rX,u+w permission fix done after extraction.
+    """
+    info = tarfile.TarInfo(member.name.rstrip('/'))
+    info.type = source.type
+    info.size = source.size if source.isreg() else 0
+    if source is member:
+        info.linkname = member.linkname
+    info.mtime = source.mtime
+    info.uid = 0
+    info.gid = 0
+    info.uname = 'root'
+    info.gname = 'root'
+    mode = source.mode & 0o7777
+    mode |= stat.S_IRUSR | stat.S_IRGRP | stat.S_IROTH | stat.S_IWUSR
+    if source.isdir() or (mode & (stat.S_IXUSR | stat.S_IXGRP | stat.S_IXOTH)):
+        mode |= stat.S_IXUSR | stat.S_IXGRP | stat.S_IXOTH
+    info.mode = mode
+    return info
+
+
 class DockerV2Handle(object):
     """
     A class for fetching and unpacking docker registry (and dockerhub) images.
@@ -241,6 +538,8 @@ class DockerV2Handle(object):
     manifest = None
     allow_authenticated = True
     check_layer_checksums = True
+    layer_concurrency = _DEFAULT_LAYER_CONCURRENCY
+    max_connections = _DEFAULT_MAX_CONNECTIONS
 
     # excluding empty tar blobSum because python 2.6 throws an exception when
     # an open is attempted
@@ -254,6 +553,9 @@ class DockerV2Handle(object):
             baseUrl to specify a URL other than dockerhub
             cacert to specify an approved signing authority
             username/password to specify a login
+            layerConcurrency to set the number of layers pulled at once
+            maxConnections to limit connections per registry host
+            cacheMaxBytes to limit the size of the layer cache
         """
         # attempt to parse image identifier
         try:
@@ -272,6 +574,12 @@ class DockerV2Handle(object):
         self.updater = updater
 
         self.cachedir = cachedir
+        self.layer_cache = None
+        self.cache_pin = None
+        if cachedir is not None:
+            self.layer_cache = LayerCache(cachedir,
+                                          options.get('cacheMaxBytes', 0))
+        self.image_id = None
 
         if 'baseUrl' in options:
             base_url = options['baseUrl']
@@ -339,6 +647,15 @@ class DockerV2Handle(object):
         self.auth_method = 'token'
         if 'authMethod' in options:
             self.auth_method = options['authMethod']
+        if options.get('layerConcurrency'):
+            self.layer_concurrency = int(options['layerConcurrency'])
+        if options.get('maxConnections'):
+            self.max_connections = int(options['maxConnections'])
+        if self.layer_concurrency < 1 or self.max_connections < 1:
+            raise ValueError('layerConcurrency and maxConnections must be '
+                             'positive')
+        self.conn_pool = _ConnectionPool(self.cacert, self.max_connections)
+        self.auth_lock = threading.Lock()
         self.eldest = None
         self.youngest = None
 
@@ -477,6 +794,7 @@ class DockerV2Handle(object):
         meta = youngest
 
         resp = {'id': meta['id']}
+        self.image_id = meta['id']
         if 'config' in meta:
             config = meta['config']
             if 'Env' in config:
@@ -492,24 +810,67 @@ class DockerV2Handle(object):
         return resp
 
     def pull_layers(self):
-        """Download layers to cachedir if they do not exist."""
+        """
+        Download layers to cachedir if they do not exist.  Layers are
+        independent blobs, so up to layer_concurrency of them are fetched at
+        once.
+        """
         # TODO: don't rely on self.eldest to demonstrate that
         # examine_manifest has run
         if self.eldest is None:
             self.examine_manifest()
+        blobsums = []
         layer = self.eldest
         while layer is not None:
-            if layer['fsLayer']['blobSum'] in self.excludeBlobSums:
-                layer = layer['child']
-                continue
+            blobsum = layer['fsLayer']['blobSum']
+            if blobsum not in self.excludeBlobSums and \
+                    blobsum not in blobsums:
+                blobsums.append(blobsum)
+            layer = layer['child']
 
-            memo = "Pulling layer %s" % layer['fsLayer']['blobSum']
-            self.log("PULLING", memo)
+        if self.layer_cache is not None and self.cache_pin is None:
+            # keep the layers until release_layers, they are still needed
+            # to build the image
+            self.cache_pin = self.layer_cache.pin(blobsums)
 
-            self.save_layer(layer['fsLayer']['blobSum'])
-            layer = layer['child']
+        nworkers = min(self.layer_concurrency, max(len(blobsums), 1))
+        executor = ThreadPoolExecutor(max_workers=nworkers)
+        futures = []
+        try:
+            for blobsum in blobsums:
+                futures.append(executor.submit(self._pull_layer, blobsum))
+            for blobsum, future in zip(blobsums, futures):
+                if not future.result():
+                    raise ValueError('Failed to pull layer %s' % blobsum)
+        finally:
+            # don't start layers that are still queued after a failure
+            for future in futures:
+                future.cancel()
+            executor.shutdown(wait=True)
+            self.conn_pool.close()
+        if self.layer_cache is not None:
+            image = self.image_id
+            if image is None:
+                image = '%s:%s' % (self.repo, self.tag)
+            self.layer_cache.add_refs(blobsums, image)
         return True
 
+    def release_layers(self):
+        """
+        Allow the layers of this image to be evicted from the cache again,
+        once they were extracted or converted.
+        """
+        if self.layer_cache is None or self.cache_pin is None:
+            return
+        self.layer_cache.unpin(self.cache_pin)
+        self.cache_pin = None
+
+    def _pull_layer(self, blobsum):
+        """Download a single layer, for use by the pull_layers workers."""
+        memo = "Pulling layer %s" % blobsum
+        self.log("PULLING", memo)
+        return self.save_layer(blobsum)
+
     def _get_auth_header(self):
         """
         Helper function to generate the header.
@@ -523,196 +884,316 @@ class DockerV2Handle(object):
 
     def save_layer(self, layer):
         """
-        Save a layer and verify with the digest
+        Save a layer and verify with the digest.  Data is downloaded into
+        <layer>.tar.partial, which is kept if the transfer is interrupted so
+        that the next attempt resumes it with an HTTP Range request.
         """
-        path = "/v2/%s/blobs/%s" % (self.repo, layer)
-        url = self.url
-        while True:
-            conn = _setup_http_conn(url, self.cacert)
-            if conn is None:
-                return None
+        filename = '%s/%s.tar' % (self.cachedir, layer)
+        partial = '%s.partial' % filename
 
-            filename = '%s/%s.tar' % (self.cachedir, layer)
+        if os.path.exists(filename):
+            try:
+                if self.check_layer_checksum(layer, filename):
+                    self._cache_used(layer, True)
+                    return True
+                return False
+            except ValueError:
+                # there was a checksum mismatch, nuke the file
+                os.unlink(filename)
 
+        with open(partial, 'a+b') as out_fp:
+            # only one download of a blob at a time, others wait for it
+            fcntl.flock(out_fp.fileno(), fcntl.LOCK_EX)
             if os.path.exists(filename):
-                try:
-                    return self.check_layer_checksum(layer, filename)
-                except ValueError:
-                    # there was a checksum mismatch, nuke the file
-                    os.unlink(filename)
+                if os.path.exists(partial) and \
+                        os.path.samestat(os.stat(partial),
+                                         os.fstat(out_fp.fileno())):
+                    os.unlink(partial)
+                # another pull downloaded it while we waited
+                if self.check_layer_checksum(layer, filename):
+                    self._cache_used(layer, True)
+                    return True
+                return False
 
+            resumed = os.fstat(out_fp.fileno()).st_size > 0
+            while True:
+                # the digest is computed as the data arrives
+                digest = self._fetch_blob(layer, out_fp)
+                if digest is None:
+                    return False
+                if self.check_layer_checksums and \
+                        digest != layer.split(':', 1)[1]:
+                    out_fp.truncate(0)
+                    if resumed:
+                        # resumed data may be stale, retry from scratch
+                        resumed = False
+                        continue
+                    os.unlink(partial)
+                    raise ValueError("checksum mismatch, failure")
+                break
+            os.rename(partial, filename)
+            # only vouch for data that was compared to the layer digest
+            if digest == layer.split(':', 1)[1]:
+                _record_verified(layer, filename)
+        self._cache_used(layer, False)
+        return True
+
+    def _cache_used(self, layer, hit):
+        """Account a cache hit or miss for a layer."""
+        if self.layer_cache is not None:
+            self.layer_cache.touch(layer, hit)
+
+    def _fetch_blob(self, layer, out_fp):
+        """
+        Fetch a blob into out_fp, following redirects to blob storage and
+        requesting only the missing tail if out_fp already has data.  Returns
+        the hex digest of the complete file, or None upon failure.
+        """
+        path = "/v2/%s/blobs/%s" % (self.repo, layer)
+        url = self.url
+        auth_tries = 0
+        while True:
+            offset = os.fstat(out_fp.fileno()).st_size
             # If the redirect path includes a verify in the path
             # then we don't need the header.  If try to use the
             # header, we may get back a 400.
-            if path.find('verify') > 0:
-                conn.request("GET", path, None, {})
-            else:
-                conn.request("GET", path, None, self.headers)
-            resp1 = conn.getresponse()
-            location = resp1.getheader('location')
-            if resp1.status == 200:
-                break
-
-            elif resp1.status == 401 and self.auth_method == 'token':
-                self.do_token_auth(resp1.getheader('WWW-Authenticate'))
+            headers = {}
+            if path.find('verify') <= 0:
+                headers.update(self.headers)
+            if offset > 0:
+                headers['Range'] = 'bytes=%d-' % offset
+            token = self.token
+
+            (conn, resp1) = self._request(url, path, headers)
+            try:
+                location = resp1.getheader('location')
+                if resp1.status in (200, 206):
+                    hasher = _new_layer_hash(layer)
+                    if resp1.status == 200 or not \
+                            self._range_matches(resp1, offset):
+                        out_fp.truncate(0)
+                    else:
+                        _hash_fd(hasher, out_fp.fileno(), offset)
+                    self._read_blob(resp1, out_fp, hasher)
+                    self.conn_pool.release(url, conn,
+                                           not resp1.will_close)
+                    return hasher.hexdigest()
+                # drain the body so the connection can be reused
+                resp1.read()
+            except Exception:
+                self.conn_pool.release(url, conn, False)
+                raise
+            self.conn_pool.release(url, conn, not resp1.will_close)
+
+            if resp1.status == 416 and offset > 0:
+                # partial data is not a prefix of this blob
+                out_fp.truncate(0)
+                continue
+            elif resp1.status == 401 and self.auth_method == 'token' and \
+                    auth_tries < 2:
+                auth_tries += 1
+                with self.auth_lock:
+                    # another download may have refreshed the token already
+                    if self.token == token:
+                        self.do_token_auth(
+                            resp1.getheader('WWW-Authenticate'))
+                    self._get_auth_header()
                 continue
             elif location is not None:
-                url = location
                 match_obj = re.match(r'(https?)://(.*?)(/.*)', location)
                 url = '%s://%s' % (match_obj.groups()[0],
                                    match_obj.groups()[1])
                 path = match_obj.groups()[2]
             else:
-                print('ERROR: Getting layer recieved status: %d' % resp1.status)
-                return False
-        maxlen = int(resp1.getheader('content-length'))
-        nread = 0
-        (out_fd, out_fn) = tempfile.mkstemp('.partial', layer, self.cachedir)
-        out_fp = os.fdopen(out_fd, 'wb')
-
-        try:
-            readsz = 4 * 1024 * 1024  # read 4MB chunks
-            while nread < maxlen:
-                # TODO find a way to timeout a failed read
-                buff = resp1.read(readsz)
-                if buff is None:
-                    break
-                out_fp.write(buff)
-                nread += len(buff)
-            out_fp.close()
-            self.check_layer_checksum(layer, out_fn)
-        except:
-            os.unlink(out_fn)
-            out_fp.close()
-            raise
+                print('ERROR: Getting layer recieved status: %d' %
+                      resp1.status)
+                return None
 
-        os.rename(out_fn, filename)
-        return True
+    def _request(self, url, path, headers):
+        """
+        Issue a GET on a pooled connection and return (conn, response).  A
+        reused connection the server has since closed is replaced once.
+        """
+        while True:
+            (conn, reused) = self.conn_pool.acquire(url)
+            if conn is None:
+                raise ValueError('Failed to connect to %s' % url)
+            try:
+                conn.request("GET", path, None, headers)
+                return (conn, conn.getresponse())
+            except _STALE_CONN_ERRORS:
+                self.conn_pool.release(url, conn, False)
+                if not reused:
+                    raise
+            except Exception:
+                self.conn_pool.release(url, conn, False)
+                raise
+
+    @staticmethod
+    def _range_matches(resp, offset):
+        """Check that a 206 response continues at offset."""
+        content_range = resp.getheader('content-range')
+        if content_range is None:
+            return False
+        match_obj = re.match(r'bytes (\d+)-', content_range)
+        return match_obj is not None and int(match_obj.group(1)) == offset
+
+    @staticmethod
+    def _read_blob(resp, out_fp, hasher):
+        """Copy a response body to out_fp, adding it to hasher."""
+        length = resp.getheader('content-length')
+        maxlen = int(length) if length is not None else None
+        nread = 0
+        readsz = 4 * 1024 * 1024  # read 4MB chunks
+        while maxlen is None or nread < maxlen:
+            # TODO find a way to timeout a failed read
+            buff = resp.read(readsz)
+            if not buff:
+                break
+            out_fp.write(buff)
+            hasher.update(buff)
+            nread += len(buff)
+        out_fp.flush()
+        if maxlen is not None and nread < maxlen:
+            raise ValueError('Short read of layer: %d/%d bytes'
+                             % (nread, maxlen))
 
     def check_layer_checksum(self, layer, filename):
-        """Perform checksum calculation to exhaustively validate download."""
+        """
+        Perform checksum calculation to exhaustively validate download.  A
+        file that was already verified and has not changed since is not read
+        again.
+        """
         if self.check_layer_checksums is False:
             return True
+        if _is_verified(layer, filename):
+            return True
 
-        (hash_type, value) = layer.split(':', 1)
-        exec_name = '%s%s' % (hash_type, 'sum')
-        process = Popen([exec_name, filename], stdout=PIPE)
-
-        stdout = process.communicate()[0].decode("utf-8")
-        checksum = stdout.split(' ', 1)[0]
-        if checksum != value:
+        value = layer.split(':', 1)[1]
+        hasher = _new_layer_hash(layer)
+        with open(filename, 'rb') as in_fp:
+            _hash_fd(hasher, in_fp.fileno())
+        if hasher.hexdigest() != value:
             raise ValueError("checksum mismatch, failure")
+        _record_verified(layer, filename)
         return True
 
     def extract_docker_layers(self, base_path):
         """Analyze files in docker layers and extract minimal set to base_path.
         """
-        def filter_layer(layer_members, to_remove):
-            """Remove members and members starting with to_remove from layer"""
-            trailing = '/' if not to_remove.endswith('/') else ''
-            prefix_to_remove = to_remove + trailing
-
-            return [x for x in layer_members
-                    if (not x.name == to_remove and
-                        not x.name.startswith(prefix_to_remove))]
-
-        layer_paths = []
+        layer_members = []
         tar_file_refs = []
         layer = self.eldest
         # Convert this base_path to unicode otherwise things will break
         # later.
         # base_path = base_path.encode('utf-8')
-        while layer is not None:
-            if layer['fsLayer']['blobSum'] in self.excludeBlobSums:
+        try:
+            while layer is not None:
+                if layer['fsLayer']['blobSum'] in self.excludeBlobSums:
+                    layer = layer['child']
+                    continue
+
+                tfname = '%s.tar' % layer['fsLayer']['blobSum']
+                tfname = os.path.join(self.cachedir, tfname)
+                tfp = tarfile.open(tfname, 'r:gz')
+                tar_file_refs.append(tfp)
+
+                # get directory of tar contents
+                layer_members.append(tfp.getmembers())
                 layer = layer['child']
-                continue
 
-            tfname = '%s.tar' % layer['fsLayer']['blobSum']
-            tfname = os.path.join(self.cachedir, tfname)
-            tfp = tarfile.open(tfname, 'r:gz')
-            tar_file_refs.append(tfp)
+            # decide which member of which layer provides each path
+            layer_paths = _flatten_layers(layer_members)
+
+            # extract the selected files, each exactly once
+            for tfp, members in zip(tar_file_refs, layer_paths):
+                tfp.extractall(path=base_path, members=members)
+                # We need to make sure everything is writeable by the user so
+                # subsequent layers can populate directories
+                for f in members:
+                    path = base_path + '/' + f.name
+                    mode = f.mode
+                    if not f.issym() and (f.mode & stat.S_IWUSR) == 0:
+                        os.chmod(path, mode | stat.S_IWUSR)
+        finally:
+            for tfp in tar_file_refs:
+                tfp.close()
 
-            # get directory of tar contents
-            members = tfp.getmembers()
-
-            # Normalize paths
-            for x in members:
-                if x.name[0:2] == './':
-                    x.name = x.name[2:]
-            # remove all illegal files
-            members = filter_layer(members, 'dev/')
-            members = filter_layer(members, '/')
-            members = [x for x in members if not x.name.find('..') >= 0]
-
-            # find all whiteouts
-            whiteouts = [x for x in members
-                         if x.name.find('/.wh.') >= 0 or
-                         x.name.startswith('.wh.')]
-
-            # remove the whiteout tags from this layer
-            for wh_ in whiteouts:
-                members.remove(wh_)
-
-            # remove the whiteout targets from all ancestral layers
-            for idx, ancs_layer in enumerate(layer_paths):
-                for wh_ in whiteouts:
-                    path = wh_.name.replace('/.wh.', '/')
-                    if path.startswith('.wh.'):
-                        path = path[4:]
-                    ancs_layer_iter = (x for x in ancs_layer if x.name == path)
-                    ancs_member = next(ancs_layer_iter, None)
-                    if ancs_member:
-                        ancs_layer = filter_layer(ancs_layer, path)
-                layer_paths[idx] = ancs_layer
-
-            # remove identical paths (not dirs) from all ancestral layers
-            notdirs = [x.name for x in members if not x.isdir()]
-            for idx, ancs_layer in enumerate(layer_paths):
-                # look for files that were directories
-                filter = [x.name for x in ancs_layer if x.isdir() and
-                          x.name in notdirs]
-                # And then filter them out and any files or subdirs
-                for f in filter:
-                    ancs_layer = [x for x in ancs_layer if x.name != f and
-                                  not x.name.startswith(f + '/')]
-                ancs_layer = [x for x in ancs_layer if x.name not in notdirs]
-                layer_paths[idx] = ancs_layer
-
-            # push this layer into the collection
-            layer_paths.append(members)
+        # fix permissions on the extracted files
+        cmd = ['chmod', '-R', 'a+rX,u+w', base_path]
+        pfp = Popen(cmd)
+        pfp.communicate()
 
-            layer = layer['child']
 
-        # extract the selected files
-        layer_idx = 0
+    def layer_files(self):
+        """
+        Return the cached tar files of the layers, eldest first.
+        """
+        files = []
         layer = self.eldest
         while layer is not None:
-            if layer['fsLayer']['blobSum'] in self.excludeBlobSums:
-                layer = layer['child']
-                continue
-
-            tfp = tar_file_refs[layer_idx]
-            members = layer_paths[layer_idx]
-            tfp.extractall(path=base_path, members=members)
-            # We need to make sure everything is writeable by the user so
-            # subsequent layers can do overwrites
-            for f in members:
-                path = base_path + '/' + f.name
-                mode = f.mode
-                if not stat.S_ISLNK(mode) and (f.mode & stat.S_IWUSR) == 0:
-                    os.chmod(path, mode | stat.S_IWUSR)
-
-            layer_idx += 1
+            if layer['fsLayer']['blobSum'] not in self.excludeBlobSums:
+                tfname = '%s.tar' % layer['fsLayer']['blobSum']
+                files.append(os.path.join(self.cachedir, tfname))
             layer = layer['child']
+        return files
+
+    def write_flattened_tar(self, out_fp):
+        """
+        Write the flattened image as a single uncompressed tar stream to
+        out_fp, see write_flattened_tar.
+        """
+        write_flattened_tar(self.layer_files(), out_fp)
+
 
+def write_flattened_tar(layer_files, out_fp):
+    """
+    Write the image made of the layer tar files (eldest first) as a single
+    uncompressed tar stream to out_fp, with whiteouts applied and the same
+    permission fixes as extract_docker_layers, so a tar-input image builder
+    can consume it without an expanded directory tree.
+    """
+    layer_members = []
+    tar_file_refs = []
+    try:
+        for tfname in layer_files:
+            tfp = tarfile.open(tfname, 'r:gz')
+            tar_file_refs.append(tfp)
+            layer_members.append(tfp.getmembers())
+
+        layer_paths = _flatten_layers(layer_members)
+
+        written = set()
+        out_tar = tarfile.open(fileobj=out_fp, mode='w|',
+                               format=tarfile.PAX_FORMAT)
+        for tfp, members in zip(tar_file_refs, layer_paths):
+            for member in members:
+                if member.ischr() or member.isblk():
+                    continue
+                source = member
+                if member.islnk():
+                    if member.linkname[0:2] == './':
+                        member.linkname = member.linkname[2:]
+                    if member.linkname not in written:
+                        # the link target is provided by a later layer,
+                        # so store a copy of the original target instead
+                        try:
+                            source = tfp.getmember(member.linkname)
+                        except KeyError:
+                            continue
+                        if not source.isreg():
+                            continue
+                info = _stream_tarinfo(member, source)
+                if info.isreg():
+                    out_tar.addfile(info, tfp.extractfile(source))
+                else:
+                    out_tar.addfile(info)
+                written.add(info.name)
+        out_tar.close()
+    finally:
         for tfp in tar_file_refs:
             tfp.close()
 
-        # fix permissions on the extracted files
-        cmd = ['chmod', '-R', 'a+rX,u+w', base_path]
-        pfp = Popen(cmd)
-        pfp.communicate()
-
 
 # Deprecated: Just use the object above
 def pull_image(options, repo, tag, cachedir='./', expanddir='./'):
@@ -731,19 +1212,22 @@ def pull_image(options, repo, tag, cachedir='./', expanddir='./'):
     handle = DockerV2Handle(imageident, options, cachedir=cachedir)
 
     meta = handle.examine_manifest()
-    handle.pull_layers()
-
     try:
-        expanddir = expanddir.decode("utf-8")
-    except:
-        pass
- 
-    expandedpath = os.path.join(expanddir, str(meta['id']))
-    meta['expandedpath'] = expandedpath
-    if not os.path.exists(expandedpath):
-        os.mkdir(expandedpath)
-
-    handle.extract_docker_layers(expandedpath)
+        handle.pull_layers()
+
+        try:
+            expanddir = expanddir.decode("utf-8")
+        except:
+            pass
+
+        expandedpath = os.path.join(expanddir, str(meta['id']))
+        meta['expandedpath'] = expandedpath
+        if not os.path.exists(expandedpath):
+            os.mkdir(expandedpath)
+
+        handle.extract_docker_layers(expandedpath)
+    finally:
+        handle.release_layers()
     return meta
 
 
@@ -2,6 +2,13 @@
 
 import hashlib
 import argparse
+import os
+from multiprocessing.pool import ThreadPool
+
+# Size of the chunks hashed independently by chunked_digest
+CHUNK_SIZE = 64 * 1024 * 1024
+_READ_SIZE = 1024 * 1024
+_DIGEST_TYPE = 'chunked-sha256'
 
 
 def fast_hash(infile):
@@ -19,11 +26,192 @@ def fast_hash(infile):
     return m.hexdigest()
 
 
+def _hash_chunk(args):
+    """ sha256 of one chunk of an open file """
+    fdesc, offset, length = args
+    digest = hashlib.sha256()
+    while length > 0:
+        data = os.pread(fdesc, min(length, _READ_SIZE), offset)
+        if not data:
+            break
+        digest.update(data)
+        offset += len(data)
+        length -= len(data)
+    return digest.digest()
+
+
+def _hash_chunks(fdesc, work, threads):
+    """ sha256 of each (fdesc, offset, length) in work, in parallel """
+    if threads is None:
+        threads = min(os.cpu_count() or 1, 8)
+    if threads > 1 and len(work) > 1:
+        pool = ThreadPool(min(threads, len(work)))
+        try:
+            return pool.map(_hash_chunk, work)
+        finally:
+            pool.close()
+            pool.join()
+    return [_hash_chunk(item) for item in work]
+
+
+def _root_digest(chunk_size, size, chunks):
+    """ Combine the chunk digests (bytes) of a file into its digest """
+    root = hashlib.sha256(('%s %d %d\n' % (_DIGEST_TYPE, chunk_size, size))
+                          .encode('utf-8'))
+    for chunk in chunks:
+        root.update(chunk)
+    return '%s:%d:%s' % (_DIGEST_TYPE, chunk_size, root.hexdigest())
+
+
+def _parse_digest(digest):
+    """ Return the chunk size of a chunked digest, or None if invalid """
+    try:
+        dtype, chunk_size, _ = digest.split(':')
+        chunk_size = int(chunk_size)
+    except ValueError:
+        return None
+    if dtype != _DIGEST_TYPE or chunk_size <= 0:
+        return None
+    return chunk_size
+
+
+def chunked_digest(infile, chunk_size=CHUNK_SIZE, threads=None):
+    """
+    Calculate a digest of the whole file.  The file is split in chunk_size
+    chunks whose sha256 are computed in parallel by threads threads (default
+    one per core, at most 8); the digest is the sha256 of the chunk digests
+    (a one level Merkle tree).  Returns the digest, as
+    chunked-sha256:<chunk size>:<hex>, and the hex digests of the chunks.
+    """
+    fdesc = os.open(infile, os.O_RDONLY)
+    try:
+        size = os.fstat(fdesc).st_size
+        work = [(fdesc, offset, min(chunk_size, size - offset))
+                for offset in range(0, size, chunk_size)]
+        chunks = _hash_chunks(fdesc, work, threads)
+    finally:
+        os.close(fdesc)
+    digest = _root_digest(chunk_size, size, chunks)
+    return digest, [chunk.hex() for chunk in chunks]
+
+
+class StreamDigest(object):
+    """
+    The digest of chunked_digest, computed over data fed in order (e.g.
+    while the file is being copied) instead of read back from a file.
+    """
+
+    def __init__(self, chunk_size=CHUNK_SIZE):
+        self.chunk_size = chunk_size
+        self.size = 0
+        self._chunks = []
+        self._chunk = hashlib.sha256()
+        self._fill = 0
+
+    def update(self, data):
+        view = memoryview(data)
+        while len(view) > 0:
+            take = min(len(view), self.chunk_size - self._fill)
+            self._chunk.update(view[:take])
+            self._fill += take
+            self.size += take
+            view = view[take:]
+            if self._fill == self.chunk_size:
+                self._chunks.append(self._chunk.digest())
+                self._chunk = hashlib.sha256()
+                self._fill = 0
+
+    def digest(self):
+        chunks = list(self._chunks)
+        if self._fill > 0:
+            chunks.append(self._chunk.digest())
+        return _root_digest(self.chunk_size, self.size, chunks)
+
+
+def stream_digest(digest):
+    """
+    Return a StreamDigest with the chunk size of digest, or None if digest
+    is not a chunked digest.
+    """
+    chunk_size = _parse_digest(digest)
+    if chunk_size is None:
+        return None
+    return StreamDigest(chunk_size)
+
+
+def verify_digest(infile, digest, threads=None):
+    """
+    Check the whole file against a digest from chunked_digest.
+    """
+    chunk_size = _parse_digest(digest)
+    if chunk_size is None:
+        return False
+    return chunked_digest(infile, chunk_size, threads)[0] == digest
+
+
+def verify_range(infile, digest, chunks, offset, length, threads=None):
+    """
+    Check length bytes of the file from offset against a digest and the
+    chunk digests returned with it by chunked_digest.  The chunk digests
+    are first checked against the digest, then only the chunks covering
+    the range are read.
+    """
+    chunk_size = _parse_digest(digest)
+    if chunk_size is None or offset < 0 or length < 0:
+        return False
+    fdesc = os.open(infile, os.O_RDONLY)
+    try:
+        size = os.fstat(fdesc).st_size
+        if len(chunks) != (size + chunk_size - 1) // chunk_size:
+            return False
+        try:
+            expected = [bytes.fromhex(chunk) for chunk in chunks]
+        except ValueError:
+            return False
+        if _root_digest(chunk_size, size, expected) != digest:
+            return False
+        first = offset // chunk_size
+        last = min((offset + length + chunk_size - 1) // chunk_size,
+                   len(chunks))
+        work = [(fdesc, idx * chunk_size,
+                 min(chunk_size, size - idx * chunk_size))
+                for idx in range(first, last)]
+        return _hash_chunks(fdesc, work, threads) == expected[first:last]
+    finally:
+        os.close(fdesc)
+
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Calculate file hash')
     parser.add_argument('infile', nargs=1, type=str)
+    parser.add_argument('--chunked', action='store_true',
+                        help='digest of the whole file, hashed in parallel')
+    parser.add_argument('--verify', type=str, default=None,
+                        help='check the file against a chunked digest')
+    parser.add_argument('--chunks', type=str, default=None,
+                        help='comma separated chunk digests, with --verify '
+                             'and --range')
+    parser.add_argument('--range', type=str, default=None,
+                        help='only verify OFFSET:LENGTH bytes')
+    parser.add_argument('-j', '--threads', type=int, default=None)
 
     args = parser.parse_args()
     infile = args.infile[0]
 
-    print(fast_hash(infile))
+    if args.verify is not None and args.range is not None:
+        offset, length = [int(val) for val in args.range.split(':')]
+        chunks = args.chunks.split(',') if args.chunks else []
+        if not verify_range(infile, args.verify, chunks, offset, length,
+                            args.threads):
+            print('MISMATCH')
+            raise SystemExit(1)
+        print('OK')
+    elif args.verify is not None:
+        if not verify_digest(infile, args.verify, args.threads):
+            print('MISMATCH')
+            raise SystemExit(1)
+        print('OK')
+    elif args.chunked:
+        print(chunked_digest(infile, threads=args.threads)[0])
+    else:
+        print(fast_hash(infile))
@@ -27,15 +27,19 @@ interactions with the Mongo Database and dispatches work through a thread pool.
 """
 
 import json
+import re
 import sys
 import os
 import logging
-from subprocess import Popen, PIPE
+import pwd
+import threading
 from time import time, sleep
 from pymongo import MongoClient
 import pymongo.errors
+from bson.objectid import ObjectId
 from shifter_imagegw.auth import Authentication
 from shifter_imagegw.imageworker import WorkerThreads
+from shifter_imagegw.layercache import LayerCache
 try:
     from multiprocessing import Process
 except:
@@ -43,6 +47,16 @@ except:
 
 import atexit
 
+# States a pull record goes through before it is READY.  Messages with these
+# states never change a READY record, so cached lookups stay valid.
+_PULL_PROGRESS_STATES = ('INIT', 'PENDING', 'PULLING', 'EXAMINATION',
+                         'CONVERSION', 'TRANSFER', 'HASHING')
+
+# Fields of an image record needed to list it and check read access.
+_LIST_FIELDS = ('id', 'system', 'itype', 'tag', 'status', 'userACL',
+                'groupACL', 'private', 'ENV', 'ENTRY', 'WORKDIR', 'LABELS',
+                'last_pull', 'status_message')
+
 
 # decorator function to re-attempt any mongo operation that may have failed
 # owing to AutoReconnect (e.g., mongod coming back, etc).  This may increase
@@ -118,6 +132,23 @@ class ImageMngr(object):
             threads = int(self.config['WorkerThreads'])
         self.workers = WorkerThreads(self.config, threads=threads)
         self.status_queue = self.workers.get_updater_queue()
+        # READY records served by lookup, dropped when the generation kept
+        # in mongo is bumped (by any API worker or status_thread) or after
+        # LookupCacheTTL seconds
+        self.lookup_ttl = float(self.config.get('LookupCacheTTL', 10))
+        self.lookup_cache = {}
+        self.lookup_generation = None
+        # auxilary groups of users, kept for GroupCacheTTL seconds
+        self.group_ttl = float(self.config.get('GroupCacheTTL', 300))
+        self.group_cache = {}
+        self.group_lock = threading.Lock()
+        # expiration resets and metrics of lookups are written by the
+        # maintenance thread every FlushInterval seconds
+        self.flush_interval = float(self.config.get('FlushInterval', 5))
+        self.pending_expire = {}
+        self.pending_metrics = []
+        self.pending_lock = threading.Lock()
+        self.maintenance_pid = None
         self.status_proc = Process(target=self.status_thread,
                                    name='StatusThread')
         self.status_proc.start()
@@ -128,11 +159,82 @@ class ImageMngr(object):
 
     def shutdown(self):
         self.status_queue.put('stop')
+        try:
+            self.flush_updates()
+        except Exception:
+            self.logger.warn('Failed to flush pending updates')
+
+    def _start_maintenance(self):
+        """
+        Start the maintenance thread of this process if it is not running.
+        This is checked on use since the server may fork after the manager
+        was created.
+        """
+        if self.maintenance_pid == os.getpid():
+            return
+        with self.pending_lock:
+            if self.maintenance_pid == os.getpid():
+                return
+            self.maintenance_pid = os.getpid()
+            # anything inherited from the parent is its to write
+            self.pending_expire = {}
+            self.pending_metrics = []
+            self.lookup_cache = {}
+        thread = threading.Thread(target=self.maintenance_thread,
+                                  name='MaintenanceThread')
+        thread.daemon = True
+        thread.start()
+
+    def maintenance_thread(self):
+        """
+        Periodically write the batched lookup updates and clean up failed
+        pulls.
+        """
+        pid = os.getpid()
+        while self.maintenance_pid == pid:
+            sleep(self.flush_interval)
+            try:
+                self.flush_updates()
+                self.update_states()
+            except Exception:
+                self.logger.exception('Maintenance failed')
+
+    def flush_updates(self):
+        """
+        Write the expiration resets and metrics recorded by lookups.
+        """
+        with self.pending_lock:
+            expires = self.pending_expire
+            metrics = self.pending_metrics
+            self.pending_expire = {}
+            self.pending_metrics = []
+        for ident, expire in expires.items():
+            self._images_update({'_id': ident},
+                                {'$set': {'expiration': expire}})
+        if len(metrics) > 0:
+            self._metrics_insert(metrics)
+
+    def _invalidate_lookups(self):
+        """Drop the cached lookups of all processes."""
+        self._versions_update({'_id': 'lookups'},
+                              {'$inc': {'generation': 1}}, upsert=True)
+
+    def _lookups_generation(self):
+        """Current generation of the cached lookups."""
+        rec = self._versions_find_one({'_id': 'lookups'})
+        if rec is None:
+            return 0
+        return rec.get('generation', 0)
 
     def mongo_init(self):
         client = MongoClient(self.config['MongoDBURI'])
         db_ = self.config['MongoDB']
         self.images = client[db_].images
+        self.versions = client[db_].versions
+        # listings are paged in _id order
+        self.images.create_index([('system', pymongo.ASCENDING),
+                                  ('status', pymongo.ASCENDING),
+                                  ('_id', pymongo.ASCENDING)])
         self.metrics = None
         if 'Metrics' in self.config and self.config['Metrics'] is True:
             self.metrics = client[db_].metrics
@@ -158,6 +260,10 @@ class ImageMngr(object):
             # A response message
             if state != 'READY':
                 self.update_mongo_state(ident, state, meta)
+                # only drop cached lookups once the new state is written,
+                # otherwise another worker could cache the old record again
+                if state not in _PULL_PROGRESS_STATES:
+                    self._invalidate_lookups()
                 continue
             if 'response' in meta and meta['response']:
                 response = meta['response']
@@ -168,6 +274,7 @@ class ImageMngr(object):
                 else:
                     self.complete_pull(ident, response)
                 self.logger.debug('meta=%s', str(response))
+            self._invalidate_lookups()
 
     def check_session(self, session, system=None):
         """Check if this is a valid session
@@ -205,20 +312,31 @@ class ImageMngr(object):
         return bool(system in self.systems)
 
     def _get_groups(self, uid, gid):
-        """Look up auxilary groups. """
-        proc = Popen(['id', '-G', '%d' % (uid)], stdout=PIPE, stderr=PIPE)
-        if proc is None:
+        """
+        Look up auxilary groups.  Lookups are cached for GroupCacheTTL
+        seconds since every lookup and pull of a private image needs them.
+        """
+        now = time()
+        with self.group_lock:
+            cached = self.group_cache.get(uid)
+            if cached is not None and now - cached[0] < self.group_ttl:
+                return cached[1]
+        try:
+            pwent = pwd.getpwuid(uid)
+            groups = os.getgrouplist(pwent.pw_name, pwent.pw_gid)
+        except (KeyError, OSError):
             self.logger.warn("Group lookup failed")
             return []
-        stdout, stderr = proc.communicate()
-        groups = []
-        for group in stdout.split():
-            groups.append(int(group))
+        if self.group_ttl > 0:
+            with self.group_lock:
+                self.group_cache[uid] = (now, groups)
         return groups
 
-    def _checkread(self, session, rec):
+    def _checkread(self, session, rec, groups=None):
         """
         Checks if the user has read permissions to the image.
+        groups are the auxilary groups of the user, they are looked up if
+        not given.
         """
 
         # Start by checking if the image is public (no ACLs)
@@ -238,7 +356,8 @@ class ImageMngr(object):
         gid = session['gid']
         self.logger.debug('uid=%s iUACL=%s' % (uid, str(iUACL)))
         self.logger.debug('sessions = ' + str(session))
-        groups = self._get_groups(uid, gid)
+        if groups is None:
+            groups = self._get_groups(uid, gid)
         if iUACL is not None and uid in iUACL:
             return True
         if iGACL is not None and gid in iGACL:
@@ -248,17 +367,28 @@ class ImageMngr(object):
                 return True
         return False
 
-    def _resetexpire(self, ident):
-        """Reset the expire time.  (Not fully implemented)."""
-        # Change expire time for image
+    def _expiretime(self):
+        """Return the expire time of an image used now."""
         # TODO shore up expire-time parsing
         expire_timeout = self.config['ImageExpirationTimeout']
         (days, hours, minutes, secs) = expire_timeout.split(':')
-        expire = time() + int(secs) + 60 * (int(minutes) +
-                                            60 * (int(hours) + 24 * int(days)))
+        return time() + int(secs) + 60 * (int(minutes) +
+                                          60 * (int(hours) + 24 * int(days)))
+
+    def _resetexpire(self, ident):
+        """Reset the expire time.  (Not fully implemented)."""
+        # Change expire time for image
+        expire = self._expiretime()
         self._images_update({'_id': ident}, {'$set': {'expiration': expire}})
         return expire
 
+    def _touchexpire(self, ident):
+        """Reset the expire time with the next flush."""
+        expire = self._expiretime()
+        with self.pending_lock:
+            self.pending_expire[ident] = expire
+        return expire
+
     def _make_acl(self, acllist, id):
         if id not in acllist:
             acllist.append(id)
@@ -306,7 +436,8 @@ class ImageMngr(object):
                 'id': record['id'],
                 'time': time()
             }
-            self._metrics_insert(r)
+            with self.pending_lock:
+                self.pending_metrics.append(r)
         except:
             self.logger.warn('Failed to log lookup.')
 
@@ -319,6 +450,7 @@ class ImageMngr(object):
             return recs
         if self.metrics is None:
             return recs
+        self.flush_updates()
         count = self.metrics.count()
         skip = count - limit
         if skip < 0:
@@ -328,6 +460,26 @@ class ImageMngr(object):
             recs.append(r)
         return recs
 
+    def get_cache_stats(self, session, system):
+        """
+        Return the layer cache counters and usage.
+        """
+        if not self._isadmin(session, system):
+            return {}
+        if 'CacheDirectory' not in self.config:
+            return {}
+        cache = LayerCache(self.config['CacheDirectory'],
+                           self.config.get('CacheMaxBytes', 0))
+        return cache.stats()
+
+    def get_worker_stats(self, session, system):
+        """
+        Return the queue depths and timings of the pull pipeline stages.
+        """
+        if not self._isadmin(session, system):
+            return []
+        return self.workers.get_stats()
+
     def new_session(self, auth_string, system):
         """
         Creates a session context that can be used for multiple transactions.
@@ -354,42 +506,142 @@ class ImageMngr(object):
         """
         if not self.check_session(session, image['system']):
             raise OSError("Invalid Session")
-        query = {
-            'status': 'READY',
-            'system': image['system'],
-            'itype': image['itype'],
-            'tag': {'$in': [image['tag']]}
-        }
-        self.update_states()
-        rec = self._images_find_one(query)
+        self._start_maintenance()
+        rec = self._cached_lookup(image)
         if rec is not None:
             if self._checkread(session, rec) is False:
                 return None
-            self._resetexpire(rec['_id'])
+            self._touchexpire(rec['_id'])
 
         if self.metrics is not None:
             self._add_metrics(session, image, rec)
         return rec
 
-    def imglist(self, session, system):
+    def lookup_batch(self, session, system, images):
+        """
+        Lookup several images of a system at once.
+        images is a list of dictionaries with itype and tag defined.  Returns
+        a list with the record of each image, or None if it is not found or
+        not readable by the user.
+        """
+        if not self.check_session(session, system):
+            raise OSError("Invalid Session")
+        self._start_maintenance()
+        images = [dict(image, system=system) for image in images]
+        recs = self._cached_lookups(system, images)
+        groups = None
+        for idx, rec in enumerate(recs):
+            if rec is not None:
+                if groups is None:
+                    groups = self._get_groups(session['uid'], session['gid'])
+                if self._checkread(session, rec, groups) is False:
+                    recs[idx] = None
+                    continue
+                self._touchexpire(rec['_id'])
+            if self.metrics is not None:
+                self._add_metrics(session, images[idx], recs[idx])
+        return recs
+
+    def _cached_lookup(self, image):
+        """
+        Find the READY record for an image, from the lookup cache if it is
+        still valid.  Misses are not cached so new images show up at once.
+        """
+        return self._cached_lookups(image['system'], [image])[0]
+
+    def _cached_lookups(self, system, images):
+        """
+        Find the READY records for a list of images of a system.  Images not
+        in the lookup cache are fetched with a single query.
+        """
+        now = time()
+        generation = None
+        if self.lookup_ttl > 0:
+            generation = self._lookups_generation()
+        if generation != self.lookup_generation:
+            self.lookup_cache = {}
+            self.lookup_generation = generation
+        recs = [None] * len(images)
+        missing = {}
+        for idx, image in enumerate(images):
+            key = (system, image['itype'], image['tag'])
+            entry = self.lookup_cache.get(key)
+            if entry is not None and now - entry[0] < self.lookup_ttl:
+                recs[idx] = dict(entry[1])
+            else:
+                missing.setdefault(key, []).append(idx)
+        if len(missing) == 0:
+            return recs
+
+        query = {
+            'status': 'READY',
+            'system': system,
+            'itype': {'$in': list(set(key[1] for key in missing))},
+            'tag': {'$in': list(set(key[2] for key in missing))}
+        }
+        for rec in self._images_find(query):
+            tags = rec.get('tag', [])
+            if not isinstance(tags, list):
+                tags = [tags]
+            for tag in tags:
+                key = (system, rec['itype'], tag)
+                if key not in missing:
+                    continue
+                for idx in missing.pop(key):
+                    recs[idx] = dict(rec)
+                if self.lookup_ttl > 0:
+                    self.lookup_cache[key] = (now, dict(rec))
+        return recs
+
+    def imglist(self, session, system, prefix=None, user=None, since=None,
+                limit=0, after=None):
         """
         list images for a system.
         Image is dictionary with system defined.
+
+        The images can be filtered by tag prefix, by a uid in their user ACL
+        and by a minimum last_pull time.  Images are returned in the order
+        they were created, which is the order of the (system, status, _id)
+        index.  With a limit at most limit images are returned; the next page
+        starts after the cursor (see list_cursor) given in after.  Raises
+        ValueError for a bad cursor.
         """
         if not self.check_session(session, system):
             raise OSError("Invalid Session")
         if self._isasystem(system) is False:
             raise OSError("Invalid System")
         query = {'status': 'READY', 'system': system}
-        self.update_states()
-        records = self._images_find(query)
+        if prefix:
+            query['tag'] = {'$regex': '^' + re.escape(prefix)}
+        if user is not None:
+            query['userACL'] = int(user)
+        if since is not None:
+            query['last_pull'] = {'$gte': float(since)}
+        if after is not None:
+            if not ObjectId.is_valid(after):
+                raise ValueError('invalid list cursor %s' % after)
+            query['_id'] = {'$gt': ObjectId(after)}
+        projection = dict((field, True) for field in _LIST_FIELDS)
+        records = self._images_find(query, projection)
+        records = records.sort('_id', pymongo.ASCENDING)
+        groups = self._get_groups(session['uid'], session['gid'])
         resp = []
+        # verify access, the cursor fetches further batches as needed
         for record in records:
-            if self._checkread(session, record):
+            if self._checkread(session, record, groups):
                 resp.append(record)
-        # verify access
+                if limit > 0 and len(resp) >= limit:
+                    break
         return resp
 
+    @staticmethod
+    def list_cursor(record):
+        """
+        Return the cursor passed as after to imglist to list the images
+        following record.
+        """
+        return str(record['_id'])
+
     def show_queue(self, session, system):
         """
         list queue for a system.
@@ -520,8 +772,6 @@ class ImageMngr(object):
         # otherwise
         #  return the record
         rec = None
-        # find any pull record
-        self.update_states()
         # let's lookup the active image
         query = {
             'status': 'READY',
@@ -588,6 +838,7 @@ class ImageMngr(object):
             self.logger.info(memo)
 
             self.update_mongo(ident, {'last_pull': time()})
+            self._invalidate_lookups()
 
         return rec
 
@@ -659,6 +910,7 @@ class ImageMngr(object):
         self.logger.info(memo)
 
         self.update_mongo(ident, {'last_pull': time()})
+        self._invalidate_lookups()
 
         return rec
 
@@ -693,6 +945,7 @@ class ImageMngr(object):
             curtag = rec['tag']
             self._images_update({'_id': ident}, {'$set': {'tag': [curtag]}})
         self._images_update({'_id': ident}, {'$addToSet': {'tag': tag}})
+        self._invalidate_lookups()
         return True
 
     def remove_tag(self, system, tag):
@@ -701,6 +954,7 @@ class ImageMngr(object):
         """
         self._images_update({'system': system, 'tag': {'$in': [tag]}},
                             {'$pull': {'tag': tag}}, multi=True)
+        self._invalidate_lookups()
         return True
 
     def update_acls(self, ident, response):
@@ -811,7 +1065,6 @@ class ImageMngr(object):
         Lookup the state of the image with _id==ident in Mongo.
         Returns the state.
         """
-        self.update_states()
         rec = self._images_find_one({'_id': ident}, {'status': 1})
         if rec is None:
             return None
@@ -834,6 +1087,8 @@ class ImageMngr(object):
         # While this should be safe, let's restrict this to admins
         if not self._isadmin(session, system):
             return False
+        # Expire based on the latest lookups
+        self.flush_updates()
         # Cleanup - Lookup for things stuck in non-READY state
         self.update_states()
         removed = []
@@ -861,6 +1116,8 @@ class ImageMngr(object):
                 else:
                     expired.append('unknown')
             self.logger.debug(rec['expiration'] > time())
+        if len(removed) > 0 or len(expired) > 0:
+            self._invalidate_lookups()
         return expired
 
     def expire_id(self, rec, ident):
@@ -890,6 +1147,7 @@ class ImageMngr(object):
             % (image['system'], ident)
         self.logger.debug(memo)
         self.workers.doexpire(ident, rec)
+        self._invalidate_lookups()
 
         memo = "expire request queued s=%s t=%s" \
             % (image['system'], image['tag'])
@@ -922,6 +1180,16 @@ class ImageMngr(object):
         """ Decorated function to insert an image in mongo """
         return self.images.insert(*args, **kwargs)
 
+    @mongo_reconnect_reattempt
+    def _versions_find_one(self, *args, **kwargs):
+        """ Decorated function to find a version document in mongo """
+        return self.versions.find_one(*args, **kwargs)
+
+    @mongo_reconnect_reattempt
+    def _versions_update(self, *args, **kwargs):
+        """ Decorated function to update a version document in mongo """
+        return self.versions.update(*args, **kwargs)
+
     @mongo_reconnect_reattempt
     def _metrics_insert(self, *args, **kwargs):
         """ Decorated function to insert an image in mongo """
@@ -20,19 +20,85 @@
 This module provides the worker function for the image gateway.
 """
 
+import functools
+import hashlib
+import json
 import os
 import shutil
 import sys
 import subprocess
 import logging
 import tempfile
+import threading
+import queue
+import multiprocessing
 from multiprocessing import Queue
 from multiprocessing.pool import ThreadPool
 from time import time
-from shifter_imagegw import converters, transfer
+from shifter_imagegw import converters, dockerv2, fasthash, transfer
 from shifter_imagegw.dockerv2 import DockerV2Handle as DockerV2
 from shifter_imagegw.dockerv2_ext import DockerV2ext
 
+# The stages of a pull in order.  Each runs on its own workers, so a long
+# conversion does not hold up the downloads of other images.
+PULL_STAGES = ('download', 'extract', 'convert', 'transfer')
+_STAGE_WAIT_MESSAGES = {
+    'extract': 'Waiting for extraction',
+    'convert': 'Waiting for conversion',
+    'transfer': 'Waiting for transfer',
+}
+# Images handed between stages that may wait for the next one
+_DEFAULT_STAGE_QUEUE_DEPTH = 4
+
+
+def _child_main(func, args, conn):
+    """ Child side of _run_in_child """
+    try:
+        conn.send((True, func(*args)))
+    except Exception as err:
+        conn.send((False, '%s: %s' % (type(err).__name__, err)))
+    conn.close()
+
+
+def _run_in_child(func, *args):
+    """
+    Run func(*args) in a child process and return its result.  Exceptions
+    in the child are raised as OSError.  The child is started by a fork
+    server rather than forked from the gateway, whose threads may hold
+    locks at fork time, so func, args and the result must be picklable.
+    """
+    ctx = multiprocessing.get_context('forkserver')
+    (reader, writer) = ctx.Pipe(duplex=False)
+    proc = ctx.Process(target=_child_main, args=(func, args, writer))
+    proc.start()
+    writer.close()
+    try:
+        (success, value) = reader.recv()
+    except EOFError:
+        success = False
+        value = None
+    reader.close()
+    proc.join()
+    if not success:
+        if value is None:
+            value = 'child exited with %d' % proc.exitcode
+        raise OSError(value)
+    return value
+
+
+def _convert(fmt, expand_path, layer_files, image_path, options,
+             startup_profile):
+    """
+    Build the image from the expanded tree, or from the layer tar files
+    (eldest first) if layer_files is set.  Returns True on success.
+    """
+    if layer_files is not None:
+        return converters.convert_stream(
+            fmt, functools.partial(dockerv2.write_flattened_tar, layer_files),
+            image_path, options=options)
+    return converters.convert(fmt, expand_path, image_path, options=options,
+                              startup_profile=startup_profile)
+
 
 class Updater(object):
     """
@@ -42,9 +108,11 @@ class Updater(object):
         """ init the updater. """
         self.ident = ident
         self.update_method = update_method
+        self.state = None
 
     def update_status(self, state, message, response=None):
         """ update the status including the heartbeat and message """
+        self.state = state
         if self.update_method is not None:
             metadata = {'heartbeat': time(),
                         'message': message,
@@ -60,14 +128,81 @@ class Updater(object):
                                meta=metadata)
 
 
+class _Stage(object):
+    """
+    A stage of the pull pipeline: the queue of images waiting for it, and
+    counters and timings of the work it did.
+    """
+    def __init__(self, name, workers, depth):
+        self.name = name
+        self.workers = workers
+        self.queue = queue.Queue(maxsize=depth)
+        self.lock = threading.Lock()
+        self.active = 0
+        self.completed = 0
+        self.failed = 0
+        self.seconds = 0.0
+        self.max_seconds = 0.0
+
+    def started(self):
+        with self.lock:
+            self.active += 1
+
+    def finished(self, elapsed, success):
+        with self.lock:
+            self.active -= 1
+            if success:
+                self.completed += 1
+            else:
+                self.failed += 1
+            self.seconds += elapsed
+            self.max_seconds = max(self.max_seconds, elapsed)
+
+    def stats(self):
+        with self.lock:
+            count = self.completed + self.failed
+            return {
+                'name': self.name,
+                'workers': self.workers,
+                'queued': self.queue.qsize(),
+                'active': self.active,
+                'completed': self.completed,
+                'failed': self.failed,
+                'avg_seconds': self.seconds / count if count > 0 else 0.0,
+                'max_seconds': self.max_seconds
+            }
+
+
 class WorkerThreads(object):
     def __init__(self, conf, threads=1):
         """
-        Initialize the thread pool and queues.
+        Initialize the thread pool and queues.  Pulls go through a pipeline
+        of stages, each with "PipelineStages"[stage] workers (default
+        threads), that hand images on through queues of at most
+        "PipelineQueueDepth" entries.
         """
         self.pools = ThreadPool(processes=threads)
         self.updater_queue = Queue()
         self.conf = conf
+        stage_workers = conf.get('PipelineStages', {})
+        depth = int(conf.get('PipelineQueueDepth',
+                             _DEFAULT_STAGE_QUEUE_DEPTH))
+        self.stages = {}
+        for name in PULL_STAGES:
+            workers = int(stage_workers.get(name, threads))
+            if workers < 1:
+                raise ValueError('PipelineStages must be positive')
+            # new pulls are never refused, only the hand-offs are bounded
+            if name == PULL_STAGES[0]:
+                self.stages[name] = _Stage(name, workers, 0)
+            else:
+                self.stages[name] = _Stage(name, workers, depth)
+            for _ in range(workers):
+                thread = threading.Thread(target=self._stage_worker,
+                                          args=(self.stages[name],),
+                                          name='%s-worker' % name)
+                thread.daemon = True
+                thread.start()
         if 'CacheDirectory' in conf:
             if not os.path.exists(conf['CacheDirectory']):
                 os.mkdir(conf['CacheDirectory'])
@@ -81,6 +216,31 @@ class WorkerThreads(object):
     def get_updater_queue(self):
         return self.updater_queue
 
+    def get_stats(self):
+        """ Return the queue depths and timings of the pull stages. """
+        return [self.stages[name].stats() for name in PULL_STAGES]
+
+    def _stage_worker(self, stage):
+        """
+        Run one stage for the images in its queue and pass them on to their
+        next stage.  Waits while the next stage's queue is full.
+        """
+        while True:
+            req = stage.queue.get()
+            start = time()
+            stage.started()
+            try:
+                nextstage = req.run_stage(stage.name)
+            except Exception:
+                # run_stage already reported the failure
+                stage.finished(time() - start, False)
+                continue
+            stage.finished(time() - start, True)
+            if nextstage is not None:
+                req.updater.update_status(req.updater.state,
+                                          _STAGE_WAIT_MESSAGES[nextstage])
+                self.stages[nextstage].queue.put(req)
+
     def updater(self, ident, state, meta):
         """
         Updater function: This just post a message to a queue.
@@ -90,7 +250,7 @@ class WorkerThreads(object):
     def pull(self, request, updater):
         try:
             req = ImageRequest(self.conf, request, updater)
-            req.pull()
+            self.stages[PULL_STAGES[0]].queue.put(req)
         except Exception as err:
             resp = {'error_type': str(type(err)),
                     'message': str(err)}
@@ -154,6 +314,8 @@ class ImageRequest(object):
         self.import_image = False
         self.metafile = None
         self.expandedpath = None
+        self.layer_source = None
+        self.puller = None
         self.imagefile = None
         self.filepath = request.get('filepath')
         self.session = request.get('session')
@@ -180,10 +342,12 @@ class ImageRequest(object):
                 raise OSError('%s does not exist' % cacert)
         return cacert
 
-    def _pull_dockerv2(self, location, repo, tag):
-        """ Private method to pull a docker images. """
+    def _pull_dockerv2(self, location, repo, tag, extract=True):
+        """
+        Private method to pull a docker images.  The layers are only
+        downloaded if extract is False, _extract_layers expands them later.
+        """
         cdir = self.conf['CacheDirectory']
-        edir = self.conf['ExpandDirectory']
         params = self.conf['Locations'][location]
         cacert = self._get_cacert(location)
 
@@ -197,6 +361,12 @@ class ImageRequest(object):
             options['baseUrl'] = url
             if 'authMethod' in params:
                 options['authMethod'] = params['authMethod']
+            if 'maxConnections' in params:
+                options['maxConnections'] = params['maxConnections']
+            if 'LayerConcurrency' in self.conf:
+                options['layerConcurrency'] = self.conf['LayerConcurrency']
+            if 'CacheMaxBytes' in self.conf:
+                options['cacheMaxBytes'] = self.conf['CacheMaxBytes']
 
             if (self.tokens):
                 if location in self.tokens:
@@ -215,6 +385,7 @@ class ImageRequest(object):
             else:
                 dock = DockerV2(imgid, options, updater=self.updater,
                                 cachedir=cdir)
+            self.puller = dock
             self.updater.update_status("PULLING", 'Getting manifest')
             self.meta = dock.examine_manifest()
             # Get the ID
@@ -225,12 +396,13 @@ class ImageRequest(object):
 
             dock.pull_layers()
 
-            self.expandedpath = tempfile.mkdtemp(suffix='extract',
-                                                 prefix=self.id,
-                                                 dir=edir)
+            if self._stream_conversion() and isinstance(dock, DockerV2):
+                # convert straight from the layers, nothing to expand
+                self.layer_source = dock
+                return True
 
-            self.updater.update_status("PULLING", 'Extracting Layers')
-            dock.extract_docker_layers(self.expandedpath)
+            if extract:
+                self._extract_layers()
             return True
         except:
             logging.warn(sys.exc_info()[1])
@@ -238,9 +410,19 @@ class ImageRequest(object):
 
         return False
 
-    def _pull_image(self):
+    def _extract_layers(self):
+        """ Expand the downloaded layers into a temporary directory. """
+        edir = self.conf['ExpandDirectory']
+        self.expandedpath = tempfile.mkdtemp(suffix='extract',
+                                             prefix=self.id,
+                                             dir=edir)
+
+        self.updater.update_status("PULLING", 'Extracting Layers')
+        self.puller.extract_docker_layers(self.expandedpath)
+
+    def _pull_image(self, extract=True):
         """
-        pull the image down and extract the contents
+        pull the image down and extract the contents, unless extract is False
 
         Returns True on success
         """
@@ -272,7 +454,7 @@ class ImageRequest(object):
             raise KeyError('%s not found in configuration' % location)
 
         if rtype == 'dockerv2':
-            return self._pull_dockerv2(location, repo, tag)
+            return self._pull_dockerv2(location, repo, tag, extract)
         elif rtype == 'dockerhub':
             logging.warning("Use of depcreated dockerhub type")
             msg = 'dockerhub type is depcreated. Use dockerv2'
@@ -281,6 +463,18 @@ class ImageRequest(object):
             raise NotImplementedError('Unsupported remote type %s' % rtype)
         return False
 
+    def _stream_conversion(self):
+        """
+        Check if the image should be converted from a flattened tar stream of
+        the layers instead of an expanded directory.  The examiner needs the
+        expanded image, so streaming is not used when one is configured, nor
+        when files are ordered for startup.
+        """
+        return bool(self.conf.get('StreamingConversion')) and \
+            converters.supports_stream(self.fmt) and \
+            'examiner' not in self.conf and \
+            not self.conf.get('StartupSort', False)
+
     def _examine_image(self):
         """
         examine the image
@@ -297,26 +491,59 @@ class ImageRequest(object):
 
         return True
 
-    def _convert_image(self):
+    def _convert_image(self, in_child=False):
         """
-        Convert the image to the required format for the target system
+        Convert the image to the required format for the target system.
+        With in_child the conversion runs in a child process.
 
         Returns True on success
         """
-        edir = self.conf['ExpandDirectory']
         if 'ConverterOptions' in self.conf:
             opts = self.conf['ConverterOptions']
         else:
             opts = None
 
-        imagefile = os.path.join(edir, '%s.%s' % (self.id,
-                                                  self.fmt))
+        imagefile = self._imagefile_path()
         self.imagefile = imagefile
 
-        status = converters.convert(self.fmt,
-                                    self.expandedpath,
-                                    imagefile, options=opts)
-        return status
+        layer_files = None
+        if self.layer_source is not None:
+            layer_files = self.layer_source.layer_files()
+        args = (self.fmt, self.expandedpath, layer_files, imagefile, opts,
+                self._startup_profile())
+        if in_child:
+            return _run_in_child(_convert, *args)
+        return _convert(*args)
+
+    def _startup_profile(self):
+        """
+        With StartupSort, return the paths recorded as read at startup by
+        earlier runs of the image, from the file named after the tag (or its
+        repository, for any tag) in StartupProfileDirectory.  Returns None
+        if startup ordering is disabled.
+        """
+        if not self.conf.get('StartupSort', False):
+            return None
+        profile_dir = self.conf.get('StartupProfileDirectory')
+        if profile_dir is None or self.tag is None:
+            return []
+        names = [self.tag]
+        if ':' in self.tag:
+            names.append(self.tag.rsplit(':', 1)[0])
+        for name in names:
+            path = os.path.join(profile_dir, name.replace('/', '_'))
+            try:
+                with open(path) as in_fp:
+                    return [line.strip() for line in in_fp
+                            if line.strip() and not line.startswith('#')]
+            except (IOError, OSError):
+                continue
+        return []
+
+    def _imagefile_path(self):
+        """ Path the image is converted to before the transfer """
+        return os.path.join(self.conf['ExpandDirectory'],
+                            '%s.%s' % (self.id, self.fmt))
 
     def _write_metadata(self):
         """
@@ -368,10 +595,18 @@ class ImageRequest(object):
                                      self.metafile, logging)
         else:
             if not self.import_image:
-                return transfer.transfer(self.sysconf,
-                                         self.imagefile,
-                                         self.metafile,
-                                         logging, self.import_image)
+                delta = self._delta_base()
+                digest = None
+                if self.meta and self.imagefile is not None:
+                    digest = self.meta.get('digest')
+                status = transfer.transfer(self.sysconf,
+                                           self.imagefile,
+                                           self.metafile,
+                                           logging, self.import_image,
+                                           delta=delta, digest=digest)
+                if status and delta is not None:
+                    self._save_manifest(delta['manifest'])
+                return status
             else:
                 return transfer.transfer(self.sysconf,
                                          self.filepath,
@@ -380,6 +615,53 @@ class ImageRequest(object):
                                          self.import_image,
                                          self.imagefile)
 
+    def _manifest_path(self):
+        """
+        Path of the block manifest of the last image of this tag transferred
+        to the system, kept with DeltaTransfer.
+        """
+        key = '%s/%s/%s' % (self.system, self.tag, self.fmt)
+        return os.path.join(self.conf['CacheDirectory'], 'manifests',
+                            '%s.json' % hashlib.sha1(key.encode('utf-8'))
+                            .hexdigest())
+
+    def _delta_base(self):
+        """
+        With DeltaTransfer, return the delta description for transfer: the
+        previous image of the tag and its block manifest, and the manifest
+        of the new image.  Returns None if delta transfers are disabled.
+        """
+        if not self.conf.get('DeltaTransfer', False) or self.tag is None:
+            return None
+        delta = {
+            'base': None,
+            'base_manifest': None,
+            'manifest': transfer.block_manifest(self.imagefile)
+        }
+        try:
+            with open(self._manifest_path()) as in_fp:
+                previous = json.load(in_fp)
+            delta['base'] = previous['image']
+            delta['base_manifest'] = previous['manifest']
+        except (IOError, OSError, ValueError, KeyError):
+            pass
+        return delta
+
+    def _save_manifest(self, manifest):
+        """ Record the manifest of the image just transferred. """
+        path = self._manifest_path()
+        try:
+            if not os.path.exists(os.path.dirname(path)):
+                os.makedirs(os.path.dirname(path))
+            temp = '%s.%d.%d' % (path, os.getpid(), threading.get_ident())
+            with open(temp, 'w') as out_fp:
+                json.dump({'image': os.path.basename(self.imagefile),
+                           'manifest': manifest}, out_fp)
+            os.rename(temp, path)
+        except (IOError, OSError):
+            logging.warn('Failed to save the block manifest of %s',
+                         self.imagefile)
+
     def remove_image(self):
         """
         Remove the image to the target system based on the configuration.
@@ -404,6 +686,10 @@ class ImageRequest(object):
         """
         Helper function to cleanup any temporary files or directories.
         """
+        if isinstance(self.puller, DockerV2):
+            # the layers may be evicted from the cache now
+            self.puller.release_layers()
+        self.puller = None
         if not self.import_image:
             items = (self.expandedpath,
                      self.imagefile,
@@ -438,71 +724,110 @@ class ImageRequest(object):
                     logging.error("Worker: caught exception while trying to "
                                   "clean up %s.", cleanitem)
 
-    def pull(self):
+    def _stage_download(self):
         """
-        Main task to do the full workflow of pulling an image and transferring
-        it
+        Download the image.  Returns the next stage: extract, or convert if
+        the image is converted from the layers, or transfer if only the
+        metadata has to be updated.
+        """
+        self.updater.update_status('PULLING', 'PULLING')
+        logging.debug(self.tag)
+        if not self._pull_image(extract=False):
+            logging.info("Worker: Pull failed")
+            raise OSError('Pull failed')
+
+        if not self.meta:
+            raise OSError('Metadata not populated')
+
+        if self._check_image():
+            self.meta_only = True
+            self.meta['meta_only'] = True
+            logging.debug("Updating metdata for %s" %
+                          (self.tag))
+            if not self._write_metadata():
+                raise OSError('Metadata creation failed')
+            return 'transfer'
+        if self.layer_source is not None:
+            return 'convert'
+        return 'extract'
+
+    def _stage_extract(self):
+        """ Expand and examine the image. """
+        self._extract_layers()
+        self.updater.update_status('EXAMINATION', 'Examining image')
+        logging.debug("Worker: examining image %s" % self.tag)
+        if not self._examine_image():
+            raise OSError('Examine failed')
+        return 'convert'
+
+    def _stage_convert(self):
+        """
+        Convert the image and write its metadata.  The conversion runs in a
+        child process so it does not compete with the other stages for the
+        interpreter.
+        """
+        self.updater.update_status('CONVERSION', 'Converting image')
+        logging.debug("Worker: converting image %s" % self.tag)
+        self.imagefile = self._imagefile_path()
+        if not self._convert_image(in_child=True):
+            raise OSError('Conversion failed')
+        self.meta['digest'], self.meta['digest_chunks'] = \
+            fasthash.chunked_digest(self.imagefile)
+        if not self._write_metadata():
+            raise OSError('Metadata creation failed')
+        return 'transfer'
+
+    def _stage_transfer(self):
+        """ Transfer the image and report it ready. """
+        if self.meta_only:
+            self.updater.update_status('TRANSFER', 'Transferring metadata')
+            logging.debug("Worker: transferring metadata %s",
+                          self.tag)
+        else:
+            self.updater.update_status('TRANSFER', 'Transferring image')
+            logging.debug("Worker: transferring image %s", self.tag)
+        if not self._transfer_image():
+            raise OSError('Transfer failed')
+
+        # Done
+        self.updater.update_status('READY', 'Image ready',
+                                   response=self.meta)
+        self._cleanup_temporary()
+        return None
+
+    def run_stage(self, stage):
+        """
+        Run one stage of a pull and return the name of the next one, or None
+        once the image is ready.  A failed pull is reported (only here) and
+        cleaned up, then the error is raised again.
         """
-        tag = self.tag
-        logging.debug("dopull system=%s tag=%s", self.system, tag)
         try:
-            # Step 1 - Do the pull
-            self.updater.update_status('PULLING', 'PULLING')
-            logging.debug(self.tag)
-            if not self._pull_image():
-                logging.info("Worker: Pull failed")
-                raise OSError('Pull failed')
-
-            if not self.meta:
-                raise OSError('Metadata not populated')
-
-            if not self._check_image():
-                # Step 2 - Check the image
-                self.updater.update_status('EXAMINATION', 'Examining image')
-                logging.debug("Worker: examining image %s" % tag)
-                if not self._examine_image():
-                    raise OSError('Examine failed')
-                # Step 3 - Convert
-                self.updater.update_status('CONVERSION', 'Converting image')
-                logging.debug("Worker: converting image %s" % tag)
-                if not self._convert_image():
-                    raise OSError('Conversion failed')
-                if not self._write_metadata():
-                    raise OSError('Metadata creation failed')
-                # Step 4 - TRANSFER
-                self.updater.update_status('TRANSFER', 'Transferring image')
-                logging.debug("Worker: transferring image %s", tag)
-                if not self._transfer_image():
-                    raise OSError('Transfer failed')
-            else:
-                self.meta_only = True
-                self.meta['meta_only'] = True
-                logging.debug("Updating metdata for %s" %
-                              (self.tag))
-                if not self._write_metadata():
-                    raise OSError('Metadata creation failed')
-                self.updater.update_status('TRANSFER', 'Transferring metadata')
-                logging.debug("Worker: transferring metadata %s",
-                              self.tag)
-                if not self._transfer_image():
-                    raise OSError('Transfer failed')
-
-            # Done
-            self.updater.update_status('READY', 'Image ready',
-                                       response=self.meta)
-            self._cleanup_temporary()
-            return self.meta
-
+            return getattr(self, '_stage_%s' % stage)()
         except:
             logging.error("ERROR: dopull failed system=%s tag=%s",
                           self.system, self.tag)
-            print(sys.exc_info()[1])
-            self.updater.update_status('FAILURE', 'FAILED')
+            err = sys.exc_info()[1]
+            print(err)
+            resp = {'error_type': str(type(err)),
+                    'message': str(err)}
+            self.updater.update_status('FAILURE', 'FAILED', response=resp)
 
             # TODO: add a debugging flag and only disable cleanup if debugging
             self._cleanup_temporary()
             raise
 
+    def pull(self):
+        """
+        Main task to do the full workflow of pulling an image and transferring
+        it.  The stages run back to back here, WorkerThreads runs them as a
+        pipeline instead.
+        """
+        logging.debug("dopull system=%s tag=%s", self.system, self.tag)
+        stage = PULL_STAGES[0]
+        while stage is not None:
+            stage = self.run_stage(stage)
+        return self.meta
+
     def img_import(self):
         """
         Task to do the full workflow of copying an image and processing it
@@ -523,13 +848,16 @@ class ImageRequest(object):
             self.updater.update_status('HASHING', 'HASHING')
             self.id = transfer.hash_file(self.filepath,
                                          self.sysconf, logging)
+            digest = transfer.hash_file(self.filepath, self.sysconf,
+                                        logging, chunked=True)
             # Step 2 - Populate the metadata file
             logging.debug("starting writing metadata")
             # if not self.meta:
             #     raise OSError('Metadata not populated')
             self.meta = {
                 'format': self.fmt,
-                'user': self.user
+                'user': self.user,
+                'digest': digest
             }
             if not self._write_metadata():
                 logging.info("Writing metadata")
@@ -543,6 +871,11 @@ class ImageRequest(object):
             if not self._transfer_image():
                 logging.warn("Worker: Import copy failed")
                 raise OSError("Import copy failed")
+            # the source may have changed since it was hashed
+            if not transfer.verify_file(imgfile, self.sysconf, digest,
+                                        logging):
+                transfer.remove(self.sysconf, imgfile, None, logging)
+                raise OSError("Imported image does not match its digest")
 
             # Done
             self.updater.update_status('READY', 'Image ready',
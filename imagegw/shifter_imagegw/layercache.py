@@ -0,0 +1,271 @@
+# Shifter, Copyright (c) 2016, The Regents of the University of California,
+# through Lawrence Berkeley National Laboratory (subject to receipt of any
+# required approvals from the U.S. Dept. of Energy).  All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#  1. Redistributions of source code must retain the above copyright notice,
+#     this list of conditions and the following disclaimer.
+#  2. Redistributions in binary form must reproduce the above copyright notice,
+#     this list of conditions and the following disclaimer in the documentation
+#     and/or other materials provided with the distribution.
+#  3. Neither the name of the University of California, Lawrence Berkeley
+#     National Laboratory, U.S. Dept. of Energy nor the names of its
+#     contributors may be used to endorse or promote products derived from this
+#     software without specific prior written permission.`
+#
+# See LICENSE for full text.
+
+"""
+This module manages the layer blobs kept in the CacheDirectory.  Blobs are
+stored by digest as <digest>.tar.  An index in the same directory records the
+size, last use and referencing images of every blob, the blobs of pulls still
+in flight, and hit/miss/eviction counters.  Once the cache grows past its byte
+limit the least recently used blobs that no pull is using are removed.
+
+The index is shared by all gateway processes using the directory, so every
+update is done under an exclusive lock on the lock file.
+"""
+
+import errno
+import fcntl
+import json
+import os
+import re
+import threading
+from contextlib import contextmanager
+from time import time
+
+_INDEX_NAME = 'layercache.json'
+_LOCK_NAME = 'layercache.lock'
+_INDEX_VERSION = 1
+_BLOB_RE = re.compile(r'^([a-z0-9]+:[0-9a-f]+)\.tar$')
+# Files that belong to a blob, relative to its <digest>.tar
+_BLOB_SUFFIXES = ('', '.verified', '.partial')
+_COUNTERS = ('hits', 'misses', 'evictions', 'evicted_bytes')
+
+_PIN_LOCK = threading.Lock()
+_PIN_SEQ = [0]
+
+
+def _pid_alive(pid):
+    """Check if a process still exists."""
+    try:
+        os.kill(pid, 0)
+    except OSError as err:
+        return err.errno == errno.EPERM
+    return True
+
+
+class LayerCache(object):
+    """
+    Accounting and LRU eviction for the layer blobs in a cache directory.
+    """
+
+    def __init__(self, cachedir, max_bytes=0):
+        """
+        cachedir is the directory holding the blobs.
+        max_bytes is the size the cache is trimmed to, 0 for no limit.
+        """
+        self.cachedir = cachedir
+        self.max_bytes = int(max_bytes or 0)
+        if self.max_bytes < 0:
+            raise ValueError('CacheMaxBytes must not be negative')
+        self.index_path = os.path.join(cachedir, _INDEX_NAME)
+        self.lock_path = os.path.join(cachedir, _LOCK_NAME)
+
+    def blob_path(self, digest):
+        """Return the path of the blob file for digest."""
+        return os.path.join(self.cachedir, '%s.tar' % digest)
+
+    def _scan(self):
+        """
+        Build an index from the blobs already in the directory, for caches
+        created before the index existed.
+        """
+        index = self._empty_index()
+        for fname in os.listdir(self.cachedir):
+            match = _BLOB_RE.match(fname)
+            if match is None:
+                continue
+            try:
+                fstat = os.stat(os.path.join(self.cachedir, fname))
+            except OSError:
+                continue
+            index['blobs'][match.group(1)] = {
+                'size': fstat.st_size,
+                'last_use': fstat.st_mtime,
+                'images': []
+            }
+        return index
+
+    @staticmethod
+    def _empty_index():
+        return {
+            'version': _INDEX_VERSION,
+            'blobs': {},
+            'pins': {},
+            'stats': dict((name, 0) for name in _COUNTERS)
+        }
+
+    def _load(self):
+        try:
+            with open(self.index_path) as in_fp:
+                index = json.load(in_fp)
+        except (IOError, OSError):
+            return self._scan()
+        except ValueError:
+            # a damaged index is rebuilt, only the counters are lost
+            return self._scan()
+        if index.get('version') != _INDEX_VERSION:
+            return self._scan()
+        for name in _COUNTERS:
+            index['stats'].setdefault(name, 0)
+        return index
+
+    def _save(self, index):
+        temp = '%s.%d.%d' % (self.index_path, os.getpid(),
+                             threading.get_ident())
+        with open(temp, 'w') as out_fp:
+            json.dump(index, out_fp)
+        os.rename(temp, self.index_path)
+
+    @contextmanager
+    def _locked(self, update=True):
+        """
+        Yield the index with the cache lock held, writing it back afterwards
+        if update is set.
+        """
+        with open(self.lock_path, 'a') as lock_fp:
+            fcntl.flock(lock_fp.fileno(),
+                        fcntl.LOCK_EX if update else fcntl.LOCK_SH)
+            index = self._load()
+            yield index
+            if update:
+                self._save(index)
+
+    @staticmethod
+    def _pinned(index):
+        """
+        Return the set of blobs used by pulls in flight, dropping the pins of
+        processes that went away without releasing them.
+        """
+        pinned = set()
+        for token in list(index['pins'].keys()):
+            pid = int(token.split('.', 1)[0])
+            if not _pid_alive(pid):
+                del index['pins'][token]
+                continue
+            pinned.update(index['pins'][token])
+        return pinned
+
+    def pin(self, digests):
+        """
+        Protect digests from eviction until unpin is called with the returned
+        token.
+        """
+        with _PIN_LOCK:
+            _PIN_SEQ[0] += 1
+            token = '%d.%d' % (os.getpid(), _PIN_SEQ[0])
+        with self._locked() as index:
+            index['pins'][token] = list(digests)
+        return token
+
+    def unpin(self, token):
+        """Release a pin and trim the cache back to its limit."""
+        with self._locked() as index:
+            index['pins'].pop(token, None)
+            return self._evict(index)
+
+    def touch(self, digest, hit):
+        """
+        Record a use of the blob for digest, counting it as a hit if it was
+        already in the cache and a miss if it had to be downloaded.
+        """
+        try:
+            size = os.stat(self.blob_path(digest)).st_size
+        except OSError:
+            return
+        with self._locked() as index:
+            entry = index['blobs'].setdefault(digest, {'images': []})
+            entry['size'] = size
+            entry['last_use'] = time()
+            index['stats']['hits' if hit else 'misses'] += 1
+
+    def add_refs(self, digests, image):
+        """Record that image is built from digests."""
+        with self._locked() as index:
+            for digest in digests:
+                entry = index['blobs'].get(digest)
+                if entry is not None and image not in entry['images']:
+                    entry['images'].append(image)
+
+    def _remove_blob(self, digest):
+        base = self.blob_path(digest)
+        for suffix in _BLOB_SUFFIXES:
+            try:
+                os.unlink(base + suffix)
+            except OSError as err:
+                if err.errno != errno.ENOENT:
+                    raise
+
+    def _evict(self, index):
+        """
+        Remove least recently used blobs until the cache fits in max_bytes.
+        Blobs pinned by a pull are never removed.  Returns the evicted
+        digests.
+        """
+        for digest in list(index['blobs'].keys()):
+            if not os.path.exists(self.blob_path(digest)):
+                del index['blobs'][digest]
+        if self.max_bytes == 0:
+            return []
+        total = sum(entry['size'] for entry in index['blobs'].values())
+        if total <= self.max_bytes:
+            return []
+        pinned = self._pinned(index)
+        candidates = sorted((entry['last_use'], digest)
+                            for digest, entry in index['blobs'].items()
+                            if digest not in pinned)
+        evicted = []
+        for _, digest in candidates:
+            if total <= self.max_bytes:
+                break
+            size = index['blobs'][digest]['size']
+            self._remove_blob(digest)
+            del index['blobs'][digest]
+            total -= size
+            index['stats']['evictions'] += 1
+            index['stats']['evicted_bytes'] += size
+            evicted.append(digest)
+        return evicted
+
+    def evict(self):
+        """Trim the cache to its limit now."""
+        with self._locked() as index:
+            return self._evict(index)
+
+    def stats(self):
+        """
+        Return the cache counters along with its current size and how much
+        of it is shared between images.
+        """
+        with self._locked(update=False) as index:
+            blobs = index['blobs']
+            resp = dict(index['stats'])
+            requests = resp['hits'] + resp['misses']
+            resp['hit_rate'] = float(resp['hits']) / requests \
+                if requests > 0 else 0.0
+            resp['blobs'] = len(blobs)
+            resp['bytes'] = sum(entry['size'] for entry in blobs.values())
+            resp['max_bytes'] = self.max_bytes
+            resp['pinned'] = len(self._pinned(index))
+            shared = [entry for entry in blobs.values()
+                      if len(entry['images']) > 1]
+            resp['shared_blobs'] = len(shared)
+            resp['shared_bytes'] = sum(entry['size'] for entry in shared)
+            images = set()
+            for entry in blobs.values():
+                images.update(entry['images'])
+            resp['images'] = len(images)
+        return resp
@@ -19,26 +19,183 @@
 
 """
 Helper routines for munge
+
+Credentials are encoded and decoded in-process through libmunge when it can
+be loaded, otherwise the munge and unmunge commands are run.  Encoding also
+falls back to the munge command when libmunge fails.
 """
 
+import ctypes
+import ctypes.util
+import grp
+import pwd
 import sys
+import threading
 from subprocess import Popen, PIPE
 debug = False
 
+# From munge.h
+_MUNGE_OPT_SOCKET = 8
+_EMUNGE_CRED_EXPIRED = 15
+_EMUNGE_CRED_REPLAYED = 17
+
+_LIB_LOCK = threading.Lock()
+# [loaded, library]; library is None to use the commands
+_LIB = [False, None]
+
+
+def use_library(path):
+    """
+    Select the libmunge to bind, None to always run the munge commands.
+    """
+    lib = None
+    if path is not None:
+        lib = _bind(path)
+    with _LIB_LOCK:
+        _LIB[0] = True
+        _LIB[1] = lib
+
+
+def _bind(path):
+    lib = ctypes.CDLL(path)
+    lib.munge_ctx_create.restype = ctypes.c_void_p
+    lib.munge_ctx_create.argtypes = []
+    lib.munge_ctx_destroy.restype = None
+    lib.munge_ctx_destroy.argtypes = [ctypes.c_void_p]
+    lib.munge_encode.restype = ctypes.c_int
+    lib.munge_encode.argtypes = [ctypes.POINTER(ctypes.c_void_p),
+                                 ctypes.c_void_p, ctypes.c_char_p,
+                                 ctypes.c_int]
+    lib.munge_decode.restype = ctypes.c_int
+    lib.munge_decode.argtypes = [ctypes.c_char_p, ctypes.c_void_p,
+                                 ctypes.POINTER(ctypes.c_void_p),
+                                 ctypes.POINTER(ctypes.c_int),
+                                 ctypes.POINTER(ctypes.c_uint),
+                                 ctypes.POINTER(ctypes.c_uint)]
+    lib.munge_strerror.restype = ctypes.c_char_p
+    lib.munge_strerror.argtypes = [ctypes.c_int]
+    return lib
+
+
+def _library():
+    """Return the bound libmunge, or None if it is not available."""
+    with _LIB_LOCK:
+        if not _LIB[0]:
+            _LIB[0] = True
+            path = ctypes.util.find_library('munge')
+            if path is not None:
+                try:
+                    _LIB[1] = _bind(path)
+                except (OSError, AttributeError):
+                    _LIB[1] = None
+        return _LIB[1]
+
+
+_LIBC = ctypes.CDLL(None)
+_LIBC.free.restype = None
+_LIBC.free.argtypes = [ctypes.c_void_p]
+
+
+def _context(lib, socket):
+    ctx = lib.munge_ctx_create()
+    if not ctx:
+        raise OSError("Failed to create munge context")
+    if socket is not None:
+        ret = lib.munge_ctx_set(ctypes.c_void_p(ctx),
+                                ctypes.c_int(_MUNGE_OPT_SOCKET),
+                                ctypes.c_char_p(socket.encode('utf-8')))
+        if ret != 0:
+            lib.munge_ctx_destroy(ctx)
+            raise OSError("Failed to set munge socket %s" % socket)
+    return ctx
+
+
+def _lib_munge(lib, text, socket):
+    ctx = _context(lib, socket)
+    cred = ctypes.c_void_p()
+    try:
+        data = text.encode('utf-8')
+        ret = lib.munge_encode(ctypes.byref(cred), ctx, data, len(data))
+        if ret != 0:
+            raise OSError("munge error %d %s" % (ret, socket))
+        return ctypes.string_at(cred.value).decode('utf-8')
+    finally:
+        if cred.value:
+            _LIBC.free(cred)
+        lib.munge_ctx_destroy(ctx)
+
+
+def _name(lookup, ident):
+    try:
+        return lookup(ident)[0]
+    except KeyError:
+        return '?'
+
+
+def _lib_unmunge(lib, encoded, socket):
+    """
+    Decode with libmunge, returning the same fields unmunge reports.
+    """
+    ctx = _context(lib, socket)
+    buf = ctypes.c_void_p()
+    length = ctypes.c_int(0)
+    uid = ctypes.c_uint(0)
+    gid = ctypes.c_uint(0)
+    try:
+        ret = lib.munge_decode(encoded.strip().encode('utf-8'), ctx,
+                               ctypes.byref(buf), ctypes.byref(length),
+                               ctypes.byref(uid), ctypes.byref(gid))
+        if ret == _EMUNGE_CRED_EXPIRED:
+            raise OSError("Expired Credential")
+        if ret == _EMUNGE_CRED_REPLAYED:
+            raise OSError("Replayed Credential")
+        elif ret != 0:
+            memo = "Unknown munge error %d %s" % (ret, socket)
+            raise OSError(memo)
+        message = ''
+        if buf.value and length.value > 0:
+            message = ctypes.string_at(buf.value, length.value)
+            message = message.decode('utf-8').replace('\n', '')
+        return {
+            'STATUS': 'Success (0)',
+            'UID': '%s (%d)' % (_name(pwd.getpwuid, uid.value), uid.value),
+            'GID': '%s (%d)' % (_name(grp.getgrgid, gid.value), gid.value),
+            'LENGTH': str(length.value),
+            'MESSAGE': message
+        }
+    finally:
+        if buf.value:
+            _LIBC.free(buf)
+        lib.munge_ctx_destroy(ctx)
+
+
+def _cmd_munge(text, socket):
+    com = ["munge", '-s', text]
+    if socket is not None:
+        com.extend(['-S', socket])
+    proc = Popen(com, stdout=PIPE, stderr=PIPE)
+    stdout, stderr = proc.communicate()
+    if proc.returncode != 0:
+        memo = "munge failed (%d): %s" % (proc.returncode,
+                                          stderr.decode('utf-8').strip())
+        raise OSError(memo)
+    return stdout.decode('utf-8').replace('\n', '')
+
 
 def munge(text, socket=None):
     """
     munge text using the optional socket
+    If libmunge fails, the munge command is tried.  raises OSError if
+    both fail.
     """
-    try:
-        com = ["munge", '-s', text]
-        if socket is not None:
-            com.extend(['-S', socket])
-        proc = Popen(com, stdout=PIPE, stderr=PIPE)
-        stdout = str(proc.communicate()[0])
-        return stdout.replace('\n', '')
-    except:
-        return None
+    lib = _library()
+    if lib is not None:
+        try:
+            return _lib_munge(lib, text, socket)
+        except OSError:
+            if debug:
+                print(sys.exc_info()[1])
+    return _cmd_munge(text, socket)
 
 
 def unmunge(encoded, socket=None):
@@ -47,6 +204,9 @@ def unmunge(encoded, socket=None):
     returns a dictionary object.
     raises exceptions if it fails.
     """
+    lib = _library()
+    if lib is not None:
+        return _lib_unmunge(lib, encoded, socket)
     try:
         com = ["unmunge"]
         if socket is not None:
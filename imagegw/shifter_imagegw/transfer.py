@@ -21,11 +21,28 @@
 Install, remove, and manipulate files on the systems either local or remote
 
 Will use local shell/copy commands to perform needed actions if the system has
-filesystems locally available.  Uses ssh for remote access to platforms.
+filesystems locally available.  Uses ssh for remote access to platforms; the
+ssh commands to a system share one multiplexed connection, so an image costs a
+single handshake.
 """
 
+import errno
+import hashlib
 import os
+import shlex
+import tempfile
 from subprocess import Popen, PIPE
+from shifter_imagegw import fasthash
+
+# Seconds an idle multiplexed ssh connection is kept open
+_CONTROL_PERSIST = 60
+_STREAM_CHUNK = 1024 * 1024
+# Granularity of delta transfers, the default squashfs block size
+DELTA_BLOCK_SIZE = 128 * 1024
+# A delta is only sent if it has at most this many runs of changed blocks
+# and changes at most this share of the image
+_DELTA_MAX_RUNS = 512
+_DELTA_MAX_SHARE = 0.5
 
 
 def _sh_cmd(system, *args):
@@ -66,6 +83,41 @@ def _ssh_cmd(system, *args):
     return ssh
 
 
+def _control_dir():
+    """
+    Return the private directory holding the ssh control sockets.
+    """
+    path = os.path.join(tempfile.gettempdir(),
+                        'shifter-ssh-%d' % os.getuid())
+    try:
+        os.mkdir(path, 0o700)
+    except OSError as err:
+        if err.errno != errno.EEXIST:
+            raise
+    fstat = os.lstat(path)
+    if fstat.st_uid != os.getuid() or (fstat.st_mode & 0o077) != 0:
+        raise OSError('%s is not a private directory' % path)
+    return path
+
+
+def _ssh_mux_cmd(system, *args):
+    """
+    Helper function to build a remote shell command that reuses the master
+    connection to the system, starting one if needed.  Setting controlPersist
+    to 0 in the ssh settings gives a connection per command.
+    """
+    ssh = _ssh_cmd(system, *args)
+    if ssh is None:
+        return None
+    persist = int(system['ssh'].get('controlPersist', _CONTROL_PERSIST))
+    if persist <= 0:
+        return ssh
+    control = ['-o', 'ControlMaster=auto',
+               '-o', 'ControlPath=%s' % os.path.join(_control_dir(), '%C'),
+               '-o', 'ControlPersist=%d' % persist]
+    return ssh[:1] + control + ssh[1:]
+
+
 def _scp_cmd(system, localfile, remotefile):
     """
     Helper function to build a remote copy command
@@ -154,6 +206,303 @@ def _get_stdout_and_log(cmd, logger=None):
     return rerror, stdout
 
 
+def _copy_local(filename, basepath, target_fn, logger=None):
+    """
+    Copy filename into place in a local imageDir.  The data is copied by the
+    kernel (copy_file_range) into a private temporary file that is renamed
+    over target_fn once complete.
+    """
+    fd, temp_fn = tempfile.mkstemp(prefix='%s.partial.' %
+                                   os.path.basename(target_fn),
+                                   dir=basepath)
+    try:
+        with open(filename, 'rb') as in_fp:
+            size = os.fstat(in_fp.fileno()).st_size
+            copied = 0
+            copy_range = getattr(os, 'copy_file_range', None)
+            while copied < size:
+                count = 0
+                if copy_range is not None:
+                    try:
+                        count = copy_range(in_fp.fileno(), fd, size - copied)
+                    except OSError as err:
+                        if err.errno not in (errno.EXDEV, errno.ENOSYS,
+                                             errno.EINVAL, errno.EOPNOTSUPP):
+                            raise
+                        copy_range = None
+                        continue
+                else:
+                    data = in_fp.read(_STREAM_CHUNK)
+                    count = os.write(fd, data) if data else 0
+                if count == 0:
+                    break
+                copied += count
+            if copied != size:
+                raise OSError('short copy of %s (%d of %d bytes)'
+                              % (filename, copied, size))
+        os.fchmod(fd, 0o600)
+        os.close(fd)
+        fd = -1
+        os.rename(temp_fn, target_fn)
+    except Exception:
+        if fd >= 0:
+            os.close(fd)
+        os.unlink(temp_fn)
+        if logger is not None:
+            logger.error('Failed to copy %s to %s' % (filename, target_fn))
+        raise
+    return True
+
+
+def _stream_remote(filename, system, basepath, target_fn, logger=None,
+                   digest=None):
+    """
+    Stream filename to the system over the multiplexed ssh connection.  The
+    remote side writes a private temporary file and reports its sha256, which
+    is checked against the digest of the data sent before the file is
+    renamed into place.  With a chunked digest, the data sent is also
+    checked against it, so the copy needs no further verification.
+    """
+    partial = os.path.join(basepath, '%s.partial.XXXXXX' %
+                           os.path.basename(target_fn))
+    script = 'umask 077 && t=$(mktemp %s) && echo "$t" && ' \
+             'cat > "$t" && sha256sum "$t"' % shlex.quote(partial)
+    cmd = _ssh_mux_cmd(system, script)
+    if logger is not None:
+        logger.info("about to exec: %s" % ' '.join(cmd))
+    sent = hashlib.sha256()
+    chunked = None
+    if digest is not None:
+        chunked = fasthash.stream_digest(digest)
+        if chunked is None:
+            raise OSError('Invalid digest for %s: %s' % (filename, digest))
+    proc = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+    try:
+        with open(filename, 'rb') as in_fp:
+            while True:
+                data = in_fp.read(_STREAM_CHUNK)
+                if not data:
+                    break
+                sent.update(data)
+                if chunked is not None:
+                    chunked.update(data)
+                proc.stdin.write(data)
+    except (IOError, OSError):
+        # the remote side went away, its error is reported below
+        pass
+    bstdout, bstderr = proc.communicate()
+    lines = bstdout.decode("utf-8").splitlines()
+    temp_fn = lines[0].strip() if len(lines) > 0 else None
+    if temp_fn is not None and not temp_fn.startswith(basepath):
+        memo = 'Got unexpected response back from tempfile precreation: %s' \
+               % temp_fn
+        raise OSError(memo)
+    remote = lines[1].split()[0] if len(lines) > 1 else None
+    matches = chunked is None or chunked.digest() == digest
+    if proc.returncode != 0 or remote != sent.hexdigest() or not matches:
+        if temp_fn is not None:
+            _exec_and_log(_ssh_mux_cmd(system, 'rm', '-f',
+                                       shlex.quote(temp_fn)), logger)
+        memo = 'Failed to transfer %s (%d): %s' % \
+               (filename, proc.returncode, bstderr.decode("utf-8").strip())
+        if proc.returncode == 0:
+            memo = 'Checksum mismatch transferring %s' % filename
+            if not matches:
+                memo = '%s does not match its digest' % filename
+        raise OSError(memo)
+
+    install = 'chmod 0600 %s && mv -f %s %s' % \
+              (shlex.quote(temp_fn), shlex.quote(temp_fn),
+               shlex.quote(target_fn))
+    if _exec_and_log(_ssh_mux_cmd(system, install), logger) != 0:
+        _exec_and_log(_ssh_mux_cmd(system, 'rm', '-f',
+                                   shlex.quote(temp_fn)), logger)
+        raise OSError('failed to install %s' % target_fn)
+    return True
+
+
+def block_manifest(filename, block_size=DELTA_BLOCK_SIZE):
+    """
+    Return the block hash manifest of a file: its size, sha256 and a hash of
+    every block_size block.
+    """
+    blocks = []
+    digest = hashlib.sha256()
+    size = 0
+    with open(filename, 'rb') as in_fp:
+        while True:
+            data = in_fp.read(block_size)
+            if not data:
+                break
+            digest.update(data)
+            blocks.append(hashlib.blake2b(data, digest_size=16).hexdigest())
+            size += len(data)
+    return {
+        'size': size,
+        'block_size': block_size,
+        'sha256': digest.hexdigest(),
+        'blocks': blocks
+    }
+
+
+def _delta_runs(base_manifest, manifest):
+    """
+    Return the (first block, block count) runs of manifest that differ from
+    base_manifest, or None if a delta is not worth sending.
+    """
+    if base_manifest.get('block_size') != manifest['block_size']:
+        return None
+    base = base_manifest['blocks']
+    runs = []
+    changed = 0
+    for idx, block in enumerate(manifest['blocks']):
+        if idx < len(base) and base[idx] == block:
+            continue
+        changed += 1
+        if len(runs) > 0 and runs[-1][0] + runs[-1][1] == idx:
+            runs[-1][1] += 1
+        else:
+            runs.append([idx, 1])
+    if len(runs) > _DELTA_MAX_RUNS or \
+            changed > _DELTA_MAX_SHARE * len(manifest['blocks']):
+        return None
+    return runs
+
+
+def _delta_local(filename, basepath, base_fn, target_fn, manifest, runs,
+                 logger=None):
+    """
+    Build target_fn from a copy of base_fn and the changed blocks of
+    filename.
+    """
+    if not os.path.exists(base_fn):
+        return False
+    block_size = manifest['block_size']
+    fd, temp_fn = tempfile.mkstemp(prefix='%s.partial.' %
+                                   os.path.basename(target_fn),
+                                   dir=basepath)
+    try:
+        os.close(fd)
+        fd = -1
+        _copy_local(base_fn, basepath, temp_fn)
+        fd = os.open(temp_fn, os.O_RDWR)
+        os.ftruncate(fd, manifest['size'])
+        with open(filename, 'rb') as in_fp:
+            for first, count in runs:
+                in_fp.seek(first * block_size)
+                data = in_fp.read(count * block_size)
+                os.pwrite(fd, data, first * block_size)
+        os.close(fd)
+        fd = -1
+        if block_manifest(temp_fn, block_size)['sha256'] != \
+                manifest['sha256']:
+            raise OSError('Checksum mismatch rebuilding %s' % target_fn)
+        os.rename(temp_fn, target_fn)
+    except Exception:
+        if fd >= 0:
+            os.close(fd)
+        os.unlink(temp_fn)
+        if logger is not None:
+            logger.warn('Delta copy to %s failed' % target_fn)
+        return False
+    return True
+
+
+def _delta_remote(filename, system, basepath, base_fn, target_fn, manifest,
+                  runs, logger=None):
+    """
+    Build target_fn on the system from a copy of base_fn there and the
+    changed blocks of filename, which are streamed in order and written in
+    place with dd.
+    """
+    block_size = manifest['block_size']
+    partial = os.path.join(basepath, '%s.partial.XXXXXX' %
+                           os.path.basename(target_fn))
+    writes = ['dd of="$t" bs=%d seek=%d count=%d conv=notrunc '
+              'iflag=fullblock status=none' % (block_size, first, count)
+              for first, count in runs]
+    script = 'umask 077 && test -f %s && t=$(mktemp %s) && echo "$t" && ' \
+             'cp --reflink=auto %s "$t" && truncate -s %d "$t" && ' \
+             '%s && sha256sum "$t"' % \
+             (shlex.quote(base_fn), shlex.quote(partial),
+              shlex.quote(base_fn), manifest['size'],
+              ' && '.join(writes + ['true']))
+    cmd = _ssh_mux_cmd(system, script)
+    if logger is not None:
+        logger.info("about to exec delta transfer of %d runs to %s" %
+                    (len(runs), target_fn))
+    proc = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+    try:
+        with open(filename, 'rb') as in_fp:
+            for first, count in runs:
+                in_fp.seek(first * block_size)
+                remaining = count * block_size
+                while remaining > 0:
+                    data = in_fp.read(min(remaining, _STREAM_CHUNK))
+                    if not data:
+                        break
+                    proc.stdin.write(data)
+                    remaining -= len(data)
+    except (IOError, OSError):
+        pass
+    bstdout, bstderr = proc.communicate()
+    lines = bstdout.decode("utf-8").splitlines()
+    temp_fn = lines[0].strip() if len(lines) > 0 else None
+    if temp_fn is not None and not temp_fn.startswith(basepath):
+        raise OSError('Got unexpected response back from tempfile '
+                      'precreation: %s' % temp_fn)
+    remote = lines[1].split()[0] if len(lines) > 1 else None
+    if proc.returncode != 0 or remote != manifest['sha256']:
+        if temp_fn is not None:
+            _exec_and_log(_ssh_mux_cmd(system, 'rm', '-f',
+                                       shlex.quote(temp_fn)), logger)
+        if logger is not None:
+            logger.warn('Delta transfer to %s failed (%d): %s' %
+                        (target_fn, proc.returncode,
+                         bstderr.decode("utf-8").strip()))
+        return False
+
+    install = 'chmod 0600 %s && mv -f %s %s' % \
+              (shlex.quote(temp_fn), shlex.quote(temp_fn),
+               shlex.quote(target_fn))
+    if _exec_and_log(_ssh_mux_cmd(system, install), logger) != 0:
+        _exec_and_log(_ssh_mux_cmd(system, 'rm', '-f',
+                                   shlex.quote(temp_fn)), logger)
+        return False
+    return True
+
+
+def copy_file_delta(filename, system, base, base_manifest, manifest,
+                    logger=None):
+    """
+    Copy a file to the specified system by sending only the blocks that
+    differ from base, an earlier image already in the imageDir of the system.
+    base_manifest and manifest are the block_manifest of base and filename.
+    Returns False if the delta could not be used; the file then needs a full
+    copy.
+    """
+    if system['accesstype'] == 'local':
+        basepath = system['local']['imageDir']
+    elif system['accesstype'] == 'remote':
+        basepath = system['ssh']['imageDir']
+    else:
+        return False
+    runs = _delta_runs(base_manifest, manifest)
+    if runs is None:
+        return False
+
+    image_fn = os.path.split(filename)[1]
+    target_fn = os.path.join(basepath, image_fn)
+    base_fn = os.path.join(basepath, os.path.split(base)[1])
+    if base_fn == target_fn:
+        return False
+    if system['accesstype'] == 'local':
+        return _delta_local(filename, basepath, base_fn, target_fn, manifest,
+                            runs, logger)
+    return _delta_remote(filename, system, basepath, base_fn, target_fn,
+                         manifest, runs, logger)
+
+
 def pre_create_tempfile(basepath, filename, sh_cmd, system, logger=None):
     """
     Generate a tempfile for filename on the system
@@ -187,20 +536,15 @@ def pre_create_tempfile(basepath, filename, sh_cmd, system, logger=None):
     return temp_fn
 
 
-def copy_file(filename, system, logger=None):
+def copy_file(filename, system, logger=None, digest=None):
     """
     Copy a file to the specified system
+    With a chunked digest, a file streamed to a remote system is checked
+    against it on the way.
     """
-    sh_cmd = None
-    cp_cmd = None
-    basepath = None
     if system['accesstype'] == 'local':
-        sh_cmd = _sh_cmd
-        cp_cmd = _cp_cmd
         basepath = system['local']['imageDir']
     elif system['accesstype'] == 'remote':
-        sh_cmd = _ssh_cmd
-        cp_cmd = _scp_cmd
         basepath = system['ssh']['imageDir']
     else:
         memo = '%s is not supported as a transfer type' % system['accesstype']
@@ -209,57 +553,11 @@ def copy_file(filename, system, logger=None):
     image_fn = os.path.split(filename)[1]
     target_fn = os.path.join(basepath, image_fn)
 
-    # pre-create the file with a temporary name
-    temp_fn = pre_create_tempfile(basepath, image_fn, sh_cmd, system, logger)
-
-    if temp_fn is None:
-        raise OSError('Got no valid response back from tempfile precreation')
-
-    if not temp_fn.startswith(basepath):
-        memo = 'Got unexpected response back from tempfile precreation: %s' \
-               % temp_fn
-        raise OSError(memo)
-
-    copyret = None
-    mvret = None
-    try:
-        copy = cp_cmd(system, filename, temp_fn)
-        copyret = _exec_and_log(copy, logger)
-    except:
-        rm_cmd = sh_cmd(system, 'rm', temp_fn)
-        _exec_and_log(rm_cmd, logger)
-        raise
-
-    if copyret == 0:
-        try:
-            chmod_cmd = sh_cmd(system, 'chmod', '0600', temp_fn)
-            ret = _exec_and_log(chmod_cmd, logger)
-            if ret != 0:
-                raise OSError('failed chmod command')
-
-            mv_cmd = sh_cmd(system, 'mv', temp_fn, target_fn)
-            mvret = _exec_and_log(mv_cmd, logger)
-            if mvret != 0:
-                raise OSError('failed mv command')
-        except:
-            # TODO we might also need to remove target_fn in this case
-            rm_cmd = sh_cmd(system, 'rm', temp_fn)
-            _exec_and_log(rm_cmd, logger)
-            raise
-
-    if mvret == 0:
-        try:
-            chmod_cmd = sh_cmd(system, 'chmod', '0600', target_fn)
-            ret = _exec_and_log(chmod_cmd, logger)
-            if ret != 0:
-                raise OSError('failed chmod command')
-            return ret == 0
-        except:
-            rm_cmd = sh_cmd(system, "rm", target_fn);
-            _exec_and_log(rm_cmd, logger)
-            raise
+    if system['accesstype'] == 'local':
+        return _copy_local(filename, basepath, target_fn, logger)
+    return _stream_remote(filename, system, basepath, target_fn, logger,
+                          digest)
 
-    return False
 
 def import_copy_file(filename, destfilename, system, logger=None):
     """
@@ -273,7 +571,7 @@ def import_copy_file(filename, destfilename, system, logger=None):
         cp_cmd = _cp_cmd
         basepath = system['local']['imageDir']
     elif system['accesstype'] == 'remote':
-        sh_cmd = _ssh_cmd
+        sh_cmd = _ssh_mux_cmd
         cp_cmd = _import_cp_cmd
         basepath = system['ssh']['imageDir']
     else:
@@ -326,7 +624,7 @@ def remove_file(filename, system, logger=None):
         sh_cmd = _sh_cmd
         basepath = system['local']['imageDir']
     elif system['accesstype'] == 'remote':
-        sh_cmd = _ssh_cmd
+        sh_cmd = _ssh_mux_cmd
         basepath = system['ssh']['imageDir']
     image_fn = os.path.split(filename)[1]
     target_fn = os.path.join(basepath, image_fn)
@@ -345,7 +643,7 @@ def check_file(filename, system, logger=None, import_image=False):
         sh_cmd = _sh_cmd
         basepath = system['local']['imageDir']
     elif system['accesstype'] == 'remote':
-        sh_cmd = _ssh_cmd
+        sh_cmd = _ssh_mux_cmd
         basepath = system['ssh']['imageDir']
     image_fn = os.path.split(filename)[1]
     target_fn = os.path.join(basepath, image_fn)
@@ -360,18 +658,23 @@ def check_file(filename, system, logger=None, import_image=False):
     return False
 
 
-def hash_file(filename, system, logger=None):
+def hash_file(filename, system, logger=None, chunked=False):
     """
     Calculate a hash of the image file,
     because this can be remote or local,
     need to use a separate helper executable fasthash
     assume it is in the path already
+    With chunked the digest covers the whole file (see
+    fasthash.chunked_digest) instead of samples of it.
     """
     if system['accesstype'] == 'local':
         sh_cmd = _sh_cmd
     elif system['accesstype'] == 'remote':
-        sh_cmd = _ssh_cmd
-    hash_cmd = sh_cmd(system, 'fasthash', filename)
+        sh_cmd = _ssh_mux_cmd
+    if chunked:
+        hash_cmd = sh_cmd(system, 'fasthash', '--chunked', filename)
+    else:
+        hash_cmd = sh_cmd(system, 'fasthash', filename)
     ret = _get_stdout_and_log(hash_cmd, logger)
     if len(ret[0]) != 0:
         raise OSError("Error calculating hash: %s" % (ret[0]))
@@ -381,10 +684,53 @@ def hash_file(filename, system, logger=None):
     return ret[1].strip()
 
 
+def verify_file(filename, system, digest, logger=None):
+    """
+    Check the whole of a file in the imageDir of the system against a digest
+    from fasthash.chunked_digest.  The file is hashed in parallel on the
+    system.
+    """
+    sh_cmd = None
+    basepath = None
+    if system['accesstype'] == 'local':
+        sh_cmd = _sh_cmd
+        basepath = system['local']['imageDir']
+    elif system['accesstype'] == 'remote':
+        sh_cmd = _ssh_mux_cmd
+        basepath = system['ssh']['imageDir']
+    else:
+        memo = '%s is not supported as a transfer type' % system['accesstype']
+        raise NotImplementedError(memo)
+    target_fn = os.path.join(basepath, os.path.split(filename)[1])
+    ret = _exec_and_log(sh_cmd(system, 'fasthash', '--verify', digest,
+                               target_fn), logger)
+    return ret == 0
+
+
+def _check_copy(system, image_path, metadata_path, digest, logger=None):
+    """
+    Check an image copied to the system against its digest, and remove it
+    and its metadata if it does not match.
+    """
+    if digest is None or verify_file(image_path, system, digest, logger):
+        return True
+    if logger is not None:
+        logger.warn("%s does not match its digest on the system" %
+                    image_path)
+    remove(system, image_path, metadata_path, logger)
+    return False
+
+
 def transfer(system, image_path, metadata_path=None, logger=None,
-             import_image=False, dest_path=None):
+             import_image=False, dest_path=None, delta=None, digest=None):
     """
     transfer an image and its metadata to the system
+    delta optionally holds the 'base' image on the system with its
+    'base_manifest', and the 'manifest' of image_path, to send only the
+    blocks that changed.
+    With a digest from fasthash.chunked_digest, the copy of the image is
+    checked against it: while it is streamed to a remote system, otherwise
+    by reading it back on the system.
     """
     # TODO: Catch copy_file fail here
     if metadata_path is not None:
@@ -398,8 +744,19 @@ def transfer(system, image_path, metadata_path=None, logger=None,
                                                       system, logger):
                 return True
     else:
-        if image_path is None or copy_file(image_path, system, logger):
+        if image_path is None:
             return True
+        if delta is not None and delta['base'] is not None and \
+                copy_file_delta(image_path, system, delta['base'],
+                                delta['base_manifest'], delta['manifest'],
+                                logger):
+            return _check_copy(system, image_path, metadata_path, digest,
+                               logger)
+        if copy_file(image_path, system, logger, digest):
+            if system['accesstype'] == 'remote':
+                return True
+            return _check_copy(system, image_path, metadata_path, digest,
+                               logger)
     if logger is not None:
         logger.error("Transfer of %s failed" % image_path)
     return False
@@ -418,13 +775,30 @@ def remove(system, image_path, metadata_path=None, logger=None):
     return False
 
 
-def imagevalid(system, image_path, metadata_path=None, logger=None):
+def imagevalid(system, image_path, metadata_path=None, logger=None,
+               digest=None):
     """
     check if image exists on the system
-    """
-    metadata_ok = True
-    if metadata_path is not None:
-        metadata_ok = check_file(metadata_path, system, logger)
-    image_ok = check_file(image_path, system, logger)
-
-    return metadata_ok and image_ok
+    With a digest from fasthash.chunked_digest, the whole image on the
+    system is also checked against it.
+    """
+    if metadata_path is None:
+        if not check_file(image_path, system, logger):
+            return False
+        return digest is None or verify_file(image_path, system, digest,
+                                             logger)
+    sh_cmd = None
+    basepath = None
+    if system['accesstype'] == 'local':
+        sh_cmd = _sh_cmd
+        basepath = system['local']['imageDir']
+    elif system['accesstype'] == 'remote':
+        sh_cmd = _ssh_mux_cmd
+        basepath = system['ssh']['imageDir']
+    paths = [os.path.join(basepath, os.path.split(path)[1])
+             for path in (metadata_path, image_path)]
+    # both are checked with a single command
+    ret = _exec_and_log(sh_cmd(system, 'ls', *paths), logger)
+    if ret != 0:
+        return False
+    return digest is None or verify_file(image_path, system, digest, logger)
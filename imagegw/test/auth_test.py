@@ -18,12 +18,15 @@
 
 import os
 import unittest
+from shifter_imagegw import munge
 from shifter_imagegw.auth import Authentication
 
 
 class AuthTestCase(unittest.TestCase):
 
     def setUp(self):
+        # the mock munge commands are used
+        munge.use_library(None)
         self.test_dir = os.path.dirname(os.path.abspath(__file__)) + \
                         "/../test/"
         self.encoded = "xxxx\n"
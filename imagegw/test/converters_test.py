@@ -17,6 +17,8 @@
 # See LICENSE for full text.
 
 import os
+import shutil
+import tempfile
 import unittest
 from shifter_imagegw import converters
 
@@ -97,6 +99,89 @@ class ConvertersTestCase(unittest.TestCase):
             self.assertEqual(v, 'bogus blah')
         os.remove(output)
 
+    def test_convert_stream(self):
+        """
+        Test conversion from a tar stream
+        """
+        output = '%s/test_stream.squashfs' % (self.outdir)
+        captured = '%s/test_stream.tar' % (self.outdir)
+        for path in (output, captured):
+            if os.path.exists(path):
+                os.remove(path)
+        os.environ['MOCK_SQUASHFS_TAR'] = captured
+
+        def write_tar(out_fp):
+            out_fp.write(b'tar stream')
+
+        resp = converters.convert_stream('squashfs', write_tar, output)
+        os.environ.pop('MOCK_SQUASHFS_TAR')
+        self.assertTrue(resp)
+        with open(output) as f:
+            line = f.read()
+            self.assertIn('-tar', line)
+            self.assertIn('-no-xattrs', line)
+        with open(captured, 'rb') as f:
+            self.assertEqual(f.read(), b'tar stream')
+        os.remove(output)
+        os.remove(captured)
+
+        with self.assertRaises(NotImplementedError):
+            converters.convert_stream('cramfs', write_tar, output)
+        self.assertFalse(os.path.exists(output))
+
+    def make_startup_tree(self):
+        """ a small image with a loader, python and a few other files """
+        path = tempfile.mkdtemp()
+        files = ['etc/ld.so.cache', 'lib64/ld-linux-x86-64.so.2',
+                 'usr/bin/python3', 'usr/lib/python3.8/site.py',
+                 'usr/lib/python3.8/__pycache__/site.cpython-38.pyc',
+                 'usr/lib/python3.8/json/decoder.py', 'opt/app/main.py',
+                 'opt/app/data.bin']
+        for fname in files:
+            fpath = os.path.join(path, fname)
+            if not os.path.exists(os.path.dirname(fpath)):
+                os.makedirs(os.path.dirname(fpath))
+            with open(fpath, 'w') as f:
+                f.write('x')
+        # links may point outside of the image and are never followed
+        os.symlink('/usr', os.path.join(path, 'hostusr'))
+        os.symlink('/usr/bin', os.path.join(path, 'bin'))
+        return path
+
+    def test_startup_sort_list(self):
+        path = self.make_startup_tree()
+        profile = ['/opt/app/main.py', 'missing', 'hostusr/bin/env',
+                   '../etc/passwd', 'usr/lib/python3.8/json/decoder.py']
+        entries = converters.startup_sort_list(path, profile)
+        paths = [entry[0] for entry in entries]
+        self.assertEqual(paths[:2], ['opt/app/main.py',
+                                     'usr/lib/python3.8/json/decoder.py'])
+        for fname in ['etc/ld.so.cache', 'lib64/ld-linux-x86-64.so.2',
+                      'usr/bin/python3', 'usr/lib/python3.8/site.py',
+                      'usr/lib/python3.8/__pycache__/site.cpython-38.pyc']:
+            self.assertIn(fname, paths)
+        self.assertNotIn('opt/app/data.bin', paths)
+        self.assertFalse([p for p in paths if p.startswith('hostusr') or
+                          p.startswith('bin/')])
+        # most important first
+        priorities = [entry[1] for entry in entries]
+        self.assertEqual(priorities, sorted(priorities, reverse=True))
+        self.assertLess(paths.index('etc/ld.so.cache'),
+                        paths.index('usr/bin/python3'))
+        self.assertEqual(converters.startup_sort_list(path, None)[0][0],
+                         'etc/ld.so.cache')
+
+        output = '%s/test_sorted.squashfs' % (self.outdir)
+        if os.path.exists(output):
+            os.remove(output)
+        resp = converters.convert('squashfs', path, output,
+                                  startup_profile=profile)
+        self.assertTrue(resp)
+        with open(output) as f:
+            self.assertIn('-sort', f.read())
+        os.remove(output)
+        shutil.rmtree(path, ignore_errors=True)
+
     def test_writemeta(self):
         """
         Test Write meta function
@@ -140,6 +225,29 @@ class ConvertersTestCase(unittest.TestCase):
         self.assertTrue(os.path.exists('/tmp/blah'))
         os.remove('/tmp/blah')
 
+    def test_erofs(self):
+        path = self.make_fake()
+        output = '%s/test.erofs' % (self.outdir)
+        if os.path.exists(output):
+            os.remove(output)
+        resp = converters.convert('erofs', path, output)
+        self.assertTrue(resp)
+        with open(output) as f:
+            line = f.read()
+            self.assertIn('--all-root', line)
+            self.assertIn('-zlz4hc', line)
+        os.remove(output)
+
+        path = self.make_fake()
+        opts = {'erofs': ['-zlzma', '-Ededupe']}
+        resp = converters.convert('erofs', path, output, options=opts)
+        self.assertTrue(resp)
+        with open(output) as f:
+            line = f.read()
+            self.assertIn('-zlzma -Ededupe', line)
+            self.assertNotIn('lz4hc', line)
+        os.remove(output)
+
     def test_squashfs(self):
         converters.generate_squashfs_image('/tmp/b', '/tmp/blah', None)
         self.assertTrue(os.path.exists('/tmp/blah'))
@@ -21,6 +21,80 @@ from shifter_imagegw import dockerv2
 import unittest
 import tempfile
 import shutil
+import hashlib
+import io
+import tarfile
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class LocalRegistry(object):
+    """
+    Minimal stand-in for a registry serving fixture blobs over HTTP/1.1 with
+    keep-alive and Range support.  Records connections, request ranges and
+    the peak number of concurrent blob requests.
+    """
+
+    def __init__(self, blobs, delay=0.0):
+        self.blobs = blobs
+        self.delay = delay
+        self.connections = 0
+        self.active = 0
+        self.max_active = 0
+        self.ranges = []
+        self.lock = threading.Lock()
+        registry = self
+
+        class Handler(BaseHTTPRequestHandler):
+            protocol_version = 'HTTP/1.1'
+
+            def setup(self):
+                with registry.lock:
+                    registry.connections += 1
+                BaseHTTPRequestHandler.setup(self)
+
+            def log_message(self, *args):
+                pass
+
+            def do_GET(self):
+                digest = self.path.split('/blobs/')[-1]
+                if digest not in registry.blobs:
+                    self.send_response(404)
+                    self.send_header('Content-Length', '0')
+                    self.end_headers()
+                    return
+                with registry.lock:
+                    registry.active += 1
+                    registry.max_active = max(registry.max_active,
+                                              registry.active)
+                time.sleep(registry.delay)
+                data = registry.blobs[digest]
+                start = 0
+                rng = self.headers.get('Range')
+                with registry.lock:
+                    registry.ranges.append(rng)
+                    registry.active -= 1
+                if rng is not None:
+                    start = int(rng.split('=')[1].split('-')[0])
+                    self.send_response(206)
+                    self.send_header('Content-Range', 'bytes %d-%d/%d' %
+                                     (start, len(data) - 1, len(data)))
+                else:
+                    self.send_response(200)
+                self.send_header('Content-Length', str(len(data) - start))
+                self.end_headers()
+                self.wfile.write(data[start:])
+
+        self.server = ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+        self.thread = threading.Thread(target=self.server.serve_forever)
+        self.thread.daemon = True
+        self.thread.start()
+        self.url = 'http://127.0.0.1:%d' % self.server.server_address[1]
+
+    def stop(self):
+        self.server.shutdown()
+        self.server.server_close()
 
 
 class Dockerv2TestCase(unittest.TestCase):
@@ -151,5 +225,340 @@ class Dockerv2TestCase(unittest.TestCase):
         os.environ.pop('http_proxy')
 
 
+class Dockerv2LayerFetchTestCase(unittest.TestCase):
+    """Layer downloads against a local registry stand-in."""
+
+    def setUp(self):
+        cwd = os.path.dirname(os.path.realpath(__file__))
+        os.environ['PATH'] = cwd + ':' + os.environ['PATH']
+        self.saved_env = {}
+        for var in ('http_proxy', 'https_proxy'):
+            if var in os.environ:
+                self.saved_env[var] = os.environ.pop(var)
+        self.cache = tempfile.mkdtemp()
+        self.blobs = {}
+        for idx in range(6):
+            data = os.urandom(100000 + idx)
+            digest = 'sha256:%s' % hashlib.sha256(data).hexdigest()
+            self.blobs[digest] = data
+        self.registry = None
+
+    def tearDown(self):
+        if self.registry is not None:
+            self.registry.stop()
+        shutil.rmtree(self.cache)
+        os.environ.update(self.saved_env)
+
+    def _handle(self, options):
+        options['baseUrl'] = self.registry.url
+        handle = dockerv2.DockerV2Handle('test/layers:latest', options,
+                                         cachedir=self.cache)
+        # chain the fixture blobs as layers, eldest first
+        child = None
+        for digest in self.blobs:
+            child = {'fsLayer': {'blobSum': digest}, 'child': child}
+        handle.eldest = child
+        return handle
+
+    def _check_cache(self):
+        for digest, data in self.blobs.items():
+            fname = os.path.join(self.cache, '%s.tar' % digest)
+            with open(fname, 'rb') as fp:
+                self.assertEqual(fp.read(), data)
+            self.assertFalse(os.path.exists(fname + '.partial'))
+
+    def test_concurrent_pull(self):
+        self.registry = LocalRegistry(self.blobs, delay=0.2)
+        handle = self._handle({'layerConcurrency': 6, 'maxConnections': 3})
+        self.assertTrue(handle.pull_layers())
+        self._check_cache()
+        # parallel, but never more than the per-registry limit
+        self.assertGreater(self.registry.max_active, 1)
+        self.assertLessEqual(self.registry.max_active, 3)
+        self.assertLessEqual(self.registry.connections, 3)
+
+    def test_shared_host_limit(self):
+        """locations sharing a host get the smallest maxConnections"""
+        self.registry = LocalRegistry(self.blobs, delay=0.2)
+        handle = self._handle({'layerConcurrency': 6, 'maxConnections': 6})
+        small = self._handle({'maxConnections': 2})
+        small.conn_pool._slot(dockerv2._host_key(self.registry.url))
+        self.assertTrue(handle.pull_layers())
+        self._check_cache()
+        self.assertGreater(self.registry.max_active, 1)
+        self.assertLessEqual(self.registry.max_active, 2)
+
+    def test_connection_reuse(self):
+        self.registry = LocalRegistry(self.blobs)
+        handle = self._handle({'layerConcurrency': 1})
+        self.assertTrue(handle.pull_layers())
+        self._check_cache()
+        self.assertEqual(self.registry.connections, 1)
+
+    def test_resume_partial(self):
+        self.registry = LocalRegistry(self.blobs)
+        digest = list(self.blobs.keys())[0]
+        partial = os.path.join(self.cache, '%s.tar.partial' % digest)
+        with open(partial, 'wb') as fp:
+            fp.write(self.blobs[digest][:5000])
+        handle = self._handle({})
+        self.assertTrue(handle.save_layer(digest))
+        self.assertEqual(self.registry.ranges, ['bytes=5000-'])
+        fname = os.path.join(self.cache, '%s.tar' % digest)
+        with open(fname, 'rb') as fp:
+            self.assertEqual(fp.read(), self.blobs[digest])
+
+    def test_resume_stale_partial(self):
+        self.registry = LocalRegistry(self.blobs)
+        digest = list(self.blobs.keys())[0]
+        partial = os.path.join(self.cache, '%s.tar.partial' % digest)
+        with open(partial, 'wb') as fp:
+            fp.write(b'garbage' * 100)
+        handle = self._handle({})
+        self.assertTrue(handle.save_layer(digest))
+        # resumed data failed verification, so the blob was refetched
+        self.assertEqual(self.registry.ranges, ['bytes=700-', None])
+        fname = os.path.join(self.cache, '%s.tar' % digest)
+        with open(fname, 'rb') as fp:
+            self.assertEqual(fp.read(), self.blobs[digest])
+
+    def test_verified_sidecar(self):
+        self.registry = LocalRegistry(self.blobs)
+        digest = list(self.blobs.keys())[0]
+        fname = os.path.join(self.cache, '%s.tar' % digest)
+        handle = self._handle({})
+        self.assertTrue(handle.save_layer(digest))
+        self.assertTrue(os.path.exists(fname + '.verified'))
+
+        # an unchanged cached blob is not hashed again
+        saved = dockerv2._hash_fd
+        dockerv2._hash_fd = None
+        try:
+            self.assertTrue(handle.save_layer(digest))
+        finally:
+            dockerv2._hash_fd = saved
+        self.assertEqual(len(self.registry.ranges), 1)
+
+        # a modified blob is re-verified, then fetched again
+        with open(fname, 'r+b') as fp:
+            fp.write(b'corrupt')
+        os.utime(fname, ns=(1, 1))
+        self.assertTrue(handle.save_layer(digest))
+        self.assertEqual(len(self.registry.ranges), 2)
+        with open(fname, 'rb') as fp:
+            self.assertEqual(fp.read(), self.blobs[digest])
+
+    def test_digest_mismatch(self):
+        digest = list(self.blobs.keys())[0]
+        self.blobs[digest] = b'not the blob'
+        self.registry = LocalRegistry(self.blobs)
+        handle = self._handle({})
+        with self.assertRaises(ValueError):
+            handle.save_layer(digest)
+        fname = os.path.join(self.cache, '%s.tar' % digest)
+        self.assertFalse(os.path.exists(fname))
+        self.assertFalse(os.path.exists(fname + '.partial'))
+
+        # without checksums the blob is kept, but never marked verified
+        handle.check_layer_checksums = False
+        self.assertTrue(handle.save_layer(digest))
+        self.assertFalse(os.path.exists(fname + '.verified'))
+        handle = self._handle({})
+        with self.assertRaises(ValueError):
+            handle.save_layer(digest)
+
+    def test_layer_cache(self):
+        self.registry = LocalRegistry(self.blobs)
+        handle = self._handle({'cacheMaxBytes': 250000})
+        self.assertTrue(handle.pull_layers())
+        # nothing is evicted while the image is being built
+        self._check_cache()
+        stats = handle.layer_cache.stats()
+        self.assertEqual(stats['misses'], 6)
+        self.assertEqual(stats['pinned'], 6)
+        self.assertEqual(stats['images'], 1)
+
+        second = self._handle({'cacheMaxBytes': 250000})
+        self.assertTrue(second.pull_layers())
+        self.assertEqual(second.layer_cache.stats()['hits'], 6)
+        self.assertEqual(len(self.registry.ranges), 6)
+        # still in use by the other pull
+        second.release_layers()
+        self.assertEqual(second.layer_cache.stats()['evictions'], 0)
+        handle.release_layers()
+        stats = handle.layer_cache.stats()
+        self.assertEqual(stats['evictions'], 4)
+        self.assertEqual(stats['blobs'], 2)
+        self.assertLessEqual(stats['bytes'], 250000)
+
+    def test_missing_layer(self):
+        self.registry = LocalRegistry(self.blobs)
+        handle = self._handle({})
+        handle.eldest = {'fsLayer': {'blobSum': 'sha256:%s' % ('0' * 64)},
+                         'child': None}
+        with self.assertRaises(ValueError):
+            handle.pull_layers()
+
+
+def make_layer(path, entries):
+    """
+    Write a gzipped layer tarball.  entries is a list of (name, content)
+    where content is None (or the mode) for a directory, ('link', target) for
+    a symlink or the file data as bytes.
+    """
+    with tarfile.open(path, 'w:gz') as tfp:
+        for name, content in entries:
+            info = tarfile.TarInfo(name)
+            if content is None or isinstance(content, int):
+                info.type = tarfile.DIRTYPE
+                info.mode = 0o755 if content is None else content
+                tfp.addfile(info)
+            elif isinstance(content, tuple):
+                info.type = tarfile.SYMTYPE
+                info.linkname = content[1]
+                tfp.addfile(info)
+            else:
+                info.size = len(content)
+                info.mode = 0o644
+                tfp.addfile(info, io.BytesIO(content))
+
+
+class Dockerv2FlattenTestCase(unittest.TestCase):
+    """Layer flattening on synthetic layers."""
+
+    def setUp(self):
+        self.cache = tempfile.mkdtemp()
+        self.expand = tempfile.mkdtemp()
+
+    def tearDown(self):
+        for path in (self.cache, self.expand):
+            os.system('chmod -R u+w %s' % path)
+            shutil.rmtree(path)
+
+    def _extract(self, layers):
+        handle = dockerv2.DockerV2Handle('test/flatten:latest',
+                                         {'baseUrl': 'http://localhost'},
+                                         cachedir=self.cache)
+        child = None
+        for idx in range(len(layers) - 1, -1, -1):
+            digest = 'sha256:%064d' % idx
+            make_layer(os.path.join(self.cache, '%s.tar' % digest),
+                       layers[idx])
+            child = {'fsLayer': {'blobSum': digest}, 'child': child}
+        handle.eldest = child
+        handle.extract_docker_layers(self.expand)
+
+    def _read(self, path):
+        with open(os.path.join(self.expand, path), 'rb') as fp:
+            return fp.read()
+
+    def _exists(self, path):
+        return os.path.lexists(os.path.join(self.expand, path))
+
+    def test_whiteout(self):
+        self._extract([
+            [('usr', None), ('usr/local', None), ('usr/local/a', b'a'),
+             ('usr/bin', None), ('usr/bin/x', b'x'), ('./etc', None),
+             ('./etc/hosts', b'old')],
+            [('usr/.wh.local', b''), ('.wh.etc', b'')],
+        ])
+        self.assertFalse(self._exists('usr/local'))
+        self.assertFalse(self._exists('usr/.wh.local'))
+        self.assertFalse(self._exists('etc'))
+        self.assertEqual(self._read('usr/bin/x'), b'x')
+
+    def test_whiteout_then_recreate(self):
+        self._extract([
+            [('opt', None), ('opt/app', None), ('opt/app/old', b'old')],
+            [('opt/.wh.app', b'')],
+            [('opt/app', None), ('opt/app/new', b'new')],
+        ])
+        self.assertFalse(self._exists('opt/app/old'))
+        self.assertEqual(self._read('opt/app/new'), b'new')
+
+    def test_opaque(self):
+        self._extract([
+            [('opt', None), ('opt/a', b'a'), ('opt/sub', None),
+             ('opt/sub/c', b'c')],
+            [('opt', None), ('opt/.wh..wh..opq', b''), ('opt/b', b'b')],
+        ])
+        self.assertTrue(os.path.isdir(os.path.join(self.expand, 'opt')))
+        self.assertFalse(self._exists('opt/a'))
+        self.assertFalse(self._exists('opt/sub'))
+        self.assertFalse(self._exists('opt/.wh..wh..opq'))
+        self.assertEqual(self._read('opt/b'), b'b')
+
+    def test_type_change(self):
+        self._extract([
+            [('d', None), ('d/f', b'f'), ('f', b'file'), ('l', b'file')],
+            [('d', b'now a file'), ('f', None), ('f/g', b'g'),
+             ('l', ('link', 'f/g'))],
+        ])
+        self.assertEqual(self._read('d'), b'now a file')
+        self.assertEqual(self._read('f/g'), b'g')
+        self.assertTrue(os.path.islink(os.path.join(self.expand, 'l')))
+
+    def test_readonly_parent(self):
+        self._extract([[('ro', 0o555), ('ro/a', b'a')], [('ro/b', b'b')]])
+        self.assertEqual(self._read('ro/a'), b'a')
+        self.assertEqual(self._read('ro/b'), b'b')
+
+    def test_flattened_tar(self):
+        layers = [
+            [('usr', None), ('usr/local', None), ('usr/local/a', b'a'),
+             ('bin', 0o700), ('bin/tool', b'old'), ('etc', None),
+             ('etc/hosts', b'hosts')],
+            [('usr/.wh.local', b''), ('bin/tool', b'new'),
+             ('etc/hosts.link', ('link', 'hosts'))],
+        ]
+        handle = dockerv2.DockerV2Handle('test/flatten:latest',
+                                         {'baseUrl': 'http://localhost'},
+                                         cachedir=self.cache)
+        child = None
+        for idx in range(len(layers) - 1, -1, -1):
+            digest = 'sha256:%064d' % idx
+            make_layer(os.path.join(self.cache, '%s.tar' % digest),
+                       layers[idx])
+            child = {'fsLayer': {'blobSum': digest}, 'child': child}
+        handle.eldest = child
+
+        stream = io.BytesIO()
+        handle.write_flattened_tar(stream)
+        stream.seek(0)
+        with tarfile.open(fileobj=stream, mode='r:') as tfp:
+            names = tfp.getnames()
+            self.assertEqual(sorted(names), sorted(set(names)))
+            self.assertNotIn('usr/local', names)
+            self.assertNotIn('usr/local/a', names)
+            self.assertNotIn('usr/.wh.local', names)
+            self.assertEqual(tfp.extractfile('bin/tool').read(), b'new')
+            self.assertEqual(tfp.extractfile('etc/hosts').read(), b'hosts')
+            self.assertEqual(tfp.getmember('bin').mode & 0o777, 0o755)
+            self.assertEqual(tfp.getmember('etc/hosts').uid, 0)
+            self.assertTrue(tfp.getmember('etc/hosts.link').issym())
+
+    def test_flatten_selects_once(self):
+        def members(names):
+            ret = []
+            for name in names:
+                info = tarfile.TarInfo(name)
+                if name.endswith('/'):
+                    info.type = tarfile.DIRTYPE
+                ret.append(info)
+            return ret
+        layers = [
+            members(['etc/', 'etc/conf', 'etc/keep', 'dev/null', '../x']),
+            members(['etc/', 'etc/conf']),
+            members(['etc/conf', 'etc/conf']),
+        ]
+        selected = dockerv2._flatten_layers(layers)
+        names = [[m.name for m in layer] for layer in selected]
+        self.assertEqual(names[0], ['etc/keep'])
+        self.assertEqual(names[1], ['etc/'])
+        # duplicate entries in one layer: the last one wins
+        self.assertEqual(len(names[2]), 1)
+        self.assertIs(selected[2][0], layers[2][1])
+
+
 if __name__ == '__main__':
     unittest.main()
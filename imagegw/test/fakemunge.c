@@ -0,0 +1,96 @@
+/*
+ * Stand-in for libmunge - For test purposes only
+ *
+ * Credentials are "MUNGE:" followed by the payload.  The credential
+ * "MUNGE:expired" is reported as expired, and every other credential can be
+ * decoded once; decoding it again is reported as a replay.  Encoding through
+ * the socket /tmp/down fails as if munged was not running.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PREFIX "MUNGE:"
+#define MAX_SEEN 64
+
+struct munge_ctx {
+    char *socket;
+};
+
+static char *seen[MAX_SEEN];
+static int nseen = 0;
+
+struct munge_ctx *munge_ctx_create(void) {
+    return calloc(1, sizeof(struct munge_ctx));
+}
+
+void munge_ctx_destroy(struct munge_ctx *ctx) {
+    if (ctx != NULL) {
+        free(ctx->socket);
+        free(ctx);
+    }
+}
+
+int munge_ctx_set(struct munge_ctx *ctx, int opt, ...) {
+    va_list ap;
+    if (opt != 8) {
+        return 2;
+    }
+    va_start(ap, opt);
+    free(ctx->socket);
+    ctx->socket = strdup(va_arg(ap, const char *));
+    va_end(ap);
+    return 0;
+}
+
+int munge_encode(char **cred, struct munge_ctx *ctx, const void *buf,
+        int len) {
+    if (ctx->socket != NULL && strcmp(ctx->socket, "/tmp/down") == 0) {
+        *cred = NULL;
+        return 6;
+    }
+    *cred = malloc(strlen(PREFIX) + len + 1);
+    if (*cred == NULL) {
+        return 3;
+    }
+    strcpy(*cred, PREFIX);
+    memcpy(*cred + strlen(PREFIX), buf, len);
+    (*cred)[strlen(PREFIX) + len] = 0;
+    return 0;
+}
+
+int munge_decode(const char *cred, struct munge_ctx *ctx, void **buf,
+        int *len, unsigned int *uid, unsigned int *gid) {
+    int idx = 0;
+    size_t plen = 0;
+
+    *buf = NULL;
+    *len = 0;
+    if (strncmp(cred, PREFIX, strlen(PREFIX)) != 0) {
+        return 8;
+    }
+    if (strcmp(cred, PREFIX "expired") == 0) {
+        return 15;
+    }
+    for (idx = 0; idx < nseen; idx++) {
+        if (strcmp(seen[idx], cred) == 0) {
+            return 17;
+        }
+    }
+    if (nseen < MAX_SEEN) {
+        seen[nseen++] = strdup(cred);
+    }
+    plen = strlen(cred) - strlen(PREFIX);
+    *buf = malloc(plen + 1);
+    memcpy(*buf, cred + strlen(PREFIX), plen + 1);
+    *len = (int) plen;
+    *uid = getuid();
+    *gid = getgid();
+    return 0;
+}
+
+const char *munge_strerror(int err) {
+    return err == 0 ? "Success" : "Failure";
+}
@@ -45,6 +45,8 @@ class GWTestCase(unittest.TestCase):
             os.makedirs(p)
         self.images = client[db].images
         self.images.drop()
+        # the records the manager cached are gone
+        self.mgr._invalidate_lookups()
         self.metrics = client[db].metrics
         self.metrics.remove({})
         self.url = "/api"
@@ -146,6 +148,46 @@ class GWTestCase(unittest.TestCase):
         _, rv = self.app.get(uri, headers={AUTH_HEADER: self.auth})
         assert rv.status == 200
 
+    def test_lookup_batch(self):
+        self.images.insert(self.good_record())
+        uri = '%s/lookup/%s/' % (self.url, self.system)
+        data = {'images': ['%s:%s' % (self.type, self.itag),
+                           '%s:bogus' % (self.type)]}
+        _, rv = self.app.post(uri, headers={AUTH_HEADER: self.auth},
+                              data=json.dumps(data))
+        self.assertEqual(rv.status, 200)
+        images = rv.json['images']
+        self.assertEqual(len(images), 2)
+        self.assertEqual(images[0]['id'], 'bogus')
+        self.assertEqual(images[0]['image'], data['images'][0])
+        self.assertIn('error', images[1])
+        _, rv = self.app.post(uri, headers={AUTH_HEADER: self.auth},
+                              data=json.dumps({'images': 'notalist'}))
+        self.assertEqual(rv.status, 404)
+        _, rv = self.app.post(uri, headers={AUTH_HEADER: self.auth_bad},
+                              data=json.dumps(data))
+        self.assertEqual(rv.status, 404)
+
+    def test_list_pages(self):
+        for idx in range(3):
+            record = self.good_record()
+            record['tag'] = ['pages/app:%d' % (idx)]
+            self.images.insert(record)
+        uri = '%s/list/%s/?prefix=pages/&limit=2' % (self.url, self.system)
+        _, rv = self.app.get(uri, headers={AUTH_HEADER: self.auth})
+        self.assertEqual(rv.status, 200)
+        self.assertEqual(len(rv.json['list']), 2)
+        self.assertEqual(rv.json['list'][0]['tag'], ['pages/app:0'])
+        self.assertIn('next', rv.json)
+        uri = '%s&after=%s' % (uri, rv.json['next'])
+        _, rv = self.app.get(uri, headers={AUTH_HEADER: self.auth})
+        self.assertEqual(rv.status, 200)
+        self.assertEqual(rv.json['list'][0]['tag'], ['pages/app:2'])
+        self.assertNotIn('next', rv.json)
+        uri = '%s/list/%s/?since=soon' % (self.url, self.system)
+        _, rv = self.app.get(uri, headers={AUTH_HEADER: self.auth})
+        self.assertEqual(rv.status, 404)
+
     def test_queue(self):
         # Do a pull so we can create an image record
         uri = '%s/pull/%s/' % (self.url, self.urlreq)
@@ -175,6 +217,31 @@ class GWTestCase(unittest.TestCase):
         _, rv = self.app.get(uri, headers={AUTH_HEADER: self.auth})
         assert rv.status == 200
 
+    def test_lookup_etag(self):
+        record = self.good_record()
+        id = self.images.insert(record)
+        assert id is not None
+        uri = '%s/lookup/%s/' % (self.url, self.urlreq)
+        _, rv = self.app.get(uri, headers={AUTH_HEADER: self.auth})
+        self.assertEqual(rv.status, 200)
+        etag = rv.headers.get('ETag')
+        self.assertIsNotNone(etag)
+        self.assertIn(record['id'], etag)
+        headers = {AUTH_HEADER: self.auth, 'If-None-Match': etag}
+        _, rv = self.app.get(uri, headers=headers)
+        self.assertEqual(rv.status, 304)
+        self.assertEqual(len(rv.body), 0)
+        # a changed record is sent again
+        self.images.update({'_id': id}, {'$set': {'last_pull': 1.0}})
+        self.mgr._invalidate_lookups()
+        _, rv = self.app.get(uri, headers=headers)
+        self.assertEqual(rv.status, 200)
+        self.assertNotEqual(rv.headers.get('ETag'), etag)
+        # the image is still checked
+        headers[AUTH_HEADER] = self.auth_bad
+        _, rv = self.app.get(uri, headers=headers)
+        self.assertEqual(rv.status, 404)
+
     def test_expire(self):
         uri = '%s/expire/%s/%s/%s/' % (self.url, self.system, self.type,
                                        self.tag)
@@ -1,5 +1,6 @@
 from shifter_imagegw.imageworker import WorkerThreads
 import os
+import pwd
 import unittest
 import time
 import json
@@ -93,6 +94,7 @@ class ImageMngrTestCase(unittest.TestCase):
         db = self.config['MongoDB']
         self.images = client[db].images
         self.metrics = client[db].metrics
+        self.versions = client[db].versions
         self.images.drop()
         self.logger = logging.getLogger("imagemngr")
         if len(self.logger.handlers) < 1:
@@ -480,6 +482,8 @@ class ImageMngrTestCase(unittest.TestCase):
         self.assertIn('_id', l)
         self.assertEqual(self.m.get_state(l['_id']), 'READY')
         i = self.query.copy()
+        # expiration resets are written in batches
+        self.m.flush_updates()
         r = self.images.find_one({'_id': l['_id']})
         self.assertIn('expiration', r)
         self.assertGreater(r['expiration'], time.time())
@@ -487,6 +491,90 @@ class ImageMngrTestCase(unittest.TestCase):
         l = self.m.lookup(session, i)
         self.assertIsNone(l)
 
+    @attr('fast')
+    def test_lookup_cache(self):
+        record = self.good_record()
+        id = self.images.insert(record)
+        session = self.m.new_session(self.auth, self.system)
+        l = self.m.lookup(session, self.query.copy())
+        self.assertEqual(l['id'], self.id)
+        # cached until something changes a READY record
+        self.images.update({'_id': id}, {'$set': {'id': 'newid'}})
+        l = self.m.lookup(session, self.query.copy())
+        self.assertEqual(l['id'], self.id)
+        self.m._invalidate_lookups()
+        l = self.m.lookup(session, self.query.copy())
+        self.assertEqual(l['id'], 'newid')
+        # the generation is kept in mongo, so changes made by other API
+        # workers drop the cache as well
+        self.images.update({'_id': id}, {'$set': {'id': 'workerid'}})
+        l = self.m.lookup(session, self.query.copy())
+        self.assertEqual(l['id'], 'newid')
+        self.versions.update({'_id': 'lookups'},
+                             {'$inc': {'generation': 1}}, upsert=True)
+        l = self.m.lookup(session, self.query.copy())
+        self.assertEqual(l['id'], 'workerid')
+        # and not beyond the TTL
+        self.images.update({'_id': id}, {'$set': {'id': 'otherid'}})
+        self.m.lookup_ttl = 0
+        l = self.m.lookup(session, self.query.copy())
+        self.assertEqual(l['id'], 'otherid')
+        # moving the tag to another image is visible at once
+        self.m.lookup_ttl = 60
+        self.m.lookup(session, self.query.copy())
+        record = self.good_record()
+        record['id'] = 'movedid'
+        record['tag'] = []
+        id2 = self.images.insert(record)
+        self.m.add_tag(id2, self.system, self.tag)
+        l = self.m.lookup(session, self.query.copy())
+        self.assertEqual(l['id'], 'movedid')
+
+    @attr('fast')
+    def test_lookup_batched_metrics(self):
+        self.images.insert(self.good_record())
+        self.metrics.remove({})
+        session = self.m.new_session(self.auth, self.system)
+        for _ in range(5):
+            self.assertIsNotNone(self.m.lookup(session, self.query.copy()))
+        self.assertEqual(self.metrics.count(), 0)
+        self.m.flush_updates()
+        self.assertEqual(self.metrics.count(), 5)
+
+    @attr('fast')
+    def test_lookup_batch(self):
+        self.images.insert(self.good_record())
+        self.metrics.remove({})
+        record = self.good_record()
+        record['id'] = 'otherid'
+        record['tag'] = ['other:1', 'other:2']
+        self.images.insert(record)
+        record = self.good_record()
+        record['id'] = 'privateid'
+        record['tag'] = ['private:latest']
+        record['userACL'] = [101]
+        record['private'] = True
+        self.images.insert(record)
+        session = self.m.new_session(self.auth, self.system)
+        images = [{'itype': self.itype, 'tag': tag}
+                  for tag in (self.tag, 'other:2', 'missing:latest',
+                              'private:latest', 'other:1')]
+        recs = self.m.lookup_batch(session, self.system, images)
+        self.assertEqual(len(recs), 5)
+        self.assertEqual(recs[0]['id'], self.id)
+        self.assertEqual(recs[1]['id'], 'otherid')
+        self.assertIsNone(recs[2])
+        self.assertIsNone(recs[3])
+        self.assertEqual(recs[4]['id'], 'otherid')
+        # the found images are cached for single lookups too
+        self.images.remove({'id': 'otherid'})
+        query = {'system': self.system, 'itype': self.itype,
+                 'tag': 'other:1'}
+        self.assertEqual(self.m.lookup(session, query)['id'], 'otherid')
+        # only found images are recorded
+        self.m.flush_updates()
+        self.assertEqual(self.metrics.count(), 4)
+
     @attr('fast')
     def test_list(self):
         record = self.good_record()
@@ -503,6 +591,54 @@ class ImageMngrTestCase(unittest.TestCase):
         self.assertEqual(self.m.get_state(l['_id']), 'READY')
         self.assertEqual(l['_id'], id1)
 
+    @attr('fast')
+    def test_list_filter_pages(self):
+        ids = []
+        for idx in range(5):
+            record = self.good_record()
+            record['id'] = 'pageid%d' % (idx)
+            record['tag'] = ['pages/app:%d' % (idx)]
+            record['last_pull'] = 1000.0 + idx
+            ids.append(self.images.insert(record))
+        # an image with several tags is listed once
+        record = self.good_record()
+        record['id'] = 'pageidmulti'
+        record['tag'] = ['pages/app:4x', 'pages/app:0x']
+        record['last_pull'] = 900.0
+        ids.append(self.images.insert(record))
+        record = self.good_record()
+        record['tag'] = ['other:latest']
+        self.images.insert(record)
+        # a private image of another user is never listed
+        record = self.good_record()
+        record['tag'] = ['pages/private:latest']
+        record['userACL'] = [101]
+        record['private'] = True
+        self.images.insert(record)
+        session = self.m.new_session(self.auth, self.system)
+        li = self.m.imglist(session, self.system, prefix='pages/')
+        self.assertEqual([l['_id'] for l in li], ids)
+        self.assertEqual(li[-1]['tag'], ['pages/app:4x', 'pages/app:0x'])
+        # only the listed fields are loaded
+        self.assertNotIn('format', li[0])
+        li = self.m.imglist(session, self.system, prefix='pages/',
+                            since=1003.0)
+        self.assertEqual([l['_id'] for l in li], ids[3:5])
+        li = self.m.imglist(session, self.system, user=101)
+        self.assertEqual(len(li), 0)
+        listed = []
+        after = None
+        while True:
+            page = self.m.imglist(session, self.system, prefix='pages/',
+                                  limit=2, after=after)
+            listed.extend(l['_id'] for l in page)
+            if len(page) < 2:
+                break
+            after = self.m.list_cursor(page[-1])
+        self.assertEqual(listed, ids)
+        with self.assertRaises(ValueError):
+            self.m.imglist(session, self.system, limit=2, after='bogus')
+
     def test_repull(self):
         # Test a repull
         record = self.good_record()
@@ -692,6 +828,18 @@ class ImageMngrTestCase(unittest.TestCase):
         # And Not
         self.assertFalse(self.m._checkread({'uid': 7, 'gid': 7}, mock_image))
 
+    @attr('fast')
+    def test_get_groups(self):
+        uid = os.getuid()
+        groups = self.m._get_groups(uid, os.getgid())
+        self.assertIn(pwd.getpwuid(uid).pw_gid, groups)
+        # served from the cache until GroupCacheTTL passes
+        self.m.group_cache[uid] = (time.time(), [12345])
+        self.assertEqual(self.m._get_groups(uid, os.getgid()), [12345])
+        self.m.group_ttl = 0
+        self.assertEqual(self.m._get_groups(uid, os.getgid()), groups)
+        self.assertEqual(self.m._get_groups(987654321, 1), [])
+
     def test_pulls_acl_change(self):
         """
         This simulates a pull inflight + an ACL pull
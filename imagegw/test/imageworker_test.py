@@ -20,8 +20,10 @@ import os
 import unittest
 import json
 import shutil
+import threading
+import time
 from copy import deepcopy
-from shifter_imagegw import imageworker
+from shifter_imagegw import imageworker, fasthash
 DEBUG = False
 
 
@@ -183,6 +185,18 @@ class ImageWorkerTestCase(unittest.TestCase):
         req = imageworker.ImageRequest(self.config, request, self.updater)
         status = req._transfer_image()
         self.assertTrue(status)
+        # the copy streamed to the system is checked against the image
+        # digest, and not installed if it does not match
+        req.imagefile = imagefile
+        req.meta = {'digest': fasthash.chunked_digest(imagefile)[0]}
+        self.assertTrue(req._transfer_image())
+        target = os.path.join(req.sysconf['ssh']['imageDir'],
+                              os.path.basename(imagefile))
+        os.unlink(target)
+        req.meta = {'digest': 'chunked-sha256:1024:00'}
+        with self.assertRaises(OSError):
+            req._transfer_image()
+        self.assertFalse(os.path.exists(target))
 
     def test_bad_pull_docker(self):
         self.cleanup_cache()
@@ -267,5 +281,97 @@ class ImageWorkerTestCase(unittest.TestCase):
         self.assertIn('alabel', resp['labels'])
 
 
+class StubRequest(object):
+    """Stands in for an ImageRequest, recording the stages it ran."""
+
+    def __init__(self, name, log, hold=None):
+        self.name = name
+        self.log = log
+        self.hold = hold
+        self.updates = []
+        self.updater = imageworker.Updater(name, self.record)
+
+    def record(self, ident, state, meta):
+        self.updates.append((state, meta['message']))
+
+    def run_stage(self, stage):
+        self.log.append((self.name, stage))
+        if stage == 'convert' and self.hold is not None:
+            self.hold.wait(10)
+        if self.name == 'bad' and stage == 'extract':
+            # like ImageRequest.run_stage, report the failure and raise
+            self.updater.update_status('FAILURE', 'FAILED')
+            raise OSError('extract failed')
+        nextstage = {'download': 'extract', 'extract': 'convert',
+                     'convert': 'transfer', 'transfer': None}[stage]
+        self.updater.update_status(stage.upper(), stage)
+        return nextstage
+
+
+class ImageWorkerPipelineTestCase(unittest.TestCase):
+
+    def _wait(self, cond):
+        for _ in range(500):
+            if cond():
+                return
+            time.sleep(0.01)
+        self.fail('timed out')
+
+    def test_run_in_child(self):
+        self.assertNotEqual(imageworker._run_in_child(os.getpid),
+                            os.getpid())
+        self.assertEqual(imageworker._run_in_child(max, 3, 7), 7)
+        with self.assertRaisesRegex(OSError, 'ValueError'):
+            imageworker._run_in_child(int, 'bad image')
+        with self.assertRaises(OSError):
+            imageworker._run_in_child(os._exit, 3)
+
+    def test_pipeline(self):
+        workers = imageworker.WorkerThreads({}, threads=1)
+        log = []
+        hold = threading.Event()
+        slow = StubRequest('slow', log, hold)
+        fast = StubRequest('fast', log)
+        bad = StubRequest('bad', log)
+        download = workers.stages['download'].queue
+        for req in (slow, fast, bad):
+            download.put(req)
+
+        # the other images download and extract during the conversion
+        self._wait(lambda: ('fast', 'extract') in log and
+                   ('bad', 'extract') in log)
+        self._wait(lambda: workers.get_stats()[2]['queued'] == 1)
+        self.assertNotIn(('slow', 'transfer'), log)
+        hold.set()
+        self._wait(lambda: ('fast', 'transfer') in log and
+                   ('slow', 'transfer') in log)
+        self.assertNotIn(('bad', 'convert'), log)
+        self.assertIn(('EXTRACT', 'Waiting for conversion'), slow.updates)
+        self.assertEqual(bad.updates[-1][0], 'FAILURE')
+        # reported once, the worker does not post it again
+        self.assertEqual([update[0] for update in bad.updates]
+                         .count('FAILURE'), 1)
+
+        self._wait(lambda: workers.get_stats()[3]['completed'] == 2)
+        stats = dict((stage['name'], stage)
+                     for stage in workers.get_stats())
+        self.assertEqual(stats['download']['completed'], 3)
+        self.assertEqual(stats['extract']['failed'], 1)
+        self.assertEqual(stats['convert']['completed'], 2)
+        self.assertEqual(stats['convert']['queued'], 0)
+        self.assertGreater(stats['convert']['max_seconds'], 0.0)
+
+    def test_stage_workers(self):
+        conf = {'PipelineStages': {'convert': 3}, 'PipelineQueueDepth': 2}
+        workers = imageworker.WorkerThreads(conf, threads=2)
+        stats = dict((stage['name'], stage)
+                     for stage in workers.get_stats())
+        self.assertEqual(stats['download']['workers'], 2)
+        self.assertEqual(stats['convert']['workers'], 3)
+        self.assertEqual(workers.stages['extract'].queue.maxsize, 2)
+        with self.assertRaises(ValueError):
+            imageworker.WorkerThreads({'PipelineStages': {'extract': 0}})
+
+
 if __name__ == '__main__':
     unittest.main()
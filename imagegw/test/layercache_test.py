@@ -0,0 +1,153 @@
+# Shifter, Copyright (c) 2016, The Regents of the University of California,
+# through Lawrence Berkeley National Laboratory (subject to receipt of any
+# required approvals from the U.S. Dept. of Energy).  All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#  1. Redistributions of source code must retain the above copyright notice,
+#     this list of conditions and the following disclaimer.
+#  2. Redistributions in binary form must reproduce the above copyright notice,
+#     this list of conditions and the following disclaimer in the documentation
+#     and/or other materials provided with the distribution.
+#  3. Neither the name of the University of California, Lawrence Berkeley
+#     National Laboratory, U.S. Dept. of Energy nor the names of its
+#     contributors may be used to endorse or promote products derived from this
+#     software without specific prior written permission.`
+#
+# See LICENSE for full text.
+
+import os
+import json
+import shutil
+import tempfile
+import unittest
+from shifter_imagegw.layercache import LayerCache
+
+
+class LayerCacheTestCase(unittest.TestCase):
+
+    def setUp(self):
+        self.cachedir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.cachedir)
+
+    def _blob(self, idx, size=1000):
+        """Create a blob in the cache and return its digest."""
+        digest = 'sha256:%064x' % idx
+        base = os.path.join(self.cachedir, '%s.tar' % digest)
+        with open(base, 'wb') as out_fp:
+            out_fp.write(b'x' * size)
+        with open(base + '.verified', 'w') as out_fp:
+            out_fp.write('stamp\n')
+        return digest
+
+    def _exists(self, digest):
+        return os.path.exists(os.path.join(self.cachedir, '%s.tar' % digest))
+
+    def test_counters(self):
+        cache = LayerCache(self.cachedir)
+        blob = self._blob(1)
+        cache.touch(blob, False)
+        cache.touch(blob, True)
+        cache.touch(blob, True)
+        stats = cache.stats()
+        self.assertEqual(stats['hits'], 2)
+        self.assertEqual(stats['misses'], 1)
+        self.assertAlmostEqual(stats['hit_rate'], 2.0 / 3)
+        self.assertEqual(stats['blobs'], 1)
+        self.assertEqual(stats['bytes'], 1000)
+        # the counters are shared through the index
+        self.assertEqual(LayerCache(self.cachedir).stats()['hits'], 2)
+
+    def test_lru_eviction(self):
+        cache = LayerCache(self.cachedir, 2500)
+        blobs = [self._blob(idx) for idx in range(3)]
+        for blob in blobs:
+            cache.touch(blob, False)
+        # the first blob becomes the most recently used
+        cache.touch(blobs[0], True)
+        cache.touch(self._blob(3), False)
+        self.assertEqual(cache.evict(), [blobs[1], blobs[2]])
+        self.assertTrue(self._exists(blobs[0]))
+        self.assertFalse(self._exists(blobs[1]))
+        base = os.path.join(self.cachedir, '%s.tar' % blobs[1])
+        self.assertFalse(os.path.exists(base + '.verified'))
+        stats = cache.stats()
+        self.assertEqual(stats['evictions'], 2)
+        self.assertEqual(stats['evicted_bytes'], 2000)
+        self.assertEqual(stats['bytes'], 2000)
+
+    def test_unbounded(self):
+        cache = LayerCache(self.cachedir)
+        for idx in range(5):
+            cache.touch(self._blob(idx), False)
+        self.assertEqual(cache.evict(), [])
+        self.assertEqual(cache.stats()['blobs'], 5)
+
+    def test_pinned_not_evicted(self):
+        cache = LayerCache(self.cachedir, 1000)
+        old = self._blob(1)
+        cache.touch(old, False)
+        token = cache.pin([old])
+        cache.touch(self._blob(2), False)
+        self.assertEqual(cache.stats()['pinned'], 1)
+        # the newer blob goes, the pinned one stays while over the limit
+        self.assertEqual(len(cache.evict()), 1)
+        self.assertTrue(self._exists(old))
+        cache.touch(self._blob(3), False)
+        self.assertEqual(cache.unpin(token), [old])
+
+    def test_stale_pin(self):
+        cache = LayerCache(self.cachedir, 1000)
+        blob = self._blob(1)
+        cache.touch(blob, False)
+        cache.pin([blob])
+        # a pin left behind by a process that is gone
+        with open(cache.index_path) as in_fp:
+            index = json.load(in_fp)
+        token = list(index['pins'].keys())[0]
+        index['pins']['999999999.1'] = index['pins'].pop(token)
+        with open(cache.index_path, 'w') as out_fp:
+            json.dump(index, out_fp)
+        cache.touch(self._blob(2), False)
+        self.assertEqual(cache.evict(), [blob])
+        self.assertEqual(cache.stats()['pinned'], 0)
+
+    def test_refs(self):
+        cache = LayerCache(self.cachedir)
+        base = self._blob(1, 500)
+        top1 = self._blob(2)
+        top2 = self._blob(3)
+        for blob in (base, top1, top2):
+            cache.touch(blob, False)
+        cache.add_refs([base, top1], 'image1')
+        cache.add_refs([base, top2], 'image2')
+        cache.add_refs([base, top2], 'image2')
+        stats = cache.stats()
+        self.assertEqual(stats['images'], 2)
+        self.assertEqual(stats['shared_blobs'], 1)
+        self.assertEqual(stats['shared_bytes'], 500)
+
+    def test_adopt_existing(self):
+        blobs = [self._blob(idx) for idx in range(2)]
+        os.utime(os.path.join(self.cachedir, '%s.tar' % blobs[1]),
+                 (1, 1))
+        with open(os.path.join(self.cachedir, 'other.tar'), 'w') as out_fp:
+            out_fp.write('not a blob')
+        cache = LayerCache(self.cachedir, 1000)
+        self.assertEqual(cache.stats()['blobs'], 2)
+        # the blob with the older mtime is used least recently
+        self.assertEqual(cache.evict(), [blobs[1]])
+
+    def test_removed_blob(self):
+        cache = LayerCache(self.cachedir, 1000)
+        blob = self._blob(1)
+        cache.touch(blob, False)
+        os.unlink(os.path.join(self.cachedir, '%s.tar' % blob))
+        self.assertEqual(cache.evict(), [])
+        self.assertEqual(cache.stats()['blobs'], 0)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -17,6 +17,9 @@
 # See LICENSE for full text.
 
 import os
+import shutil
+import subprocess
+import tempfile
 import unittest
 from shifter_imagegw import munge
 
@@ -24,6 +27,8 @@ from shifter_imagegw import munge
 class MungeTestCase(unittest.TestCase):
 
     def setUp(self):
+        # the mock munge commands are used
+        munge.use_library(None)
         self.test_dir = os.path.dirname(os.path.abspath(__file__)) + \
                         "/../test/"
         self.encoded = "xxxx\n"
@@ -57,5 +62,58 @@ class MungeTestCase(unittest.TestCase):
             munge.unmunge(self.encoded)
 
 
+class LibMungeTestCase(unittest.TestCase):
+    """
+    Exercise the libmunge binding against the stand-in in fakemunge.c
+    """
+
+    def setUp(self):
+        test_dir = os.path.dirname(os.path.abspath(__file__))
+        self.build_dir = tempfile.mkdtemp()
+        lib = os.path.join(self.build_dir, 'libmunge.so')
+        try:
+            subprocess.check_call(['cc', '-shared', '-fPIC', '-o', lib,
+                                   os.path.join(test_dir, 'fakemunge.c')])
+        except (OSError, subprocess.CalledProcessError):
+            shutil.rmtree(self.build_dir)
+            self.skipTest('no C compiler to build the fake libmunge')
+        munge.use_library(lib)
+
+    def tearDown(self):
+        munge.use_library(None)
+        shutil.rmtree(self.build_dir)
+
+    def test_roundtrip(self):
+        cred = munge.munge('{"authorized_locations": "a"}', socket='/tmp/s')
+        self.assertEqual(cred, 'MUNGE:{"authorized_locations": "a"}')
+        resp = munge.unmunge(cred + '\n', socket='/tmp/s')
+        self.assertEqual(resp['STATUS'], 'Success (0)')
+        self.assertEqual(resp['MESSAGE'], '{"authorized_locations": "a"}')
+        self.assertTrue(resp['UID'].endswith('(%d)' % os.getuid()))
+        self.assertTrue(resp['GID'].endswith('(%d)' % os.getgid()))
+
+    def test_munge_fallback(self):
+        # the munge command is used when libmunge fails
+        test_dir = os.path.dirname(os.path.abspath(__file__))
+        fname = os.path.join(test_dir, 'munge.test')
+        with open(fname, 'w') as f:
+            f.write('yyyy\n')
+        self.assertEqual(munge.munge('test', socket='/tmp/down'), 'yyyy')
+        # and an error is raised only if that fails as well
+        os.unlink(fname)
+        with self.assertRaises(OSError):
+            munge.munge('test', socket='/tmp/down')
+
+    def test_errors(self):
+        with self.assertRaises(OSError):
+            munge.unmunge('MUNGE:expired')
+        resp = munge.unmunge('MUNGE:once')
+        self.assertEqual(resp['MESSAGE'], 'once')
+        with self.assertRaises(OSError):
+            munge.unmunge('MUNGE:once')
+        with self.assertRaises(OSError):
+            munge.unmunge('garbage')
+
+
 if __name__ == '__main__':
     unittest.main()
@@ -19,7 +19,7 @@
 import os
 import unittest
 import tempfile
-from shifter_imagegw import transfer
+from shifter_imagegw import fasthash, transfer
 
 
 class TransferTestCase(unittest.TestCase):
@@ -74,6 +74,21 @@ class TransferTestCase(unittest.TestCase):
         cmd = transfer._ssh_cmd(self.system)
         self.assertIsNone(cmd)
 
+    def test_ssh_mux_cmd(self):
+        cmd = transfer._ssh_mux_cmd(self.system, 'echo', 'test')
+        self.assertEqual(cmd[0], 'ssh')
+        self.assertIn('ControlMaster=auto', cmd)
+        self.assertIn('ControlPersist=60', cmd)
+        self.assertEqual(cmd[-3:], ['nobody@localhost', 'echo', 'test'])
+        control = os.path.dirname(cmd[cmd.index('ControlMaster=auto') + 2]
+                                  .split('=', 1)[1])
+        self.assertEqual(os.stat(control).st_mode & 0o777, 0o700)
+
+        self.system['ssh']['controlPersist'] = 0
+        cmd = transfer._ssh_mux_cmd(self.system, 'echo', 'test')
+        self.assertEqual(cmd, transfer._ssh_cmd(self.system, 'echo', 'test'))
+        del self.system['ssh']['controlPersist']
+
     def test_cp_cmd(self):
         cmd = transfer._cp_cmd(self.system, 'a', 'b')
         self.assertEqual(len(cmd), 3)
@@ -146,6 +161,127 @@ class TransferTestCase(unittest.TestCase):
 
         os.rmdir(tmp_path)
 
+    def test_copyfile_remote_checksum(self):
+        """a transfer that arrives damaged is not installed"""
+        tmp_path = tempfile.mkdtemp()
+        bin_path = tempfile.mkdtemp()
+        self.system['ssh']['imageDir'] = tmp_path
+        self.system['accesstype'] = 'remote'
+        with open(os.path.join(bin_path, 'sha256sum'), 'w') as out_fp:
+            out_fp.write('#!/bin/sh\necho 0000 "$1"\n')
+        os.chmod(os.path.join(bin_path, 'sha256sum'), 0o755)
+        path = os.environ['PATH']
+        os.environ['PATH'] = '%s:%s' % (bin_path, path)
+        try:
+            with self.assertRaises(OSError):
+                transfer.copy_file(__file__, self.system)
+        finally:
+            os.environ['PATH'] = path
+        self.assertEqual(self.inode_counter(tmp_path), 0)
+        os.unlink(os.path.join(bin_path, 'sha256sum'))
+        os.rmdir(bin_path)
+        os.rmdir(tmp_path)
+
+    def test_copyfile_remote_digest(self):
+        """a streamed copy is checked against the image digest on the way"""
+        tmp_path = tempfile.mkdtemp()
+        self.system['ssh']['imageDir'] = tmp_path
+        self.system['accesstype'] = 'remote'
+        fname = os.path.split(__file__)[1]
+        digest = fasthash.chunked_digest(__file__, chunk_size=1024)[0]
+        self.assertTrue(transfer.copy_file(__file__, self.system,
+                                           digest=digest))
+        os.unlink(os.path.join(tmp_path, fname))
+        with self.assertRaises(OSError):
+            transfer.copy_file(__file__, self.system,
+                               digest='chunked-sha256:1024:00')
+        with self.assertRaises(OSError):
+            transfer.copy_file(__file__, self.system, digest='bogus')
+        self.assertEqual(self.inode_counter(tmp_path), 0)
+        os.rmdir(tmp_path)
+
+    def test_copyfile_local_mode(self):
+        tmp_path = tempfile.mkdtemp()
+        self.system['local']['imageDir'] = tmp_path
+        self.system['accesstype'] = 'local'
+        self.assertTrue(transfer.copy_file(__file__, self.system))
+        file_path = os.path.join(tmp_path, os.path.split(__file__)[1])
+        self.assertEqual(os.stat(file_path).st_mode & 0o777, 0o600)
+        with open(__file__, 'rb') as in_fp, open(file_path, 'rb') as out_fp:
+            self.assertEqual(in_fp.read(), out_fp.read())
+        # replacing an existing image
+        self.assertTrue(transfer.copy_file(__file__, self.system))
+        self.assertEqual(self.inode_counter(tmp_path), 1)
+        os.unlink(file_path)
+        os.rmdir(tmp_path)
+
+    def _delta_images(self, tmp_path):
+        """Write an image and a changed version of it."""
+        block = transfer.DELTA_BLOCK_SIZE
+        old = os.path.join(tmp_path, 'old.squashfs')
+        new = os.path.join(tempfile.mkdtemp(), 'new.squashfs')
+        data = bytearray(os.urandom(block * 8 + 100))
+        with open(old, 'wb') as out_fp:
+            out_fp.write(data)
+        data[block * 2:block * 2 + 10] = b'x' * 10
+        data[block * 5 + 7] = (data[block * 5 + 7] + 1) % 256
+        data += b'tail'
+        with open(new, 'wb') as out_fp:
+            out_fp.write(data)
+        return old, new, bytes(data)
+
+    def _check_delta(self, accesstype):
+        tmp_path = tempfile.mkdtemp()
+        self.system['local']['imageDir'] = tmp_path
+        self.system['ssh']['imageDir'] = tmp_path
+        self.system['accesstype'] = accesstype
+        old, new, data = self._delta_images(tmp_path)
+        base_manifest = transfer.block_manifest(old)
+        manifest = transfer.block_manifest(new)
+        self.assertEqual(len(manifest['blocks']), 9)
+        self.assertEqual(transfer._delta_runs(base_manifest, manifest),
+                         [[2, 1], [5, 1], [8, 1]])
+        self.assertTrue(transfer.copy_file_delta(new, self.system, old,
+                                                 base_manifest, manifest))
+        target = os.path.join(tmp_path, 'new.squashfs')
+        with open(target, 'rb') as in_fp:
+            self.assertEqual(in_fp.read(), data)
+        self.assertEqual(os.stat(target).st_mode & 0o777, 0o600)
+        self.assertEqual(self.inode_counter(tmp_path), 2)
+
+        # without the base on the system a full copy is needed
+        os.unlink(target)
+        os.unlink(old)
+        self.assertFalse(transfer.copy_file_delta(new, self.system, old,
+                                                  base_manifest, manifest))
+        self.assertEqual(self.inode_counter(tmp_path), 0)
+        delta = {'base': old, 'base_manifest': base_manifest,
+                 'manifest': manifest}
+        self.assertTrue(transfer.transfer(self.system, new, delta=delta))
+        with open(target, 'rb') as in_fp:
+            self.assertEqual(in_fp.read(), data)
+        os.unlink(target)
+        os.unlink(new)
+        os.rmdir(os.path.dirname(new))
+        os.rmdir(tmp_path)
+
+    def test_delta_local(self):
+        self._check_delta('local')
+
+    def test_delta_remote(self):
+        """uses the mock ssh to rebuild the image with dd"""
+        self._check_delta('remote')
+
+    def test_delta_not_worth_it(self):
+        base = {'block_size': 4, 'blocks': ['a', 'b', 'c', 'd']}
+        self.assertIsNone(transfer._delta_runs(
+            base, {'block_size': 8, 'blocks': ['a', 'b', 'c', 'd']}))
+        self.assertIsNone(transfer._delta_runs(
+            base, {'block_size': 4, 'blocks': ['x', 'y', 'c', 'z']}))
+        self.assertEqual(transfer._delta_runs(
+            base, {'block_size': 4, 'blocks': ['a', 'y', 'c', 'd', 'e']}),
+            [[1, 1], [4, 1]])
+
     def test_copyfile_invalid(self):
         tmp_path = tempfile.mkdtemp()
         self.system['local']['imageDir'] = tmp_path
@@ -238,6 +374,61 @@ class TransferTestCase(unittest.TestCase):
         self.assertEqual(hash, gh)
         transfer.remove_file(fname, self.system)
 
+    def test_chunked_digest(self):
+        (fdesc, tmp_path) = tempfile.mkstemp()
+        os.write(fdesc, os.urandom(10000))
+        os.close(fdesc)
+        digest, chunks = fasthash.chunked_digest(tmp_path, chunk_size=1024,
+                                                 threads=4)
+        self.assertEqual(len(chunks), 10)
+        self.assertTrue(digest.startswith('chunked-sha256:1024:'))
+        # the same digest whatever the parallelism
+        self.assertEqual(fasthash.chunked_digest(tmp_path, 1024, 1)[0],
+                         digest)
+        self.assertTrue(fasthash.verify_digest(tmp_path, digest))
+        self.assertFalse(fasthash.verify_digest(tmp_path, 'bogus'))
+        # and when the data is fed in pieces of any size
+        stream = fasthash.stream_digest(digest)
+        with open(tmp_path, 'rb') as in_fp:
+            data = in_fp.read()
+        for offset in range(0, len(data), 700):
+            stream.update(data[offset:offset + 700])
+        self.assertEqual(stream.digest(), digest)
+        self.assertIsNone(fasthash.stream_digest('bogus'))
+        # a range is checked from the chunk digests alone
+        self.assertTrue(fasthash.verify_range(tmp_path, digest, chunks,
+                                              3000, 2500))
+        forged = list(chunks)
+        forged[4] = '00' * 32
+        self.assertFalse(fasthash.verify_range(tmp_path, digest, forged,
+                                               0, 1024))
+
+        dname, fname = os.path.split(tmp_path)
+        self.system['local']['imageDir'] = dname
+        self.system['accesstype'] = 'local'
+        full = transfer.hash_file(tmp_path, self.system, chunked=True)
+        self.assertEqual(full, fasthash.chunked_digest(tmp_path)[0])
+        self.assertTrue(transfer.verify_file(fname, self.system, full))
+        self.assertTrue(transfer.imagevalid(self.system, fname, digest=full))
+        # any changed byte is noticed
+        with open(tmp_path, 'r+b') as out_fp:
+            out_fp.seek(5000)
+            byte = out_fp.read(1)[0]
+            out_fp.seek(5000)
+            out_fp.write(bytes([byte ^ 0xff]))
+        self.assertFalse(transfer.verify_file(fname, self.system, full))
+        self.assertFalse(transfer.imagevalid(self.system, fname,
+                                             digest=full))
+        # only the chunks covering the range are read
+        self.assertTrue(fasthash.verify_range(tmp_path, digest, chunks,
+                                              0, 3000))
+        self.assertFalse(fasthash.verify_range(tmp_path, digest, chunks,
+                                               4500, 1000))
+        self.system['accesstype'] = 'bogus'
+        with self.assertRaises(NotImplementedError):
+            transfer.verify_file(fname, self.system, full)
+        os.unlink(tmp_path)
+
     def test_get_stdout_and_log(self):
         cmd = "ls"
         stderr, stdout = transfer._get_stdout_and_log(cmd, None)
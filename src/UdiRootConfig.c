@@ -328,6 +328,10 @@ void free_UdiRootConfig(UdiRootConfig *config, int freeStruct) {
         free(config->optUdiImage);
         config->optUdiImage = NULL;
     }
+    if (config->udiImageStagingPath != NULL) {
+        free(config->udiImageStagingPath);
+        config->udiImageStagingPath = NULL;
+    }
     if (config->etcPath != NULL) {
         free(config->etcPath);
         config->etcPath = NULL;
@@ -365,6 +369,22 @@ void free_UdiRootConfig(UdiRootConfig *config, int freeStruct) {
         free(config->rootfsType);
         config->rootfsType = NULL;
     }
+    if (config->gatewayCachePath != NULL) {
+        free(config->gatewayCachePath);
+        config->gatewayCachePath = NULL;
+    }
+    if (config->teardownStatePath != NULL) {
+        free(config->teardownStatePath);
+        config->teardownStatePath = NULL;
+    }
+    if (config->sshKeyPoolPath != NULL) {
+        free(config->sshKeyPoolPath);
+        config->sshKeyPoolPath = NULL;
+    }
+    if (config->udiStatePath != NULL) {
+        free(config->udiStatePath);
+        config->udiStatePath = NULL;
+    }
     if (config->siteFs != NULL) {
         free_VolumeMap(config->siteFs, 1);
         config->siteFs = NULL;
@@ -468,6 +488,8 @@ size_t fprint_UdiRootConfig(FILE *fp, UdiRootConfig *config) {
         (config->sitePostMountHook != NULL ? config->sitePostMountHook : ""));
     written += fprintf(fp, "optUdiImage = %s\n",
         (config->optUdiImage != NULL ? config->optUdiImage : ""));
+    written += fprintf(fp, "udiImageStagingPath = %s\n",
+        (config->udiImageStagingPath != NULL ? config->udiImageStagingPath : ""));
     written += fprintf(fp, "etcPath = %s\n",
         (config->etcPath != NULL ? config->etcPath : ""));
     written += fprintf(fp, "allowLocalChroot = %d\n",
@@ -481,6 +503,14 @@ size_t fprint_UdiRootConfig(FILE *fp, UdiRootConfig *config) {
          "slave" : "private"));
     written += fprintf(fp, "rootfsType = %s\n",
         (config->rootfsType != NULL ? config->rootfsType : ""));
+    written += fprintf(fp, "gatewayCachePath = %s\n",
+        (config->gatewayCachePath != NULL ? config->gatewayCachePath : ""));
+    written += fprintf(fp, "teardownStatePath = %s\n",
+        (config->teardownStatePath != NULL ? config->teardownStatePath : ""));
+    written += fprintf(fp, "sshKeyPoolPath = %s\n",
+        (config->sshKeyPoolPath != NULL ? config->sshKeyPoolPath : ""));
+    written += fprintf(fp, "udiStatePath = %s\n",
+        (config->udiStatePath != NULL ? config->udiStatePath : ""));
     written += fprintf(fp, "modprobePath = %s\n",
         (config->modprobePath != NULL ? config->modprobePath : ""));
     written += fprintf(fp, "insmodPath = %s\n",
@@ -672,6 +702,9 @@ static int _assign(const char *key, const char *value, void *t_config) {
     } else if (strcmp(key, "optUdiImage") == 0) {
         config->optUdiImage = _strdup(value);
         if (config->optUdiImage == NULL) return 1;
+    } else if (strcmp(key, "udiImageStagingPath") == 0) {
+        config->udiImageStagingPath = _strdup(value);
+        if (config->udiImageStagingPath == NULL) return 1;
     } else if (strcmp(key, "etcPath") == 0) {
         config->etcPath = _strdup(value);
         if (config->etcPath == NULL) return 1;
@@ -715,6 +748,18 @@ static int _assign(const char *key, const char *value, void *t_config) {
         config->rootfsType = _strdup(value);
     } else if (strcmp(key, "gatewayTimeout") == 0) {
         config->gatewayTimeout = strtoul(value, NULL, 10);
+    } else if (strcmp(key, "gatewayCachePath") == 0) {
+        config->gatewayCachePath = _strdup(value);
+        if (config->gatewayCachePath == NULL) return 1;
+    } else if (strcmp(key, "teardownStatePath") == 0) {
+        config->teardownStatePath = _strdup(value);
+        if (config->teardownStatePath == NULL) return 1;
+    } else if (strcmp(key, "sshKeyPoolPath") == 0) {
+        config->sshKeyPoolPath = _strdup(value);
+        if (config->sshKeyPoolPath == NULL) return 1;
+    } else if (strcmp(key, "udiStatePath") == 0) {
+        config->udiStatePath = _strdup(value);
+        if (config->udiStatePath == NULL) return 1;
     } else if (strcmp(key, "kmodBasePath") == 0) {
         fprintf(stderr, "IGNORING parameter kmodBasePath, deprecated.\n");
     } else if (strcmp(key, "kmodCacheFile") == 0) {
@@ -107,6 +107,7 @@ typedef struct _UdiRootConfig {
     char *sitePreMountHook;
     char *sitePostMountHook;
     char *optUdiImage;
+    char *udiImageStagingPath;
     char *etcPath;
     char *rootfsType;
     char **gwUrl;
@@ -128,6 +129,10 @@ typedef struct _UdiRootConfig {
     int optionalSshdAsRoot;
     size_t maxGroupCount;
     size_t gatewayTimeout;
+    char *gatewayCachePath;
+    char *teardownStatePath;
+    char *sshKeyPoolPath;
+    char *udiStatePath;
     size_t mountPropagationStyle;
 
     char *modprobePath;
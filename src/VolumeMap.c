@@ -761,6 +761,54 @@ char *getVolMapSignature(VolumeMap *volMap) {
     return ret;
 }
 
+/* _pathDepth: number of components in a path, ignoring repeated slashes */
+static size_t _pathDepth(const char *path) {
+    size_t depth = 0;
+    const char *ptr = NULL;
+    for (ptr = path; ptr && *ptr; ptr++) {
+        if (*ptr != '/' && (ptr == path || *(ptr - 1) == '/')) {
+            depth++;
+        }
+    }
+    return depth;
+}
+
+/**
+ * getVolumeMapMountOrder
+ * Get the order in which the entries of a VolumeMap must be mounted so that
+ * no mount hides another one made before it: an entry whose destination is
+ * below the destination of another entry is mounted after it.  Entries are
+ * ordered by the depth of their destination, keeping the configured order
+ * otherwise.
+ *
+ * Returns newly allocated array of volMap->n indices, NULL on error.
+ */
+size_t *getVolumeMapMountOrder(VolumeMap *volMap) {
+    size_t *order = NULL;
+    size_t *depth = NULL;
+    size_t idx = 0;
+    size_t jdx = 0;
+
+    if (volMap == NULL || volMap->n == 0) {
+        return NULL;
+    }
+    order = (size_t *) _malloc(sizeof(size_t) * volMap->n);
+    depth = (size_t *) _malloc(sizeof(size_t) * volMap->n);
+
+    /* stable insertion sort, siteFs lists are short */
+    for (idx = 0; idx < volMap->n; idx++) {
+        size_t entryDepth = _pathDepth(volMap->to[idx]);
+        for (jdx = idx; jdx > 0 && depth[jdx - 1] > entryDepth; jdx--) {
+            order[jdx] = order[jdx - 1];
+            depth[jdx] = depth[jdx - 1];
+        }
+        order[jdx] = idx;
+        depth[jdx] = entryDepth;
+    }
+    free(depth);
+    return order;
+}
+
 /**
  * free_VolumeMap
  * Release memory allocated for VolumeMap structure. Optionally
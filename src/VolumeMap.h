@@ -90,6 +90,7 @@ typedef struct {
 int parseVolumeMap(const char *input, VolumeMap *volMap);
 int parseVolumeMapSiteFs(const char *input, VolumeMap *volMap);
 char *getVolMapSignature(VolumeMap *volMap);
+size_t *getVolumeMapMountOrder(VolumeMap *volMap);
 size_t fprint_VolumeMap(FILE *fp, VolumeMap *volMap);
 void free_VolumeMap(VolumeMap *volMap, int freeStruct);
 int validateVolumeMap_userRequest(const char *from, const char *to, VolumeMapFlag *flags);
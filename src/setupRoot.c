@@ -97,6 +97,7 @@ int main(int argc, char **argv) {
     UdiRootConfig udiConfig;
     SetupRootConfig config;
     ImageData image;
+    int needSshd = 0;
 
     memset(&udiConfig, 0, sizeof(UdiRootConfig));
     memset(&config, 0, sizeof(SetupRootConfig));
@@ -151,6 +152,13 @@ int main(int argc, char **argv) {
     if (config.verbose) {
         fprint_ImageData(stdout, &image);
     }
+    needSshd = config.sshPubKey != NULL && strlen(config.sshPubKey) > 0
+            && config.user != NULL && strlen(config.user) > 0
+            && config.uid != 0;
+    if (waitForTeardown(&udiConfig, needSshd) != 0) {
+        fprintf(stderr, "FAILED to finish teardown of the previous UDI\n");
+        exit(1);
+    }
     if (image.useLoopMount) {
         if (mountImageLoop(&image, &udiConfig) != 0) {
             fprintf(stderr, "FAILED to mount image on loop device.\n");
@@ -162,9 +170,7 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (config.sshPubKey != NULL && strlen(config.sshPubKey) > 0
-            && config.user != NULL && strlen(config.user) > 0
-            && config.uid != 0) {
+    if (needSshd) {
         if (setupImageSsh(config.sshPubKey, config.user, config.uid, config.gid, &udiConfig) != 0) {
             fprintf(stderr, "FAILED to setup ssh configuration\n");
             exit(1);
@@ -90,6 +90,8 @@ int fprint_options(FILE *, struct options *);
 void free_options(struct options *, int freeStruct);
 int isImageLoaded(ImageData *, struct options *, UdiRootConfig *);
 int loadImage(ImageData *, struct options *, UdiRootConfig *);
+int updateImage(ImageData *, VolumeMap *, VolumeMap *, UdiRootConfig *);
+int enterPrivateNamespace(void);
 int adoptPATH(char **environ);
 
 #ifndef _TESTHARNESS_SHIFTER
@@ -200,10 +202,26 @@ int main(int argc, char **argv) {
     }
 
     if (isImageLoaded(imageData, opts, udiConfig) == 0) {
-        if (loadImage(imageData, opts, udiConfig) != 0) {
+        VolumeMap added;
+        VolumeMap removed;
+        memset(&added, 0, sizeof(VolumeMap));
+        memset(&removed, 0, sizeof(VolumeMap));
+
+        /* if only the user volumes differ, adjust those and keep the rest of
+         * the loaded image */
+        if (diffShifterConfig(opts->username, imageData, &(opts->volumeMap),
+                    udiConfig, &added, &removed) == 0)
+        {
+            if (updateImage(imageData, &added, &removed, udiConfig) != 0) {
+                fprintf(stderr, "FAILED to update image volumes.\n");
+                exit(1);
+            }
+        } else if (loadImage(imageData, opts, udiConfig) != 0) {
             fprintf(stderr, "FAILED to setup image.\n");
             exit(1);
         }
+        free_VolumeMap(&added, 0);
+        free_VolumeMap(&removed, 0);
     }
 
     /* switch to new / to prevent the chroot jail from being leaky */
@@ -775,31 +793,28 @@ int isImageLoaded(ImageData *image, struct options *options, UdiRootConfig *udiC
 }
 
 /**
- * Loads the needed image
+ * enterPrivateNamespace - Gain full root privileges and move into a private
+ * mount namespace in which the image can be (re)configured.
  */
-int loadImage(ImageData *image, struct options *opts, UdiRootConfig *udiConfig) {
-    int retryCnt = 0;
-    char chrootPath[PATH_MAX];
-    snprintf(chrootPath, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    chrootPath[PATH_MAX - 1] = 0;
+int enterPrivateNamespace(void) {
     gid_t gidZero = 0;
 
     /* must achieve full root privileges to perform mounts */
     if (setgroups(1, &gidZero) != 0) {
         fprintf(stderr, "Failed to setgroups to %d\n", gidZero);
-        goto _loadImage_error;
+        return 1;
     }
     if (setresgid(0, 0, 0) != 0) {
         fprintf(stderr, "Failed to setgid to %d\n", 0);
-        goto _loadImage_error;
+        return 1;
     }
     if (setresuid(0, 0, 0) != 0) {
         fprintf(stderr, "Failed to setuid to %d\n", 0);
-        goto _loadImage_error;
+        return 1;
     }
     if (unshare(CLONE_NEWNS) != 0) {
         perror("Failed to unshare the filesystem namespace.");
-        goto _loadImage_error;
+        return 1;
     }
 
     /* all of the mounts visible to us are now in our private namespace; since
@@ -812,6 +827,35 @@ int loadImage(ImageData *image, struct options *opts, UdiRootConfig *udiConfig)
      */
     if (mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL) != 0) {
         perror("Failed to remount \"/\" non-shared.");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * updateImage - Adjust the user volume mounts of the loaded image in a
+ * private namespace, keeping the rest of the prepared tree.
+ */
+int updateImage(ImageData *image, VolumeMap *added, VolumeMap *removed, UdiRootConfig *udiConfig) {
+    if (enterPrivateNamespace() != 0) {
+        return 1;
+    }
+    if (updateUserMounts(image, added, removed, udiConfig) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Loads the needed image
+ */
+int loadImage(ImageData *image, struct options *opts, UdiRootConfig *udiConfig) {
+    int retryCnt = 0;
+    char chrootPath[PATH_MAX];
+    snprintf(chrootPath, PATH_MAX, "%s", udiConfig->udiMountPoint);
+    chrootPath[PATH_MAX - 1] = 0;
+
+    if (enterPrivateNamespace() != 0) {
         goto _loadImage_error;
     }
 
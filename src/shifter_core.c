@@ -40,6 +40,9 @@
 #include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
+#include <ftw.h>
+#include <poll.h>
+#include <time.h>
 #include <linux/version.h>
 
 #include <sys/types.h>
@@ -49,6 +52,9 @@
 #include <sys/types.h>
 #include <sys/prctl.h>
 #include <sys/capability.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>
 
 #include "ImageData.h"
 #include "UdiRootConfig.h"
@@ -64,14 +70,105 @@
 #define BINDMOUNT_OVERWRITE_UNMOUNT_RETRY 3
 #endif
 
+/* launch plan file format and operation codes */
+#define LAUNCHPLAN_HEADER "SHIFTER_LAUNCHPLAN 1 "
+#define LAUNCHPLAN_END "END"
+#define LAUNCHPLAN_COPY_LINK 'l'
+#define LAUNCHPLAN_COPY_FILE 'f'
+#define LAUNCHPLAN_BIND_FILE 'b'
+#define LAUNCHPLAN_DIRECTORY 'd'
+
 #ifndef UMOUNT_NOFOLLOW
 #define UMOUNT_NOFOLLOW 0x00000008 /* do not follow symlinks when unmounting */
 #endif
 
+/* root-owned state of the UDI, kept outside of it in the udiStatePath */
+#ifndef UDI_STATE_PATH_DEFAULT
+#define UDI_STATE_PATH_DEFAULT "/var/run/shifter/state"
+#endif
+
+/* record of the sshd started in the UDI, a state file */
+#define SSHD_PATH "/opt/udiImage/sbin/sshd"
+#define SSHD_RECORD "sshd"
+#define SSHD_EXIT_TIMEOUT_MS 2000
+/* how long sshd may take after exec to listen */
+#define SSHD_START_TIMEOUT_MS 5000
+#define SSHD_START_POLL_MS 5
+/* socket state of a listening socket in /proc/<pid>/net/tcp */
+#define PROC_TCP_LISTEN 0x0A
+
+/* pool of pre-generated sshd host keys, kept in the sshKeyPoolPath */
+#define SSH_KEY_POOL_DEPTH 4
+#define SSH_KEY_SET_PREFIX "hostkeys."
+#define SSH_KEY_POOL_LOCK ".refill.lock"
+
+static const char *sshHostKeyTypes[] = {"dsa", "ecdsa", "rsa", "ed25519", NULL};
+
+/* processes used to trigger automounts of volume sources concurrently */
+#define VOLUME_WARM_WORKERS 8
+
+/* per volume record of the user volume mounts in the UDI, written along with
+ * shifterConfig.json, kept in the udiStatePath */
+#define VOLUMES_RECORD "volumes"
+#define VOLUMES_HEADER "SHIFTER_VOLUMES 1"
+
+/* deferred teardown records, kept in the teardownStatePath */
+#define TEARDOWN_HEADER "SHIFTER_TEARDOWN 1"
+#define TEARDOWN_PREFIX "teardown."
+#define TEARDOWN_RETRIES 6
+#define TEARDOWN_RETRY_MS 250
+#define TEARDOWN_WAIT_MS 30000
+
 int _shifterCore_bindMount(UdiRootConfig *confg, MountList *mounts,
         const char *from, const char *to, size_t flags, int overwrite);
 int _shifterCore_copyFile(const char *cpPath, const char *source, const char *dest, int keepLink, uid_t owner, gid_t group, mode_t mode);
 int _shifterCore_copyUdiImage(UdiRootConfig *config);
+char *_shifterCore_stageUdiContent(UdiRootConfig *udiConfig, const char *src, const char *label, int *pinFd);
+char *_shifterCore_stageSiteEtc(UdiRootConfig *udiConfig, int *pinFd);
+char *_shifterCore_launchPlanPath(UdiRootConfig *udiConfig,
+        ImageData *imageData, const char *relpath, int copyFlag);
+char *_shifterCore_launchPlanStamp(ImageData *imageData, int dirFd);
+int _shifterCore_readLaunchPlan(const char *path, const char *stamp,
+        char ***names, char **ops, size_t *count);
+int _shifterCore_procStartTime(pid_t pid, unsigned long long *startTime);
+int _shifterCore_recordSshd(pid_t pid, UdiRootConfig *udiConfig);
+int _shifterCore_readSshdRecord(UdiRootConfig *udiConfig, pid_t *pid,
+        unsigned long long *startTime);
+int _shifterCore_isUdiSshd(pid_t pid, UdiRootConfig *udiConfig);
+int _shifterCore_isListening(pid_t pid);
+int _shifterCore_waitForListen(pid_t pid, int timeoutMs);
+char *_shifterCore_udiStateFile(UdiRootConfig *udiConfig, const char *kind);
+FILE *_shifterCore_openStateFile(const char *path);
+FILE *_shifterCore_createStateFile(const char *path);
+int _shifterCore_waitForExit(pid_t pid, int pidFd, int timeoutMs);
+int _shifterCore_waitMountChange(int mountsFd, int timeoutMs);
+int _shifterCore_detachMount(const char *path);
+int _shifterCore_setBindMountAllowedDevices(ImageData *imageData,
+        UdiRootConfig *udiConfig);
+int _shifterCore_saveVolumes(const char *user, ImageData *image,
+        VolumeMap *volumeMap, UdiRootConfig *udiConfig);
+size_t _shifterCore_warmVolumeSources(UdiRootConfig *udiConfig);
+char **_shifterCore_readVolumes(const char *path, const char *base);
+char *_shifterCore_volumeDestination(const char *to, UdiRootConfig *udiConfig);
+int _shifterCore_stopProcess(pid_t pid, unsigned long long startTime);
+int _shifterCore_checkPrivateDir(const char *path, mode_t disallowed);
+int _shifterCore_generateHostKeys(const char *keygen, const char *dir,
+        uid_t owner, gid_t group, int silent);
+char *_shifterCore_claimHostKeys(const char *poolPath);
+int _shifterCore_installHostKeys(const char *keySet, const char *etcDir,
+        uid_t owner, gid_t group);
+void _shifterCore_removeKeySet(const char *keySet);
+int _shifterCore_refillKeyPool(const char *poolPath, const char *keygen);
+int _shifterCore_writeTeardown(const char *stateDir, pid_t sshdPid,
+        unsigned long long sshdStart, UdiRootConfig *udiConfig, char **path);
+int _shifterCore_reapTeardown(int fd, const char *path, int attempts);
+int _shifterCore_teardownConflicts(int fd, int needSshd,
+        UdiRootConfig *udiConfig);
+int _shifterCore_writeLaunchPlan(const char *path, const char *stamp,
+        char **names, const char *ops, size_t count);
+static int _shifterCore_validateStagingPath(const char *path);
+static int _shifterCore_lstatAt(int dirFd, const char *name, mode_t *mode,
+        off_t *size);
 
 /*! Bind subtree of static image into UDI rootfs */
 /*!
@@ -95,10 +192,18 @@ int bindImageIntoUDI(
     char *imgRoot = _malloc(sizeof(char) * PATH_MAX);
     char *mntBuffer = _malloc(sizeof(char) * PATH_MAX);
     char *srcBuffer = _malloc(sizeof(char) * PATH_MAX);
+    char *planPath = NULL;
+    char *planStamp = NULL;
+    char **names = NULL;
+    char *ops = NULL;
+    size_t count = 0;
+    size_t idx = 0;
     DIR *subtree = NULL;
     struct dirent *dirEntry = NULL;
     struct stat statData;
-    char *itemname = NULL;
+    char itemname[NAME_MAX + 1];
+    int srcFd = -1;
+    int udiFd = -1;
     int rc = 0;
 
     MountList mountCache;
@@ -150,28 +255,54 @@ int bindImageIntoUDI(
     /* start traversing through image subtree */
     snprintf(srcBuffer, PATH_MAX, "%s/%s", imgRoot, relpath);
     srcBuffer[PATH_MAX-1] = 0;
-    subtree = opendir(srcBuffer);
-    if (subtree == NULL) {
+    srcFd = open(srcBuffer, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (srcFd < 0) {
         /* desired path is not a directory we can see, skip */
         rc = 1;
         goto _bindImgUDI_unclean;
     }
+
+    /* replay the previously compiled plan for this image subtree if the
+     * source is unchanged, otherwise scan the subtree and record a new plan */
+    planPath = _shifterCore_launchPlanPath(udiConfig, imageData, relpath,
+            copyFlag);
+    if (planPath != NULL) {
+        planStamp = _shifterCore_launchPlanStamp(imageData, srcFd);
+    }
+    if (planStamp != NULL && _shifterCore_readLaunchPlan(planPath, planStamp,
+                &names, &ops, &count) == 0)
+    {
+        goto _bindImgUDI_apply;
+    }
+
+    /* entries are examined relative to the directory fd, and the d_type
+     * provided by getdents avoids a stat round-trip (an RPC on parallel
+     * filesystems) for everything but regular files, which need a size */
+    subtree = fdopendir(srcFd);
+    if (subtree == NULL) {
+        rc = 1;
+        goto _bindImgUDI_unclean;
+    }
+    srcFd = -1;
     while ((dirEntry = readdir(subtree)) != NULL) {
+        unsigned char dtype = dirEntry->d_type;
+        char op = 0;
+        mode_t mode = 0;
+        off_t size = 0;
         if (strcmp(dirEntry->d_name, ".") == 0 ||
             strcmp(dirEntry->d_name, "..") == 0)
         {
             continue;
         }
-        itemname = userInputPathFilter(dirEntry->d_name, 0);
-        if (itemname == NULL) {
+        if (userInputPathFilterBuffer(dirEntry->d_name, 0, itemname,
+                    sizeof(itemname)) == NULL)
+        {
             fprintf(stderr, "FAILED to correctly filter entry: %s\n",
                 dirEntry->d_name);
             rc = 2;
             goto _bindImgUDI_unclean;
         }
         if (strlen(itemname) == 0) {
-            free(itemname);
-            itemname = NULL;
             continue;
         }
 
@@ -179,34 +310,85 @@ int bindImageIntoUDI(
         snprintf(mntBuffer, PATH_MAX, "/%s/%s", relpath, itemname);
         mntBuffer[PATH_MAX-1] = 0;
         if (pathcmp(mntBuffer, udiConfig->udiMountPoint) == 0) {
-            free(itemname);
-            itemname = NULL;
             continue;
         }
 
+        /* d_type describes the unfiltered name only */
+        if (strcmp(itemname, dirEntry->d_name) != 0) {
+            dtype = DT_UNKNOWN;
+        }
+        if (dtype == DT_LNK) {
+            op = LAUNCHPLAN_COPY_LINK;
+        } else if (dtype == DT_DIR) {
+            op = LAUNCHPLAN_DIRECTORY;
+        } else if (dtype == DT_REG || dtype == DT_UNKNOWN) {
+            if (_shifterCore_lstatAt(dirfd(subtree), itemname, &mode, &size) != 0) {
+                /* path didn't exist, skip */
+                continue;
+            }
+            if (S_ISLNK(mode)) {
+                op = LAUNCHPLAN_COPY_LINK;
+            } else if (S_ISREG(mode)) {
+                if (size < FILE_SIZE_LIMIT) {
+                    op = LAUNCHPLAN_COPY_FILE;
+                } else {
+                    op = LAUNCHPLAN_BIND_FILE;
+                }
+            } else if (S_ISDIR(mode)) {
+                op = LAUNCHPLAN_DIRECTORY;
+            }
+        }
+        if (op == 0) {
+            /* no other types are supported */
+            continue;
+        }
+
+        names = _realloc(names, sizeof(char *) * (count + 2));
+        ops = _realloc(ops, sizeof(char) * (count + 2));
+        names[count] = _strdup(itemname);
+        ops[count] = op;
+        count++;
+        names[count] = NULL;
+        ops[count] = 0;
+    }
+    closedir(subtree);
+    subtree = NULL;
+
+    if (planStamp != NULL) {
+        if (_shifterCore_writeLaunchPlan(planPath, planStamp, names, ops,
+                    count) != 0)
+        {
+            fprintf(stderr, "WARNING: failed to record launch plan %s\n",
+                    planPath);
+        }
+    }
+
+_bindImgUDI_apply:
+    if (srcFd >= 0) {
+        close(srcFd);
+        srcFd = -1;
+    }
+    snprintf(mntBuffer, PATH_MAX, "%s/%s", udiRoot, relpath);
+    mntBuffer[PATH_MAX-1] = 0;
+    udiFd = open(mntBuffer, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (idx = 0; idx < count; idx++) {
         /* check to see if UDI version already exists */
-        snprintf(mntBuffer, PATH_MAX, "%s/%s/%s", udiRoot, relpath, itemname);
-        mntBuffer[PATH_MAX-1] = 0;
-        if (lstat(mntBuffer, &statData) == 0) {
+        if (udiFd >= 0 && _shifterCore_lstatAt(udiFd, names[idx], NULL, NULL) == 0) {
             /* exists in UDI, skip */
-            free(itemname);
-            itemname = NULL;
             continue;
         }
-
-        /* after filtering, lstat path to get details */
-        snprintf(srcBuffer, PATH_MAX, "%s/%s/%s", imgRoot, relpath, itemname);
-        srcBuffer[PATH_MAX-1] = 0;
-        if (lstat(srcBuffer, &statData) != 0) {
-            /* path didn't exist, skip */
-            free(itemname);
-            itemname = NULL;
+        snprintf(mntBuffer, PATH_MAX, "%s/%s/%s", udiRoot, relpath, names[idx]);
+        mntBuffer[PATH_MAX-1] = 0;
+        if (udiFd < 0 && lstat(mntBuffer, &statData) == 0) {
             continue;
         }
+        snprintf(srcBuffer, PATH_MAX, "%s/%s/%s", imgRoot, relpath, names[idx]);
+        srcBuffer[PATH_MAX-1] = 0;
 
-        /* if target is a symlink, copy it */
-        if (S_ISLNK(statData.st_mode)) {
-            char *args[] = { _strdup(udiConfig->cpPath), _strdup("-P"),
+        /* if target is a symlink, copy it; copy small files */
+        if (ops[idx] == LAUNCHPLAN_COPY_LINK || ops[idx] == LAUNCHPLAN_COPY_FILE) {
+            char *args[] = { _strdup(udiConfig->cpPath),
+                _strdup(ops[idx] == LAUNCHPLAN_COPY_LINK ? "-P" : "-p"),
                 _strdup(srcBuffer), _strdup(mntBuffer), NULL
             };
             char **argsPtr = NULL;
@@ -219,26 +401,10 @@ int bindImageIntoUDI(
                 rc = 2;
                 goto _bindImgUDI_unclean;
             }
-            free(itemname);
-            itemname = NULL;
             continue;
         }
-        if (S_ISREG(statData.st_mode)) {
-            if (statData.st_size < FILE_SIZE_LIMIT) {
-                char *args[] = { _strdup(udiConfig->cpPath), _strdup("-p"),
-                    _strdup(srcBuffer), _strdup(mntBuffer), NULL
-                };
-                char **argsPtr = NULL;
-                int ret = forkAndExecv(args);
-                for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
-                    free(*argsPtr);
-                }
-                if (ret != 0) {
-                    fprintf(stderr, "Failed to copy %s to %s.\n", srcBuffer, mntBuffer);
-                    rc = 2;
-                    goto _bindImgUDI_unclean;
-                }
-            } else if (copyFlag == 0) {
+        if (ops[idx] == LAUNCHPLAN_BIND_FILE) {
+            if (copyFlag == 0) {
                 /* create the file */
                 FILE *fp = fopen(mntBuffer, "w");
                 if (fp != NULL) {
@@ -246,11 +412,9 @@ int bindImageIntoUDI(
                 }
                 BINDMOUNT(&mountCache, srcBuffer, mntBuffer, 0, 0);
             }
-            free(itemname);
-            itemname = NULL;
             continue;
         }
-        if (S_ISDIR(statData.st_mode)) {
+        if (ops[idx] == LAUNCHPLAN_DIRECTORY) {
             if (copyFlag == 0) {
                 MKDIR(mntBuffer, 0755);
                 BINDMOUNT(&mountCache, srcBuffer, mntBuffer, 0, 0);
@@ -270,21 +434,21 @@ int bindImageIntoUDI(
                     goto _bindImgUDI_unclean;
                 }
             }
-            free(itemname);
-            itemname = NULL;
             continue;
         }
-        /* no other types are supported */
-        free(itemname);
-        itemname = NULL;
     }
-    closedir(subtree);
-    subtree = NULL;
 
 #undef MKDIR
 #undef BINDMOUNT
 
     free_MountList(&mountCache, 0);
+    if (udiFd >= 0) {
+        close(udiFd);
+    }
+    free_string_array(names);
+    free(ops);
+    free(planPath);
+    free(planStamp);
     free(udiRoot);
     free(imgRoot);
     free(mntBuffer);
@@ -293,14 +457,20 @@ int bindImageIntoUDI(
 
 _bindImgUDI_unclean:
     free_MountList(&mountCache, 0);
-    if (itemname != NULL) {
-        free(itemname);
-        itemname = NULL;
+    if (srcFd >= 0) {
+        close(srcFd);
+    }
+    if (udiFd >= 0) {
+        close(udiFd);
     }
     if (subtree != NULL) {
         closedir(subtree);
         subtree = NULL;
     }
+    free_string_array(names);
+    free(ops);
+    free(planPath);
+    free(planStamp);
     free(udiRoot);
     free(imgRoot);
     free(mntBuffer);
@@ -308,6 +478,251 @@ _bindImgUDI_unclean:
     return rc;
 }
 
+/*! Locate the launch plan file for an image subtree */
+/*!
+ * Launch plans are kept in udiImageStagingPath and are named after a hash of
+ * everything that determines the scan result apart from the image content
+ * itself: the image path, the subtree, the copy mode and the udiMount point.
+ *
+ * \param udiConfig UdiRootConfig configuration object
+ * \param imageData Metadata about image
+ * \param relpath subtree of the image
+ * \param copyFlag copyFlag passed to bindImageIntoUDI
+ * \return newly allocated path, or NULL if plans are not in use
+ */
+char *_shifterCore_launchPlanPath(UdiRootConfig *udiConfig,
+        ImageData *imageData, const char *relpath, int copyFlag)
+{
+    uint64_t hash = SHIFTER_FNV1A64_INIT;
+    long long sizeLimit = FILE_SIZE_LIMIT;
+    if (udiConfig == NULL || imageData == NULL || relpath == NULL ||
+            imageData->filename == NULL ||
+            udiConfig->udiImageStagingPath == NULL ||
+            strlen(udiConfig->udiImageStagingPath) == 0 ||
+            udiConfig->udiMountPoint == NULL)
+    {
+        return NULL;
+    }
+    if (_shifterCore_validateStagingPath(udiConfig->udiImageStagingPath) != 0) {
+        return NULL;
+    }
+    hash = shifter_fnv1a64(hash, imageData->filename,
+            strlen(imageData->filename) + 1);
+    hash = shifter_fnv1a64(hash, relpath, strlen(relpath) + 1);
+    hash = shifter_fnv1a64(hash, udiConfig->udiMountPoint,
+            strlen(udiConfig->udiMountPoint) + 1);
+    hash = shifter_fnv1a64(hash, &copyFlag, sizeof(int));
+    hash = shifter_fnv1a64(hash, &sizeLimit, sizeof(long long));
+    return alloc_strgenf("%s/plan-%016llx", udiConfig->udiImageStagingPath,
+            (unsigned long long) hash);
+}
+
+/*! Describe the state of the image source a launch plan was compiled from */
+/*!
+ * The stamp covers the image file (or local image directory) and the scanned
+ * subtree directory.  Adding, removing or renaming an entry updates the
+ * directory mtime/ctime, and replacing an image file changes its inode, size
+ * or mtime, so a matching stamp means the scan would produce the same plan.
+ *
+ * \param imageData Metadata about image
+ * \param dirFd open descriptor of the scanned directory
+ * \return newly allocated stamp string, NULL upon failure
+ */
+char *_shifterCore_launchPlanStamp(ImageData *imageData, int dirFd) {
+    struct stat imageStat;
+    struct stat dirStat;
+    if (imageData == NULL || imageData->filename == NULL || dirFd < 0) {
+        return NULL;
+    }
+    if (stat(imageData->filename, &imageStat) != 0 ||
+            fstat(dirFd, &dirStat) != 0)
+    {
+        return NULL;
+    }
+    /* device of a loop-mounted image changes every mount, so omit it */
+    return alloc_strgenf("%lu:%lu:%lld:%lld.%ld:%lld.%ld %lu:%lld.%ld:%lld.%ld",
+            (unsigned long) imageStat.st_dev, (unsigned long) imageStat.st_ino,
+            (long long) imageStat.st_size,
+            (long long) imageStat.st_mtim.tv_sec, imageStat.st_mtim.tv_nsec,
+            (long long) imageStat.st_ctim.tv_sec, imageStat.st_ctim.tv_nsec,
+            (unsigned long) dirStat.st_ino,
+            (long long) dirStat.st_mtim.tv_sec, dirStat.st_mtim.tv_nsec,
+            (long long) dirStat.st_ctim.tv_sec, dirStat.st_ctim.tv_nsec);
+}
+
+/*! lstat a directory entry relative to a directory fd */
+/*!
+ * Only the type and size are requested, and without forcing attribute
+ * synchronization with the server, so network filesystems can answer from
+ * cached attributes.
+ *
+ * \param dirFd open descriptor of the parent directory
+ * \param name entry name within dirFd
+ * \param mode output, file type and mode, may be NULL
+ * \param size output, file size, may be NULL
+ * \return 0 if the entry exists, nonzero otherwise
+ */
+static int _shifterCore_lstatAt(int dirFd, const char *name, mode_t *mode,
+        off_t *size)
+{
+#ifdef HAVE_STATX
+    struct statx statxData;
+    unsigned int mask = 0;
+    if (mode != NULL) mask |= STATX_TYPE | STATX_MODE;
+    if (size != NULL) mask |= STATX_SIZE;
+    if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask,
+                &statxData) != 0)
+    {
+        return 1;
+    }
+    if (mode != NULL) *mode = statxData.stx_mode;
+    if (size != NULL) *size = (off_t) statxData.stx_size;
+#else
+    struct stat statData;
+    if (fstatat(dirFd, name, &statData, AT_SYMLINK_NOFOLLOW) != 0) {
+        return 1;
+    }
+    if (mode != NULL) *mode = statData.st_mode;
+    if (size != NULL) *size = statData.st_size;
+#endif
+    return 0;
+}
+
+/*! Read a launch plan */
+/*!
+ * \param path plan file
+ * \param stamp expected stamp, from _shifterCore_launchPlanStamp()
+ * \param names output, NULL-terminated array of entry names
+ * \param ops output, operation code for each entry
+ * \param count output, number of entries
+ * \return 0 if the plan exists and matches stamp, nonzero otherwise
+ */
+int _shifterCore_readLaunchPlan(const char *path, const char *stamp,
+        char ***names, char **ops, size_t *count)
+{
+    FILE *fp = NULL;
+    char *linePtr = NULL;
+    size_t lineSize = 0;
+    ssize_t nread = 0;
+    char **planNames = NULL;
+    char *planOps = NULL;
+    size_t planCount = 0;
+    int valid = 0;
+
+    if (path == NULL || stamp == NULL || names == NULL || ops == NULL ||
+            count == NULL)
+    {
+        return 1;
+    }
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    nread = getline(&linePtr, &lineSize, fp);
+    if (nread <= 0 || strncmp(linePtr, LAUNCHPLAN_HEADER,
+                strlen(LAUNCHPLAN_HEADER)) != 0 ||
+            strcmp(shifter_trim(linePtr + strlen(LAUNCHPLAN_HEADER)), stamp) != 0)
+    {
+        goto _readPlan_unclean;
+    }
+    while ((nread = getline(&linePtr, &lineSize, fp)) > 0) {
+        char *ptr = shifter_trim(linePtr);
+        char *name = NULL;
+        if (strcmp(ptr, LAUNCHPLAN_END) == 0) {
+            valid = 1;
+            break;
+        }
+        if (strlen(ptr) < 3 || ptr[1] != ' ' ||
+                (ptr[0] != LAUNCHPLAN_COPY_LINK &&
+                 ptr[0] != LAUNCHPLAN_COPY_FILE &&
+                 ptr[0] != LAUNCHPLAN_BIND_FILE &&
+                 ptr[0] != LAUNCHPLAN_DIRECTORY))
+        {
+            goto _readPlan_unclean;
+        }
+        name = userInputPathFilter(ptr + 2, 0);
+        /* a name the filter changes is not the entry that was scanned */
+        if (name == NULL || strcmp(name, ptr + 2) != 0) {
+            free(name);
+            goto _readPlan_unclean;
+        }
+        planNames = _realloc(planNames, sizeof(char *) * (planCount + 2));
+        planOps = _realloc(planOps, sizeof(char) * (planCount + 2));
+        planNames[planCount] = name;
+        planOps[planCount] = ptr[0];
+        planCount++;
+        planNames[planCount] = NULL;
+        planOps[planCount] = 0;
+    }
+    /* a truncated plan is not trusted */
+    if (!valid) {
+        goto _readPlan_unclean;
+    }
+    fclose(fp);
+    free(linePtr);
+    *names = planNames;
+    *ops = planOps;
+    *count = planCount;
+    return 0;
+
+_readPlan_unclean:
+    fclose(fp);
+    free(linePtr);
+    free_string_array(planNames);
+    free(planOps);
+    return 1;
+}
+
+/*! Write a launch plan */
+/*!
+ * The plan is written to a temporary file and renamed into place so that
+ * concurrent setups on the node only ever see complete plans.
+ *
+ * \param path plan file
+ * \param stamp stamp of the scanned source
+ * \param names entry names
+ * \param ops operation code for each entry
+ * \param count number of entries
+ * \return 0 upon success, nonzero upon failure
+ */
+int _shifterCore_writeLaunchPlan(const char *path, const char *stamp,
+        char **names, const char *ops, size_t count)
+{
+    char *tmpPath = NULL;
+    FILE *fp = NULL;
+    size_t idx = 0;
+    int rc = 0;
+
+    if (path == NULL || stamp == NULL || (count > 0 && (names == NULL || ops == NULL))) {
+        return 1;
+    }
+    tmpPath = alloc_strgenf("%s.%d", path, (int) getpid());
+    fp = fopen(tmpPath, "w");
+    if (fp == NULL) {
+        free(tmpPath);
+        return 1;
+    }
+    fprintf(fp, "%s%s\n", LAUNCHPLAN_HEADER, stamp);
+    for (idx = 0; idx < count; idx++) {
+        fprintf(fp, "%c %s\n", ops[idx], names[idx]);
+    }
+    fprintf(fp, "%s\n", LAUNCHPLAN_END);
+    if (fclose(fp) != 0) {
+        rc = 1;
+    }
+    if (rc == 0 && chmod(tmpPath, 0644) != 0) {
+        rc = 1;
+    }
+    if (rc == 0 && rename(tmpPath, path) != 0) {
+        rc = 1;
+    }
+    if (rc != 0) {
+        unlink(tmpPath);
+    }
+    free(tmpPath);
+    return rc;
+}
+
 /*! Copy a file or link as correctly as possible */
 /*!
  * Copy file (or symlink) from source to dest.
@@ -409,2715 +824,4970 @@ _copyFile_unclean:
     return 1;
 }
 
-/*! Copy udiImage content */
+/*! Accumulate a signature of a directory tree */
 /*!
- * Recursively copy the udiImage content including active modules to
- * opt/udiImage within the container
- * \param config UdiRootConfig configuration object
+ * Walks the tree rooted at base/relpath and adds a hash of each entry's
+ * relative path, type, mode, ownership, size, mtime and (for symlinks) link
+ * target to signature.  Per-entry hashes are summed so the result does not
+ * depend on readdir() ordering.
+ * \param base root of the tree
+ * \param relpath subtree to consider, "" for the root itself
+ * \param signature pointer to running signature
  * \return 0 for success, nonzero for any error
  */
-int _shifterCore_copyUdiImage(UdiRootConfig *udiConfig) {
+static int _shifterCore_hashTree(const char *base, const char *relpath,
+        uint64_t *signature)
+{
+    char *path = NULL;
+    DIR *dir = NULL;
+    struct dirent *entry = NULL;
     int rc = 0;
-    char **srcPaths = NULL;
-    char **destPaths = NULL;
-    char **pptr = NULL;
-    size_t n_src = 0;
-    size_t n_dest = 0;
-    int idx = 0;
 
-    if (udiConfig->optUdiImage != NULL) {
-        char *src = alloc_strgenf("%s/", udiConfig->optUdiImage);
-        char *dest = alloc_strgenf("%s/opt/udiImage/", udiConfig->udiMountPoint);
-        srcPaths = _malloc(sizeof(char *) * 2);
-        destPaths = _malloc(sizeof(char *) * 2);
-        srcPaths[0] = src;
-        srcPaths[1] = NULL;
-        destPaths[0] = dest;
-        destPaths[1] = NULL;
-        n_src = 1;
-        n_dest = 1;
+    path = alloc_strgenf("%s/%s", base, relpath);
+    if (path == NULL || strlen(path) >= PATH_MAX) {
+        rc = 1;
+        goto _hashTree_exit;
     }
-    for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
-        char *src = NULL;
-        char *dest = NULL;
-        if (udiConfig->active_modules[idx]->copyPath == NULL)
-            continue;
-        src = alloc_strgenf("%s/", udiConfig->active_modules[idx]->copyPath);
-        dest = alloc_strgenf("%s/opt/udiImage/modules/%s/", udiConfig->udiMountPoint, udiConfig->active_modules[idx]->name);
-        srcPaths = _realloc(srcPaths, sizeof(char *) * (n_src + 2));
-        destPaths = _realloc(destPaths, sizeof(char *) * (n_dest + 2));
-
-        srcPaths[n_src++] = src;
-        srcPaths[n_src] = NULL;
-        destPaths[n_dest++] = dest;
-        destPaths[n_dest] = NULL;
+    dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "FAILED to opendir %s: %s\n", path, strerror(errno));
+        rc = 1;
+        goto _hashTree_exit;
     }
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat statData;
+        char *entryRel = NULL;
+        char *entryPath = NULL;
+        char linkTarget[PATH_MAX];
+        uint64_t hash = SHIFTER_FNV1A64_INIT;
+        uint64_t fields[7];
 
-    for (idx = 0; idx < n_src; idx++) {
-        char *src = srcPaths[idx];
-        char *dest = destPaths[idx];
-        size_t srclen = strlen(src);
-        size_t destlen = strlen(dest);
-        DIR *srcDir = NULL;
-        struct dirent *entry = NULL;
-
-        if (srclen == 0 || srclen > PATH_MAX || destlen == 0 || destlen > PATH_MAX) {
-            fprintf(stderr, "FAILED: copy path has invalid length!\n");
-            goto _fail;
-        }
-        errno = 0;
-        if (mkdir(dest, 0755) != 0) {
-            if (errno != EEXIST) {
-                fprintf(stderr, "FAILED to mkdir %s: %s. Exiting.\n", dest, strerror(errno));
-                goto _fail;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        entryRel = alloc_strgenf("%s/%s", relpath, entry->d_name);
+        entryPath = alloc_strgenf("%s/%s", base, entryRel);
+        if (lstat(entryPath, &statData) != 0) {
+            fprintf(stderr, "FAILED to stat %s\n", entryPath);
+            free(entryRel);
+            free(entryPath);
+            rc = 1;
+            goto _hashTree_exit;
+        }
+        fields[0] = statData.st_mode;
+        fields[1] = statData.st_uid;
+        fields[2] = statData.st_gid;
+        fields[3] = statData.st_size;
+        fields[4] = statData.st_mtim.tv_sec;
+        fields[5] = statData.st_mtim.tv_nsec;
+        fields[6] = statData.st_ino;
+        hash = shifter_fnv1a64(hash, entryRel, strlen(entryRel));
+        hash = shifter_fnv1a64(hash, fields, sizeof(fields));
+        if (S_ISLNK(statData.st_mode)) {
+            ssize_t len = readlink(entryPath, linkTarget, PATH_MAX);
+            if (len > 0) {
+                hash = shifter_fnv1a64(hash, linkTarget, len);
             }
         }
+        *signature += hash;
 
-        srcDir = opendir(src);
-        if (srcDir == NULL) {
-            fprintf(stderr, "FAILED to opendir %s: %s. Exiting.\n", src, strerror(errno));
-            goto _fail;
+        if (S_ISDIR(statData.st_mode)) {
+            rc = _shifterCore_hashTree(base, entryRel, signature);
         }
-        while ((entry = readdir(srcDir)) != NULL) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
-            char *src_path = alloc_strgenf("%s/%s", src, entry->d_name);
-            char *args[] = {_strdup(udiConfig->cpPath), _strdup("-rp"),
-                            _strdup(src_path), _strdup(dest), NULL};
-            rc = forkAndExecv(args);
-            for (pptr = args; pptr && *pptr; pptr++)
-                free(*pptr);
-            if (rc != 0) {
-                fprintf(stderr, "FAILED to copy %s to %s.\n", src_path, dest);
-                free(src_path);
-                src_path = NULL;
-                closedir(srcDir);
-                goto _fail;
-            }
-            free(src_path);
-            src_path = NULL;
+        free(entryRel);
+        free(entryPath);
+        if (rc != 0) {
+            goto _hashTree_exit;
         }
-        closedir(srcDir);
     }
 
-    char *udiimage_path = alloc_strgenf("%s/opt/udiImage", udiConfig->udiMountPoint);
-    char *chmodArgs[] = {_strdup(udiConfig->chmodPath), _strdup("-R"),
-        _strdup("a+rX"), _strdup(udiimage_path), NULL
-    };
-    rc = forkAndExecv(chmodArgs);
-    for (pptr = chmodArgs; pptr && *pptr; pptr++)
-        free(*pptr);
-    if (rc != 0) {
-        fprintf(stderr, "FAILED to fix permissions on %s.\n", udiimage_path);
-        free(udiimage_path);
-        udiimage_path = NULL;
-        goto _fail;
+_hashTree_exit:
+    if (dir != NULL) {
+        closedir(dir);
     }
-    free(udiimage_path);
-    udiimage_path = NULL;
-
-    for (pptr = srcPaths; pptr && *pptr; pptr++)
-        free(*pptr);
-    for (pptr = destPaths; pptr && *pptr; pptr++)
-        free(*pptr);
-    if (srcPaths)
-        free(srcPaths);
-    if (destPaths)
-        free(destPaths);
-    return 0;
+    if (path != NULL) {
+        free(path);
+    }
+    return rc;
+}
 
-_fail:
-    for (pptr = srcPaths; pptr && *pptr; pptr++)
-        free(*pptr);
-    for (pptr = destPaths; pptr && *pptr; pptr++)
-        free(*pptr);
-    if (srcPaths)
-        free(srcPaths);
-    if (destPaths)
-        free(destPaths);
-    return 1;
+/*! Accumulate the contents of a file into a hash */
+static int _shifterCore_hashFile(const char *path, uint64_t *hash) {
+    char buffer[8192];
+    size_t nread = 0;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    while ((nread = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        *hash = shifter_fnv1a64(*hash, buffer, nread);
+    }
+    if (ferror(fp)) {
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    return 0;
 }
 
-/*! Import a user into the container passwd/group files */
-/*!
-  \param passwd_fp open file pointer to container /etc/passwd file
-  \param group_fp open file pointer to container /etc/group file
-  \param uid user id to consider (-1 to ignore)
-  \param uname username to consider (NULL to ignore)
-  \param config configuration state structure
-  \return 0 for success, non-zero for error
-*/
-int _import_user(FILE *passwd_fp, FILE *group_fp, uid_t uid, char *uname, UdiRootConfig *config) {
-    struct passwd *pwd = NULL;
-    struct group *grp = NULL;
-    int idx = 0;
-    int nGroups = 0;
-    gid_t *gidList = NULL;
+static int _shifterCore_removeTreeEntry(const char *path,
+        const struct stat *statData, int type, struct FTW *ftwbuf)
+{
+    return remove(path);
+}
 
-    if (uid > 0)
-        pwd = shifter_getpwuid(uid, config);
-    if (uname)
-        pwd = shifter_getpwnam(uname, config);
-    if (!pwd)
-        return 1;
+/*! Recursively remove a directory tree without crossing mounts */
+static int _shifterCore_removeTree(const char *path) {
+    return nftw(path, _shifterCore_removeTreeEntry, 64,
+            FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+}
 
-    fprintf(passwd_fp, "%s:x:%d:%d:%s:%s:%s\n", pwd->pw_name, pwd->pw_uid,
-            pwd->pw_gid, pwd->pw_gecos, pwd->pw_dir, pwd->pw_shell);
+/*! Ensure staging area exists and is only writable by root */
+static int _shifterCore_validateStagingPath(const char *path) {
+    struct stat statData;
 
-    /* get group data */
-    gidList = shifter_getgrouplist(pwd->pw_name, pwd->pw_gid, &nGroups);
-    for (idx = 0; idx < nGroups; idx++) {
-        grp = getgrgid(gidList[idx]);
-        if (!grp)
-            continue;
-        fprintf(group_fp, "%s:x:%d:\n", grp->gr_name, grp->gr_gid);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "FAILED to mkdir %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (lstat(path, &statData) != 0 || !S_ISDIR(statData.st_mode)) {
+        fprintf(stderr, "Staging path %s is not a directory\n", path);
+        return 1;
+    }
+#ifndef NO_ROOT_OWN_CHECK
+    if (statData.st_uid != 0) {
+        fprintf(stderr, "Staging path %s must be owned by root\n", path);
+        return 1;
+    }
+#endif
+    if (statData.st_mode & (S_IWGRP | S_IWOTH)) {
+        fprintf(stderr, "Staging path %s must not be writable by non-root "
+                "users\n", path);
+        return 1;
     }
     return 0;
 }
 
-/*! Setup all required files/paths for site mods to the image */
+/*! Pin a staged tree while it is in use */
 /*!
-  Setup all required files/paths for site mods to the image.  This should be
-  called before performing any bindmounts or other discovery of the user image.
-  Any paths created here should then be ignored by all other setup function-
-  ality; i.e., no bind-mounts over these locations/paths.
-
-  The site-configured bind-mounts will also be performed here.
-
-  \param username username for group-file filtering
-  \param minNodeSpec nodelist specification
-  \param udiConfig global configuration for udiRoot
-  \return 0 for succss, 1 otherwise
-*/
-int prepareSiteModifications(const char *username,
-                             const char *minNodeSpec,
-                             UdiRootConfig *udiConfig)
-{
-    /* construct path to "live" copy of the image. */
-    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
-    char *mntBuffer = _malloc(sizeof(char) * PATH_MAX);
-    char *srcBuffer = _malloc(sizeof(char) * PATH_MAX);
-    char *source = _malloc(sizeof(char) * PATH_MAX);
-    char *dest = _malloc(sizeof(char) * PATH_MAX);
-    char *path = _malloc(sizeof(char) * PATH_MAX);
-    const char **fnamePtr = NULL;
-    int ret = 0;
-    int idx = 0;
+ * Takes a shared lock on the staged directory; _shifterCore_pruneStaged never
+ * removes a tree while any such lock is held.  The lock is released by
+ * closing the returned descriptor.
+ *
+ * \param path staged tree
+ * \return locked descriptor, -1 if the tree is gone or cannot be locked
+ */
+static int _shifterCore_pinStaged(const char *path) {
     struct stat statData;
-    dev_t udiMountDev = 0;
-    MountList mountCache;
-
-    const char *mandatorySiteEtcFiles[4] = {
-        "passwd", "group", "nsswitch.conf", NULL
-    };
-    const char *copyLocalEtcFiles[3] = {
-        "hosts", "resolv.conf", NULL
-    };
-
-    memset(&mountCache, 0, sizeof(MountList));
-    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    udiRoot[PATH_MAX-1] = 0;
-
-    /* get udiMount device id */
-    if (stat(udiRoot, &statData) != 0) {
-        fprintf(stderr, "FAILED to stat udiRoot %s.\n", udiRoot);
-        ret = 1;
-        goto _prepSiteMod_unclean;
-    }
-    udiMountDev = statData.st_dev;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
 
-    /* ensure any upcoming relative path operations are done with correct
-       working directory */
-    if (chdir(udiRoot) != 0) {
-        fprintf(stderr, "FAILED to chdir to %s. Exiting.\n", udiRoot);
-        ret = 1;
-        goto _prepSiteMod_unclean;
+    if (fd < 0) {
+        return -1;
     }
-
-    /* get list of current mounts for this namespace */
-    if (parse_MountList(&mountCache) != 0) {
-        fprintf(stderr, "FAILED to get list of current mount points\n");
-        ret = 1;
-        goto _prepSiteMod_unclean;
+    /* the tree may have been pruned between open and flock */
+    if (flock(fd, LOCK_SH) != 0 || fstat(fd, &statData) != 0 ||
+            statData.st_nlink == 0)
+    {
+        close(fd);
+        return -1;
     }
-
-    /* create all the directories needed for initial setup */
-#define _MKDIR(dir, perm) if (mkdir(dir, perm) != 0) { \
-    fprintf(stderr, "FAILED to mkdir %s. Exiting.\n", dir); \
-    perror("   --- REASON: "); \
-    ret = 1; \
-    goto _prepSiteMod_unclean; \
-}
-#define _BINDMOUNT(mountCache, from, to, flags, overwrite) if (_shifterCore_bindMount(udiConfig, mountCache, from, to, flags, overwrite) != 0) { \
-    fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n", from, to); \
-    perror("   --- REASON: "); \
-    ret = 1; \
-    goto _prepSiteMod_unclean; \
+    return fd;
 }
 
-    _MKDIR("etc", 0755);
-    _MKDIR("etc/udiImage", 0755);
-    _MKDIR("opt", 0755);
-    _MKDIR("opt/udiImage", 0755);
-    _MKDIR("opt/udiImage/modules", 0755);
-    _MKDIR("var", 0755);
-    _MKDIR("var/spool", 0755);
-    _MKDIR("var/run", 0755);
-    _MKDIR("var/tmp", 0755);
-    _MKDIR("var/empty", 0700);
-    _MKDIR("proc", 0755);
-    _MKDIR("sys", 0755);
-    _MKDIR("dev", 0755);
-    _MKDIR("tmp", 0777);
+/*! Check if a staged tree, or anything in it, is bind mounted */
+/*!
+ * Looks for mounts in /proc/self/mountinfo of the filesystem holding path
+ * whose root is path or below it.
+ *
+ * \param path staged tree
+ * \return 1 if mounted (or if this cannot be determined), 0 otherwise
+ */
+static int _shifterCore_stagedMounted(const char *path) {
+    struct stat statData;
+    char *real = NULL;
+    char *rel = NULL;
+    char *line = NULL;
+    size_t line_sz = 0;
+    size_t best = 0;
+    size_t rel_len = 0;
+    char root[PATH_MAX];
+    char mnt[PATH_MAX];
+    unsigned int devMajor = 0;
+    unsigned int devMinor = 0;
+    FILE *fp = NULL;
+    int pass = 0;
+    int mounted = 1;
 
-    /* run site-defined pre-mount procedure */
-    if (udiConfig->sitePreMountHook && strlen(udiConfig->sitePreMountHook) > 0) {
-        char *args[] = {
-            _strdup("/bin/sh"), _strdup(udiConfig->sitePreMountHook), NULL
-        };
-        char **argsPtr = NULL;
-        ret = forkAndExecv(args);
-        for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
-            free(*argsPtr);
+    real = realpath(path, NULL);
+    if (real == NULL || stat(real, &statData) != 0) {
+        goto _stagedMounted_out;
+    }
+    for (pass = 0; pass < 2; pass++) {
+        fp = fopen("/proc/self/mountinfo", "r");
+        if (fp == NULL) {
+            goto _stagedMounted_out;
+        }
+        while (getline(&line, &line_sz, fp) > 0) {
+            size_t len = 0;
+            if (sscanf(line, "%*d %*d %u:%u %4095s %4095s", &devMajor,
+                        &devMinor, root, mnt) != 4 ||
+                    devMajor != major(statData.st_dev) ||
+                    devMinor != minor(statData.st_dev))
+            {
+                continue;
+            }
+            len = strlen(mnt);
+            if (pass == 0) {
+                /* find path relative to the root of its filesystem */
+                if (strcmp(mnt, "/") == 0) {
+                    len = 0;
+                } else if (strncmp(real, mnt, len) != 0 ||
+                        (real[len] != '/' && real[len] != 0))
+                {
+                    continue;
+                }
+                if (rel == NULL || len > best) {
+                    free(rel);
+                    rel = alloc_strgenf("%s%s",
+                            strcmp(root, "/") == 0 ? "" : root, real + len);
+                    best = len;
+                }
+            } else if (strncmp(root, rel, rel_len) == 0 &&
+                    (root[rel_len] == '/' || root[rel_len] == 0))
+            {
+                fclose(fp);
+                fp = NULL;
+                goto _stagedMounted_out;
+            }
         }
-        if (ret != 0) {
-            fprintf(stderr, "Site premount hook failed. Exiting.\n");
-            ret = 1;
-            goto _prepSiteMod_unclean;
+        fclose(fp);
+        fp = NULL;
+        if (rel == NULL) {
+            goto _stagedMounted_out;
         }
+        rel_len = strlen(rel);
     }
+    mounted = 0;
+_stagedMounted_out:
+    free(line);
+    free(real);
+    free(rel);
+    return mounted;
+}
 
-    /* do site-defined mount activities */
-    if (setupVolumeMapMounts(&mountCache, udiConfig->siteFs, 0, udiMountDev, udiConfig) != 0) {
-        fprintf(stderr, "FAILED to mount siteFs volumes\n");
-        goto _prepSiteMod_unclean;
-    }
-
-    /* run site-defined post-mount procedure */
-    if (udiConfig->sitePostMountHook && strlen(udiConfig->sitePostMountHook) > 0) {
-        char *args[] = {
-            _strdup("/bin/sh"), _strdup(udiConfig->sitePostMountHook), NULL
-        };
-        char **argsPtr = NULL;
-        ret = forkAndExecv(args);
-        for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
-            free(*argsPtr);
+/*! Remove staged trees superseded by keep */
+/*!
+ * Removes the <prefix><signature> trees in stagingPath other than keep.  Trees
+ * pinned by a setup (see _shifterCore_pinStaged) or bind mounted into a
+ * container are in use, and are left for a later prune.
+ *
+ * \param stagingPath udiImageStagingPath
+ * \param prefix name of the trees up to the signature
+ * \param keep tree just staged
+ */
+static void _shifterCore_pruneStaged(const char *stagingPath,
+        const char *prefix, const char *keep)
+{
+    DIR *dir = NULL;
+    struct dirent *entry = NULL;
+    const char *keepName = strrchr(keep, '/');
+    size_t prefix_len = strlen(prefix);
+
+    keepName = keepName != NULL ? keepName + 1 : keep;
+    dir = opendir(stagingPath);
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        const char *sig = entry->d_name + prefix_len;
+        char *path = NULL;
+        int fd = -1;
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0 ||
+                strlen(sig) != 16 || strspn(sig, "0123456789abcdef") != 16 ||
+                strcmp(entry->d_name, keepName) == 0)
+        {
+            continue;
         }
-        if (ret != 0) {
-            fprintf(stderr, "Site postmount hook failed. Exiting.\n");
-            ret = 1;
-            goto _prepSiteMod_unclean;
+        path = alloc_strgenf("%s/%s", stagingPath, entry->d_name);
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+                !_shifterCore_stagedMounted(path))
+        {
+            _shifterCore_removeTree(path);
         }
-    }
-
-    /* do active modules site-defined mount activities */
-    for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
-        if (udiConfig->active_modules[idx]->siteFs) {
-            if (setupVolumeMapMounts(&mountCache, udiConfig->active_modules[idx]->siteFs, 0, udiMountDev, udiConfig) != 0) {
-                fprintf(stderr, "FAILED to mount siteFs volumes for active modules.\n");
-                goto _prepSiteMod_unclean;
-            }
+        if (fd >= 0) {
+            close(fd);
         }
+        free(path);
     }
+    closedir(dir);
+}
 
-    /* add symlink for /proc/mounts at /etc/mtab */
-    snprintf(srcBuffer, PATH_MAX, "%s/etc/mtab", udiRoot);
-    if (symlink("/proc/mounts", srcBuffer) != 0) {
-        fprintf(stderr, "FAILED to create /etc/mtab link\n");
-        goto _prepSiteMod_unclean;
+/*! Stage a permission-fixed copy of udiImage content on the node */
+/*!
+ * Maintains <udiImageStagingPath>/<label>-<signature>, a copy of src with
+ * permissions already opened up (a+rX), so that it can be read-only bind
+ * mounted into containers instead of being copied on every setup.  The
+ * signature is computed over the src tree metadata, so any change to src
+ * results in a freshly staged copy.  The copy is made in a temporary
+ * directory and renamed into place, and src is re-examined afterwards to
+ * ensure it did not change during the copy.  Once a new copy is published,
+ * the copies of label it supersedes are pruned unless they are still in use.
+ *
+ * \param udiConfig UdiRootConfig configuration object
+ * \param src directory to stage
+ * \param label name to identify the staged copy
+ * \param pinFd set to a descriptor pinning the staged copy (see
+ *        _shifterCore_pinStaged), to be closed once it is bind mounted
+ * \return newly allocated path of the staged copy, NULL upon failure
+ */
+char *_shifterCore_stageUdiContent(UdiRootConfig *udiConfig, const char *src,
+        const char *label, int *pinFd)
+{
+    char *name = NULL;
+    char *prefix = NULL;
+    char *staged = NULL;
+    char *tmpPath = NULL;
+    char *srcContent = NULL;
+    char **pptr = NULL;
+    uint64_t signature = 0;
+    uint64_t verify = 0;
+    struct stat statData;
+    int rc = 0;
+
+    if (pinFd == NULL) {
+        return NULL;
+    }
+    *pinFd = -1;
+    if (udiConfig == NULL || udiConfig->udiImageStagingPath == NULL ||
+            src == NULL || label == NULL)
+    {
+        return NULL;
+    }
+    if (_shifterCore_validateStagingPath(udiConfig->udiImageStagingPath) != 0) {
+        return NULL;
+    }
+    name = userInputPathFilter(label, 0);
+    if (name == NULL || strlen(name) == 0) {
+        goto _stage_unclean;
+    }
+    if (_shifterCore_hashTree(src, "", &signature) != 0) {
+        fprintf(stderr, "FAILED to compute signature of %s\n", src);
+        goto _stage_unclean;
     }
 
-    /* copy needed local files */
-    for (fnamePtr = copyLocalEtcFiles; *fnamePtr != NULL; fnamePtr++) {
-        snprintf(source, PATH_MAX, "/etc/%s", *fnamePtr);
-        snprintf(dest, PATH_MAX, "%s/etc/%s", udiRoot, *fnamePtr);
-        source[PATH_MAX - 1] = 0;
-        dest[PATH_MAX - 1] = 0;
-        if (_shifterCore_copyFile(udiConfig->cpPath, source, dest, 1, 0, 0, 0644) != 0) {
-            fprintf(stderr, "Failed to copy %s to %s\n", source, dest);
-            goto _prepSiteMod_unclean;
+    staged = alloc_strgenf("%s/%s-%016llx", udiConfig->udiImageStagingPath,
+            name, (unsigned long long) signature);
+    if (lstat(staged, &statData) == 0 && S_ISDIR(statData.st_mode)) {
+        /* already staged by a previous setup on this node */
+        *pinFd = _shifterCore_pinStaged(staged);
+        if (*pinFd >= 0) {
+            free(name);
+            return staged;
         }
+        /* pruned in the meantime, stage it again */
     }
 
-    /* validate that the mandatorySiteEtcFiles do not exist yet */
-    for (fnamePtr = mandatorySiteEtcFiles; *fnamePtr != NULL; fnamePtr++) {
-        snprintf(path, PATH_MAX, "%s/etc/%s", udiRoot, *fnamePtr);
-        if (stat(path, &statData) == 0) {
-            fprintf(stderr, "%s already exists! ALERT!\n", path);
-            goto _prepSiteMod_unclean;
-        }
+    tmpPath = alloc_strgenf("%s/.%s-%016llx.%d",
+            udiConfig->udiImageStagingPath, name,
+            (unsigned long long) signature, (int) getpid());
+    if (mkdir(tmpPath, 0755) != 0) {
+        fprintf(stderr, "FAILED to mkdir %s: %s\n", tmpPath, strerror(errno));
+        free(tmpPath);
+        tmpPath = NULL;
+        goto _stage_unclean;
     }
 
-    if (udiConfig->populateEtcDynamically == 0) {
-        /* --> loop over everything in site etc-files and copy into image etc */
-        if (udiConfig->etcPath == NULL || strlen(udiConfig->etcPath) == 0) {
-            fprintf(stderr, "UDI etcPath source directory not defined.\n");
-            goto _prepSiteMod_unclean;
-        }
-        snprintf(srcBuffer, PATH_MAX, "%s", udiConfig->etcPath);
-        srcBuffer[PATH_MAX-1] = 0;
-        memset(&statData, 0, sizeof(struct stat));
-        if (stat(srcBuffer, &statData) == 0) {
-            DIR *etcDir = opendir(srcBuffer);
-            struct dirent *entry = NULL;
-            while ((entry = readdir(etcDir)) != NULL) {
-                char *filename = NULL;
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                    continue;
-                }
-                filename = userInputPathFilter(entry->d_name, 0);
-                if (filename == NULL) {
-                    fprintf(stderr, "FAILED to allocate filename string.\n");
-                    goto _fail_copy_etcPath;
-                }
-                snprintf(srcBuffer, PATH_MAX, "%s/%s", udiConfig->etcPath, filename);
-                srcBuffer[PATH_MAX-1] = 0;
-                snprintf(mntBuffer, PATH_MAX, "%s/etc/%s", udiRoot, filename);
-                mntBuffer[PATH_MAX-1] = 0;
-                free(filename);
-                filename = NULL;
-
-                if (lstat(srcBuffer, &statData) != 0) {
-                    fprintf(stderr, "Couldn't find source file, check if there are illegal characters: %s\n", srcBuffer);
-                    goto _fail_copy_etcPath;
-                }
+    srcContent = alloc_strgenf("%s/.", src);
+    {
+        char *args[] = {_strdup(udiConfig->cpPath), _strdup("-rp"),
+                        _strdup(srcContent), _strdup(tmpPath), NULL};
+        rc = forkAndExecv(args);
+        for (pptr = args; pptr && *pptr; pptr++)
+            free(*pptr);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "FAILED to stage %s into %s\n", src, tmpPath);
+        goto _stage_unclean;
+    }
+    {
+        char *args[] = {_strdup(udiConfig->chmodPath), _strdup("-R"),
+                        _strdup("a+rX"), _strdup(tmpPath), NULL};
+        rc = forkAndExecv(args);
+        for (pptr = args; pptr && *pptr; pptr++)
+            free(*pptr);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "FAILED to fix permissions on %s\n", tmpPath);
+        goto _stage_unclean;
+    }
 
-                if (lstat(mntBuffer, &statData) == 0) {
-                    fprintf(stderr, "Couldn't copy %s because file already exists.\n", mntBuffer);
-                    goto _fail_copy_etcPath;
-                } else {
-                    ret = _shifterCore_copyFile(udiConfig->cpPath, srcBuffer, mntBuffer, 0, 0, 0, 0644);
-                    if (ret != 0) {
-                        fprintf(stderr, "Failed to copy %s to %s.\n", srcBuffer, mntBuffer);
-                        goto _fail_copy_etcPath;
-                    }
-                }
-                continue;
-_fail_copy_etcPath:
-                if (filename != NULL) {
-                    free(filename);
-                    filename = NULL;
-                }
-                if (etcDir != NULL) {
-                    closedir(etcDir);
-                    etcDir = NULL;
-                }
-                goto _prepSiteMod_unclean;
-            }
-            closedir(etcDir);
-        } else {
-            fprintf(stderr, "Couldn't stat udiRoot etc dir: %s\n", srcBuffer);
-            goto _prepSiteMod_unclean;
-        }
-    } else if (udiConfig->target_uid != 0 && udiConfig->target_gid != 0) {
-        /* udiConfig->populateEtcDynamically == 1 */
-        FILE *passwd_fp = NULL;
-        FILE *group_fp = NULL;
-        FILE *fp = NULL;
-        int idx = 0;
+    /* refuse to publish a copy of a tree that changed while copying */
+    if (_shifterCore_hashTree(src, "", &verify) != 0 || verify != signature) {
+        fprintf(stderr, "%s changed while being staged\n", src);
+        goto _stage_unclean;
+    }
 
-        /* prepare container etc/passwd */
-        snprintf(srcBuffer, PATH_MAX, "%s/etc/passwd", udiRoot);
-        passwd_fp = fopen(srcBuffer, "w");
-        if (passwd_fp == NULL) {
-            fprintf(stderr, "Couldn't open passwd file for writing\n");
-            goto _prepSiteMod_unclean;
+    if (rename(tmpPath, staged) != 0) {
+        if (errno != EEXIST && errno != ENOTEMPTY) {
+            fprintf(stderr, "FAILED to rename %s to %s: %s\n", tmpPath, staged,
+                    strerror(errno));
+            goto _stage_unclean;
         }
+        /* another setup on this node staged the same content first */
+        _shifterCore_removeTree(tmpPath);
+    }
+    *pinFd = _shifterCore_pinStaged(staged);
+    if (*pinFd < 0) {
+        fprintf(stderr, "FAILED to pin %s\n", staged);
+        free(tmpPath);
+        tmpPath = NULL;
+        goto _stage_unclean;
+    }
+    prefix = alloc_strgenf("%s-", name);
+    _shifterCore_pruneStaged(udiConfig->udiImageStagingPath, prefix, staged);
 
-        /* prepare container etc/group */
-        snprintf(srcBuffer, PATH_MAX, "%s/etc/group", udiRoot);
-        group_fp = fopen(srcBuffer, "w");
-        if (group_fp == NULL) {
-            fprintf(stderr, "Couldn't open group file for writing\n");
-            goto _prepSiteMod_unclean;
-        }
+    free(prefix);
+    free(tmpPath);
+    free(srcContent);
+    free(name);
+    return staged;
 
-        if (_import_user(passwd_fp, group_fp, udiConfig->target_uid, NULL, udiConfig) != 0) {
-             fprintf(stderr, "FAILED to import user.  Exiting\n");
-             goto _prepSiteMod_unclean;
-        }
+_stage_unclean:
+    if (tmpPath != NULL) {
+        _shifterCore_removeTree(tmpPath);
+        free(tmpPath);
+    }
+    if (srcContent != NULL) {
+        free(srcContent);
+    }
+    if (staged != NULL) {
+        free(staged);
+    }
+    if (name != NULL) {
+        free(name);
+    }
+    return NULL;
+}
 
-        for (idx = 0; idx < udiConfig->usersToImport_size; idx++) {
-            if (_import_user(passwd_fp, group_fp, -1, udiConfig->usersToImport[idx], udiConfig) != 0) {
-                fprintf(stderr, "FAILED to import user %s. Exiting\n", udiConfig->usersToImport[idx]);
-                goto _prepSiteMod_unclean;
+/*! Signature of the site etc inputs of _shifterCore_stageSiteEtc */
+/*!
+ * Hashes the populateEtcDynamically setting and the names and contents of
+ * srcFiles.  The first nLocal files are copied keeping symlinks, so their
+ * link targets are hashed as well.
+ *
+ * \return 0 upon success, 1 if a file could not be read
+ */
+static int _shifterCore_siteEtcSignature(UdiRootConfig *udiConfig,
+        char **srcFiles, char **names, size_t nLocal, uint64_t *signature)
+{
+    size_t idx = 0;
+    uint64_t sum = shifter_fnv1a64(SHIFTER_FNV1A64_INIT,
+            &(udiConfig->populateEtcDynamically),
+            sizeof(udiConfig->populateEtcDynamically));
+
+    for (idx = 0; srcFiles[idx] != NULL; idx++) {
+        uint64_t hash = shifter_fnv1a64(SHIFTER_FNV1A64_INIT, names[idx],
+                strlen(names[idx]));
+        if (idx < nLocal) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(srcFiles[idx], target, sizeof(target));
+            if (len > 0) {
+                hash = shifter_fnv1a64(hash, target, (size_t) len);
             }
         }
+        if (_shifterCore_hashFile(srcFiles[idx], &hash) != 0) {
+            fprintf(stderr, "FAILED to read %s\n", srcFiles[idx]);
+            return 1;
+        }
+        sum += hash;
+    }
+    *signature = sum;
+    return 0;
+}
 
-        fclose(passwd_fp);
-        fclose(group_fp);
+/*! Stage the site-provided /etc payload on the node */
+/*!
+ * Builds <udiImageStagingPath>/etc-<signature> containing the local hosts and
+ * resolv.conf files, the contents of etcPath (unless etc is populated
+ * dynamically) and an empty shadow file, all root-owned and mode 0644.  The
+ * signature is a hash of the contents of every source file, so the payload is
+ * only rebuilt when site inputs change; container setup then needs a single
+ * copy of the staged tree instead of one copy per file.  Publishing a new
+ * payload prunes the superseded ones not in use.
+ *
+ * \param udiConfig UdiRootConfig configuration object
+ * \param pinFd output, pins the staged tree until closed by the caller
+ * \return newly allocated path of the staged tree, NULL upon failure
+ */
+char *_shifterCore_stageSiteEtc(UdiRootConfig *udiConfig, int *pinFd) {
+    const char *copyLocalEtcFiles[3] = {
+        "hosts", "resolv.conf", NULL
+    };
+    const char **fnamePtr = NULL;
+    char **srcFiles = NULL;
+    char **names = NULL;
+    char *staged = NULL;
+    char *tmpPath = NULL;
+    char *dest = NULL;
+    size_t n_files = 0;
+    size_t n_local = 0;
+    size_t idx = 0;
+    uint64_t signature = 0;
+    uint64_t verify = 0;
+    struct stat statData;
+    FILE *fp = NULL;
 
-        /* write out container etc/nsswitch.conf */
-        snprintf(srcBuffer, PATH_MAX, "%s/etc/nsswitch.conf", udiRoot);
-        fp = fopen(srcBuffer, "w");
-        if (fp == NULL) {
-            fprintf(stderr, "Couldn't open nsswitch.conf for writing\n");
-            goto _prepSiteMod_unclean;
+    if (udiConfig == NULL || udiConfig->udiImageStagingPath == NULL ||
+            pinFd == NULL)
+    {
+        return NULL;
+    }
+    *pinFd = -1;
+    if (_shifterCore_validateStagingPath(udiConfig->udiImageStagingPath) != 0) {
+        return NULL;
+    }
+
+#define _ADD_FILE(src, name) \
+    srcFiles = _realloc(srcFiles, sizeof(char *) * (n_files + 2)); \
+    names = _realloc(names, sizeof(char *) * (n_files + 2)); \
+    srcFiles[n_files] = src; \
+    names[n_files] = name; \
+    n_files++; \
+    srcFiles[n_files] = NULL; \
+    names[n_files] = NULL;
+
+    /* gather the list of inputs, in the order they are applied */
+    for (fnamePtr = copyLocalEtcFiles; *fnamePtr != NULL; fnamePtr++) {
+        _ADD_FILE(alloc_strgenf("/etc/%s", *fnamePtr), _strdup(*fnamePtr));
+    }
+    n_local = n_files;
+    if (udiConfig->populateEtcDynamically == 0) {
+        DIR *etcDir = NULL;
+        struct dirent *entry = NULL;
+        if (udiConfig->etcPath == NULL || strlen(udiConfig->etcPath) == 0) {
+            fprintf(stderr, "UDI etcPath source directory not defined.\n");
+            goto _stageEtc_unclean;
         }
-        fprintf(fp, "passwd: files\ngroup: files\nhosts: files dns\n"
-                "networks:   files dns\nservices: files\nprotocols: files\n"
-                "rpc: files\nethers: files\nnetmasks: files\nnetgroup: files\n"
-                "publickey: files\nbootparams: files\nautomount: files\n"
-                "aliases: files\n");
-        fclose(fp);
-        fp = NULL;
+        etcDir = opendir(udiConfig->etcPath);
+        if (etcDir == NULL) {
+            fprintf(stderr, "Couldn't open udiRoot etc dir: %s\n",
+                    udiConfig->etcPath);
+            goto _stageEtc_unclean;
+        }
+        while ((entry = readdir(etcDir)) != NULL) {
+            char *filename = NULL;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            filename = userInputPathFilter(entry->d_name, 0);
+            if (filename == NULL || strlen(filename) == 0) {
+                fprintf(stderr, "FAILED to filter etc filename %s\n",
+                        entry->d_name);
+                free(filename);
+                closedir(etcDir);
+                goto _stageEtc_unclean;
+            }
+            /* these are created in the container etc during setup */
+            if (strcmp(filename, "mtab") == 0 || strcmp(filename, "udiImage") == 0) {
+                fprintf(stderr, "Couldn't copy %s because file already exists.\n",
+                        filename);
+                free(filename);
+                closedir(etcDir);
+                goto _stageEtc_unclean;
+            }
+            _ADD_FILE(alloc_strgenf("%s/%s", udiConfig->etcPath, filename),
+                    filename);
+        }
+        closedir(etcDir);
+    }
+#undef _ADD_FILE
 
-        /* write out container etc/host.conf */
-        snprintf(srcBuffer, PATH_MAX, "%s/etc/host.conf", udiRoot);
-        fp = fopen(srcBuffer, "w");
-        if (fp == NULL) {
-            fprintf(stderr, "Couldn't open host.conf for writing\n");
-            goto _prepSiteMod_unclean;
+    if (_shifterCore_siteEtcSignature(udiConfig, srcFiles, names, n_local,
+                &signature) != 0)
+    {
+        goto _stageEtc_unclean;
+    }
+
+    staged = alloc_strgenf("%s/etc-%016llx", udiConfig->udiImageStagingPath,
+            (unsigned long long) signature);
+    if (lstat(staged, &statData) == 0 && S_ISDIR(statData.st_mode)) {
+        *pinFd = _shifterCore_pinStaged(staged);
+        if (*pinFd >= 0) {
+            goto _stageEtc_exit;
+        }
+        /* pruned in the meantime, stage it again */
+    }
+
+    tmpPath = alloc_strgenf("%s/.etc-%016llx.%d",
+            udiConfig->udiImageStagingPath, (unsigned long long) signature,
+            (int) getpid());
+    if (mkdir(tmpPath, 0755) != 0) {
+        fprintf(stderr, "FAILED to mkdir %s: %s\n", tmpPath, strerror(errno));
+        free(tmpPath);
+        tmpPath = NULL;
+        goto _stageEtc_unclean;
+    }
+    for (idx = 0; idx < n_files; idx++) {
+        dest = alloc_strgenf("%s/%s", tmpPath, names[idx]);
+        if (lstat(dest, &statData) == 0) {
+            fprintf(stderr, "Couldn't copy %s because file already exists.\n",
+                    names[idx]);
+            goto _stageEtc_unclean;
+        }
+        /* same link handling as the unstaged copy in
+         * prepareSiteModifications */
+        if (_shifterCore_copyFile(udiConfig->cpPath, srcFiles[idx], dest,
+                    idx < n_local ? 1 : 0, 0, 0, 0644) != 0)
+        {
+            fprintf(stderr, "Failed to copy %s to %s.\n", srcFiles[idx], dest);
+            goto _stageEtc_unclean;
         }
-        fprintf(fp, "order bind,hosts\nmulti on\n");
-        fclose(fp);
-        fp = NULL;
-    } else {
-        fprintf(stderr, "Unable to setup etc.\n");
-        goto _prepSiteMod_unclean;
+        free(dest);
+        dest = NULL;
     }
 
     /* no valid reason for a user to provide their own /etc/shadow */
-    /* populate /etc/shadow with an empty file */
-    snprintf(srcBuffer, PATH_MAX, "%s/etc/shadow", udiRoot);
-    FILE *fp = fopen(srcBuffer, "w");
+    dest = alloc_strgenf("%s/shadow", tmpPath);
+    fp = fopen(dest, "w");
     if (fp == NULL) {
         fprintf(stderr, "Couldn't open shadow file for writing\n");
-        goto _prepSiteMod_unclean;
+        goto _stageEtc_unclean;
     }
     fclose(fp);
     fp = NULL;
-
-    /* validate that the mandatorySiteEtcFiles now exist */
-    for (fnamePtr = mandatorySiteEtcFiles; *fnamePtr != NULL; fnamePtr++) {
-        snprintf(path, PATH_MAX, "%s/etc/%s", udiRoot, *fnamePtr);
-        if (stat(path, &statData) != 0) {
-            fprintf(stderr, "%s does not exist! ALERT!\n", path);
-            goto _prepSiteMod_unclean;
-        }
-        if (chown(path, 0, 0) != 0) {
-            fprintf(stderr, "failed to chown %s to userid 0\n", path);
-            goto _prepSiteMod_unclean;
-        }
-        if (chmod(path, 0644) != 0) {
-            fprintf(stderr, "failed to chmod %s to 0644\n", path);
-            goto _prepSiteMod_unclean;
-        }
+    if (chmod(dest, 0644) != 0) {
+        fprintf(stderr, "failed to chmod %s to 0644\n", dest);
+        goto _stageEtc_unclean;
     }
+    free(dest);
+    dest = NULL;
 
-    /* filter the group file */
+    /* refuse to publish a payload whose inputs changed while copying */
+    if (_shifterCore_siteEtcSignature(udiConfig, srcFiles, names, n_local,
+                &verify) != 0)
     {
-        char *mvArgs[5];
-        char **argsPtr = NULL;
-        char *new_source = NULL;
-        char *new_dest = NULL;
-        snprintf(source, PATH_MAX, "%s/etc/group", udiRoot);
-        snprintf(dest, PATH_MAX, "%s/etc/group.orig", udiRoot);
-        source[PATH_MAX - 1] = 0;
-        dest[PATH_MAX - 1] = 0;
-        mvArgs[0] = _strdup(udiConfig->mvPath);
-        mvArgs[1] = _strdup(source);
-        mvArgs[2] = _strdup(dest);
-        mvArgs[3] = NULL;
-        ret = forkAndExecv(mvArgs);
-        for (argsPtr = mvArgs; *argsPtr != NULL; argsPtr++) {
-            free(*argsPtr);
-        }
-        if (ret != 0) {
-            fprintf(stderr, "Failed to rename %s to %s\n", source, dest);
-            goto _prepSiteMod_unclean;
-        }
+        goto _stageEtc_unclean;
+    }
+    if (verify != signature) {
+        fprintf(stderr, "site etc files changed while being staged\n");
+        goto _stageEtc_unclean;
+    }
 
-        /* swapping source and dest because filtering the group file will write
-         * out the final copy in the final location
-         *   about mv'd /etc/group (source) -> /etc/group.orig (dest)
-         *   filter reads /etc/group.orig (new_source) and
-         *          writes /etc/group (new_dest)
-         */
-        new_source = dest;
-        new_dest = source;
-        if (filterEtcGroup(new_dest, new_source, username, udiConfig->maxGroupCount) != 0) {
-            fprintf(stderr, "Failed to filter group file %s\n", source);
-            goto _prepSiteMod_unclean;
+    if (rename(tmpPath, staged) != 0) {
+        if (errno != EEXIST && errno != ENOTEMPTY) {
+            fprintf(stderr, "FAILED to rename %s to %s: %s\n", tmpPath, staged,
+                    strerror(errno));
+            goto _stageEtc_unclean;
         }
+        /* another setup on this node staged the same content first */
+        _shifterCore_removeTree(tmpPath);
     }
+    *pinFd = _shifterCore_pinStaged(staged);
+    if (*pinFd < 0) {
+        fprintf(stderr, "FAILED to pin %s\n", staged);
+        goto _stageEtc_unclean;
+    }
+    _shifterCore_pruneStaged(udiConfig->udiImageStagingPath, "etc-", staged);
 
-    if (_shifterCore_copyUdiImage(udiConfig) != 0) {
-        fprintf(stderr, "FAILED to setup udiImage local content.\n");
-        goto _prepSiteMod_unclean;
+_stageEtc_exit:
+    if (tmpPath != NULL) {
+        free(tmpPath);
     }
+    free_string_array(srcFiles);
+    free_string_array(names);
+    return staged;
 
-    /* setup hostlist for current allocation
-       format of minNodeSpec is "host1/16 host2/16" for 16 copies each of host1 and host2 */
-    if (minNodeSpec != NULL) {
-        if (writeHostFile(minNodeSpec, udiConfig) != 0) {
-            fprintf(stderr, "FAILED to write out hostsfile\n");
-            goto _prepSiteMod_unclean;
-        }
+_stageEtc_unclean:
+    if (dest != NULL) {
+        free(dest);
+    }
+    if (tmpPath != NULL) {
+        _shifterCore_removeTree(tmpPath);
+        free(tmpPath);
     }
+    if (staged != NULL) {
+        free(staged);
+    }
+    free_string_array(srcFiles);
+    free_string_array(names);
+    return NULL;
+}
 
-    /* run active-module roothooks */
-    for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
-        if (udiConfig->active_modules[idx]->roothook) {
-            char *args[] = {
-                _strdup("/bin/sh"), _strdup(udiConfig->active_modules[idx]->roothook), NULL
-            };
-            char **argsPtr = NULL;
-            ret = forkAndExecv(args);
-            for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
-                free(*argsPtr);
-            }
-            if (ret != 0) {
-                fprintf(stderr, "%s module roothook failed. Exiting.\n", udiConfig->active_modules[idx]->name);
-                ret = 1;
-                goto _prepSiteMod_unclean;
+/*! Copy udiImage content */
+/*!
+ * Recursively copy the udiImage content including active modules to
+ * opt/udiImage within the container
+ *
+ * If udiImageStagingPath is configured, module copyPath content and the
+ * optUdiImage subdirectories (other than etc and modules, which are modified
+ * during setup) are instead staged once per node and read-only bind mounted
+ * into place.  The staged copies are pinned until they are mounted, so that
+ * a concurrent setup does not prune them.  Any content which cannot be staged
+ * falls back to being copied.
+ *
+ * \param config UdiRootConfig configuration object
+ * \return 0 for success, nonzero for any error
+ */
+int _shifterCore_copyUdiImage(UdiRootConfig *udiConfig) {
+    int rc = 0;
+    char **srcPaths = NULL;
+    char **destPaths = NULL;
+    char **bindSrcPaths = NULL;
+    char **bindDestPaths = NULL;
+    int *bindPins = NULL;
+    char **pptr = NULL;
+    size_t n_src = 0;
+    size_t n_dest = 0;
+    size_t n_bind = 0;
+    int idx = 0;
+    int staging = 0;
+    MountList mountCache;
+
+    memset(&mountCache, 0, sizeof(MountList));
+    staging = udiConfig->udiImageStagingPath != NULL &&
+            strlen(udiConfig->udiImageStagingPath) > 0;
+
+#define _ADD_BIND(from, to, pin) \
+    bindSrcPaths = _realloc(bindSrcPaths, sizeof(char *) * (n_bind + 2)); \
+    bindDestPaths = _realloc(bindDestPaths, sizeof(char *) * (n_bind + 2)); \
+    bindPins = _realloc(bindPins, sizeof(int) * (n_bind + 1)); \
+    bindSrcPaths[n_bind] = from; \
+    bindDestPaths[n_bind] = to; \
+    bindPins[n_bind] = pin; \
+    n_bind++; \
+    bindSrcPaths[n_bind] = NULL; \
+    bindDestPaths[n_bind] = NULL;
+
+    if (udiConfig->optUdiImage != NULL) {
+        char *src = alloc_strgenf("%s/", udiConfig->optUdiImage);
+        char *dest = alloc_strgenf("%s/opt/udiImage/", udiConfig->udiMountPoint);
+        srcPaths = _malloc(sizeof(char *) * 2);
+        destPaths = _malloc(sizeof(char *) * 2);
+        srcPaths[0] = src;
+        srcPaths[1] = NULL;
+        destPaths[0] = dest;
+        destPaths[1] = NULL;
+        n_src = 1;
+        n_dest = 1;
+    }
+    for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
+        char *src = NULL;
+        char *dest = NULL;
+        if (udiConfig->active_modules[idx]->copyPath == NULL)
+            continue;
+        dest = alloc_strgenf("%s/opt/udiImage/modules/%s/", udiConfig->udiMountPoint, udiConfig->active_modules[idx]->name);
+        if (staging) {
+            char *label = alloc_strgenf("module_%s",
+                    udiConfig->active_modules[idx]->name);
+            int pin = -1;
+            char *staged = _shifterCore_stageUdiContent(udiConfig,
+                    udiConfig->active_modules[idx]->copyPath, label, &pin);
+            free(label);
+            if (staged != NULL) {
+                _ADD_BIND(staged, dest, pin);
+                continue;
             }
+            fprintf(stderr, "WARNING: could not stage module %s, copying "
+                    "instead\n", udiConfig->active_modules[idx]->name);
         }
-    }
+        src = alloc_strgenf("%s/", udiConfig->active_modules[idx]->copyPath);
+        srcPaths = _realloc(srcPaths, sizeof(char *) * (n_src + 2));
+        destPaths = _realloc(destPaths, sizeof(char *) * (n_dest + 2));
 
-    /***** setup linux needs ******/
-    /* mount /proc */
-    snprintf(mntBuffer, PATH_MAX, "%s/proc", udiRoot);
-    mntBuffer[PATH_MAX-1] = 0;
-    if (mount(NULL, mntBuffer, "proc", MS_NOSUID|MS_NOEXEC|MS_NODEV, NULL) != 0) {
-        fprintf(stderr, "FAILED to mount /proc\n");
-        goto _prepSiteMod_unclean;
+        srcPaths[n_src++] = src;
+        srcPaths[n_src] = NULL;
+        destPaths[n_dest++] = dest;
+        destPaths[n_dest] = NULL;
     }
 
-    /* mount /sys */
-    snprintf(mntBuffer, PATH_MAX, "%s/sys", udiRoot);
-    mntBuffer[PATH_MAX-1] = 0;
-    _BINDMOUNT(&mountCache, "/sys", mntBuffer, 0, 1);
+    for (idx = 0; idx < n_src; idx++) {
+        char *src = srcPaths[idx];
+        char *dest = destPaths[idx];
+        size_t srclen = strlen(src);
+        size_t destlen = strlen(dest);
+        DIR *srcDir = NULL;
+        struct dirent *entry = NULL;
+        int stageEntries = staging && idx == 0 && udiConfig->optUdiImage != NULL;
 
-    /* mount /dev */
-    snprintf(mntBuffer, PATH_MAX, "%s/dev", udiRoot);
-    mntBuffer[PATH_MAX-1] = 0;
-    _BINDMOUNT(&mountCache, "/dev", mntBuffer, 0, 1);
+        if (srclen == 0 || srclen > PATH_MAX || destlen == 0 || destlen > PATH_MAX) {
+            fprintf(stderr, "FAILED: copy path has invalid length!\n");
+            goto _fail;
+        }
+        errno = 0;
+        if (mkdir(dest, 0755) != 0) {
+            if (errno != EEXIST) {
+                fprintf(stderr, "FAILED to mkdir %s: %s. Exiting.\n", dest, strerror(errno));
+                goto _fail;
+            }
+        }
 
-    /* mount /tmp */
-    snprintf(mntBuffer, PATH_MAX, "%s/tmp", udiRoot);
-    mntBuffer[PATH_MAX-1] = 0;
-    _BINDMOUNT(&mountCache, "/tmp", mntBuffer, 0, 1);
+        srcDir = opendir(src);
+        if (srcDir == NULL) {
+            fprintf(stderr, "FAILED to opendir %s: %s. Exiting.\n", src, strerror(errno));
+            goto _fail;
+        }
+        while ((entry = readdir(srcDir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            char *src_path = alloc_strgenf("%s/%s", src, entry->d_name);
+            struct stat statData;
+
+            /* etc and modules are written to during setup, copy those */
+            if (stageEntries && strcmp(entry->d_name, "etc") != 0 &&
+                    strcmp(entry->d_name, "modules") != 0 &&
+                    lstat(src_path, &statData) == 0 &&
+                    S_ISDIR(statData.st_mode))
+            {
+                char *label = alloc_strgenf("udiImage_%s", entry->d_name);
+                int pin = -1;
+                char *staged = _shifterCore_stageUdiContent(udiConfig,
+                        src_path, label, &pin);
+                free(label);
+                if (staged != NULL) {
+                    char *bindDest = alloc_strgenf("%s%s", dest, entry->d_name);
+                    _ADD_BIND(staged, bindDest, pin);
+                    free(src_path);
+                    src_path = NULL;
+                    continue;
+                }
+                fprintf(stderr, "WARNING: could not stage %s, copying "
+                        "instead\n", src_path);
+            }
 
-    /* mount /var/tmp, checking if executable as an existance check */
-    if (access("/var/tmp", X_OK) == 0) {
-        snprintf(mntBuffer, PATH_MAX, "%s/var/tmp", udiRoot);
-        mntBuffer[PATH_MAX-1] = 0;
-        _BINDMOUNT(&mountCache, "/var/tmp", mntBuffer, 0, 1);
+            char *args[] = {_strdup(udiConfig->cpPath), _strdup("-rp"),
+                            _strdup(src_path), _strdup(dest), NULL};
+            rc = forkAndExecv(args);
+            for (pptr = args; pptr && *pptr; pptr++)
+                free(*pptr);
+            if (rc != 0) {
+                fprintf(stderr, "FAILED to copy %s to %s.\n", src_path, dest);
+                free(src_path);
+                src_path = NULL;
+                closedir(srcDir);
+                goto _fail;
+            }
+            free(src_path);
+            src_path = NULL;
+        }
+        closedir(srcDir);
     }
 
-#undef _MKDIR
-#undef _BINDMOUNT
+    /* fix permissions before the read-only staged content is mounted */
+    char *udiimage_path = alloc_strgenf("%s/opt/udiImage", udiConfig->udiMountPoint);
+    char *chmodArgs[] = {_strdup(udiConfig->chmodPath), _strdup("-R"),
+        _strdup("a+rX"), _strdup(udiimage_path), NULL
+    };
+    rc = forkAndExecv(chmodArgs);
+    for (pptr = chmodArgs; pptr && *pptr; pptr++)
+        free(*pptr);
+    if (rc != 0) {
+        fprintf(stderr, "FAILED to fix permissions on %s.\n", udiimage_path);
+        free(udiimage_path);
+        udiimage_path = NULL;
+        goto _fail;
+    }
+    free(udiimage_path);
+    udiimage_path = NULL;
+
+    if (n_bind > 0 && parse_MountList(&mountCache) != 0) {
+        fprintf(stderr, "FAILED to read existing mounts.\n");
+        goto _fail;
+    }
+    for (idx = 0; idx < n_bind; idx++) {
+        if (mkdir(bindDestPaths[idx], 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "FAILED to mkdir %s: %s. Exiting.\n",
+                    bindDestPaths[idx], strerror(errno));
+            goto _fail;
+        }
+        if (_shifterCore_bindMount(udiConfig, &mountCache, bindSrcPaths[idx],
+                    bindDestPaths[idx], VOLMAP_FLAG_READONLY, 0) != 0)
+        {
+            fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n",
+                    bindSrcPaths[idx], bindDestPaths[idx]);
+            goto _fail;
+        }
+    }
+#undef _ADD_BIND
 
     free_MountList(&mountCache, 0);
-    free(srcBuffer);
-    free(mntBuffer);
-    free(udiRoot);
-    free(source);
-    free(dest);
-    free(path);
+    for (pptr = srcPaths; pptr && *pptr; pptr++)
+        free(*pptr);
+    for (pptr = destPaths; pptr && *pptr; pptr++)
+        free(*pptr);
+    for (pptr = bindSrcPaths; pptr && *pptr; pptr++)
+        free(*pptr);
+    for (pptr = bindDestPaths; pptr && *pptr; pptr++)
+        free(*pptr);
+    if (srcPaths)
+        free(srcPaths);
+    if (destPaths)
+        free(destPaths);
+    if (bindSrcPaths)
+        free(bindSrcPaths);
+    if (bindDestPaths)
+        free(bindDestPaths);
+    /* the mounts keep the staged copies from being pruned from here on */
+    for (idx = 0; idx < n_bind; idx++)
+        close(bindPins[idx]);
+    if (bindPins)
+        free(bindPins);
     return 0;
-_prepSiteMod_unclean:
+
+_fail:
     free_MountList(&mountCache, 0);
-    free(srcBuffer);
-    free(mntBuffer);
-    free(udiRoot);
-    free(source);
-    free(dest);
-    free(path);
-    destructUDI(udiConfig, 0);
-    if (ret == 0) {
-        return 1;
-    }
-    return ret;
+    for (pptr = srcPaths; pptr && *pptr; pptr++)
+        free(*pptr);
+    for (pptr = destPaths; pptr && *pptr; pptr++)
+        free(*pptr);
+    for (pptr = bindSrcPaths; pptr && *pptr; pptr++)
+        free(*pptr);
+    for (pptr = bindDestPaths; pptr && *pptr; pptr++)
+        free(*pptr);
+    if (srcPaths)
+        free(srcPaths);
+    if (destPaths)
+        free(destPaths);
+    if (bindSrcPaths)
+        free(bindSrcPaths);
+    if (bindDestPaths)
+        free(bindDestPaths);
+    for (idx = 0; idx < n_bind; idx++)
+        close(bindPins[idx]);
+    if (bindPins)
+        free(bindPins);
+    return 1;
 }
 
-/*! Write out hostsfile into image */
+/*! Import a user into the container passwd/group files */
 /*!
- * Writes out an MPI-style hostsfile, e.g., one element per task.
- *     nid00001
- *     nid00001
- *     nid00002
- *     nid00002
- * For a two node/four task job.
- * Written to /var/hostsfile within the image.
- *
- * \param minNodeSpec string formatted like "nid00001/2 nid00002/2" for above
- * \param udiConfig UDI configuration object
- *
- * \returns 0 upon success, 1 upon failure
- */
-int writeHostFile(const char *minNodeSpec, UdiRootConfig *udiConfig) {
-    char *minNode = NULL;
-    char *sptr = NULL;
-    char *eptr = NULL;
-    char *limit = NULL;
-    FILE *fp = NULL;
-    char *filename = NULL;
+  \param passwd_fp open file pointer to container /etc/passwd file
+  \param group_fp open file pointer to container /etc/group file
+  \param uid user id to consider (-1 to ignore)
+  \param uname username to consider (NULL to ignore)
+  \param config configuration state structure
+  \return 0 for success, non-zero for error
+*/
+int _import_user(FILE *passwd_fp, FILE *group_fp, uid_t uid, char *uname, UdiRootConfig *config) {
+    struct passwd *pwd = NULL;
+    struct group *grp = NULL;
     int idx = 0;
+    int nGroups = 0;
+    gid_t *gidList = NULL;
 
-    if (minNodeSpec == NULL || udiConfig == NULL) return 1;
-    filename = _malloc(sizeof(char) * PATH_MAX);
-
-    minNode = _strdup(minNodeSpec);
-    limit = minNode + strlen(minNode);
+    if (uid > 0)
+        pwd = shifter_getpwuid(uid, config);
+    if (uname)
+        pwd = shifter_getpwnam(uname, config);
+    if (!pwd)
+        return 1;
 
-    snprintf(filename, PATH_MAX, "%s/var/hostsfile", udiConfig->udiMountPoint);
-    filename[PATH_MAX-1] = 0;
+    fprintf(passwd_fp, "%s:x:%d:%d:%s:%s:%s\n", pwd->pw_name, pwd->pw_uid,
+            pwd->pw_gid, pwd->pw_gecos, pwd->pw_dir, pwd->pw_shell);
 
-    fp = fopen(filename, "w");
-    if (fp == NULL) {
-        fprintf(stderr, "FAILED to open hostsfile for writing: %s\n", filename);
-        goto _writeHostFile_error;
+    /* get group data */
+    gidList = shifter_getgrouplist(pwd->pw_name, pwd->pw_gid, &nGroups);
+    for (idx = 0; idx < nGroups; idx++) {
+        grp = getgrgid(gidList[idx]);
+        if (!grp)
+            continue;
+        fprintf(group_fp, "%s:x:%d:\n", grp->gr_name, grp->gr_gid);
     }
+    return 0;
+}
 
-    sptr = minNode;
-    while (sptr < limit) {
-        /* find hostname */
-        char *hostname = sptr;
-        int count = 0;
-        eptr = strchr(sptr, '/');
-        if (eptr == NULL) {
-            /* parse error, should be hostname/number (e.g., nid00001/24) */
-            fprintf(stderr, "FAILED to identify hostname when writing hosts list\n");
-            goto _writeHostFile_error;
-        }
-        *eptr = 0;
-
-        /* find count */
-        sptr = eptr + 1;
-        eptr = strchr(sptr, ' ');
-        if (eptr == NULL) eptr = sptr + strlen(sptr);
-        *eptr = 0;
-        count = (int) strtol(sptr, NULL, 10);
-        if (count == 0) {
-            /* parse error, not a number */
-            goto _writeHostFile_error;
-        }
+/*! Setup all required files/paths for site mods to the image */
+/*!
+  Setup all required files/paths for site mods to the image.  This should be
+  called before performing any bindmounts or other discovery of the user image.
+  Any paths created here should then be ignored by all other setup function-
+  ality; i.e., no bind-mounts over these locations/paths.
 
-        /* write out */
-        for (idx = 0; idx < count; idx++) {
-            fprintf(fp, "%s\n", hostname);
-        }
+  The site-configured bind-mounts will also be performed here.
 
-        sptr = eptr + 1;
-    }
-    fclose(fp);
-    fp = NULL;
-    free(filename);
-    filename = NULL;
-    free(minNode);
-    minNode = NULL;
-    return 0;
+  \param username username for group-file filtering
+  \param minNodeSpec nodelist specification
+  \param udiConfig global configuration for udiRoot
+  \return 0 for succss, 1 otherwise
+*/
+int prepareSiteModifications(const char *username,
+                             const char *minNodeSpec,
+                             UdiRootConfig *udiConfig)
+{
+    /* construct path to "live" copy of the image. */
+    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
+    char *mntBuffer = _malloc(sizeof(char) * PATH_MAX);
+    char *srcBuffer = _malloc(sizeof(char) * PATH_MAX);
+    char *source = _malloc(sizeof(char) * PATH_MAX);
+    char *dest = _malloc(sizeof(char) * PATH_MAX);
+    char *path = _malloc(sizeof(char) * PATH_MAX);
+    char *stagedEtc = NULL;
+    int stagedEtcPin = -1;
+    const char **fnamePtr = NULL;
+    int ret = 0;
+    int idx = 0;
+    struct stat statData;
+    dev_t udiMountDev = 0;
+    MountList mountCache;
 
-_writeHostFile_error:
-    free(filename);
-    filename = NULL;
-    free(minNode);
-    minNode = NULL;
-    if (fp != NULL) {
-        fclose(fp);
-    }
-    return 1;
-}
+    const char *mandatorySiteEtcFiles[4] = {
+        "passwd", "group", "nsswitch.conf", NULL
+    };
+    const char *copyLocalEtcFiles[3] = {
+        "hosts", "resolv.conf", NULL
+    };
 
-int mountImageVFS(ImageData *imageData,
-                  const char *username,
-                  int verbose,
-                  const char *minNodeSpec,
-                  UdiRootConfig *udiConfig) {
-    struct stat statData;
-    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
-    char *sshPath = NULL;
-    dev_t destRootDev = 0;
-    dev_t srcRootDev = 0;
-    dev_t tmpDev = 0;
+    memset(&mountCache, 0, sizeof(MountList));
+    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
+    udiRoot[PATH_MAX-1] = 0;
 
-    umask(022);
+    /* get udiMount device id */
+    if (stat(udiRoot, &statData) != 0) {
+        fprintf(stderr, "FAILED to stat udiRoot %s.\n", udiRoot);
+        ret = 1;
+        goto _prepSiteMod_unclean;
+    }
+    udiMountDev = statData.st_dev;
 
-    if (imageData == NULL || username == NULL || udiConfig == NULL) {
-        fprintf(stderr, "Invalid arguments to mountImageVFS(), error.\n");
-        goto _mountImgVfs_unclean;
+    /* ensure any upcoming relative path operations are done with correct
+       working directory */
+    if (chdir(udiRoot) != 0) {
+        fprintf(stderr, "FAILED to chdir to %s. Exiting.\n", udiRoot);
+        ret = 1;
+        goto _prepSiteMod_unclean;
     }
-    if (imageData->type != NULL && strcmp(imageData->type, "local") == 0 && udiConfig->allowLocalChroot == 0) {
-        fprintf(stderr, "local chroot path requested, but this is disallowed by site policy, Fail.\n");
-        goto _mountImgVfs_unclean;
+
+    /* get list of current mounts for this namespace */
+    if (parse_MountList(&mountCache) != 0) {
+        fprintf(stderr, "FAILED to get list of current mount points\n");
+        ret = 1;
+        goto _prepSiteMod_unclean;
     }
 
+    /* create all the directories needed for initial setup */
 #define _MKDIR(dir, perm) if (mkdir(dir, perm) != 0) { \
     fprintf(stderr, "FAILED to mkdir %s. Exiting.\n", dir); \
-    goto _mountImgVfs_unclean; \
+    perror("   --- REASON: "); \
+    ret = 1; \
+    goto _prepSiteMod_unclean; \
+}
+#define _BINDMOUNT(mountCache, from, to, flags, overwrite) if (_shifterCore_bindMount(udiConfig, mountCache, from, to, flags, overwrite) != 0) { \
+    fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n", from, to); \
+    perror("   --- REASON: "); \
+    ret = 1; \
+    goto _prepSiteMod_unclean; \
 }
 
-    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
+    _MKDIR("etc", 0755);
+    _MKDIR("etc/udiImage", 0755);
+    _MKDIR("opt", 0755);
+    _MKDIR("opt/udiImage", 0755);
+    _MKDIR("opt/udiImage/modules", 0755);
+    _MKDIR("var", 0755);
+    _MKDIR("var/spool", 0755);
+    _MKDIR("var/run", 0755);
+    _MKDIR("var/tmp", 0755);
+    _MKDIR("var/empty", 0700);
+    _MKDIR("proc", 0755);
+    _MKDIR("sys", 0755);
+    _MKDIR("dev", 0755);
+    _MKDIR("tmp", 0777);
 
-    if (lstat(udiRoot, &statData) != 0) {
-        _MKDIR(udiRoot, 0755);
+    /* run site-defined pre-mount procedure */
+    if (udiConfig->sitePreMountHook && strlen(udiConfig->sitePreMountHook) > 0) {
+        char *args[] = {
+            _strdup("/bin/sh"), _strdup(udiConfig->sitePreMountHook), NULL
+        };
+        char **argsPtr = NULL;
+        ret = forkAndExecv(args);
+        for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
+            free(*argsPtr);
+        }
+        if (ret != 0) {
+            fprintf(stderr, "Site premount hook failed. Exiting.\n");
+            ret = 1;
+            goto _prepSiteMod_unclean;
+        }
     }
 
-#define BIND_IMAGE_INTO_UDI(subtree, img, udiConfig, copyFlag) \
-    if (bindImageIntoUDI(subtree, img, udiConfig, copyFlag) > 1) { \
-        fprintf(stderr, "FAILED To setup \"%s\" in %s\n", subtree, udiRoot); \
-        goto _mountImgVfs_unclean; \
-    }
+    /* trigger automounts of all site and module volumes at once */
+    _shifterCore_warmVolumeSources(udiConfig);
 
-    /* mount a new rootfs to work in */
-    if (mount(NULL, udiRoot, udiConfig->rootfsType, MS_NOSUID|MS_NODEV, NULL) != 0) {
-        fprintf(stderr, "FAILED to mount rootfs on %s\n", udiRoot);
-        perror("   --- REASON: ");
-        goto _mountImgVfs_unclean;
+    /* do site-defined mount activities */
+    if (setupVolumeMapMounts(&mountCache, udiConfig->siteFs, 0, udiMountDev, udiConfig) != 0) {
+        fprintf(stderr, "FAILED to mount siteFs volumes\n");
+        goto _prepSiteMod_unclean;
     }
-    if (makeUdiMountPrivate(udiConfig) != 0) {
-        fprintf(stderr, "FAILED to mark the udi as a private mount\n");
-        goto _mountImgVfs_unclean;
+
+    /* run site-defined post-mount procedure */
+    if (udiConfig->sitePostMountHook && strlen(udiConfig->sitePostMountHook) > 0) {
+        char *args[] = {
+            _strdup("/bin/sh"), _strdup(udiConfig->sitePostMountHook), NULL
+        };
+        char **argsPtr = NULL;
+        ret = forkAndExecv(args);
+        for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
+            free(*argsPtr);
+        }
+        if (ret != 0) {
+            fprintf(stderr, "Site postmount hook failed. Exiting.\n");
+            ret = 1;
+            goto _prepSiteMod_unclean;
+        }
     }
 
-    if (chmod(udiRoot, 0755) != 0) {
-        fprintf(stderr, "FAILED to chmod \"%s\" to 0755.\n", udiRoot);
-        goto _mountImgVfs_unclean;
+    /* do active modules site-defined mount activities */
+    for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
+        if (udiConfig->active_modules[idx]->siteFs) {
+            if (setupVolumeMapMounts(&mountCache, udiConfig->active_modules[idx]->siteFs, 0, udiMountDev, udiConfig) != 0) {
+                fprintf(stderr, "FAILED to mount siteFs volumes for active modules.\n");
+                goto _prepSiteMod_unclean;
+            }
+        }
     }
 
-    /* get destination device */
-    if (lstat(udiRoot, &statData) != 0) {
-        fprintf(stderr, "FAILED to stat %s\n", udiRoot);
-        goto _mountImgVfs_unclean;
+    /* add symlink for /proc/mounts at /etc/mtab */
+    snprintf(srcBuffer, PATH_MAX, "%s/etc/mtab", udiRoot);
+    if (symlink("/proc/mounts", srcBuffer) != 0) {
+        fprintf(stderr, "FAILED to create /etc/mtab link\n");
+        goto _prepSiteMod_unclean;
     }
-    destRootDev = statData.st_dev;
 
-    /* work out source device */
-    if (imageData->useLoopMount) {
-        if (lstat(udiConfig->loopMountPoint, &statData) != 0) {
-            fprintf(stderr, "FAILED to stat loop mount point.\n");
-            goto _mountImgVfs_unclean;
-        }
-    } else {
-        if (lstat(imageData->filename, &statData) != 0) {
-            fprintf(stderr, "FAILED to stat udi source.\n");
-            goto _mountImgVfs_unclean;
+    /* use the prepared etc payload for this node if staging is enabled */
+    if (udiConfig->udiImageStagingPath != NULL &&
+            strlen(udiConfig->udiImageStagingPath) > 0)
+    {
+        stagedEtc = _shifterCore_stageSiteEtc(udiConfig, &stagedEtcPin);
+        if (stagedEtc == NULL) {
+            fprintf(stderr, "WARNING: could not stage site etc files, copying "
+                    "instead\n");
         }
     }
-    srcRootDev = statData.st_dev;
 
-    if (lstat("/tmp", &statData) != 0) {
-        fprintf(stderr, "FAILED to stat /tmp\n");
-        goto _mountImgVfs_unclean;
+    /* copy needed local files */
+    for (fnamePtr = copyLocalEtcFiles; stagedEtc == NULL && *fnamePtr != NULL; fnamePtr++) {
+        snprintf(source, PATH_MAX, "/etc/%s", *fnamePtr);
+        snprintf(dest, PATH_MAX, "%s/etc/%s", udiRoot, *fnamePtr);
+        source[PATH_MAX - 1] = 0;
+        dest[PATH_MAX - 1] = 0;
+        if (_shifterCore_copyFile(udiConfig->cpPath, source, dest, 1, 0, 0, 0644) != 0) {
+            fprintf(stderr, "Failed to copy %s to %s\n", source, dest);
+            goto _prepSiteMod_unclean;
+        }
     }
-    tmpDev = statData.st_dev;
-
-    /* authorize destRootDev, srcRootDev, and tmpDev  as the only allowed
-     * volume mount targets */
-    udiConfig->bindMountAllowedDevices = _malloc(3 * sizeof(dev_t));
-    udiConfig->bindMountAllowedDevices[0] = destRootDev;
-    udiConfig->bindMountAllowedDevices[1] = srcRootDev;
-    udiConfig->bindMountAllowedDevices[2] = tmpDev;
-    udiConfig->bindMountAllowedDevices_sz = 3;
 
-
-    /* get our needs injected first */
-    if (prepareSiteModifications(username, minNodeSpec, udiConfig) != 0) {
-        fprintf(stderr, "FAILED to properly setup site modifications\n");
-        goto _mountImgVfs_unclean;
+    /* validate that the mandatorySiteEtcFiles do not exist yet */
+    for (fnamePtr = mandatorySiteEtcFiles; *fnamePtr != NULL; fnamePtr++) {
+        snprintf(path, PATH_MAX, "%s/etc/%s", udiRoot, *fnamePtr);
+        if (stat(path, &statData) == 0) {
+            fprintf(stderr, "%s already exists! ALERT!\n", path);
+            goto _prepSiteMod_unclean;
+        }
     }
 
-    /* copy/bind mount pieces into prepared site */
-    BIND_IMAGE_INTO_UDI("/", imageData, udiConfig, 0);
-    BIND_IMAGE_INTO_UDI("/var", imageData, udiConfig, 0);
-    BIND_IMAGE_INTO_UDI("/opt", imageData, udiConfig, 0);
-
-    /* setup sshd configuration */
-    sshPath = alloc_strgenf("%s/etc/ssh", udiRoot);
-    if (sshPath != NULL) {
-        _MKDIR(sshPath, 0755);
-        free(sshPath);
-        sshPath = NULL;
+    if (stagedEtc != NULL) {
+        char *stagedContent = alloc_strgenf("%s/.", stagedEtc);
+        snprintf(dest, PATH_MAX, "%s/etc", udiRoot);
+        dest[PATH_MAX - 1] = 0;
+        char *args[] = {_strdup(udiConfig->cpPath), _strdup("-rp"),
+                        stagedContent, _strdup(dest), NULL};
+        char **argsPtr = NULL;
+        ret = forkAndExecv(args);
+        for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
+            free(*argsPtr);
+        }
+        /* the payload may be pruned once copied */
+        close(stagedEtcPin);
+        stagedEtcPin = -1;
+        if (ret != 0) {
+            fprintf(stderr, "Failed to copy %s to %s\n", stagedEtc, dest);
+            ret = 1;
+            goto _prepSiteMod_unclean;
+        }
     }
 
-    /* copy image /etc into place */
-    BIND_IMAGE_INTO_UDI("/etc", imageData, udiConfig, 1);
+    if (udiConfig->populateEtcDynamically == 0 && stagedEtc == NULL) {
+        /* --> loop over everything in site etc-files and copy into image etc */
+        if (udiConfig->etcPath == NULL || strlen(udiConfig->etcPath) == 0) {
+            fprintf(stderr, "UDI etcPath source directory not defined.\n");
+            goto _prepSiteMod_unclean;
+        }
+        snprintf(srcBuffer, PATH_MAX, "%s", udiConfig->etcPath);
+        srcBuffer[PATH_MAX-1] = 0;
+        memset(&statData, 0, sizeof(struct stat));
+        if (stat(srcBuffer, &statData) == 0) {
+            DIR *etcDir = opendir(srcBuffer);
+            struct dirent *entry = NULL;
+            while ((entry = readdir(etcDir)) != NULL) {
+                char *filename = NULL;
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                    continue;
+                }
+                filename = userInputPathFilter(entry->d_name, 0);
+                if (filename == NULL) {
+                    fprintf(stderr, "FAILED to allocate filename string.\n");
+                    goto _fail_copy_etcPath;
+                }
+                snprintf(srcBuffer, PATH_MAX, "%s/%s", udiConfig->etcPath, filename);
+                srcBuffer[PATH_MAX-1] = 0;
+                snprintf(mntBuffer, PATH_MAX, "%s/etc/%s", udiRoot, filename);
+                mntBuffer[PATH_MAX-1] = 0;
+                free(filename);
+                filename = NULL;
 
-#undef BIND_IMAGE_INTO_UDI
-#undef _MKDIR
+                if (lstat(srcBuffer, &statData) != 0) {
+                    fprintf(stderr, "Couldn't find source file, check if there are illegal characters: %s\n", srcBuffer);
+                    goto _fail_copy_etcPath;
+                }
 
-    free(udiRoot);
-    return 0;
+                if (lstat(mntBuffer, &statData) == 0) {
+                    fprintf(stderr, "Couldn't copy %s because file already exists.\n", mntBuffer);
+                    goto _fail_copy_etcPath;
+                } else {
+                    ret = _shifterCore_copyFile(udiConfig->cpPath, srcBuffer, mntBuffer, 0, 0, 0, 0644);
+                    if (ret != 0) {
+                        fprintf(stderr, "Failed to copy %s to %s.\n", srcBuffer, mntBuffer);
+                        goto _fail_copy_etcPath;
+                    }
+                }
+                continue;
+_fail_copy_etcPath:
+                if (filename != NULL) {
+                    free(filename);
+                    filename = NULL;
+                }
+                if (etcDir != NULL) {
+                    closedir(etcDir);
+                    etcDir = NULL;
+                }
+                goto _prepSiteMod_unclean;
+            }
+            closedir(etcDir);
+        } else {
+            fprintf(stderr, "Couldn't stat udiRoot etc dir: %s\n", srcBuffer);
+            goto _prepSiteMod_unclean;
+        }
+    } else if (udiConfig->populateEtcDynamically != 0 &&
+            udiConfig->target_uid != 0 && udiConfig->target_gid != 0)
+    {
+        FILE *passwd_fp = NULL;
+        FILE *group_fp = NULL;
+        FILE *fp = NULL;
+        int idx = 0;
 
-_mountImgVfs_unclean:
-    if (sshPath != NULL) {
-        free(sshPath);
-    }
-    free(udiRoot);
-    return 1;
-}
+        /* prepare container etc/passwd */
+        snprintf(srcBuffer, PATH_MAX, "%s/etc/passwd", udiRoot);
+        passwd_fp = fopen(srcBuffer, "w");
+        if (passwd_fp == NULL) {
+            fprintf(stderr, "Couldn't open passwd file for writing\n");
+            goto _prepSiteMod_unclean;
+        }
 
-/** makeUdiMountPrivate
- *  Some Linux systems default their mounts to "shared" mounts, which means
- *  that mount option changes Shifter makes (or unmounts) can propagate back up
- *  to the original mount, which is not desirable.  This function remounts the
- *  base udiMount point as MS_PRIVATE - which means that no external mount
- *  changes propagate into these mountpoints, nor do these go back up the
- *  chain.  It may be desirable to allow sites to choose MS_SLAVE instead of
- *  MS_PRIVATE here, as that will allow site unmounts to propagate into shifter
- *  containers.
- */
-int makeUdiMountPrivate(UdiRootConfig *udiConfig) {
-    char *buffer = _malloc(sizeof(char) * PATH_MAX);
-    snprintf(buffer, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    if (mount(NULL, buffer, NULL, MS_PRIVATE|MS_REC, NULL) != 0) {
-        perror("Failed to remount non-shared.");
-        free(buffer);
-        return 1;
-    }
-    free(buffer);
-    return 0;
-}
+        /* prepare container etc/group */
+        snprintf(srcBuffer, PATH_MAX, "%s/etc/group", udiRoot);
+        group_fp = fopen(srcBuffer, "w");
+        if (group_fp == NULL) {
+            fprintf(stderr, "Couldn't open group file for writing\n");
+            goto _prepSiteMod_unclean;
+        }
 
-int remountUdiRootReadonly(UdiRootConfig *udiConfig) {
-    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
+        if (_import_user(passwd_fp, group_fp, udiConfig->target_uid, NULL, udiConfig) != 0) {
+             fprintf(stderr, "FAILED to import user.  Exiting\n");
+             goto _prepSiteMod_unclean;
+        }
 
-    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
-        free(udiRoot);
-        return 1;
-    }
-    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
+        for (idx = 0; idx < udiConfig->usersToImport_size; idx++) {
+            if (_import_user(passwd_fp, group_fp, -1, udiConfig->usersToImport[idx], udiConfig) != 0) {
+                fprintf(stderr, "FAILED to import user %s. Exiting\n", udiConfig->usersToImport[idx]);
+                goto _prepSiteMod_unclean;
+            }
+        }
 
-    if (mount(udiRoot, udiRoot, udiConfig->rootfsType, MS_REMOUNT|MS_NOSUID|MS_NODEV|MS_RDONLY, NULL) != 0) {
-        fprintf(stderr, "FAILED to remount rootfs readonly on %s\n", udiRoot);
-        perror("   --- REASON: ");
-        goto _remountUdiRootReadonly_unclean;
-    }
-    free(udiRoot);
-    return 0;
+        fclose(passwd_fp);
+        fclose(group_fp);
 
-_remountUdiRootReadonly_unclean:
-    free(udiRoot);
-    return 1;
-}
+        /* write out container etc/nsswitch.conf */
+        snprintf(srcBuffer, PATH_MAX, "%s/etc/nsswitch.conf", udiRoot);
+        fp = fopen(srcBuffer, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Couldn't open nsswitch.conf for writing\n");
+            goto _prepSiteMod_unclean;
+        }
+        fprintf(fp, "passwd: files\ngroup: files\nhosts: files dns\n"
+                "networks:   files dns\nservices: files\nprotocols: files\n"
+                "rpc: files\nethers: files\nnetmasks: files\nnetgroup: files\n"
+                "publickey: files\nbootparams: files\nautomount: files\n"
+                "aliases: files\n");
+        fclose(fp);
+        fp = NULL;
 
-int mountImageLoop(ImageData *imageData, UdiRootConfig *udiConfig) {
-    char *loopMountPath = _malloc(sizeof(char) * PATH_MAX);
-    char *imagePath = _malloc(sizeof(char) * PATH_MAX);
-    if (imageData == NULL || udiConfig == NULL) {
-        goto _mountImageLoop_unclean;
-    }
-    if (imageData->useLoopMount == 0) {
-        goto _finish_normal;
-    }
-    if (udiConfig->loopMountPoint == NULL || strlen(udiConfig->loopMountPoint) == 0) {
-        goto _mountImageLoop_unclean;
-    }
-    if (mkdir(udiConfig->loopMountPoint, 0755) != 0) {
-        if (errno != EEXIST) {
-            fprintf(stderr, "FAILED to mkdir %s. Exiting.\n", udiConfig->loopMountPoint);
-            goto _mountImageLoop_unclean;
+        /* write out container etc/host.conf */
+        snprintf(srcBuffer, PATH_MAX, "%s/etc/host.conf", udiRoot);
+        fp = fopen(srcBuffer, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Couldn't open host.conf for writing\n");
+            goto _prepSiteMod_unclean;
         }
+        fprintf(fp, "order bind,hosts\nmulti on\n");
+        fclose(fp);
+        fp = NULL;
+    } else if (udiConfig->populateEtcDynamically != 0) {
+        fprintf(stderr, "Unable to setup etc.\n");
+        goto _prepSiteMod_unclean;
     }
 
-    snprintf(loopMountPath, PATH_MAX, "%s", udiConfig->loopMountPoint);
-    loopMountPath[PATH_MAX-1] = 0;
-    snprintf(imagePath, PATH_MAX, "%s", imageData->filename);
-    imagePath[PATH_MAX-1] = 0;
-    if (loopMount(imagePath, loopMountPath, imageData->format, udiConfig, 1) != 0) {
-        fprintf(stderr, "FAILED to loop mount image: %s\n", imagePath);
-        goto _mountImageLoop_unclean;
+    /* no valid reason for a user to provide their own /etc/shadow */
+    /* populate /etc/shadow with an empty file (already in staged etc) */
+    if (stagedEtc == NULL) {
+        snprintf(srcBuffer, PATH_MAX, "%s/etc/shadow", udiRoot);
+        FILE *fp = fopen(srcBuffer, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Couldn't open shadow file for writing\n");
+            goto _prepSiteMod_unclean;
+        }
+        fclose(fp);
+        fp = NULL;
     }
-_finish_normal:
-    free(loopMountPath);
-    free(imagePath);
-    return 0;
-_mountImageLoop_unclean:
-    free(loopMountPath);
-    free(imagePath);
-    return 1;
-}
-
-/**
- * _sortFsTypeForward
- * Utility function use for comparisons for sorting filesystems
- */
-static int _sortFsTypeForward(const void *ta, const void *tb) {
-    const char **a = (const char **) ta;
-    const char **b = (const char **) tb;
 
-    return strcmp(*a, *b);
-}
+    /* validate that the mandatorySiteEtcFiles now exist */
+    for (fnamePtr = mandatorySiteEtcFiles; *fnamePtr != NULL; fnamePtr++) {
+        snprintf(path, PATH_MAX, "%s/etc/%s", udiRoot, *fnamePtr);
+        if (stat(path, &statData) != 0) {
+            fprintf(stderr, "%s does not exist! ALERT!\n", path);
+            goto _prepSiteMod_unclean;
+        }
+        if (chown(path, 0, 0) != 0) {
+            fprintf(stderr, "failed to chown %s to userid 0\n", path);
+            goto _prepSiteMod_unclean;
+        }
+        if (chmod(path, 0644) != 0) {
+            fprintf(stderr, "failed to chmod %s to 0644\n", path);
+            goto _prepSiteMod_unclean;
+        }
+    }
 
-/** getSupportedFilesystems
- *  Read /proc/filesystems and produce a list of filesystems supported by this
- *  kernel.
- *
- *  Returns NULL-terminated array of strings with all filesystem types
+    /* filter the group file */
+    {
+        char *mvArgs[5];
+        char **argsPtr = NULL;
+        char *new_source = NULL;
+        char *new_dest = NULL;
+        snprintf(source, PATH_MAX, "%s/etc/group", udiRoot);
+        snprintf(dest, PATH_MAX, "%s/etc/group.orig", udiRoot);
+        source[PATH_MAX - 1] = 0;
+        dest[PATH_MAX - 1] = 0;
+        mvArgs[0] = _strdup(udiConfig->mvPath);
+        mvArgs[1] = _strdup(source);
+        mvArgs[2] = _strdup(dest);
+        mvArgs[3] = NULL;
+        ret = forkAndExecv(mvArgs);
+        for (argsPtr = mvArgs; *argsPtr != NULL; argsPtr++) {
+            free(*argsPtr);
+        }
+        if (ret != 0) {
+            fprintf(stderr, "Failed to rename %s to %s\n", source, dest);
+            goto _prepSiteMod_unclean;
+        }
+
+        /* swapping source and dest because filtering the group file will write
+         * out the final copy in the final location
+         *   about mv'd /etc/group (source) -> /etc/group.orig (dest)
+         *   filter reads /etc/group.orig (new_source) and
+         *          writes /etc/group (new_dest)
+         */
+        new_source = dest;
+        new_dest = source;
+        if (filterEtcGroup(new_dest, new_source, username, udiConfig->maxGroupCount) != 0) {
+            fprintf(stderr, "Failed to filter group file %s\n", source);
+            goto _prepSiteMod_unclean;
+        }
+    }
+
+    if (_shifterCore_copyUdiImage(udiConfig) != 0) {
+        fprintf(stderr, "FAILED to setup udiImage local content.\n");
+        goto _prepSiteMod_unclean;
+    }
+
+    /* setup hostlist for current allocation
+       format of minNodeSpec is "host1/16 host2/16" for 16 copies each of host1 and host2 */
+    if (minNodeSpec != NULL) {
+        if (writeHostFile(minNodeSpec, udiConfig) != 0) {
+            fprintf(stderr, "FAILED to write out hostsfile\n");
+            goto _prepSiteMod_unclean;
+        }
+    }
+
+    /* run active-module roothooks */
+    for (idx = 0; idx < udiConfig->n_active_modules; idx++) {
+        if (udiConfig->active_modules[idx]->roothook) {
+            char *args[] = {
+                _strdup("/bin/sh"), _strdup(udiConfig->active_modules[idx]->roothook), NULL
+            };
+            char **argsPtr = NULL;
+            ret = forkAndExecv(args);
+            for (argsPtr = args; *argsPtr != NULL; argsPtr++) {
+                free(*argsPtr);
+            }
+            if (ret != 0) {
+                fprintf(stderr, "%s module roothook failed. Exiting.\n", udiConfig->active_modules[idx]->name);
+                ret = 1;
+                goto _prepSiteMod_unclean;
+            }
+        }
+    }
+
+    /***** setup linux needs ******/
+    /* mount /proc */
+    snprintf(mntBuffer, PATH_MAX, "%s/proc", udiRoot);
+    mntBuffer[PATH_MAX-1] = 0;
+    if (mount(NULL, mntBuffer, "proc", MS_NOSUID|MS_NOEXEC|MS_NODEV, NULL) != 0) {
+        fprintf(stderr, "FAILED to mount /proc\n");
+        goto _prepSiteMod_unclean;
+    }
+
+    /* mount /sys */
+    snprintf(mntBuffer, PATH_MAX, "%s/sys", udiRoot);
+    mntBuffer[PATH_MAX-1] = 0;
+    _BINDMOUNT(&mountCache, "/sys", mntBuffer, 0, 1);
+
+    /* mount /dev */
+    snprintf(mntBuffer, PATH_MAX, "%s/dev", udiRoot);
+    mntBuffer[PATH_MAX-1] = 0;
+    _BINDMOUNT(&mountCache, "/dev", mntBuffer, 0, 1);
+
+    /* mount /tmp */
+    snprintf(mntBuffer, PATH_MAX, "%s/tmp", udiRoot);
+    mntBuffer[PATH_MAX-1] = 0;
+    _BINDMOUNT(&mountCache, "/tmp", mntBuffer, 0, 1);
+
+    /* mount /var/tmp, checking if executable as an existance check */
+    if (access("/var/tmp", X_OK) == 0) {
+        snprintf(mntBuffer, PATH_MAX, "%s/var/tmp", udiRoot);
+        mntBuffer[PATH_MAX-1] = 0;
+        _BINDMOUNT(&mountCache, "/var/tmp", mntBuffer, 0, 1);
+    }
+
+#undef _MKDIR
+#undef _BINDMOUNT
+
+    free_MountList(&mountCache, 0);
+    free(srcBuffer);
+    free(mntBuffer);
+    free(udiRoot);
+    free(source);
+    free(dest);
+    free(path);
+    free(stagedEtc);
+    return 0;
+_prepSiteMod_unclean:
+    free_MountList(&mountCache, 0);
+    if (stagedEtcPin >= 0) {
+        close(stagedEtcPin);
+    }
+    free(stagedEtc);
+    free(srcBuffer);
+    free(mntBuffer);
+    free(udiRoot);
+    free(source);
+    free(dest);
+    free(path);
+    destructUDI(udiConfig, 0);
+    if (ret == 0) {
+        return 1;
+    }
+    return ret;
+}
+
+/*! Write out hostsfile into image */
+/*!
+ * Writes out an MPI-style hostsfile, e.g., one element per task.
+ *     nid00001
+ *     nid00001
+ *     nid00002
+ *     nid00002
+ * For a two node/four task job.
+ * Written to /var/hostsfile within the image.
+ *
+ * \param minNodeSpec string formatted like "nid00001/2 nid00002/2" for above
+ * \param udiConfig UDI configuration object
+ *
+ * \returns 0 upon success, 1 upon failure
  */
-char **getSupportedFilesystems() {
-    char buffer[4096];
-    char **ret = (char **) _malloc(sizeof(char *) * 10);
-    char **writePtr = NULL;
-    size_t listExtent = 10;
-    size_t listLen = 0;
+int writeHostFile(const char *minNodeSpec, UdiRootConfig *udiConfig) {
+    char *minNode = NULL;
+    char *sptr = NULL;
+    char *eptr = NULL;
+    char *limit = NULL;
     FILE *fp = NULL;
+    char *filename = NULL;
+    int idx = 0;
 
-    fp = fopen("/proc/filesystems", "r");
+    if (minNodeSpec == NULL || udiConfig == NULL) return 1;
+    filename = _malloc(sizeof(char) * PATH_MAX);
+
+    minNode = _strdup(minNodeSpec);
+    limit = minNode + strlen(minNode);
+
+    snprintf(filename, PATH_MAX, "%s/var/hostsfile", udiConfig->udiMountPoint);
+    filename[PATH_MAX-1] = 0;
+
+    fp = fopen(filename, "w");
     if (fp == NULL) {
-        free(ret);
-        ret = NULL;
-        return NULL;
+        fprintf(stderr, "FAILED to open hostsfile for writing: %s\n", filename);
+        goto _writeHostFile_error;
     }
 
-    writePtr = ret;
-    *writePtr = NULL;
-    while (fgets(buffer, 4096, fp) != NULL) {
-        char *ptr = strchr(buffer, '\t');
+    sptr = minNode;
+    while (sptr < limit) {
+        /* find hostname */
+        char *hostname = sptr;
+        int count = 0;
+        eptr = strchr(sptr, '/');
+        if (eptr == NULL) {
+            /* parse error, should be hostname/number (e.g., nid00001/24) */
+            fprintf(stderr, "FAILED to identify hostname when writing hosts list\n");
+            goto _writeHostFile_error;
+        }
+        *eptr = 0;
 
-        if (ptr != NULL) {
-            ptr = shifter_trim(ptr);
-            if (strlen(ptr) == 0) continue;
-            if (listLen == listExtent - 2) {
-                char **tmp = (char **) _realloc(ret, sizeof(char *) * (listExtent + 10));
-                writePtr = tmp + (writePtr - ret);
-                ret = tmp;
-                listExtent += 10;
+        /* find count */
+        sptr = eptr + 1;
+        eptr = strchr(sptr, ' ');
+        if (eptr == NULL) eptr = sptr + strlen(sptr);
+        *eptr = 0;
+        count = (int) strtol(sptr, NULL, 10);
+        if (count == 0) {
+            /* parse error, not a number */
+            goto _writeHostFile_error;
+        }
+
+        /* write out */
+        for (idx = 0; idx < count; idx++) {
+            fprintf(fp, "%s\n", hostname);
+        }
+
+        sptr = eptr + 1;
+    }
+    fclose(fp);
+    fp = NULL;
+    free(filename);
+    filename = NULL;
+    free(minNode);
+    minNode = NULL;
+    return 0;
+
+_writeHostFile_error:
+    free(filename);
+    filename = NULL;
+    free(minNode);
+    minNode = NULL;
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    return 1;
+}
+
+/**
+ * _shifterCore_setBindMountAllowedDevices
+ * Authorize the devices of the UDI rootfs, the image source and /tmp as the
+ * only allowed volume mount targets.
+ */
+int _shifterCore_setBindMountAllowedDevices(ImageData *imageData,
+        UdiRootConfig *udiConfig)
+{
+    struct stat statData;
+    dev_t destRootDev = 0;
+    dev_t srcRootDev = 0;
+    dev_t tmpDev = 0;
+
+    /* get destination device */
+    if (lstat(udiConfig->udiMountPoint, &statData) != 0) {
+        fprintf(stderr, "FAILED to stat %s\n", udiConfig->udiMountPoint);
+        return 1;
+    }
+    destRootDev = statData.st_dev;
+
+    /* work out source device */
+    if (imageData->useLoopMount) {
+        if (lstat(udiConfig->loopMountPoint, &statData) != 0) {
+            fprintf(stderr, "FAILED to stat loop mount point.\n");
+            return 1;
+        }
+    } else {
+        if (lstat(imageData->filename, &statData) != 0) {
+            fprintf(stderr, "FAILED to stat udi source.\n");
+            return 1;
+        }
+    }
+    srcRootDev = statData.st_dev;
+
+    if (lstat("/tmp", &statData) != 0) {
+        fprintf(stderr, "FAILED to stat /tmp\n");
+        return 1;
+    }
+    tmpDev = statData.st_dev;
+
+    if (udiConfig->bindMountAllowedDevices != NULL) {
+        free(udiConfig->bindMountAllowedDevices);
+    }
+    udiConfig->bindMountAllowedDevices = _malloc(3 * sizeof(dev_t));
+    udiConfig->bindMountAllowedDevices[0] = destRootDev;
+    udiConfig->bindMountAllowedDevices[1] = srcRootDev;
+    udiConfig->bindMountAllowedDevices[2] = tmpDev;
+    udiConfig->bindMountAllowedDevices_sz = 3;
+    return 0;
+}
+
+int mountImageVFS(ImageData *imageData,
+                  const char *username,
+                  int verbose,
+                  const char *minNodeSpec,
+                  UdiRootConfig *udiConfig) {
+    struct stat statData;
+    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
+    char *sshPath = NULL;
+
+    umask(022);
+
+    if (imageData == NULL || username == NULL || udiConfig == NULL) {
+        fprintf(stderr, "Invalid arguments to mountImageVFS(), error.\n");
+        goto _mountImgVfs_unclean;
+    }
+    if (imageData->type != NULL && strcmp(imageData->type, "local") == 0 && udiConfig->allowLocalChroot == 0) {
+        fprintf(stderr, "local chroot path requested, but this is disallowed by site policy, Fail.\n");
+        goto _mountImgVfs_unclean;
+    }
+
+#define _MKDIR(dir, perm) if (mkdir(dir, perm) != 0) { \
+    fprintf(stderr, "FAILED to mkdir %s. Exiting.\n", dir); \
+    goto _mountImgVfs_unclean; \
+}
+
+    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
+
+    if (lstat(udiRoot, &statData) != 0) {
+        _MKDIR(udiRoot, 0755);
+    }
+
+#define BIND_IMAGE_INTO_UDI(subtree, img, udiConfig, copyFlag) \
+    if (bindImageIntoUDI(subtree, img, udiConfig, copyFlag) > 1) { \
+        fprintf(stderr, "FAILED To setup \"%s\" in %s\n", subtree, udiRoot); \
+        goto _mountImgVfs_unclean; \
+    }
+
+    /* mount a new rootfs to work in */
+    if (mount(NULL, udiRoot, udiConfig->rootfsType, MS_NOSUID|MS_NODEV, NULL) != 0) {
+        fprintf(stderr, "FAILED to mount rootfs on %s\n", udiRoot);
+        perror("   --- REASON: ");
+        goto _mountImgVfs_unclean;
+    }
+    if (makeUdiMountPrivate(udiConfig) != 0) {
+        fprintf(stderr, "FAILED to mark the udi as a private mount\n");
+        goto _mountImgVfs_unclean;
+    }
+
+    if (chmod(udiRoot, 0755) != 0) {
+        fprintf(stderr, "FAILED to chmod \"%s\" to 0755.\n", udiRoot);
+        goto _mountImgVfs_unclean;
+    }
+
+    if (_shifterCore_setBindMountAllowedDevices(imageData, udiConfig) != 0) {
+        goto _mountImgVfs_unclean;
+    }
+
+
+    /* get our needs injected first */
+    if (prepareSiteModifications(username, minNodeSpec, udiConfig) != 0) {
+        fprintf(stderr, "FAILED to properly setup site modifications\n");
+        goto _mountImgVfs_unclean;
+    }
+
+    /* copy/bind mount pieces into prepared site */
+    BIND_IMAGE_INTO_UDI("/", imageData, udiConfig, 0);
+    BIND_IMAGE_INTO_UDI("/var", imageData, udiConfig, 0);
+    BIND_IMAGE_INTO_UDI("/opt", imageData, udiConfig, 0);
+
+    /* setup sshd configuration */
+    sshPath = alloc_strgenf("%s/etc/ssh", udiRoot);
+    if (sshPath != NULL) {
+        _MKDIR(sshPath, 0755);
+        free(sshPath);
+        sshPath = NULL;
+    }
+
+    /* copy image /etc into place */
+    BIND_IMAGE_INTO_UDI("/etc", imageData, udiConfig, 1);
+
+#undef BIND_IMAGE_INTO_UDI
+#undef _MKDIR
+
+    free(udiRoot);
+    return 0;
+
+_mountImgVfs_unclean:
+    if (sshPath != NULL) {
+        free(sshPath);
+    }
+    free(udiRoot);
+    return 1;
+}
+
+/** makeUdiMountPrivate
+ *  Some Linux systems default their mounts to "shared" mounts, which means
+ *  that mount option changes Shifter makes (or unmounts) can propagate back up
+ *  to the original mount, which is not desirable.  This function remounts the
+ *  base udiMount point as MS_PRIVATE - which means that no external mount
+ *  changes propagate into these mountpoints, nor do these go back up the
+ *  chain.  It may be desirable to allow sites to choose MS_SLAVE instead of
+ *  MS_PRIVATE here, as that will allow site unmounts to propagate into shifter
+ *  containers.
+ */
+int makeUdiMountPrivate(UdiRootConfig *udiConfig) {
+    char *buffer = _malloc(sizeof(char) * PATH_MAX);
+    snprintf(buffer, PATH_MAX, "%s", udiConfig->udiMountPoint);
+    if (mount(NULL, buffer, NULL, MS_PRIVATE|MS_REC, NULL) != 0) {
+        perror("Failed to remount non-shared.");
+        free(buffer);
+        return 1;
+    }
+    free(buffer);
+    return 0;
+}
+
+int remountUdiRootReadonly(UdiRootConfig *udiConfig) {
+    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
+
+    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
+        free(udiRoot);
+        return 1;
+    }
+    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
+
+    if (mount(udiRoot, udiRoot, udiConfig->rootfsType, MS_REMOUNT|MS_NOSUID|MS_NODEV|MS_RDONLY, NULL) != 0) {
+        fprintf(stderr, "FAILED to remount rootfs readonly on %s\n", udiRoot);
+        perror("   --- REASON: ");
+        goto _remountUdiRootReadonly_unclean;
+    }
+    free(udiRoot);
+    return 0;
+
+_remountUdiRootReadonly_unclean:
+    free(udiRoot);
+    return 1;
+}
+
+int mountImageLoop(ImageData *imageData, UdiRootConfig *udiConfig) {
+    char *loopMountPath = _malloc(sizeof(char) * PATH_MAX);
+    char *imagePath = _malloc(sizeof(char) * PATH_MAX);
+    if (imageData == NULL || udiConfig == NULL) {
+        goto _mountImageLoop_unclean;
+    }
+    if (imageData->useLoopMount == 0) {
+        goto _finish_normal;
+    }
+    if (udiConfig->loopMountPoint == NULL || strlen(udiConfig->loopMountPoint) == 0) {
+        goto _mountImageLoop_unclean;
+    }
+    if (mkdir(udiConfig->loopMountPoint, 0755) != 0) {
+        if (errno != EEXIST) {
+            fprintf(stderr, "FAILED to mkdir %s. Exiting.\n", udiConfig->loopMountPoint);
+            goto _mountImageLoop_unclean;
+        }
+    }
+
+    snprintf(loopMountPath, PATH_MAX, "%s", udiConfig->loopMountPoint);
+    loopMountPath[PATH_MAX-1] = 0;
+    snprintf(imagePath, PATH_MAX, "%s", imageData->filename);
+    imagePath[PATH_MAX-1] = 0;
+    if (loopMount(imagePath, loopMountPath, imageData->format, udiConfig, 1) != 0) {
+        fprintf(stderr, "FAILED to loop mount image: %s\n", imagePath);
+        goto _mountImageLoop_unclean;
+    }
+_finish_normal:
+    free(loopMountPath);
+    free(imagePath);
+    return 0;
+_mountImageLoop_unclean:
+    free(loopMountPath);
+    free(imagePath);
+    return 1;
+}
+
+/**
+ * _sortFsTypeForward
+ * Utility function use for comparisons for sorting filesystems
+ */
+static int _sortFsTypeForward(const void *ta, const void *tb) {
+    const char **a = (const char **) ta;
+    const char **b = (const char **) tb;
+
+    return strcmp(*a, *b);
+}
+
+/** getSupportedFilesystems
+ *  Read /proc/filesystems and produce a list of filesystems supported by this
+ *  kernel.
+ *
+ *  Returns NULL-terminated array of strings with all filesystem types
+ */
+char **getSupportedFilesystems() {
+    char buffer[4096];
+    char **ret = (char **) _malloc(sizeof(char *) * 10);
+    char **writePtr = NULL;
+    size_t listExtent = 10;
+    size_t listLen = 0;
+    FILE *fp = NULL;
+
+    fp = fopen("/proc/filesystems", "r");
+    if (fp == NULL) {
+        free(ret);
+        ret = NULL;
+        return NULL;
+    }
+
+    writePtr = ret;
+    *writePtr = NULL;
+    while (fgets(buffer, 4096, fp) != NULL) {
+        char *ptr = strchr(buffer, '\t');
+
+        if (ptr != NULL) {
+            ptr = shifter_trim(ptr);
+            if (strlen(ptr) == 0) continue;
+            if (listLen == listExtent - 2) {
+                char **tmp = (char **) _realloc(ret, sizeof(char *) * (listExtent + 10));
+                writePtr = tmp + (writePtr - ret);
+                ret = tmp;
+                listExtent += 10;
+            }
+            *writePtr = _strdup(ptr);
+            writePtr++;
+            *writePtr = NULL;
+            listLen++;
+        }
+    }
+    qsort(ret, listLen, sizeof(char *), _sortFsTypeForward);
+
+    fclose(fp);
+    fp = NULL;
+    return ret;
+}
+
+int supportsFilesystem(char *const * fsTypes, const char *fsType) {
+    char *const *ptr = fsTypes;
+
+    if (fsTypes == NULL || fsType == NULL) {
+        return -1;
+    }
+    for (ptr = fsTypes; ptr && *ptr; ptr++) {
+        if (strcmp(fsType, *ptr) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int loopMount(const char *imagePath, const char *loopMountPath, ImageFormat format, UdiRootConfig *udiConfig, int readOnly) {
+    char *mountExec = _malloc(sizeof(char) * PATH_MAX);
+    struct stat statData;
+    int ready = 0;
+    int useAutoclear = 0;
+    const char *imgType = NULL;
+    char **fstypes = getSupportedFilesystems();
+
+    snprintf(mountExec, PATH_MAX, "%s/mount", LIBEXECDIR);
+    if (stat(mountExec, &statData) != 0) {
+        fprintf(stderr, "udiRoot mount executable missing: %s\n", mountExec);
+        goto _loopMount_unclean;
+    } else if (statData.st_uid != 0 || statData.st_mode & S_IWGRP || statData.st_mode & S_IWOTH || !(statData.st_mode & S_IXUSR)) {
+        fprintf(stderr, "udiRoot mount has incorrect ownership or permissions: %s\n", mountExec);
+        goto _loopMount_unclean;
+    }
+
+    if (stat("/dev/loop0", &statData) != 0) {
+        fprintf(stderr, "ERROR: no apparent support for loop devices!");
+        goto _loopMount_unclean;
+    }
+    if (format == FORMAT_SQUASHFS) {
+        if (supportsFilesystem(fstypes, "squashfs") != 0) {
+            fprintf(stderr, "ERROR: no apparent support for squashfs!");
+            goto _loopMount_unclean;
+        }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0)
+        useAutoclear = 0;
+#else
+        useAutoclear = 1;
+#endif
+        ready = 1;
+        imgType = "squashfs";
+    } else if (format == FORMAT_XFS) {
+        if (supportsFilesystem(fstypes, "xfs") != 0) {
+            fprintf(stderr, "ERROR: no apparent support for xfs!");
+            goto _loopMount_unclean;
+        }
+        useAutoclear = 0;
+        ready = 1;
+        imgType = "xfs";
+    } else if (format == FORMAT_EROFS) {
+        if (supportsFilesystem(fstypes, "erofs") != 0) {
+            fprintf(stderr, "ERROR: no apparent support for erofs!");
+            goto _loopMount_unclean;
+        }
+        /* erofs is read-only; older (staging) erofs kernels do not release
+         * the loop device on unmount */
+        readOnly = 1;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0)
+        useAutoclear = 0;
+#else
+        useAutoclear = 1;
+#endif
+        ready = 1;
+        imgType = "erofs";
+    } else {
+        fprintf(stderr, "ERROR: unknown image format.\n");
+        goto _loopMount_unclean;
+    }
+    if (ready) {
+        char *args[] = {
+            _strdup(mountExec),
+            _strdup("-n"),
+            _strdup("-o"),
+            alloc_strgenf("loop,nosuid,nodev%s%s",
+                    (readOnly ? ",ro" : ""),
+                    (useAutoclear ? ",autoclear" : "")
+            ),
+            _strdup("-t"),
+            _strdup(imgType),
+            _strdup(imagePath),
+            _strdup(loopMountPath),
+            NULL
+        };
+        char **argsPtr = NULL;
+        int ret = 0;
+        for (argsPtr = args; argsPtr - args < 8; argsPtr++) {
+            if (argsPtr == NULL || *argsPtr == NULL) {
+                ret = 1;
+            }
+        }
+        if (ret == 0) {
+            ret = forkAndExecvSilent(args);
+        }
+        for (argsPtr = args; argsPtr && *argsPtr; argsPtr++) {
+            free(*argsPtr);
+        }
+        if (ret != 0) {
+            fprintf(stderr, "FAILED to mount image %s (%s) on %s\n", imagePath, imgType, loopMountPath);
+            goto _loopMount_unclean;
+        }
+    }
+
+    if (fstypes != NULL) {
+        char **ptr = NULL;
+        for (ptr = fstypes; ptr && *ptr; ptr++) {
+            free(*ptr);
+        }
+        free(fstypes);
+        fstypes = NULL;
+    }
+    free(mountExec);
+    return 0;
+_loopMount_unclean:
+
+    if (fstypes != NULL) {
+        char **ptr = NULL;
+        for (ptr = fstypes; ptr && *ptr; ptr++) {
+            free(*ptr);
+        }
+        free(fstypes);
+        fstypes = NULL;
+    }
+    free(mountExec);
+    return 1;
+}
+
+/**
+ * _shifterCore_warmVolumeSources
+ * Access the sources of the siteFs and active module volumes from a few
+ * worker processes at once.  Automounted network filesystems can take
+ * hundreds of ms to mount on first access; triggering them concurrently
+ * means setupVolumeMapMounts does not wait for each one in turn when it
+ * validates and mounts the volumes in order.  Errors are ignored here, they
+ * are reported when the volume is mounted.
+ *
+ * Returns the number of sources accessed.
+ */
+size_t _shifterCore_warmVolumeSources(UdiRootConfig *udiConfig) {
+    VolumeMap **maps = NULL;
+    const char **sources = NULL;
+    pid_t workers[VOLUME_WARM_WORKERS];
+    size_t n_maps = 0;
+    size_t n_sources = 0;
+    size_t n_workers = 0;
+    size_t idx = 0;
+    size_t jdx = 0;
+    int midx = 0;
+
+    if (udiConfig == NULL) {
+        return 0;
+    }
+    maps = (VolumeMap **) _malloc(sizeof(VolumeMap *) *
+            (udiConfig->n_active_modules + 1));
+    if (udiConfig->siteFs != NULL) {
+        maps[n_maps++] = udiConfig->siteFs;
+    }
+    for (midx = 0; midx < udiConfig->n_active_modules; midx++) {
+        if (udiConfig->active_modules[midx]->siteFs != NULL) {
+            maps[n_maps++] = udiConfig->active_modules[midx]->siteFs;
+        }
+    }
+    for (idx = 0; idx < n_maps; idx++) {
+        n_sources += maps[idx]->n;
+    }
+    if (n_sources < 2) {
+        free(maps);
+        return 0;
+    }
+
+    sources = (const char **) _malloc(sizeof(char *) * n_sources);
+    n_sources = 0;
+    for (idx = 0; idx < n_maps; idx++) {
+        for (jdx = 0; jdx < maps[idx]->n; jdx++) {
+            VolumeMapFlag *flags = maps[idx]->flags[jdx];
+            int pernode = 0;
+            for ( ; flags && flags->type != 0; flags++) {
+                if (flags->type == VOLMAP_FLAG_PERNODECACHE) {
+                    pernode = 1;
+                }
+            }
+            if (!pernode) {
+                sources[n_sources++] = maps[idx]->from[jdx];
+            }
+        }
+    }
+
+    for (n_workers = 0; n_workers < VOLUME_WARM_WORKERS &&
+            n_workers < n_sources; n_workers++)
+    {
+        pid_t pid = fork();
+        if (pid < 0) {
+            break;
+        }
+        if (pid == 0) {
+            char path[PATH_MAX];
+            struct stat statData;
+            for (idx = n_workers; idx < n_sources; idx += VOLUME_WARM_WORKERS) {
+                /* stat the inside of the directory to trigger direct maps */
+                snprintf(path, PATH_MAX, "%s/.", sources[idx]);
+                stat(path, &statData);
+            }
+            _exit(0);
+        }
+        workers[n_workers] = pid;
+    }
+    /* anything not handed to a worker is simply accessed when mounted */
+    for (idx = 0; idx < n_workers; idx++) {
+        int status = 0;
+        while (waitpid(workers[idx], &status, 0) < 0 && errno == EINTR) { }
+    }
+    free(sources);
+    free(maps);
+    return n_sources;
+}
+
+int setupUserMounts(VolumeMap *map, UdiRootConfig *udiConfig) {
+    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
+    MountList mountCache;
+    struct stat statData;
+    int ret = 0;
+    dev_t udiMountDev = 0;
+
+    memset(&mountCache, 0, sizeof(MountList));
+    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
+    udiRoot[PATH_MAX-1] = 0;
+
+    if (stat(udiRoot, &statData) != 0) {
+        fprintf(stderr, "FAILED to stat udiRoot %s\n", udiRoot);
+        free(udiRoot);
+        return 1;
+    }
+    udiMountDev = statData.st_dev;
+
+    /* get list of current mounts for this namespace */
+    if (parse_MountList(&mountCache) != 0) {
+        fprintf(stderr, "FAILED to get list of current mount points\n");
+        free(udiRoot);
+        return 1;
+    }
+
+    ret = setupVolumeMapMounts(&mountCache, map, 1, udiMountDev, udiConfig);
+    free_MountList(&mountCache, 0);
+    free(udiRoot);
+    return ret;
+}
+
+int setupPerNodeCacheFilename(
+        UdiRootConfig *udiConfig,
+        VolMapPerNodeCacheConfig *cache,
+        char *buffer,
+        size_t buffer_len)
+{
+    char hostname_buf[128];
+    size_t pos = 0;
+    int fd = 0;
+    int nbytes = 0;
+
+    if (    cache == NULL ||
+            cache->fstype == NULL  ||
+            buffer == NULL ||
+            buffer_len == 0 ||
+            udiConfig == NULL)
+    {
+        return -1;
+    }
+    if (    udiConfig->perNodeCachePath == NULL ||
+            strlen(udiConfig->perNodeCachePath) == 0)
+    {
+        fprintf(stderr, "udiRoot.conf does not have a valid perNodeCachePath."
+                " Cannot generate perNodeCache backing stores.\n");
+        return -1;
+    }
+    if (udiConfig->target_uid == 0 || udiConfig->target_gid == 0) {
+        fprintf(stderr, "will not setup per-node cache with target uid or gid of 0\n");
+        return -1;
+    }
+    pos = strlen(buffer);
+    if (pos > buffer_len) {
+        return -1;
+    }
+    if (gethostname(hostname_buf, 128) != 0) {
+        return -1;
+    }
+    nbytes = snprintf(buffer, buffer_len, "%s/perNodeCache_uid%d_gid%d_%s.%s.XXXXXX",
+            udiConfig->perNodeCachePath,
+            udiConfig->target_uid,
+            udiConfig->target_gid,
+            hostname_buf,
+            cache->fstype
+    );
+    if (nbytes < 0) {
+        fprintf(stderr, "FAILED to write perNodeCache filename into buffer.\n");
+        return -1;
+    }
+    if (nbytes >= 0 && (size_t) nbytes >= buffer_len) {
+        fprintf(stderr, "perNodeCache filename too long to store in buffer.\n");
+        return -1;
+    }
+    mode_t old_umask = umask(077);
+    fd = mkstemp(buffer);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open perNodeCache backing store %s.\n",
+                buffer);
+        perror("Error: ");
+        umask(old_umask);
+        return -1;
+    }
+    umask(old_umask);
+    return fd;
+}
+
+int setupPerNodeCacheBackingStore(VolMapPerNodeCacheConfig *cache, const char *buffer, UdiRootConfig *udiConfig) {
+    if (udiConfig == NULL || cache == NULL || cache->fstype == NULL) {
+        fprintf(stderr, "configuration is invalid (null), cannot setup per-node cache\n");
+        return 1;
+    }
+    char *args[7];
+    char **arg = NULL;
+    int ret = 0;
+    if (udiConfig->ddPath == NULL) {
+        fprintf(stderr, "Must define ddPath in udiRoot configuration to use this feature\n");
+        return 1;
+    }
+    args[0] = _strdup(udiConfig->ddPath);
+    args[1] = _strdup("if=/dev/zero");
+    args[2] = alloc_strgenf("of=%s", buffer);
+    args[3] = _strdup("bs=1");
+    args[4] = _strdup("count=0");
+    args[5] = alloc_strgenf("seek=%lu", cache->cacheSize);
+    args[6] = NULL;
+    for (arg = args; arg - args < 6; arg++) {
+        if (arg == NULL || *arg == NULL) {
+            fprintf(stderr, "FAILED to allocate memory!\n");
+            ret = 1;
+        }
+    }
+    if (ret == 0) {
+        ret = forkAndExecvSilent(args);
+    }
+    for (arg = args; *arg; arg++) {
+        free(*arg);
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "FAILED to dd backing store for cache on %s, %d\n", buffer, ret);
+        return 1;
+    }
+    if (strcmp(cache->fstype, "xfs") == 0) {
+        char **args = NULL;
+        char **argPtr = NULL;
+        int ret = 0;
+        if (udiConfig->mkfsXfsPath == NULL) {
+            fprintf(stderr, "Must define mkfsXfsPath in udiRoot configuration to use this feature\n");
+            exit(1);
+        }
+        args = (char **) _malloc(sizeof(char *) * 4);
+        args[0] = _strdup(udiConfig->mkfsXfsPath);
+        args[1] = _strdup("-d");
+        args[2] = alloc_strgenf("name=%s,file=1,size=%lu", buffer, cache->cacheSize);
+        args[3] = NULL;
+        ret = forkAndExecvSilent(args);
+        for (argPtr = args; argPtr && *argPtr; argPtr++) {
+            free(*argPtr);
+        }
+        free(args);
+        if (ret != 0) {
+            fprintf(stderr, "FAILED to create the XFS cache filesystem on %s\n", buffer);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int setupVolumeMapMounts(
+        MountList *mountCache,
+        VolumeMap *map,
+        int userRequested,
+        dev_t createToDev,
+        UdiRootConfig *udiConfig
+) {
+    char *filtered_from = NULL;
+    char *filtered_to = NULL;
+    char *to_real = NULL;
+    char *from_real = NULL;
+    VolumeMapFlag *flags = NULL;
+    int (*_validate_fp)(const char *, const char *, VolumeMapFlag *);
+
+    size_t *order = NULL;
+    size_t orderIdx = 0;
+    size_t udiMountLen = 0;
+
+    char *from_buffer = _malloc(sizeof(char) * PATH_MAX);
+    char *to_buffer = _malloc(sizeof(char) * PATH_MAX);
+    struct stat statData;
+
+    if (udiConfig == NULL) {
+        free(from_buffer);
+        free(to_buffer);
+        return 1;
+    }
+
+    if (map == NULL || map->n == 0) {
+        free(from_buffer);
+        free(to_buffer);
+        return 0;
+    }
+
+    if (userRequested == 0) {
+        _validate_fp = validateVolumeMap_siteRequest;
+    } else {
+        _validate_fp = validateVolumeMap_userRequest;
+    }
+
+    udiMountLen = strlen(udiConfig->udiMountPoint);
+
+    /* mount parents before the entries nested below them */
+    order = getVolumeMapMountOrder(map);
+    if (order == NULL) {
+        free(from_buffer);
+        free(to_buffer);
+        return 1;
+    }
+
+    for (orderIdx = 0; orderIdx < map->n; orderIdx++) {
+        size_t mapIdx = order[orderIdx];
+        size_t flagsInEffect = 0;
+        size_t flagIdx = 0;
+        int backingStoreExists = 0;
+        filtered_from = userInputPathFilter(map->from[mapIdx], 1);
+        filtered_to = userInputPathFilter(map->to[mapIdx], 1);
+        flags = map->flags[mapIdx];
+
+        if (filtered_from == NULL || filtered_to == NULL) {
+            fprintf(stderr, "INVALID mount from %s to %s\n",
+                    map->from[mapIdx], map->to[mapIdx]);
+            goto _handleVolMountError;
+        }
+        snprintf(from_buffer, PATH_MAX, "%s/%s",
+                (userRequested != 0 ? udiConfig->udiMountPoint : ""),
+                filtered_from
+        );
+        from_buffer[PATH_MAX-1] = 0;
+        snprintf(to_buffer, PATH_MAX, "%s/%s",
+                udiConfig->udiMountPoint,
+                filtered_to
+        );
+        to_buffer[PATH_MAX-1] = 0;
+
+        free(filtered_to);
+        filtered_to = NULL;
+
+        /* check if this is a per-volume cache, and if so mangle the from name
+         * and then create the volume backing store */
+        for (flagIdx = 0; flags && flags[flagIdx].type != 0; flagIdx++) {
+            flagsInEffect |= flags[flagIdx].type;
+            if (flags[flagIdx].type == VOLMAP_FLAG_PERNODECACHE) {
+                int ret = 0;
+                int fd = 0;
+
+                VolMapPerNodeCacheConfig *cache =
+                        (VolMapPerNodeCacheConfig *) flags[flagIdx].value;
+                fd = setupPerNodeCacheFilename(udiConfig, cache, from_buffer,
+                        PATH_MAX);
+                if (fd < 0) {
+                    fprintf(stderr, "FAILED to set perNodeCache name\n");
+                    goto _handleVolMountError;
+                }
+
+                /* intialize the backing store */
+                ret = setupPerNodeCacheBackingStore(cache, from_buffer, udiConfig);
+                if (ret != 0) {
+                    fprintf(stderr, "FAILED to setup perNodeCache\n");
+                    goto _handleVolMountError;
+                }
+                close(fd);
+                backingStoreExists = 1;
+            }
+        }
+
+        /* if this is not a per-node cache (i.e., is a standand volume mount),
+         * then validate the user has permissions to view the content, by
+         * performing realpath() and lstat() as the user */
+        if (!(flagsInEffect & VOLMAP_FLAG_PERNODECACHE)) {
+            uid_t orig_euid = geteuid();
+            gid_t orig_egid = getegid();
+            gid_t *orig_auxgids = NULL;
+            int norig_auxgids = 0;
+            int switch_user_stage = 0;
+
+            /* switch privileges if this is a user mount to ensure we only
+             * grant access to resources the user can reach at time of
+             * invocation */
+            if (userRequested != 0) {
+                if (udiConfig->auxiliary_gids == NULL ||
+                        udiConfig->nauxiliary_gids <= 0 ||
+                        udiConfig->target_uid == 0 ||
+                        udiConfig->target_gid == 0)
+                {
+                    fprintf(stderr, "Insufficient information about target "
+                            "user to setup volume mount\n");
+                    goto _fail_check_fromvol;
+                }
+                norig_auxgids = getgroups(0, NULL);
+                if (norig_auxgids < 0) {
+                    fprintf(stderr, "FAILED to getgroups.\n");
+                    goto _fail_check_fromvol;
+                } else if (norig_auxgids > 0) {
+                    orig_auxgids = (gid_t *) _malloc(sizeof(gid_t) * norig_auxgids);
+                    norig_auxgids = getgroups(norig_auxgids, orig_auxgids);
+                    if (norig_auxgids <= 0) {
+                        fprintf(stderr, "FAILED to getgroups().\n");
+                        goto _fail_check_fromvol;
+                    }
+                }
+
+                if (setgroups(udiConfig->nauxiliary_gids, udiConfig->auxiliary_gids) != 0) {
+                    fprintf(stderr, "FAILED to assume user auxiliary gids\n");
+                    goto _fail_check_fromvol;
+                }
+                switch_user_stage++;
+
+                if (setegid(udiConfig->target_gid) != 0) {
+                    fprintf(stderr, "FAILED to assume user gid\n");
+                    goto _fail_check_fromvol;
+                }
+                switch_user_stage++;
+
+                if (seteuid(udiConfig->target_uid) != 0) {
+                    fprintf(stderr, "FAILED to assume user uid\n");
+                    goto _fail_check_fromvol;
+                }
+                switch_user_stage++;
+            }
+
+            /* perform some introspection on the path to get it's real location
+             * and vital attributes */
+            if (userRequested != 0) {
+                char *from_real_shft = shifter_realpath(filtered_from, udiConfig);
+                if (from_real_shft == NULL) {
+                    fprintf(stderr, "FAILED to find real path for volume "
+                            "\"from\": %s\n", filtered_from);
+                    goto _fail_check_fromvol;
+                }
+                from_real = realpath(from_real_shft, NULL);
+                free(from_real_shft);
+            } else {
+                from_real = realpath(from_buffer, NULL);
+            }
+            if (from_real == NULL) {
+                fprintf(stderr, "FAILED to find real path for volume "
+                        "\"from\": %s\n", from_buffer);
+                goto _fail_check_fromvol;
+            }
+            if (lstat(from_real, &statData) != 0) {
+                fprintf(stderr, "FAILED to find volume \"from\": %s\n", from_buffer);
+                goto _fail_check_fromvol;
+            }
+            if (!S_ISDIR(statData.st_mode)) {
+                fprintf(stderr, "FAILED \"from\" location is not directory: "
+                        "%s\n", from_real);
+                goto _fail_check_fromvol;
+            }
+
+            /* switch back to original privileges */
+            if (userRequested != 0) {
+                if (seteuid(orig_euid) != 0) {
+                    fprintf(stderr, "FAILED to assume original user effective uid\n");
+                    goto _fail_check_fromvol;
+                }
+                switch_user_stage--;
+
+                if (setegid(orig_egid) != 0) {
+                    fprintf(stderr, "FAILED to assume original user effective gid\n");
+                    goto _fail_check_fromvol;
+                }
+                switch_user_stage--;
+
+                if (setgroups(norig_auxgids, orig_auxgids) != 0) {
+                    fprintf(stderr, "FAILED to assume original user auxiliary gids\n");
+                    goto _fail_check_fromvol;
+                }
+                switch_user_stage--;
+            }
+            /* skip over error handler */
+            goto _pass_check_fromvol;
+
+_fail_check_fromvol:
+            if (switch_user_stage > 0) {
+                /* TODO decide if we should re-assume original privileges for
+                 * the crash */
+            }
+            if (orig_auxgids != NULL) {
+                free(orig_auxgids);
+                orig_auxgids = NULL;
+            }
+            goto _handleVolMountError;
+
+_pass_check_fromvol:
+            if (orig_auxgids != NULL) {
+                free(orig_auxgids);
+                orig_auxgids = NULL;
+            }
+        } else {
+            from_real = realpath(from_buffer, NULL);
+        }
+        if (lstat(to_buffer, &statData) != 0) {
+            if (createToDev) {
+                int okToMkdir = 0;
+
+                char *ptr = strrchr(to_buffer, '/');
+                if (ptr) {
+                    /* get parent path of intended dir */
+                    *ptr = '\0';
+
+                    /* if parent path is on the same device as is authorized by createToDev
+                       then ok the mkdir operation */
+                    if (lstat(to_buffer, &statData) == 0) {
+                        if (statData.st_dev == createToDev) {
+                            okToMkdir = 1;
+                        }
+                    }
+
+                    /* reset to target path */
+                    *ptr = '/';
+                }
+
+                if (okToMkdir) {
+                    mkdir(to_buffer, 0755);
+                    if (lstat(to_buffer, &statData) != 0) {
+                        fprintf(stderr, "FAILED to find volume \"to\": %s\n",
+                                to_buffer);
+                        goto _handleVolMountError;
+                    }
+                } else {
+                    fprintf(stderr, "FAILED to create volume \"to\": %s, cannot"
+                            " create mount points in that location\n",
+                            to_buffer);
+                    goto _handleVolMountError;
+                }
+            } else {
+                fprintf(stderr, "FAILED to find volume \"to\": %s\n", to_buffer);
+                goto _handleVolMountError;
+            }
+        }
+        if (!S_ISDIR(statData.st_mode)) {
+            fprintf(stderr, "FAILED \"to\" location is not directory: %s\n", to_buffer);
+            goto _handleVolMountError;
+        }
+
+        to_real = realpath(to_buffer, NULL);
+        if (to_real == NULL) {
+            fprintf(stderr, "Failed to get realpath for %s\n", to_buffer);
+            goto _handleVolMountError;
+        } else if (from_real == NULL) {
+            fprintf(stderr, "Failed to get realpath for %s\n", from_buffer);
+            goto _handleVolMountError;
+        } else {
+            size_t to_len = strlen(to_real);
+            size_t from_len = strlen(from_real);
+            size_t idx = 0;
+            int volMountDevOk = 0;
+            const char *container_to_real = NULL;
+            const char *container_from_real = NULL;
+            int ret = 0;
+            struct stat toStat;
+
+            /* validate that path starts with udiMountPoint */
+            if (to_len <= udiMountLen ||
+                strncmp(to_real, udiConfig->udiMountPoint, udiMountLen) != 0) {
+
+                fprintf(stderr, "Invalid destination %s, not allowed, fail.\n", to_real);
+                goto _handleVolMountError;
+            }
+
+            /* validate source mount point */
+            if (userRequested != 0 && !(flagsInEffect & VOLMAP_FLAG_PERNODECACHE)) {
+                if (from_len <= udiMountLen ||
+                    strncmp(from_real, udiConfig->udiMountPoint, udiMountLen) != 0) {
+
+                    fprintf(stderr, "Invalid source %s, not allowed, fail.\n", from_real);
+                    goto _handleVolMountError;
+                } else {
+                    /* from_real is known to be longer than udiMountLen from
+                     * previous check (i.e., don't remove the check!) */
+                    container_from_real = from_real + udiMountLen;
+                }
+            } else {
+                container_from_real = from_real;
+            }
+
+            /* validate that the path is allowed */
+            /* to_real is known to be longer than udiMountLen from previous
+             * check (i.e., don't remove the check!) */
+            container_to_real = to_real + udiMountLen;
+
+            if ((ret = _validate_fp(container_from_real, container_to_real, flags)) != 0) {
+                fprintf(stderr, "Invalid mount request, permission denied! "
+                        "Cannot mount from %s to %s. Err Code %d\n",
+                        container_from_real, container_to_real, ret);
+                goto _handleVolMountError;
+            }
+
+            /* the destination mount must be either in the shifter root
+             * filesystem, or on the orignal device providing the container
+             * image.  Should not allow volume mounts onto other imported
+             * content */
+            memset(&toStat, 0, sizeof(struct stat));
+            if (lstat(to_real, &toStat) != 0) {
+                fprintf(stderr, "Failed to stat destination mount point: %s\n",
+                        strerror(errno));
+                goto _handleVolMountError;
+            }
+            if (udiConfig->bindMountAllowedDevices == NULL) {
+                fprintf(stderr, "No devices are authorized to accept "
+                        "volume mounts.\n");
+                goto _handleVolMountError;
+            }
+
+            volMountDevOk = 0;
+            for (idx = 0; idx < udiConfig->bindMountAllowedDevices_sz; idx++) {
+                if (toStat.st_dev == udiConfig->bindMountAllowedDevices[idx]) {
+                    volMountDevOk = 1;
+                    break;
+                }
+            }
+            /* Allow mounts if the user owns the destionation directory. */
+            int toDirOwnedByUser = 0;
+            if (statData.st_uid == geteuid()) {
+                toDirOwnedByUser = 1;
+            }
+            if (volMountDevOk == 0 && toDirOwnedByUser == 0) {
+                fprintf(stderr, "Mount request path %s not on an approved "
+                        "device for volume mounts.\n", to_real);
+                goto _handleVolMountError;
+            }
+        }
+
+        if (flagsInEffect & VOLMAP_FLAG_PERNODECACHE) {
+            VolMapPerNodeCacheConfig *cacheConfig = NULL;
+            /* do something to mount backing store */
+            for (flagIdx = 0; flags && flags[flagIdx].type != 0; flagIdx++) {
+                if (flags[flagIdx].type == VOLMAP_FLAG_PERNODECACHE) {
+                    cacheConfig = (VolMapPerNodeCacheConfig *) flags[flagIdx].value;
+                    break;
+                }
+            }
+            if (cacheConfig == NULL) {
+                fprintf(stderr, "FAILED to find per-node cache config, exiting.\n");
+                goto _handleVolMountError;
+            }
+            ImageFormat format = FORMAT_INVALID;
+            if (strcmp(cacheConfig->fstype, "xfs") == 0) {
+                format = FORMAT_XFS;
+            }
+            if (strcmp(cacheConfig->method, "loop") == 0) {
+                if (loopMount(from_buffer, to_real, format, udiConfig, 0) != 0) {
+                    fprintf(stderr, "FAILED to mount per-node cache, exiting.\n");
+                    goto _handleVolMountError;
+                }
+                insert_MountList(mountCache, to_real);
+            } else {
+                fprintf(stderr, "FAILED to understand per-node cache mounting method, exiting.\n");
+                goto _handleVolMountError;
+            }
+            if (chown(to_real, udiConfig->target_uid, udiConfig->target_gid) != 0) {
+                fprintf(stderr, "FAILED to chown per-node cache to user.\n");
+                goto _handleVolMountError;
+            }
+            if (unlink(from_buffer) != 0) {
+                fprintf(stderr, "FAILED to unlink backing file: %s!", from_buffer);
+                perror("Error: ");
+                goto _handleVolMountError;
+            }
+
+        } else {
+            int allowOverwriteBind = 1;
+
+            if (_shifterCore_bindMount(udiConfig, mountCache, from_real, to_real, flagsInEffect, allowOverwriteBind) != 0) {
+                fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n", from_buffer, to_real);
+                goto _handleVolMountError;
             }
-            *writePtr = _strdup(ptr);
-            writePtr++;
-            *writePtr = NULL;
-            listLen++;
         }
-    }
-    qsort(ret, listLen, sizeof(char *), _sortFsTypeForward);
+        free(to_real);
+        to_real = NULL;
+        free(from_real);
+        from_real = NULL;
+        free(filtered_from);
+        filtered_from = NULL;
 
-    fclose(fp);
-    fp = NULL;
-    return ret;
-}
+        continue;
+_handleVolMountError:
+        if ((flagsInEffect & VOLMAP_FLAG_PERNODECACHE) && backingStoreExists == 1) {
+            unlink(from_buffer);
+        }
+        goto _setupVolumeMapMounts_unclean;
+    }
 
-int supportsFilesystem(char *const * fsTypes, const char *fsType) {
-    char *const *ptr = fsTypes;
+#undef _BINDMOUNT
+    free(order);
+    free(from_buffer);
+    free(to_buffer);
+    return 0;
 
-    if (fsTypes == NULL || fsType == NULL) {
-        return -1;
+_setupVolumeMapMounts_unclean:
+    if (filtered_from != NULL) {
+        free(filtered_from);
     }
-    for (ptr = fsTypes; ptr && *ptr; ptr++) {
-        if (strcmp(fsType, *ptr) == 0) {
-            return 0;
-        }
+    if (filtered_to != NULL) {
+        free(filtered_to);
+    }
+    if (to_real != NULL) {
+        free(to_real);
+    }
+    if (order != NULL) {
+        free(order);
     }
+    free(from_buffer);
+    free(to_buffer);
     return 1;
 }
 
-int loopMount(const char *imagePath, const char *loopMountPath, ImageFormat format, UdiRootConfig *udiConfig, int readOnly) {
-    char *mountExec = _malloc(sizeof(char) * PATH_MAX);
-    struct stat statData;
-    int ready = 0;
-    int useAutoclear = 0;
-    const char *imgType = NULL;
-    char **fstypes = getSupportedFilesystems();
+char *generateShifterConfigString(const char *user, ImageData *image,
+                                  VolumeMap *volumeMap, UdiRootConfig *config)
+{
+    char *str = NULL;
+    char *volMapSig = NULL;
+    char *modules = NULL;
+    size_t modules_len = 0;
+    size_t modules_sz = 0;
+    int idx = 0;
+    if (image == NULL || volumeMap == NULL) return NULL;
 
-    snprintf(mountExec, PATH_MAX, "%s/mount", LIBEXECDIR);
-    if (stat(mountExec, &statData) != 0) {
-        fprintf(stderr, "udiRoot mount executable missing: %s\n", mountExec);
-        goto _loopMount_unclean;
-    } else if (statData.st_uid != 0 || statData.st_mode & S_IWGRP || statData.st_mode & S_IWOTH || !(statData.st_mode & S_IXUSR)) {
-        fprintf(stderr, "udiRoot mount has incorrect ownership or permissions: %s\n", mountExec);
-        goto _loopMount_unclean;
+    volMapSig = getVolMapSignature(volumeMap);
+    for (idx = 0; idx < config->n_active_modules; idx++) {
+        modules = alloc_strcatf(modules, &modules_len, &modules_sz, "%s,",
+                                config->active_modules[idx]->name);
     }
 
-    if (stat("/dev/loop0", &statData) != 0) {
-        fprintf(stderr, "ERROR: no apparent support for loop devices!");
-        goto _loopMount_unclean;
+    str = alloc_strgenf(
+            "{\"identifier\":\"%s\","
+            "\"user\":\"%s\","
+            "\"volMap\":\"%s\","
+            "\"modules\":\"%s\"}",
+            image->identifier,
+            user,
+            (volMapSig == NULL ? "" : volMapSig),
+            (modules == NULL ? "" : modules)
+    );
+
+    if (volMapSig != NULL) {
+        free(volMapSig);
     }
-    if (format == FORMAT_SQUASHFS) {
-        if (supportsFilesystem(fstypes, "squashfs") != 0) {
-            fprintf(stderr, "ERROR: no apparent support for squashfs!");
-            goto _loopMount_unclean;
-        }
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0)
-        useAutoclear = 0;
-#else
-        useAutoclear = 1;
-#endif
-        ready = 1;
-        imgType = "squashfs";
-    } else if (format == FORMAT_XFS) {
-        if (supportsFilesystem(fstypes, "xfs") != 0) {
-            fprintf(stderr, "ERROR: no apparent support for xfs!");
-            goto _loopMount_unclean;
-        }
-        useAutoclear = 0;
-        ready = 1;
-        imgType = "xfs";
-    } else {
-        fprintf(stderr, "ERROR: unknown image format.\n");
-        goto _loopMount_unclean;
+    if (modules != NULL) {
+        free(modules);
     }
-    if (ready) {
-        char *args[] = {
-            _strdup(mountExec),
-            _strdup("-n"),
-            _strdup("-o"),
-            alloc_strgenf("loop,nosuid,nodev%s%s",
-                    (readOnly ? ",ro" : ""),
-                    (useAutoclear ? ",autoclear" : "")
-            ),
-            _strdup("-t"),
-            _strdup(imgType),
-            _strdup(imagePath),
-            _strdup(loopMountPath),
-            NULL
-        };
-        char **argsPtr = NULL;
-        int ret = 0;
-        for (argsPtr = args; argsPtr - args < 8; argsPtr++) {
-            if (argsPtr == NULL || *argsPtr == NULL) {
-                ret = 1;
-            }
-        }
-        if (ret == 0) {
-            ret = forkAndExecvSilent(args);
-        }
-        for (argsPtr = args; argsPtr && *argsPtr; argsPtr++) {
-            free(*argsPtr);
-        }
-        if (ret != 0) {
-            fprintf(stderr, "FAILED to mount image %s (%s) on %s\n", imagePath, imgType, loopMountPath);
-            goto _loopMount_unclean;
-        }
+    return str;
+}
+
+int saveShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap, UdiRootConfig *udiConfig) {
+    char *saveFilename = _malloc(sizeof(char) * PATH_MAX);
+    FILE *fp = NULL;
+    char *configString = generateShifterConfigString(user, image, volumeMap, udiConfig);
+
+    if (configString == NULL) {
+        goto _saveShifterConfig_error;
     }
 
-    if (fstypes != NULL) {
-        char **ptr = NULL;
-        for (ptr = fstypes; ptr && *ptr; ptr++) {
-            free(*ptr);
-        }
-        free(fstypes);
-        fstypes = NULL;
+    snprintf(saveFilename, PATH_MAX, "%s/var/shifterConfig.json",
+            udiConfig->udiMountPoint);
+    fp = fopen(saveFilename, "w");
+    if (fp == NULL) {
+        goto _saveShifterConfig_error;
     }
-    free(mountExec);
-    return 0;
-_loopMount_unclean:
+    fprintf(fp, "%s\n", configString);
+    fclose(fp);
+    fp = NULL;
 
-    if (fstypes != NULL) {
-        char **ptr = NULL;
-        for (ptr = fstypes; ptr && *ptr; ptr++) {
-            free(*ptr);
-        }
-        free(fstypes);
-        fstypes = NULL;
+    if (_shifterCore_saveVolumes(user, image, volumeMap, udiConfig) != 0) {
+        goto _saveShifterConfig_error;
     }
-    free(mountExec);
+
+    free(configString);
+    configString = NULL;
+    free(saveFilename);
+    return 0;
+_saveShifterConfig_error:
+    if (configString != NULL) {
+        free(configString);
+    }
+    free(saveFilename);
     return 1;
 }
 
-int setupUserMounts(VolumeMap *map, UdiRootConfig *udiConfig) {
-    char *udiRoot = _malloc(sizeof(char) * PATH_MAX);
-    MountList mountCache;
-    struct stat statData;
-    int ret = 0;
-    dev_t udiMountDev = 0;
+int compareShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap, UdiRootConfig *udiConfig) {
+    char *configFilename = _malloc(sizeof(char) * PATH_MAX);
+    FILE *fp = NULL;
+    char *configString = generateShifterConfigString(user, image, volumeMap, udiConfig);
+    char *buffer = NULL;
+    size_t len = 0;
+    size_t nread = 0;
+    int cmpVal = 0;
 
-    memset(&mountCache, 0, sizeof(MountList));
-    snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    udiRoot[PATH_MAX-1] = 0;
+    if (configString == NULL) {
+        goto _compareShifterConfig_error;
+    }
+    len = strlen(configString);
+    buffer = (char *) _malloc(sizeof(char) * len);
 
-    if (stat(udiRoot, &statData) != 0) {
-        fprintf(stderr, "FAILED to stat udiRoot %s\n", udiRoot);
-        free(udiRoot);
-        return 1;
+    snprintf(configFilename, PATH_MAX, "%s/var/shifterConfig.json",
+            udiConfig->udiMountPoint);
+
+    fp = fopen(configFilename, "r");
+    if (fp == NULL) {
+        goto _compareShifterConfig_error;
     }
-    udiMountDev = statData.st_dev;
 
-    /* get list of current mounts for this namespace */
-    if (parse_MountList(&mountCache) != 0) {
-        fprintf(stderr, "FAILED to get list of current mount points\n");
-        free(udiRoot);
-        return 1;
+    nread = fread(buffer, sizeof(char), len, fp);
+    fclose(fp);
+    fp = NULL;
+
+    if (nread == len) {
+        cmpVal = memcmp(configString, buffer, sizeof(char) * len);
+    } else {
+        cmpVal = -1;
+    }
+
+    free(configString);
+    configString = NULL;
+
+    free(buffer);
+    buffer = NULL;
+    free(configFilename);
+    return cmpVal;
+_compareShifterConfig_error:
+    if (configString != NULL) {
+        free(configString);
     }
-
-    ret = setupVolumeMapMounts(&mountCache, map, 1, udiMountDev, udiConfig);
-    free_MountList(&mountCache, 0);
-    free(udiRoot);
-    return ret;
+    if (buffer != NULL) {
+        free(buffer);
+    }
+    free(configFilename);
+    return -1;
 }
 
-int setupPerNodeCacheFilename(
-        UdiRootConfig *udiConfig,
-        VolMapPerNodeCacheConfig *cache,
-        char *buffer,
-        size_t buffer_len)
+/**
+ * _shifterCore_saveVolumes
+ * Write the per volume record of the UDI: the configuration string of the
+ * UDI without volumes followed by one raw user volume map entry per line.
+ * This lets a later shifter invocation work out which volume mounts differ
+ * from the ones in place (see diffShifterConfig).  The record is kept in the
+ * udiStatePath, out of reach of the image.  No record is written for entries
+ * that cannot be stored one per line, which only disables the incremental
+ * update.
+ */
+int _shifterCore_saveVolumes(const char *user, ImageData *image,
+        VolumeMap *volumeMap, UdiRootConfig *udiConfig)
 {
-    char hostname_buf[128];
-    size_t pos = 0;
-    int fd = 0;
-    int nbytes = 0;
+    VolumeMap empty;
+    char *base = NULL;
+    char *path = NULL;
+    FILE *fp = NULL;
+    size_t idx = 0;
+    int rc = 1;
 
-    if (    cache == NULL ||
-            cache->fstype == NULL  ||
-            buffer == NULL ||
-            buffer_len == 0 ||
-            udiConfig == NULL)
-    {
-        return -1;
-    }
-    if (    udiConfig->perNodeCachePath == NULL ||
-            strlen(udiConfig->perNodeCachePath) == 0)
-    {
-        fprintf(stderr, "udiRoot.conf does not have a valid perNodeCachePath."
-                " Cannot generate perNodeCache backing stores.\n");
-        return -1;
+    memset(&empty, 0, sizeof(VolumeMap));
+    path = _shifterCore_udiStateFile(udiConfig, VOLUMES_RECORD);
+    if (path == NULL) {
+        fprintf(stderr, "FAILED to record volumes, state directory unusable\n");
+        return 1;
     }
-    if (udiConfig->target_uid == 0 || udiConfig->target_gid == 0) {
-        fprintf(stderr, "will not setup per-node cache with target uid or gid of 0\n");
-        return -1;
+    unlink(path);
+    for (idx = 0; idx < volumeMap->n; idx++) {
+        if (strchr(volumeMap->raw[idx], '\n') != NULL) {
+            rc = 0;
+            goto _saveVolumes_out;
+        }
     }
-    pos = strlen(buffer);
-    if (pos > buffer_len) {
-        return -1;
+    base = generateShifterConfigString(user, image, &empty, udiConfig);
+    if (base == NULL) {
+        goto _saveVolumes_out;
     }
-    if (gethostname(hostname_buf, 128) != 0) {
-        return -1;
+    fp = _shifterCore_createStateFile(path);
+    if (fp == NULL) {
+        goto _saveVolumes_out;
     }
-    nbytes = snprintf(buffer, buffer_len, "%s/perNodeCache_uid%d_gid%d_%s.%s.XXXXXX",
-            udiConfig->perNodeCachePath,
-            udiConfig->target_uid,
-            udiConfig->target_gid,
-            hostname_buf,
-            cache->fstype
-    );
-    if (nbytes < 0) {
-        fprintf(stderr, "FAILED to write perNodeCache filename into buffer.\n");
-        return -1;
+    fprintf(fp, "%s\n%s\n", VOLUMES_HEADER, base);
+    for (idx = 0; idx < volumeMap->n; idx++) {
+        fprintf(fp, "%s\n", volumeMap->raw[idx]);
     }
-    if (nbytes >= 0 && (size_t) nbytes >= buffer_len) {
-        fprintf(stderr, "perNodeCache filename too long to store in buffer.\n");
-        return -1;
+    if (fclose(fp) == 0) {
+        rc = 0;
     }
-    mode_t old_umask = umask(077);
-    fd = mkstemp(buffer);
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open perNodeCache backing store %s.\n",
-                buffer);
-        perror("Error: ");
-        umask(old_umask);
-        return -1;
+_saveVolumes_out:
+    if (base != NULL) {
+        free(base);
     }
-    umask(old_umask);
-    return fd;
+    free(path);
+    return rc;
 }
 
-int setupPerNodeCacheBackingStore(VolMapPerNodeCacheConfig *cache, const char *buffer, UdiRootConfig *udiConfig) {
-    if (udiConfig == NULL || cache == NULL || cache->fstype == NULL) {
-        fprintf(stderr, "configuration is invalid (null), cannot setup per-node cache\n");
-        return 1;
-    }
-    char *args[7];
-    char **arg = NULL;
-    int ret = 0;
-    if (udiConfig->ddPath == NULL) {
-        fprintf(stderr, "Must define ddPath in udiRoot configuration to use this feature\n");
-        return 1;
+/**
+ * _shifterCore_readVolumes
+ * Read the raw volume map entries from a per volume record, if the record
+ * was written for a UDI with the configuration string base.
+ *
+ * Returns a NULL-terminated array of entries, or NULL if the record is
+ * missing, cannot be trusted (see _shifterCore_openStateFile), is invalid or
+ * is for a different image, user or set of modules.
+ */
+char **_shifterCore_readVolumes(const char *path, const char *base) {
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t nread = 0;
+    char **entries = NULL;
+    size_t n_entries = 0;
+    int lineno = 0;
+
+    fp = _shifterCore_openStateFile(path);
+    if (fp == NULL) {
+        return NULL;
     }
-    args[0] = _strdup(udiConfig->ddPath);
-    args[1] = _strdup("if=/dev/zero");
-    args[2] = alloc_strgenf("of=%s", buffer);
-    args[3] = _strdup("bs=1");
-    args[4] = _strdup("count=0");
-    args[5] = alloc_strgenf("seek=%lu", cache->cacheSize);
-    args[6] = NULL;
-    for (arg = args; arg - args < 6; arg++) {
-        if (arg == NULL || *arg == NULL) {
-            fprintf(stderr, "FAILED to allocate memory!\n");
-            ret = 1;
+    entries = (char **) _malloc(sizeof(char *));
+    entries[0] = NULL;
+    while ((nread = getline(&line, &line_sz, fp)) > 0) {
+        if (line[nread - 1] == '\n') {
+            line[nread - 1] = 0;
         }
+        if (lineno == 0 && strcmp(line, VOLUMES_HEADER) != 0) {
+            goto _readVolumes_error;
+        } else if (lineno == 1 && strcmp(line, base) != 0) {
+            goto _readVolumes_error;
+        } else if (lineno > 1) {
+            entries = (char **) _realloc(entries,
+                    sizeof(char *) * (n_entries + 2));
+            entries[n_entries++] = _strdup(line);
+            entries[n_entries] = NULL;
+        }
+        lineno++;
     }
-    if (ret == 0) {
-        ret = forkAndExecvSilent(args);
+    if (lineno < 2) {
+        goto _readVolumes_error;
     }
-    for (arg = args; *arg; arg++) {
-        free(*arg);
+    fclose(fp);
+    if (line != NULL) {
+        free(line);
     }
-
-    if (ret != 0) {
-        fprintf(stderr, "FAILED to dd backing store for cache on %s, %d\n", buffer, ret);
-        return 1;
+    return entries;
+_readVolumes_error:
+    fclose(fp);
+    if (line != NULL) {
+        free(line);
     }
-    if (strcmp(cache->fstype, "xfs") == 0) {
-        char **args = NULL;
-        char **argPtr = NULL;
-        int ret = 0;
-        if (udiConfig->mkfsXfsPath == NULL) {
-            fprintf(stderr, "Must define mkfsXfsPath in udiRoot configuration to use this feature\n");
-            exit(1);
-        }
-        args = (char **) _malloc(sizeof(char *) * 4);
-        args[0] = _strdup(udiConfig->mkfsXfsPath);
-        args[1] = _strdup("-d");
-        args[2] = alloc_strgenf("name=%s,file=1,size=%lu", buffer, cache->cacheSize);
-        args[3] = NULL;
-        ret = forkAndExecvSilent(args);
-        for (argPtr = args; argPtr && *argPtr; argPtr++) {
-            free(*argPtr);
-        }
-        free(args);
-        if (ret != 0) {
-            fprintf(stderr, "FAILED to create the XFS cache filesystem on %s\n", buffer);
-            return 1;
-        }
+    for (n_entries = 0; entries[n_entries] != NULL; n_entries++) {
+        free(entries[n_entries]);
     }
-    return 0;
+    free(entries);
+    return NULL;
 }
 
-int setupVolumeMapMounts(
-        MountList *mountCache,
-        VolumeMap *map,
-        int userRequested,
-        dev_t createToDev,
-        UdiRootConfig *udiConfig
-) {
-    char *filtered_from = NULL;
-    char *filtered_to = NULL;
-    char *to_real = NULL;
-    char *from_real = NULL;
-    VolumeMapFlag *flags = NULL;
-    int (*_validate_fp)(const char *, const char *, VolumeMapFlag *);
+/**
+ * _shifterCore_volumeDestination
+ * Get the path in the UDI a volume mounted to "to" is found at, as
+ * setupVolumeMapMounts resolves it.
+ *
+ * Returns newly allocated path, or NULL if it does not exist or is outside
+ * of the UDI.
+ */
+char *_shifterCore_volumeDestination(const char *to, UdiRootConfig *udiConfig) {
+    char *filtered = userInputPathFilter(to, 1);
+    char *path = NULL;
+    char *real = NULL;
+    size_t udiMountLen = strlen(udiConfig->udiMountPoint);
 
-    size_t mapIdx = 0;
-    size_t udiMountLen = 0;
+    if (filtered == NULL) {
+        return NULL;
+    }
+    path = alloc_strgenf("%s/%s", udiConfig->udiMountPoint, filtered);
+    free(filtered);
+    if (path == NULL) {
+        return NULL;
+    }
+    real = realpath(path, NULL);
+    free(path);
+    if (real != NULL && (strlen(real) <= udiMountLen ||
+            strncmp(real, udiConfig->udiMountPoint, udiMountLen) != 0 ||
+            real[udiMountLen] != '/'))
+    {
+        free(real);
+        real = NULL;
+    }
+    return real;
+}
 
-    char *from_buffer = _malloc(sizeof(char) * PATH_MAX);
-    char *to_buffer = _malloc(sizeof(char) * PATH_MAX);
-    struct stat statData;
+/**
+ * diffShifterConfig
+ * Work out how the user volume mounts requested differ from those of the
+ * loaded UDI, for the case where only the volume map changed.  The entries
+ * to mount are parsed into added and those to unmount into removed.
+ *
+ * An incremental update is refused (and the UDI should be rebuilt) if the
+ * volume record is missing or untrusted, if the image, user or modules
+ * differ, if a volume to remove has anything mounted
+ * beneath it or shares its destination with a siteFs mount (unmounting it
+ * would take those along), or if the destination of a new volume does not
+ * exist yet (the shared UDI tree must not be modified).
+ *
+ * Returns 0 if the UDI can be updated with added and removed, 1 otherwise.
+ * added and removed must be freed by the caller in either case.
+ */
+int diffShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap,
+        UdiRootConfig *udiConfig, VolumeMap *added, VolumeMap *removed)
+{
+    VolumeMap empty;
+    MountList mounts;
+    char *base = NULL;
+    char *path = NULL;
+    char **loaded = NULL;
+    char **ptr = NULL;
+    size_t idx = 0;
+    size_t jdx = 0;
+    int rc = 1;
 
-    if (udiConfig == NULL) {
-        free(from_buffer);
-        free(to_buffer);
+    memset(&empty, 0, sizeof(VolumeMap));
+    memset(&mounts, 0, sizeof(MountList));
+    if (user == NULL || image == NULL || volumeMap == NULL ||
+            udiConfig == NULL || added == NULL || removed == NULL)
+    {
         return 1;
     }
 
-    if (map == NULL || map->n == 0) {
-        free(from_buffer);
-        free(to_buffer);
-        return 0;
+    base = generateShifterConfigString(user, image, &empty, udiConfig);
+    path = _shifterCore_udiStateFile(udiConfig, VOLUMES_RECORD);
+    if (base == NULL || path == NULL) {
+        goto _diffShifterConfig_out;
+    }
+    loaded = _shifterCore_readVolumes(path, base);
+    if (loaded == NULL) {
+        goto _diffShifterConfig_out;
     }
 
-    if (userRequested == 0) {
-        _validate_fp = validateVolumeMap_siteRequest;
-    } else {
-        _validate_fp = validateVolumeMap_userRequest;
+    for (idx = 0; idx < volumeMap->n; idx++) {
+        for (ptr = loaded; *ptr != NULL; ptr++) {
+            if (strcmp(*ptr, volumeMap->raw[idx]) == 0) break;
+        }
+        if (*ptr == NULL && parseVolumeMap(volumeMap->raw[idx], added) != 0) {
+            goto _diffShifterConfig_out;
+        }
+    }
+    for (ptr = loaded; *ptr != NULL; ptr++) {
+        for (idx = 0; idx < volumeMap->n; idx++) {
+            if (strcmp(*ptr, volumeMap->raw[idx]) == 0) break;
+        }
+        if (idx == volumeMap->n && parseVolumeMap(*ptr, removed) != 0) {
+            goto _diffShifterConfig_out;
+        }
     }
 
-    udiMountLen = strlen(udiConfig->udiMountPoint);
+    if (parse_MountList(&mounts) != 0) {
+        goto _diffShifterConfig_out;
+    }
+    for (idx = 0; idx < removed->n; idx++) {
+        char *dest = _shifterCore_volumeDestination(removed->to[idx], udiConfig);
+        size_t len = 0;
+        int conflict = 0;
+        if (dest == NULL) {
+            goto _diffShifterConfig_out;
+        }
+        len = strlen(dest);
+        for (ptr = mounts.mountPointList; ptr && *ptr; ptr++) {
+            if (strncmp(*ptr, dest, len) == 0 && (*ptr)[len] == '/') {
+                conflict = 1;
+            }
+        }
+        for (jdx = 0; udiConfig->siteFs != NULL && jdx < udiConfig->siteFs->n; jdx++) {
+            char *siteDest = _shifterCore_volumeDestination(
+                    udiConfig->siteFs->to[jdx], udiConfig);
+            if (siteDest != NULL && strcmp(siteDest, dest) == 0) {
+                conflict = 1;
+            }
+            if (siteDest != NULL) {
+                free(siteDest);
+            }
+        }
+        free(dest);
+        if (conflict) {
+            goto _diffShifterConfig_out;
+        }
+    }
+    for (idx = 0; idx < added->n; idx++) {
+        char *dest = _shifterCore_volumeDestination(added->to[idx], udiConfig);
+        int conflict = 0;
+        if (dest == NULL) {
+            goto _diffShifterConfig_out;
+        }
+        /* the destination may only exist in a volume about to go away */
+        for (jdx = 0; jdx < removed->n; jdx++) {
+            char *removedDest = _shifterCore_volumeDestination(
+                    removed->to[jdx], udiConfig);
+            size_t len = removedDest != NULL ? strlen(removedDest) : 0;
+            if (removedDest != NULL && strncmp(dest, removedDest, len) == 0 &&
+                    dest[len] == '/')
+            {
+                conflict = 1;
+            }
+            if (removedDest != NULL) {
+                free(removedDest);
+            }
+        }
+        free(dest);
+        if (conflict) {
+            goto _diffShifterConfig_out;
+        }
+    }
+    rc = 0;
 
-    for (mapIdx = 0; mapIdx < map->n; mapIdx++) {
-        size_t flagsInEffect = 0;
-        size_t flagIdx = 0;
-        int backingStoreExists = 0;
-        filtered_from = userInputPathFilter(map->from[mapIdx], 1);
-        filtered_to = userInputPathFilter(map->to[mapIdx], 1);
-        flags = map->flags[mapIdx];
+_diffShifterConfig_out:
+    free_MountList(&mounts, 0);
+    if (loaded != NULL) {
+        for (ptr = loaded; *ptr != NULL; ptr++) {
+            free(*ptr);
+        }
+        free(loaded);
+    }
+    if (base != NULL) {
+        free(base);
+    }
+    if (path != NULL) {
+        free(path);
+    }
+    return rc;
+}
 
-        if (filtered_from == NULL || filtered_to == NULL) {
-            fprintf(stderr, "INVALID mount from %s to %s\n",
-                    map->from[mapIdx], map->to[mapIdx]);
-            goto _handleVolMountError;
+/**
+ * updateUserMounts
+ * Apply the difference found by diffShifterConfig to the loaded UDI: unmount
+ * the removed user volumes and mount the added ones, keeping the rest of the
+ * tree.  Must be called in a private mount namespace.
+ *
+ * The stored configuration is deliberately not updated, it lives in the UDI
+ * shared with the namespace the UDI was set up in.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int updateUserMounts(ImageData *image, VolumeMap *added, VolumeMap *removed,
+        UdiRootConfig *udiConfig)
+{
+    MountList mounts;
+    size_t idx = 0;
+    int rc = 1;
+
+    memset(&mounts, 0, sizeof(MountList));
+    if (_shifterCore_setBindMountAllowedDevices(image, udiConfig) != 0) {
+        return 1;
+    }
+    if (removed->n > 0 && parse_MountList(&mounts) != 0) {
+        fprintf(stderr, "FAILED to get list of current mount points\n");
+        return 1;
+    }
+    for (idx = 0; idx < removed->n; idx++) {
+        char *dest = _shifterCore_volumeDestination(removed->to[idx], udiConfig);
+        if (dest == NULL) {
+            fprintf(stderr, "FAILED to find volume %s\n", removed->to[idx]);
+            goto _updateUserMounts_out;
         }
-        snprintf(from_buffer, PATH_MAX, "%s/%s",
-                (userRequested != 0 ? udiConfig->udiMountPoint : ""),
-                filtered_from
-        );
-        from_buffer[PATH_MAX-1] = 0;
-        snprintf(to_buffer, PATH_MAX, "%s/%s",
-                udiConfig->udiMountPoint,
-                filtered_to
-        );
-        to_buffer[PATH_MAX-1] = 0;
+        if (unmountTree(&mounts, dest) != 0) {
+            fprintf(stderr, "FAILED to unmount volume %s\n", dest);
+            free(dest);
+            goto _updateUserMounts_out;
+        }
+        free(dest);
+    }
+    if (setupUserMounts(added, udiConfig) != 0) {
+        fprintf(stderr, "FAILED to setup user-requested mounts.\n");
+        goto _updateUserMounts_out;
+    }
+    rc = 0;
+_updateUserMounts_out:
+    free_MountList(&mounts, 0);
+    return rc;
+}
 
-        free(filtered_to);
-        filtered_to = NULL;
+/**
+ * _shifterCore_checkPrivateDir
+ * Create a root-managed state directory if needed, and check it is owned by
+ * the effective user and grants none of the disallowed permissions.
+ *
+ * Returns 0 if the directory can be used, 1 otherwise.
+ */
+int _shifterCore_checkPrivateDir(const char *path, mode_t disallowed) {
+    struct stat statData;
 
-        /* check if this is a per-volume cache, and if so mangle the from name
-         * and then create the volume backing store */
-        for (flagIdx = 0; flags && flags[flagIdx].type != 0; flagIdx++) {
-            flagsInEffect |= flags[flagIdx].type;
-            if (flags[flagIdx].type == VOLMAP_FLAG_PERNODECACHE) {
-                int ret = 0;
-                int fd = 0;
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "FAILED to create %s\n", path);
+        return 1;
+    }
+    if (lstat(path, &statData) != 0 || !S_ISDIR(statData.st_mode) ||
+            statData.st_uid != geteuid() ||
+            (statData.st_mode & disallowed) != 0)
+    {
+        fprintf(stderr, "%s is not a private directory\n", path);
+        return 1;
+    }
+    return 0;
+}
 
-                VolMapPerNodeCacheConfig *cache =
-                        (VolMapPerNodeCacheConfig *) flags[flagIdx].value;
-                fd = setupPerNodeCacheFilename(udiConfig, cache, from_buffer,
-                        PATH_MAX);
-                if (fd < 0) {
-                    fprintf(stderr, "FAILED to set perNodeCache name\n");
-                    goto _handleVolMountError;
-                }
+/**
+ * _shifterCore_generateHostKeys
+ * Generate a full set of sshd host keys in dir with keygen (ssh-keygen),
+ * owned by owner/group.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int _shifterCore_generateHostKeys(const char *keygen, const char *dir,
+        uid_t owner, gid_t group, int silent)
+{
+    const char **keyPtr = NULL;
+    char keyFileName[PATH_MAX];
 
-                /* intialize the backing store */
-                ret = setupPerNodeCacheBackingStore(cache, from_buffer, udiConfig);
-                if (ret != 0) {
-                    fprintf(stderr, "FAILED to setup perNodeCache\n");
-                    goto _handleVolMountError;
-                }
-                close(fd);
-                backingStoreExists = 1;
-            }
-        }
+    for (keyPtr = sshHostKeyTypes; *keyPtr != NULL; keyPtr++) {
+        char *args[8];
+        char **argPtr = NULL;
+        int ret = 0;
 
-        /* if this is not a per-node cache (i.e., is a standand volume mount),
-         * then validate the user has permissions to view the content, by
-         * performing realpath() and lstat() as the user */
-        if (!(flagsInEffect & VOLMAP_FLAG_PERNODECACHE)) {
-            uid_t orig_euid = geteuid();
-            gid_t orig_egid = getegid();
-            gid_t *orig_auxgids = NULL;
-            int norig_auxgids = 0;
-            int switch_user_stage = 0;
+        snprintf(keyFileName, PATH_MAX, "%s/ssh_host_%s_key", dir, *keyPtr);
+        args[0] = _strdup(keygen);
+        args[1] = _strdup("-t");
+        args[2] = _strdup(*keyPtr);
+        args[3] = _strdup("-f");
+        args[4] = _strdup(keyFileName);
+        args[5] = _strdup("-N");
+        args[6] = _strdup("");
+        args[7] = NULL;
+        ret = silent ? forkAndExecvSilent(args) : forkAndExecv(args);
+        for (argPtr = args; *argPtr != NULL; argPtr++) {
+            free(*argPtr);
+        }
 
-            /* switch privileges if this is a user mount to ensure we only
-             * grant access to resources the user can reach at time of
-             * invocation */
-            if (userRequested != 0) {
-                if (udiConfig->auxiliary_gids == NULL ||
-                        udiConfig->nauxiliary_gids <= 0 ||
-                        udiConfig->target_uid == 0 ||
-                        udiConfig->target_gid == 0)
-                {
-                    fprintf(stderr, "Insufficient information about target "
-                            "user to setup volume mount\n");
-                    goto _fail_check_fromvol;
-                }
-                norig_auxgids = getgroups(0, NULL);
-                if (norig_auxgids < 0) {
-                    fprintf(stderr, "FAILED to getgroups.\n");
-                    goto _fail_check_fromvol;
-                } else if (norig_auxgids > 0) {
-                    orig_auxgids = (gid_t *) _malloc(sizeof(gid_t) * norig_auxgids);
-                    norig_auxgids = getgroups(norig_auxgids, orig_auxgids);
-                    if (norig_auxgids <= 0) {
-                        fprintf(stderr, "FAILED to getgroups().\n");
-                        goto _fail_check_fromvol;
-                    }
-                }
+        if (ret != 0) {
+            fprintf(stderr, "Failed to generate key of type %s\n", *keyPtr);
+            return 1;
+        }
 
-                if (setgroups(udiConfig->nauxiliary_gids, udiConfig->auxiliary_gids) != 0) {
-                    fprintf(stderr, "FAILED to assume user auxiliary gids\n");
-                    goto _fail_check_fromvol;
-                }
-                switch_user_stage++;
+        /* chown files to user */
+        if (chown(keyFileName, owner, group) != 0) {
+            fprintf(stderr, "Failed to chown ssh host key to user: %s\n",
+                    keyFileName);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-                if (setegid(udiConfig->target_gid) != 0) {
-                    fprintf(stderr, "FAILED to assume user gid\n");
-                    goto _fail_check_fromvol;
-                }
-                switch_user_stage++;
+/**
+ * _shifterCore_claimHostKeys
+ * Take a set of host keys out of the pool.  Sets are claimed by renaming
+ * them, so concurrent setups never get the same keys.
+ *
+ * Returns newly allocated path of the claimed set, NULL if the pool is empty.
+ */
+char *_shifterCore_claimHostKeys(const char *poolPath) {
+    DIR *dirp = opendir(poolPath);
+    struct dirent *entry = NULL;
+    char *claimed = NULL;
+    int seq = 0;
 
-                if (seteuid(udiConfig->target_uid) != 0) {
-                    fprintf(stderr, "FAILED to assume user uid\n");
-                    goto _fail_check_fromvol;
-                }
-                switch_user_stage++;
+    if (dirp == NULL) {
+        return NULL;
+    }
+    while (claimed == NULL && (entry = readdir(dirp)) != NULL) {
+        char *path = NULL;
+        if (strncmp(entry->d_name, SSH_KEY_SET_PREFIX,
+                    strlen(SSH_KEY_SET_PREFIX)) != 0)
+        {
+            continue;
+        }
+        path = alloc_strgenf("%s/%s", poolPath, entry->d_name);
+        claimed = alloc_strgenf("%s/.claimed.%d.%d", poolPath, getpid(), seq++);
+        if (path == NULL || claimed == NULL || rename(path, claimed) != 0) {
+            /* taken by someone else in the meantime */
+            if (claimed != NULL) {
+                free(claimed);
+                claimed = NULL;
             }
+        }
+        if (path != NULL) {
+            free(path);
+        }
+    }
+    closedir(dirp);
+    return claimed;
+}
 
-            /* perform some introspection on the path to get it's real location
-             * and vital attributes */
-            if (userRequested != 0) {
-                char *from_real_shft = shifter_realpath(filtered_from, udiConfig);
-                if (from_real_shft == NULL) {
-                    fprintf(stderr, "FAILED to find real path for volume "
-                            "\"from\": %s\n", filtered_from);
-                    goto _fail_check_fromvol;
+/**
+ * _shifterCore_installHostKeys
+ * Copy a set of host keys into etcDir, the private keys readable only by
+ * owner.  Nothing is left behind in etcDir on failure.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int _shifterCore_installHostKeys(const char *keySet, const char *etcDir,
+        uid_t owner, gid_t group)
+{
+    const char **keyPtr = NULL;
+    const char *suffixes[] = { "", ".pub", NULL };
+    const char **suffix = NULL;
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    char buffer[8192];
+
+    for (keyPtr = sshHostKeyTypes; *keyPtr != NULL; keyPtr++) {
+        for (suffix = suffixes; *suffix != NULL; suffix++) {
+            int inFd = -1;
+            int outFd = -1;
+            ssize_t nread = 0;
+            int ok = 1;
+            mode_t mode = strlen(*suffix) == 0 ? 0600 : 0644;
+
+            snprintf(from, PATH_MAX, "%s/ssh_host_%s_key%s", keySet,
+                    *keyPtr, *suffix);
+            snprintf(to, PATH_MAX, "%s/ssh_host_%s_key%s", etcDir,
+                    *keyPtr, *suffix);
+            inFd = open(from, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            outFd = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                    O_CLOEXEC, mode);
+            if (inFd < 0 || outFd < 0) {
+                ok = 0;
+            }
+            while (ok && (nread = read(inFd, buffer, sizeof(buffer))) > 0) {
+                if (write(outFd, buffer, nread) != nread) {
+                    ok = 0;
                 }
-                from_real = realpath(from_real_shft, NULL);
-                free(from_real_shft);
-            } else {
-                from_real = realpath(from_buffer, NULL);
             }
-            if (from_real == NULL) {
-                fprintf(stderr, "FAILED to find real path for volume "
-                        "\"from\": %s\n", from_buffer);
-                goto _fail_check_fromvol;
+            if (nread < 0 || (ok && (fchown(outFd, owner, group) != 0 ||
+                            fchmod(outFd, mode) != 0)))
+            {
+                ok = 0;
             }
-            if (lstat(from_real, &statData) != 0) {
-                fprintf(stderr, "FAILED to find volume \"from\": %s\n", from_buffer);
-                goto _fail_check_fromvol;
+            if (inFd >= 0) {
+                close(inFd);
             }
-            if (!S_ISDIR(statData.st_mode)) {
-                fprintf(stderr, "FAILED \"from\" location is not directory: "
-                        "%s\n", from_real);
-                goto _fail_check_fromvol;
+            if (outFd >= 0 && close(outFd) != 0) {
+                ok = 0;
             }
-
-            /* switch back to original privileges */
-            if (userRequested != 0) {
-                if (seteuid(orig_euid) != 0) {
-                    fprintf(stderr, "FAILED to assume original user effective uid\n");
-                    goto _fail_check_fromvol;
-                }
-                switch_user_stage--;
-
-                if (setegid(orig_egid) != 0) {
-                    fprintf(stderr, "FAILED to assume original user effective gid\n");
-                    goto _fail_check_fromvol;
-                }
-                switch_user_stage--;
-
-                if (setgroups(norig_auxgids, orig_auxgids) != 0) {
-                    fprintf(stderr, "FAILED to assume original user auxiliary gids\n");
-                    goto _fail_check_fromvol;
-                }
-                switch_user_stage--;
+            if (!ok) {
+                fprintf(stderr, "FAILED to install pooled host key %s\n", to);
+                goto _installHostKeys_unclean;
             }
-            /* skip over error handler */
-            goto _pass_check_fromvol;
+        }
+    }
+    return 0;
 
-_fail_check_fromvol:
-            if (switch_user_stage > 0) {
-                /* TODO decide if we should re-assume original privileges for
-                 * the crash */
-            }
-            if (orig_auxgids != NULL) {
-                free(orig_auxgids);
-                orig_auxgids = NULL;
-            }
-            goto _handleVolMountError;
+_installHostKeys_unclean:
+    for (keyPtr = sshHostKeyTypes; *keyPtr != NULL; keyPtr++) {
+        for (suffix = suffixes; *suffix != NULL; suffix++) {
+            snprintf(to, PATH_MAX, "%s/ssh_host_%s_key%s", etcDir,
+                    *keyPtr, *suffix);
+            unlink(to);
+        }
+    }
+    return 1;
+}
 
-_pass_check_fromvol:
-            if (orig_auxgids != NULL) {
-                free(orig_auxgids);
-                orig_auxgids = NULL;
+/**
+ * _shifterCore_removeKeySet
+ * Remove a set of host keys (a claimed one, or a partial one).
+ */
+void _shifterCore_removeKeySet(const char *keySet) {
+    DIR *dirp = opendir(keySet);
+    struct dirent *entry = NULL;
+    char path[PATH_MAX];
+
+    if (dirp != NULL) {
+        while ((entry = readdir(dirp)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 ||
+                    strcmp(entry->d_name, "..") == 0)
+            {
+                continue;
             }
-        } else {
-            from_real = realpath(from_buffer, NULL);
+            snprintf(path, PATH_MAX, "%s/%s", keySet, entry->d_name);
+            unlink(path);
         }
-        if (lstat(to_buffer, &statData) != 0) {
-            if (createToDev) {
-                int okToMkdir = 0;
-
-                char *ptr = strrchr(to_buffer, '/');
-                if (ptr) {
-                    /* get parent path of intended dir */
-                    *ptr = '\0';
-
-                    /* if parent path is on the same device as is authorized by createToDev
-                       then ok the mkdir operation */
-                    if (lstat(to_buffer, &statData) == 0) {
-                        if (statData.st_dev == createToDev) {
-                            okToMkdir = 1;
-                        }
-                    }
+        closedir(dirp);
+    }
+    rmdir(keySet);
+}
 
-                    /* reset to target path */
-                    *ptr = '/';
-                }
+/**
+ * _shifterCore_refillKeyPool
+ * Generate sets of host keys until the pool holds SSH_KEY_POOL_DEPTH of
+ * them.  Only one refill runs at a time per pool.
+ *
+ * Returns 0 on success (or if another refill is running), 1 on failure.
+ */
+int _shifterCore_refillKeyPool(const char *poolPath, const char *keygen) {
+    DIR *dirp = NULL;
+    struct dirent *entry = NULL;
+    char *lockPath = alloc_strgenf("%s/%s", poolPath, SSH_KEY_POOL_LOCK);
+    int lockFd = -1;
+    int count = 0;
+    int seq = 0;
+    int rc = 1;
+
+    if (lockPath == NULL) {
+        return 1;
+    }
+    lockFd = open(lockPath, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    free(lockPath);
+    if (lockFd < 0) {
+        return 1;
+    }
+    if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+        close(lockFd);
+        return 0;
+    }
 
-                if (okToMkdir) {
-                    mkdir(to_buffer, 0755);
-                    if (lstat(to_buffer, &statData) != 0) {
-                        fprintf(stderr, "FAILED to find volume \"to\": %s\n",
-                                to_buffer);
-                        goto _handleVolMountError;
-                    }
-                } else {
-                    fprintf(stderr, "FAILED to create volume \"to\": %s, cannot"
-                            " create mount points in that location\n",
-                            to_buffer);
-                    goto _handleVolMountError;
-                }
-            } else {
-                fprintf(stderr, "FAILED to find volume \"to\": %s\n", to_buffer);
-                goto _handleVolMountError;
+    dirp = opendir(poolPath);
+    if (dirp == NULL) {
+        goto _refillKeyPool_out;
+    }
+    while ((entry = readdir(dirp)) != NULL) {
+        char path[PATH_MAX];
+        if (strncmp(entry->d_name, SSH_KEY_SET_PREFIX,
+                    strlen(SSH_KEY_SET_PREFIX)) == 0)
+        {
+            count++;
+        } else if (strncmp(entry->d_name, ".new.", 5) == 0) {
+            /* left behind by an interrupted refill */
+            snprintf(path, PATH_MAX, "%s/%s", poolPath, entry->d_name);
+            _shifterCore_removeKeySet(path);
+        }
+    }
+    closedir(dirp);
+
+    for ( ; count < SSH_KEY_POOL_DEPTH; count++) {
+        char *tmpDir = alloc_strgenf("%s/.new.XXXXXX", poolPath);
+        char *setDir = NULL;
+        if (tmpDir == NULL || mkdtemp(tmpDir) == NULL) {
+            if (tmpDir != NULL) {
+                free(tmpDir);
             }
+            goto _refillKeyPool_out;
         }
-        if (!S_ISDIR(statData.st_mode)) {
-            fprintf(stderr, "FAILED \"to\" location is not directory: %s\n", to_buffer);
-            goto _handleVolMountError;
+        if (_shifterCore_generateHostKeys(keygen, tmpDir, geteuid(),
+                    getegid(), 1) != 0)
+        {
+            _shifterCore_removeKeySet(tmpDir);
+            free(tmpDir);
+            goto _refillKeyPool_out;
+        }
+        setDir = alloc_strgenf("%s/%s%ld.%d.%d", poolPath, SSH_KEY_SET_PREFIX,
+                (long) time(NULL), getpid(), seq++);
+        if (setDir == NULL || rename(tmpDir, setDir) != 0) {
+            _shifterCore_removeKeySet(tmpDir);
+            free(tmpDir);
+            if (setDir != NULL) {
+                free(setDir);
+            }
+            goto _refillKeyPool_out;
         }
+        free(tmpDir);
+        free(setDir);
+    }
+    rc = 0;
+_refillKeyPool_out:
+    close(lockFd);
+    return rc;
+}
 
-        to_real = realpath(to_buffer, NULL);
-        if (to_real == NULL) {
-            fprintf(stderr, "Failed to get realpath for %s\n", to_buffer);
-            goto _handleVolMountError;
-        } else if (from_real == NULL) {
-            fprintf(stderr, "Failed to get realpath for %s\n", from_buffer);
-            goto _handleVolMountError;
-        } else {
-            size_t to_len = strlen(to_real);
-            size_t from_len = strlen(from_real);
-            size_t idx = 0;
-            int volMountDevOk = 0;
-            const char *container_to_real = NULL;
-            const char *container_from_real = NULL;
-            int ret = 0;
-            struct stat toStat;
+/**
+ * startKeyPoolRefill
+ * Refill the sshd host key pool from a detached background process, so
+ * setup does not wait for key generation.
+ *
+ * Returns 0 if the refill was started (or no pool is configured), 1 otherwise.
+ */
+int startKeyPoolRefill(UdiRootConfig *udiConfig) {
+    char keygen[PATH_MAX];
+    pid_t pid = 0;
+    int status = 0;
 
-            /* validate that path starts with udiMountPoint */
-            if (to_len <= udiMountLen ||
-                strncmp(to_real, udiConfig->udiMountPoint, udiMountLen) != 0) {
+    if (udiConfig == NULL || udiConfig->sshKeyPoolPath == NULL ||
+            strlen(udiConfig->sshKeyPoolPath) == 0 ||
+            udiConfig->optUdiImage == NULL)
+    {
+        return 0;
+    }
+    snprintf(keygen, PATH_MAX, "%s/bin/ssh-keygen", udiConfig->optUdiImage);
+    keygen[PATH_MAX-1] = 0;
 
-                fprintf(stderr, "Invalid destination %s, not allowed, fail.\n", to_real);
-                goto _handleVolMountError;
+    pid = fork();
+    if (pid < 0) {
+        return 1;
+    }
+    if (pid == 0) {
+        int devNull = -1;
+        setsid();
+        if (fork() != 0) {
+            _exit(0);
+        }
+        /* do not keep the UDI busy */
+        if (chdir("/") != 0) {
+            _exit(1);
+        }
+        devNull = open("/dev/null", O_RDWR);
+        if (devNull >= 0) {
+            dup2(devNull, STDIN_FILENO);
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+            if (devNull > STDERR_FILENO) {
+                close(devNull);
             }
+        }
+        _exit(_shifterCore_refillKeyPool(udiConfig->sshKeyPoolPath, keygen));
+    }
+    waitpid(pid, &status, 0);
+    return 0;
+}
 
-            /* validate source mount point */
-            if (userRequested != 0 && !(flagsInEffect & VOLMAP_FLAG_PERNODECACHE)) {
-                if (from_len <= udiMountLen ||
-                    strncmp(from_real, udiConfig->udiMountPoint, udiMountLen) != 0) {
+int setupImageSsh(char *sshPubKey, char *username, uid_t uid, gid_t gid, UdiRootConfig *udiConfig) {
+    struct stat statData;
+    char *udiImage = _malloc(sizeof(char) * PATH_MAX);
+    char *sshdConfigPath = _malloc(sizeof(char) * PATH_MAX);
+    char *sshdConfigPathNew = _malloc(sizeof(char) * PATH_MAX);
+    char *from = _malloc(sizeof(char) * PATH_MAX);
+    char *to = _malloc(sizeof(char) * PATH_MAX);
+    char *buffer = _malloc(sizeof(char) * PATH_MAX);
+    char *keygenExec = _malloc(sizeof(char) * PATH_MAX);
+    char *lineBuf = NULL;
+    size_t lineBuf_size = 0;
+    uid_t ownerUid = uid;
+    gid_t ownerGid = gid;
+    int keysInstalled = 0;
 
-                    fprintf(stderr, "Invalid source %s, not allowed, fail.\n", from_real);
-                    goto _handleVolMountError;
-                } else {
-                    /* from_real is known to be longer than udiMountLen from
-                     * previous check (i.e., don't remove the check!) */
-                    container_from_real = from_real + udiMountLen;
-                }
-            } else {
-                container_from_real = from_real;
-            }
+    FILE *inputFile = NULL;
+    FILE *outputFile = NULL;
 
-            /* validate that the path is allowed */
-            /* to_real is known to be longer than udiMountLen from previous
-             * check (i.e., don't remove the check!) */
-            container_to_real = to_real + udiMountLen;
+    MountList mountCache;
+    memset(&mountCache, 0, sizeof(MountList));
 
-            if ((ret = _validate_fp(container_from_real, container_to_real, flags)) != 0) {
-                fprintf(stderr, "Invalid mount request, permission denied! "
-                        "Cannot mount from %s to %s. Err Code %d\n",
-                        container_from_real, container_to_real, ret);
-                goto _handleVolMountError;
-            }
+    if (ownerUid == 0 || ownerGid == 0) {
+        fprintf(stderr, "FAILED to identify proper uid to run sshd\n");
+        goto _setupImageSsh_unclean;
+    }
 
-            /* the destination mount must be either in the shifter root
-             * filesystem, or on the orignal device providing the container
-             * image.  Should not allow volume mounts onto other imported
-             * content */
-            memset(&toStat, 0, sizeof(struct stat));
-            if (lstat(to_real, &toStat) != 0) {
-                fprintf(stderr, "Failed to stat destination mount point: %s\n",
-                        strerror(errno));
-                goto _handleVolMountError;
-            }
-            if (udiConfig->bindMountAllowedDevices == NULL) {
-                fprintf(stderr, "No devices are authorized to accept "
-                        "volume mounts.\n");
-                goto _handleVolMountError;
-            }
+#define _BINDMOUNT(mounts, from, to, flags, overwrite) if (_shifterCore_bindMount(udiConfig, mounts, from, to, flags, overwrite) != 0) { \
+    fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n", from, to); \
+    goto _setupImageSsh_unclean; \
+}
 
-            volMountDevOk = 0;
-            for (idx = 0; idx < udiConfig->bindMountAllowedDevices_sz; idx++) {
-                if (toStat.st_dev == udiConfig->bindMountAllowedDevices[idx]) {
-                    volMountDevOk = 1;
-                    break;
-                }
-            }
-            /* Allow mounts if the user owns the destionation directory. */
-            int toDirOwnedByUser = 0;
-            if (statData.st_uid == geteuid()) {
-                toDirOwnedByUser = 1;
-            }
-            if (volMountDevOk == 0 && toDirOwnedByUser == 0) {
-                fprintf(stderr, "Mount request path %s not on an approved "
-                        "device for volume mounts.\n", to_real);
-                goto _handleVolMountError;
-            }
+    if (parse_MountList(&mountCache) != 0) {
+        fprintf(stderr, "FAILED to parse existing mounts\n");
+        goto _setupImageSsh_unclean;
+    }
+
+    snprintf(udiImage, PATH_MAX, "%s/opt/udiImage", udiConfig->udiMountPoint);
+    udiImage[PATH_MAX-1] = 0;
+    if (stat(udiImage, &statData) != 0) {
+        fprintf(stderr, "FAILED to find udiImage path, cannot setup sshd\n");
+        goto _setupImageSsh_unclean;
+    }
+    if (chdir(udiImage) != 0) {
+        fprintf(stderr, "FAILED to chdir to %s\n", udiImage);
+        goto _setupImageSsh_unclean;
+    }
+
+    /* install host keys from the node pool if there are any left, and
+     * have the pool refilled in the background */
+    snprintf(buffer, PATH_MAX, "%s/etc", udiImage);
+    buffer[PATH_MAX-1] = 0;
+    if (udiConfig->sshKeyPoolPath != NULL &&
+            strlen(udiConfig->sshKeyPoolPath) > 0 &&
+            _shifterCore_checkPrivateDir(udiConfig->sshKeyPoolPath,
+                S_IRWXG | S_IRWXO) == 0)
+    {
+        char *keySet = _shifterCore_claimHostKeys(udiConfig->sshKeyPoolPath);
+        if (keySet != NULL) {
+            keysInstalled = _shifterCore_installHostKeys(keySet, buffer,
+                    ownerUid, ownerGid) == 0;
+            _shifterCore_removeKeySet(keySet);
+            free(keySet);
         }
+        startKeyPoolRefill(udiConfig);
+    }
 
-        if (flagsInEffect & VOLMAP_FLAG_PERNODECACHE) {
-            VolMapPerNodeCacheConfig *cacheConfig = NULL;
-            /* do something to mount backing store */
-            for (flagIdx = 0; flags && flags[flagIdx].type != 0; flagIdx++) {
-                if (flags[flagIdx].type == VOLMAP_FLAG_PERNODECACHE) {
-                    cacheConfig = (VolMapPerNodeCacheConfig *) flags[flagIdx].value;
-                    break;
-                }
-            }
-            if (cacheConfig == NULL) {
-                fprintf(stderr, "FAILED to find per-node cache config, exiting.\n");
-                goto _handleVolMountError;
-            }
-            ImageFormat format = FORMAT_INVALID;
-            if (strcmp(cacheConfig->fstype, "xfs") == 0) {
-                format = FORMAT_XFS;
-            }
-            if (strcmp(cacheConfig->method, "loop") == 0) {
-                if (loopMount(from_buffer, to_real, format, udiConfig, 0) != 0) {
-                    fprintf(stderr, "FAILED to mount per-node cache, exiting.\n");
-                    goto _handleVolMountError;
-                }
-                insert_MountList(mountCache, to_real);
-            } else {
-                fprintf(stderr, "FAILED to understand per-node cache mounting method, exiting.\n");
-                goto _handleVolMountError;
-            }
-            if (chown(to_real, udiConfig->target_uid, udiConfig->target_gid) != 0) {
-                fprintf(stderr, "FAILED to chown per-node cache to user.\n");
-                goto _handleVolMountError;
-            }
-            if (unlink(from_buffer) != 0) {
-                fprintf(stderr, "FAILED to unlink backing file: %s!", from_buffer);
-                perror("Error: ");
-                goto _handleVolMountError;
-            }
+    /* otherwise generate ssh host keys */
+    snprintf(keygenExec, PATH_MAX, "%s/bin/ssh-keygen", udiImage);
+    keygenExec[PATH_MAX-1] = 0;
+    if (!keysInstalled && _shifterCore_generateHostKeys(keygenExec, buffer,
+                ownerUid, ownerGid, 0) != 0)
+    {
+        goto _setupImageSsh_unclean;
+    }
+
+    /* rewrite sshd_config */
+    snprintf(sshdConfigPath, PATH_MAX, "%s/etc/sshd_config", udiImage);
+    sshdConfigPath[PATH_MAX - 1] = 0;
+    snprintf(sshdConfigPathNew, PATH_MAX, "%s/etc/sshd_config.new", udiImage);
+    sshdConfigPathNew[PATH_MAX - 1] = 0;
+
+    inputFile = fopen(sshdConfigPath, "r");
+    outputFile = fopen(sshdConfigPathNew, "w");
+
+    if (inputFile == NULL || outputFile == NULL) {
+        fprintf(stderr, "Could not open sshd_config for reading or writing\n");
+        goto _setupImageSsh_unclean;
+    }
 
+    while (!feof(inputFile) && !ferror(inputFile)) {
+        size_t nbytes = getline(&lineBuf, &lineBuf_size, inputFile);
+        char *ptr = NULL;
+        if (nbytes == 0) break;
+        ptr = shifter_trim(lineBuf);
+        if (strcmp(ptr, "AllowUsers ToBeReplaced") == 0) {
+            fprintf(outputFile, "AllowUsers %s\n", username);
         } else {
-            int allowOverwriteBind = 1;
+            fprintf(outputFile, "%s\n", ptr);
+        }
+    }
+    fclose(inputFile);
+    fclose(outputFile);
+    inputFile = NULL;
+    outputFile = NULL;
+    if (lineBuf != NULL) {
+        free(lineBuf);
+        lineBuf = NULL;
+    }
+    if (stat(sshdConfigPathNew, &statData) != 0) {
+        fprintf(stderr, "FAILED to find new sshd_config file, cannot setup sshd\n");
+        goto _setupImageSsh_unclean;
+    } else if (rename(sshdConfigPathNew, sshdConfigPath) != 0) {
+        fprintf(stderr, "FAILED to replace sshd_config with configured version.\n");
+        goto _setupImageSsh_unclean;
+    }
+    if (chown(sshdConfigPath, ownerUid, ownerGid) != 0) {
+        fprintf(stderr, "FAILED to chown sshd config path %s\n", sshdConfigPath);
+        perror("   errno: ");
+        goto _setupImageSsh_unclean;
+    }
+    if (chmod(sshdConfigPath, S_IRUSR | S_IROTH) != 0) {
+        fprintf(stderr, "FAILED to set sshd config permissions to 0600\n");
+        perror("   errno: ");
+        goto _setupImageSsh_unclean;
+    }
 
-            if (_shifterCore_bindMount(udiConfig, mountCache, from_real, to_real, flagsInEffect, allowOverwriteBind) != 0) {
-                fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n", from_buffer, to_real);
-                goto _handleVolMountError;
-            }
+    if (sshPubKey != NULL && strlen(sshPubKey) > 0) {
+        snprintf(buffer, PATH_MAX, "%s/etc/user_auth_keys", udiImage);
+        buffer[PATH_MAX - 1] = 0;
+        outputFile = fopen(buffer, "w");
+        if (outputFile == NULL) {
+            fprintf(stderr, "FAILED to open user_auth_keys for writing\n");
+            goto _setupImageSsh_unclean;
+        }
+        fprintf(outputFile, "%s\n", sshPubKey);
+        fclose(outputFile);
+        outputFile = NULL;
+        if (chown(buffer, uid, 0) != 0) {
+            fprintf(stderr, "FAILED to chown ssh pub key to uid %d\n", uid);
+            perror("   errno: ");
+            goto _setupImageSsh_unclean;
+        }
+        if (chmod(buffer, S_IRUSR) != 0) {
+            fprintf(stderr, "FAILED to set ssh pub key permissions to 0600\n");
+            perror("   errno: ");
+            goto _setupImageSsh_unclean;
         }
-        free(to_real);
-        to_real = NULL;
-        free(from_real);
-        from_real = NULL;
-        free(filtered_from);
-        filtered_from = NULL;
+    }
 
-        continue;
-_handleVolMountError:
-        if ((flagsInEffect & VOLMAP_FLAG_PERNODECACHE) && backingStoreExists == 1) {
-            unlink(from_buffer);
+    {
+        snprintf(from, PATH_MAX, "%s/bin/ssh", udiImage);
+        snprintf(to, PATH_MAX, "%s/usr/bin/ssh", udiConfig->udiMountPoint);
+        from[PATH_MAX-1] = 0;
+        to[PATH_MAX-1] = 0;
+        if (stat(to, &statData) == 0) {
+            _BINDMOUNT(&mountCache, from, to, VOLMAP_FLAG_READONLY, 1);
         }
-        goto _setupVolumeMapMounts_unclean;
+        snprintf(from, PATH_MAX, "%s/bin/ssh", udiImage);
+        snprintf(to, PATH_MAX, "%s/bin/ssh", udiConfig->udiMountPoint);
+        from[PATH_MAX - 1] = 0;
+        to[PATH_MAX - 1] = 0;
+        if (stat(to, &statData) == 0) {
+            _BINDMOUNT(&mountCache, from, to, VOLMAP_FLAG_READONLY, 1);
+        }
+        snprintf(from, PATH_MAX, "%s/etc/ssh_config", udiImage);
+        snprintf(to, PATH_MAX, "%s/etc/ssh/ssh_config", udiConfig->udiMountPoint);
+        if (_shifterCore_copyFile(udiConfig->cpPath, from, to, 0, 0, 0, 0) != 0) {
+            fprintf(stderr, "FAILED to copy ssh_config to %s\n", to);
+            goto _setupImageSsh_unclean;
+        }
+        /* rely on var/empty created earlier in the setup process */
     }
-
 #undef _BINDMOUNT
-    free(from_buffer);
-    free(to_buffer);
+    free(udiImage);
+    free(sshdConfigPath);
+    free(sshdConfigPathNew);
+    free(from);
+    free(to);
+    free(buffer);
+    free(keygenExec);
     return 0;
-
-_setupVolumeMapMounts_unclean:
-    if (filtered_from != NULL) {
-        free(filtered_from);
-    }
-    if (filtered_to != NULL) {
-        free(filtered_to);
+_setupImageSsh_unclean:
+    if (inputFile != NULL) {
+        fclose(inputFile);
+        inputFile = NULL;
     }
-    if (to_real != NULL) {
-        free(to_real);
+    if (outputFile != NULL) {
+        fclose(outputFile);
+        outputFile = NULL;
     }
-    free(from_buffer);
-    free(to_buffer);
+    free(udiImage);
+    free(sshdConfigPath);
+    free(sshdConfigPathNew);
+    free(from);
+    free(to);
+    free(buffer);
+    free(keygenExec);
     return 1;
 }
 
-char *generateShifterConfigString(const char *user, ImageData *image,
-                                  VolumeMap *volumeMap, UdiRootConfig *config)
-{
-    char *str = NULL;
-    char *volMapSig = NULL;
-    char *modules = NULL;
-    size_t modules_len = 0;
-    size_t modules_sz = 0;
+gid_t *shifter_getgrouplist(const char *user, gid_t group, int *ngroups) {
+    int ret = 0;
     int idx = 0;
-    if (image == NULL || volumeMap == NULL) return NULL;
+    gid_t *ret_groups = NULL;
+    int nret_groups = 0;
 
-    volMapSig = getVolMapSignature(volumeMap);
-    for (idx = 0; idx < config->n_active_modules; idx++) {
-        modules = alloc_strcatf(modules, &modules_len, &modules_sz, "%s,",
-                                config->active_modules[idx]->name);
+    if (user == NULL || group == 0 || ngroups == NULL) {
+        goto _getgrlist_err;
+    }
+    if (strcmp(user, "root") == 0) {
+        fprintf(stderr, "FAILED: refuse to lookup groups for root\n");
+        goto _getgrlist_err;
     }
 
-    str = alloc_strgenf(
-            "{\"identifier\":\"%s\","
-            "\"user\":\"%s\","
-            "\"volMap\":\"%s\","
-            "\"modules\":\"%s\"}",
-            image->identifier,
-            user,
-            (volMapSig == NULL ? "" : volMapSig),
-            (modules == NULL ? "" : modules)
-    );
+    ret = getgrouplist(user, group, NULL, &nret_groups);
+    if (ret < 0 && nret_groups > 0) {
+        if (nret_groups > 512) {
+            fprintf(stderr, "FAILED to get groups, seriously 512 groups is enough!\n");
+            goto _getgrlist_err;
+        }
 
-    if (volMapSig != NULL) {
-        free(volMapSig);
+        /* allocate and initialize memory to be populated by getgrouplist */
+        ret_groups = (gid_t *) _malloc(sizeof(gid_t) * (nret_groups + 1));
+        memset(ret_groups, 0, sizeof(gid_t) * (nret_groups + 1));
+
+        ret = getgrouplist(user, group, ret_groups, &nret_groups);
+        if (ret < 0) {
+            fprintf(stderr, "FAILED to get groups correctly\n");
+            goto _getgrlist_err;
+        }
     }
-    if (modules != NULL) {
-        free(modules);
+
+    /* set default group list if none are found */
+    if (nret_groups <= 0) {
+        if (ret_groups != NULL) {
+            free(ret_groups);
+            ret_groups = NULL;
+        }
+        ret_groups = (gid_t *) _malloc(sizeof(gid_t) * 2);
+        ret_groups[0] = group;
+        ret_groups[1] = 0;
+        nret_groups = 1;
     }
-    return str;
+    if (ret_groups == NULL) {
+        fprintf(stderr, "FAILED: no auxilliary groups found!\n");
+        goto _getgrlist_err;
+    }
+
+    /* just make sure no zeros snuck in */
+    for (idx = 0; idx < nret_groups; idx++) {
+        if (ret_groups[idx] == 0) {
+            ret_groups[idx] = group;
+        }
+    }
+    *ngroups = nret_groups;
+    return ret_groups;
+
+_getgrlist_err:
+    if (ret_groups != NULL) {
+        free(ret_groups);
+        ret_groups = NULL;
+    }
+    if (ngroups != NULL) {
+        *ngroups = 0;
+    }
+    return NULL;
 }
 
-int saveShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap, UdiRootConfig *udiConfig) {
-    char *saveFilename = _malloc(sizeof(char) * PATH_MAX);
-    FILE *fp = NULL;
-    char *configString = generateShifterConfigString(user, image, volumeMap, udiConfig);
+/**
+  * startSshd
+  * chroots into image and runs the secured sshd
+  */
+int startSshd(const char *user, UdiRootConfig *udiConfig) {
+    char *chrootPath = _malloc(sizeof(char) * PATH_MAX);
+    pid_t pid = 0;
+    int execPipe[2] = { -1, -1 };
 
-    if (configString == NULL) {
-        goto _saveShifterConfig_error;
+    snprintf(chrootPath, PATH_MAX, "%s", udiConfig->udiMountPoint);
+    chrootPath[PATH_MAX - 1] = 0;
+
+    if (chdir(chrootPath) != 0) {
+        fprintf(stderr, "FAILED to chdir to %s while attempted to start sshd\n", chrootPath);
+        goto _startSshd_unclean;
+    }
+    if (udiConfig->target_uid == 0 || udiConfig->target_gid == 0) {
+        fprintf(stderr, "FAILED to start sshd, will not start as root\n");
+        goto _startSshd_unclean;
+    }
+    if (pipe2(execPipe, O_CLOEXEC) != 0) {
+        fprintf(stderr, "FAILED to create pipe while attempting to start sshd\n");
+        goto _startSshd_unclean;
     }
 
-    snprintf(saveFilename, PATH_MAX, "%s/var/shifterConfig.json",
-            udiConfig->udiMountPoint);
-    fp = fopen(saveFilename, "w");
-    if (fp == NULL) {
-        goto _saveShifterConfig_error;
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "FAILED to fork while attempting to start sshd\n");
+        goto _startSshd_unclean;
     }
-    fprintf(fp, "%s\n", configString);
-    fclose(fp);
-    fp = NULL;
+    if (pid == 0) {
+        /* get grouplist in the external environment */
+        int nGroups = 0;
+        gid_t *gidList = shifter_getgrouplist(user, udiConfig->target_gid, &nGroups);
+        if (gidList == NULL) {
+            fprintf(stderr, "FAILED to correctly get grouplist for sshd\n");
+            goto _startSshd_child_fail;
+        }
 
-    free(configString);
-    configString = NULL;
-    free(saveFilename);
-    return 0;
-_saveShifterConfig_error:
-    if (configString != NULL) {
-        free(configString);
+        if (chdir(chrootPath) != 0) {
+            fprintf(stderr, "FAILED to chdir to %s while attempting to start sshd\n", chrootPath);
+            goto _startSshd_child_fail;
+        }
+        if (chroot(chrootPath) != 0) {
+            fprintf(stderr, "FAILED to chroot to %s while attempting to start sshd\n", chrootPath);
+            goto _startSshd_child_fail;
+        }
+        if (chdir("/") != 0) {
+            fprintf(stderr, "FAILED to chdir following chroot\n");
+            goto _startSshd_child_fail;
+        }
+        if (gidList == NULL) {
+            fprintf(stderr, "FAILED to get groupllist for sshd, exiting!\n");
+            goto _startSshd_child_fail;
+        }
+        if (shifter_set_capability_boundingset_null() != 0) {
+            fprintf(stderr, "FAILED to restrict future capabilities\n");
+            goto _startSshd_child_fail;
+        }
+        if (setgroups(nGroups, gidList) != 0) {
+            fprintf(stderr, "FAILED to setgroups(): %s\n", strerror(errno));
+            goto _startSshd_child_fail;
+        }
+        if (setresgid(udiConfig->target_gid, udiConfig->target_gid,
+                      udiConfig->target_gid) != 0) {
+            fprintf(stderr, "FAILED to setresgid(): %s\n", strerror(errno));
+            goto _startSshd_child_fail;
+        }
+        if (setresuid(udiConfig->target_uid, udiConfig->target_uid,
+                      udiConfig->target_uid) != 0) {
+            fprintf(stderr, "FAILED to setresuid(): %s\n", strerror(errno));
+            goto _startSshd_child_fail;
+        }
+#if HAVE_DECL_PR_SET_NO_NEW_PRIVS == 1
+        /* ensure this process and its heirs cannot gain privilege */
+        /* see https://www.kernel.org/doc/Documentation/prctl/no_new_privs.txt */
+        if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
+            fprintf(stderr, "Failed to fully drop privileges: %s",
+                    strerror(errno));
+            goto _startSshd_child_fail;
+        }
+#endif
+        /* sshd stays in the foreground of its own session so that its pid
+         * is the one recorded by the parent */
+        int devNull = open("/dev/null", O_RDWR);
+        if (devNull < 0 || setsid() < 0) {
+            fprintf(stderr, "FAILED to detach sshd: %s\n", strerror(errno));
+            goto _startSshd_child_fail;
+        }
+        char **sshdArgs = (char **) _malloc(sizeof(char *) * 3);
+        sshdArgs[0] = _strdup("/opt/udiImage/sbin/sshd");
+        sshdArgs[1] = _strdup("-D");
+        sshdArgs[2] = NULL;
+        close(execPipe[0]);
+        dup2(devNull, STDIN_FILENO);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        execv(sshdArgs[0], sshdArgs);
+
+        /* if we fell through to here, there is a problem, report errno
+         * through the pipe so the parent knows sshd did not start */
+_startSshd_child_fail:
+        {
+            int err = errno;
+            if (write(execPipe[1], &err, sizeof(int)) < 0) {
+                /* nothing left to report to */
+            }
+        }
+        exit(1);
+    } else {
+        int err = 0;
+        int status = 0;
+        ssize_t nread = 0;
+        close(execPipe[1]);
+        execPipe[1] = -1;
+        /* the pipe closes without data once sshd is executing */
+        do {
+            nread = read(execPipe[0], &err, sizeof(int));
+        } while (nread < 0 && errno == EINTR);
+        close(execPipe[0]);
+        execPipe[0] = -1;
+        if (nread != 0) {
+            if (nread == sizeof(int) && err != 0) {
+                fprintf(stderr, "FAILED to start sshd: %s\n", strerror(err));
+            }
+            waitpid(pid, &status, 0);
+            goto _startSshd_unclean;
+        }
+        /* sshd -D reports a bad configuration or host key, or a port already
+         * in use, by exiting before it listens */
+        switch (_shifterCore_waitForListen(pid, SSHD_START_TIMEOUT_MS)) {
+            case 0:
+                break;
+            case 1:
+                fprintf(stderr, "FAILED to start sshd: exited during "
+                        "startup\n");
+                goto _startSshd_unclean;
+            default:
+                fprintf(stderr, "FAILED to start sshd: not listening after "
+                        "%d ms\n", SSHD_START_TIMEOUT_MS);
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+                goto _startSshd_unclean;
+        }
+        /* teardown and the WLM find the sshd through the record only */
+        if (_shifterCore_recordSshd(pid, udiConfig) != 0) {
+            fprintf(stderr, "FAILED to record sshd pid %d\n", pid);
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            goto _startSshd_unclean;
+        }
+        free(chrootPath);
+        return 0;
     }
-    free(saveFilename);
+    free(chrootPath);
+    return 0;
+_startSshd_unclean:
+    if (execPipe[0] >= 0) close(execPipe[0]);
+    if (execPipe[1] >= 0) close(execPipe[1]);
+    free(chrootPath);
     return 1;
 }
 
-int compareShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap, UdiRootConfig *udiConfig) {
-    char *configFilename = _malloc(sizeof(char) * PATH_MAX);
-    FILE *fp = NULL;
-    char *configString = generateShifterConfigString(user, image, volumeMap, udiConfig);
-    char *buffer = NULL;
-    size_t len = 0;
-    size_t nread = 0;
-    int cmpVal = 0;
-
-    if (configString == NULL) {
-        goto _compareShifterConfig_error;
-    }
-    len = strlen(configString);
-    buffer = (char *) _malloc(sizeof(char) * len);
-
-    snprintf(configFilename, PATH_MAX, "%s/var/shifterConfig.json",
-            udiConfig->udiMountPoint);
-
-    fp = fopen(configFilename, "r");
-    if (fp == NULL) {
-        goto _compareShifterConfig_error;
-    }
-
-    nread = fread(buffer, sizeof(char), len, fp);
-    fclose(fp);
-    fp = NULL;
+int _forkAndExecv(char *const *args, int silent) {
+    pid_t pid = 0;
 
-    if (nread == len) {
-        cmpVal = memcmp(configString, buffer, sizeof(char) * len);
-    } else {
-        cmpVal = -1;
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "FAILED to fork! Exiting.\n");
+        return 1;
     }
-
-    free(configString);
-    configString = NULL;
-
-    free(buffer);
-    buffer = NULL;
-    free(configFilename);
-    return cmpVal;
-_compareShifterConfig_error:
-    if (configString != NULL) {
-        free(configString);
+    if (pid > 0) {
+        /* this is the parent */
+        int status = 0;
+        do {
+            pid_t ret = waitpid(pid, &status, 0);
+            if (ret != pid) {
+                fprintf(stderr, "This might be impossible: forked by couldn't wait, FAIL!\n");
+                return 1;
+            }
+        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        if (WIFEXITED(status)) {
+            status = WEXITSTATUS(status);
+        } else {
+            status = 1;
+        }
+        return status;
     }
-    if (buffer != NULL) {
-        free(buffer);
+    /* this is the child */
+    if (silent) {
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull < 0) {
+            fprintf(stderr, "FAILED to open /dev/null: %s", strerror(errno));
+            exit(1);
+        }
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(devNull);
     }
-    free(configFilename);
-    return -1;
+    execv(args[0], args);
+    fprintf(stderr, "FAILED to execvp! Exiting.\n");
+    exit(127);
 }
 
-int setupImageSsh(char *sshPubKey, char *username, uid_t uid, gid_t gid, UdiRootConfig *udiConfig) {
-    struct stat statData;
-    char *udiImage = _malloc(sizeof(char) * PATH_MAX);
-    char *sshdConfigPath = _malloc(sizeof(char) * PATH_MAX);
-    char *sshdConfigPathNew = _malloc(sizeof(char) * PATH_MAX);
-    char *from = _malloc(sizeof(char) * PATH_MAX);
-    char *to = _malloc(sizeof(char) * PATH_MAX);
-    char *buffer = _malloc(sizeof(char) * PATH_MAX);
-    char *keygenExec = _malloc(sizeof(char) * PATH_MAX);
-    char *keyFileName = _malloc(sizeof(char) * PATH_MAX);
-    const char *keyType[5] = {"dsa", "ecdsa", "rsa","ed25519", NULL};
-    const char **keyPtr = NULL;
-    char *lineBuf = NULL;
-    size_t lineBuf_size = 0;
-    uid_t ownerUid = uid;
-    gid_t ownerGid = gid;
-
-    FILE *inputFile = NULL;
-    FILE *outputFile = NULL;
-
-    MountList mountCache;
-    memset(&mountCache, 0, sizeof(MountList));
-
-    if (ownerUid == 0 || ownerGid == 0) {
-        fprintf(stderr, "FAILED to identify proper uid to run sshd\n");
-        goto _setupImageSsh_unclean;
-    }
+int forkAndExecv(char *const *args) {
+    return _forkAndExecv(args, 0);
+}
 
-#define _BINDMOUNT(mounts, from, to, flags, overwrite) if (_shifterCore_bindMount(udiConfig, mounts, from, to, flags, overwrite) != 0) { \
-    fprintf(stderr, "BIND MOUNT FAILED from %s to %s\n", from, to); \
-    goto _setupImageSsh_unclean; \
+int forkAndExecvSilent(char *const *args) {
+    return _forkAndExecv(args, 1);
 }
 
-    if (parse_MountList(&mountCache) != 0) {
-        fprintf(stderr, "FAILED to parse existing mounts\n");
-        goto _setupImageSsh_unclean;
-    }
+int _shifterCore_bindMount(UdiRootConfig *udiConfig, MountList *mountCache,
+        const char *from, const char *to, size_t flags, int overwriteMounts)
+{
+    int ret = 0;
+    char **ptr = NULL;
+    char *to_real = NULL;
+    unsigned long mountFlags = MS_BIND;
+    unsigned long remountFlags = MS_REMOUNT|MS_BIND|MS_NOSUID;
+    unsigned long privateRemountFlags = 0;
 
-    snprintf(udiImage, PATH_MAX, "%s/opt/udiImage", udiConfig->udiMountPoint);
-    udiImage[PATH_MAX-1] = 0;
-    if (stat(udiImage, &statData) != 0) {
-        fprintf(stderr, "FAILED to find udiImage path, cannot setup sshd\n");
-        goto _setupImageSsh_unclean;
-    }
-    if (chdir(udiImage) != 0) {
-        fprintf(stderr, "FAILED to chdir to %s\n", udiImage);
-        goto _setupImageSsh_unclean;
+    if (udiConfig == NULL) {
+        fprintf(stderr, "FAILED to provide udiConfig!\n");
+        return 1;
     }
 
-    /* generate ssh host keys */
-    for (keyPtr = keyType; *keyPtr != NULL; keyPtr++) {
-        char *args[8];
-        char **argPtr = NULL;
-        int ret = 0;
-
-        snprintf(keygenExec, PATH_MAX, "%s/bin/ssh-keygen", udiImage);
-        keygenExec[PATH_MAX-1] = 0;
-        snprintf(keyFileName, PATH_MAX, "%s/etc/ssh_host_%s_key", udiImage, *keyPtr);
-        args[0] = _strdup(keygenExec);
-        args[1] = _strdup("-t");
-        args[2] = _strdup(*keyPtr);
-        args[3] = _strdup("-f");
-        args[4] = _strdup(keyFileName);
-        args[5] = _strdup("-N");
-        args[6] = _strdup("");
-        args[7] = NULL;
-        for (argPtr = args; argPtr - args < 7; argPtr++) {
-            if (argPtr == NULL || *argPtr == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                ret = 1;
-            }
-        }
-        if (ret == 0) {
-            ret = forkAndExecv(args);
-        }
-        for (argPtr = args; *argPtr != NULL; argPtr++) {
-            free(*argPtr);
-        }
-
-        if (ret != 0) {
-            fprintf(stderr, "Failed to generate key of type %s\n", *keyPtr);
-            goto _setupImageSsh_unclean;
-        }
+    privateRemountFlags =
+        udiConfig->mountPropagationStyle == VOLMAP_FLAG_SLAVE ?
+        MS_SLAVE : MS_PRIVATE;
 
-        /* chown files to user */
-        if (chown(keyFileName, ownerUid, ownerGid) != 0) {
-            fprintf(stderr, "Failed to chown ssh host key to user: %s\n",
-                    keyFileName);
-            goto _setupImageSsh_unclean;
-        }
+    if (flags & VOLMAP_FLAG_SLAVE) {
+        privateRemountFlags = MS_SLAVE;
+    } else if (flags & VOLMAP_FLAG_PRIVATE) {
+        privateRemountFlags = MS_PRIVATE;
     }
 
-    /* rewrite sshd_config */
-    snprintf(sshdConfigPath, PATH_MAX, "%s/etc/sshd_config", udiImage);
-    sshdConfigPath[PATH_MAX - 1] = 0;
-    snprintf(sshdConfigPathNew, PATH_MAX, "%s/etc/sshd_config.new", udiImage);
-    sshdConfigPathNew[PATH_MAX - 1] = 0;
-
-    inputFile = fopen(sshdConfigPath, "r");
-    outputFile = fopen(sshdConfigPathNew, "w");
+    if (from == NULL || to == NULL || mountCache == NULL) {
+        fprintf(stderr, "INVALID input to bind-mount. Fail\n");
+        return 1;
+    }
 
-    if (inputFile == NULL || outputFile == NULL) {
-        fprintf(stderr, "Could not open sshd_config for reading or writing\n");
-        goto _setupImageSsh_unclean;
+    to_real = realpath(to, NULL);
+    if (to_real == NULL) {
+        fprintf(stderr, "Couldn't lookup path %s, fail.\n", to);
+        return 1;
     }
 
-    while (!feof(inputFile) && !ferror(inputFile)) {
-        size_t nbytes = getline(&lineBuf, &lineBuf_size, inputFile);
-        char *ptr = NULL;
-        if (nbytes == 0) break;
-        ptr = shifter_trim(lineBuf);
-        if (strcmp(ptr, "AllowUsers ToBeReplaced") == 0) {
-            fprintf(outputFile, "AllowUsers %s\n", username);
+    /* not interested in mounting over existing mounts, prevents
+       things from getting into a weird state later. */
+    ptr = find_MountList(mountCache, to_real);
+    if (ptr != NULL) {
+        if (overwriteMounts) {
+            int retry = 0;
+            for (retry = 0; retry < BINDMOUNT_OVERWRITE_UNMOUNT_RETRY; retry++) {
+                if (unmountTree(mountCache, to_real) != 0) {
+                    fprintf(stderr, "%s was already mounted, failed to unmount existing, fail.\n", to_real);
+                    ret = 1;
+                    goto _bindMount_exit;
+                }
+                if (validateUnmounted(to_real, 0) == 0) {
+                    break;
+                }
+                usleep(300000); /* sleep for 0.3s */
+            }
         } else {
-            fprintf(outputFile, "%s\n", ptr);
-        }
-    }
-    fclose(inputFile);
-    fclose(outputFile);
-    inputFile = NULL;
-    outputFile = NULL;
-    if (lineBuf != NULL) {
-        free(lineBuf);
-        lineBuf = NULL;
-    }
-    if (stat(sshdConfigPathNew, &statData) != 0) {
-        fprintf(stderr, "FAILED to find new sshd_config file, cannot setup sshd\n");
-        goto _setupImageSsh_unclean;
-    } else {
-        char *moveCmd[] = { _strdup(udiConfig->mvPath),
-            _strdup(sshdConfigPathNew),
-            _strdup(sshdConfigPath),
-            NULL
-        };
-        char **argsPtr = NULL;
-        int ret = forkAndExecv(moveCmd);
-        for (argsPtr = moveCmd; *argsPtr != NULL; argsPtr++) {
-            free(*argsPtr);
-        }
-        if (ret != 0) {
-            fprintf(stderr, "FAILED to replace sshd_config with configured version.\n");
-            goto _setupImageSsh_unclean;
+            fprintf(stderr, "%s was already mounted, not allowed to unmount existing, fail.\n", to_real);
+            ret = 1;
+            goto _bindMount_exit;
         }
     }
-    if (chown(sshdConfigPath, ownerUid, ownerGid) != 0) {
-        fprintf(stderr, "FAILED to chown sshd config path %s\n", sshdConfigPath);
-        perror("   errno: ");
-        goto _setupImageSsh_unclean;
+
+    if (strcmp(from, "/dev") == 0 || (flags & VOLMAP_FLAG_RECURSIVE)) {
+        mountFlags |= MS_REC;
+        remountFlags |= MS_REC;
+        privateRemountFlags = MS_PRIVATE|MS_REC;
     }
-    if (chmod(sshdConfigPath, S_IRUSR | S_IROTH) != 0) {
-        fprintf(stderr, "FAILED to set sshd config permissions to 0600\n");
-        perror("   errno: ");
-        goto _setupImageSsh_unclean;
+
+    /* perform the initial bind-mount */
+    ret = mount(from, to_real, "bind", mountFlags, NULL);
+    if (ret != 0) {
+        goto _bindMount_unclean;
     }
+    insert_MountList(mountCache, to_real);
 
-    if (sshPubKey != NULL && strlen(sshPubKey) > 0) {
-        snprintf(buffer, PATH_MAX, "%s/etc/user_auth_keys", udiImage);
-        buffer[PATH_MAX - 1] = 0;
-        outputFile = fopen(buffer, "w");
-        if (outputFile == NULL) {
-            fprintf(stderr, "FAILED to open user_auth_keys for writing\n");
-            goto _setupImageSsh_unclean;
-        }
-        fprintf(outputFile, "%s\n", sshPubKey);
-        fclose(outputFile);
-        outputFile = NULL;
-        if (chown(buffer, uid, 0) != 0) {
-            fprintf(stderr, "FAILED to chown ssh pub key to uid %d\n", uid);
-            perror("   errno: ");
-            goto _setupImageSsh_unclean;
-        }
-        if (chmod(buffer, S_IRUSR) != 0) {
-            fprintf(stderr, "FAILED to set ssh pub key permissions to 0600\n");
-            perror("   errno: ");
-            goto _setupImageSsh_unclean;
-        }
+    /* if the source is exactly /dev or starts with /dev/ then
+       ALLOW device entires, otherwise remount with noDev */
+    if (strcmp(from, "/dev") != 0 && strncmp(from, "/dev/", 5) != 0) {
+        remountFlags |= MS_NODEV;
     }
 
-    {
-        snprintf(from, PATH_MAX, "%s/bin/ssh", udiImage);
-        snprintf(to, PATH_MAX, "%s/usr/bin/ssh", udiConfig->udiMountPoint);
-        from[PATH_MAX-1] = 0;
-        to[PATH_MAX-1] = 0;
-        if (stat(to, &statData) == 0) {
-            _BINDMOUNT(&mountCache, from, to, VOLMAP_FLAG_READONLY, 1);
-        }
-        snprintf(from, PATH_MAX, "%s/bin/ssh", udiImage);
-        snprintf(to, PATH_MAX, "%s/bin/ssh", udiConfig->udiMountPoint);
-        from[PATH_MAX - 1] = 0;
-        to[PATH_MAX - 1] = 0;
-        if (stat(to, &statData) == 0) {
-            _BINDMOUNT(&mountCache, from, to, VOLMAP_FLAG_READONLY, 1);
-        }
-        snprintf(from, PATH_MAX, "%s/etc/ssh_config", udiImage);
-        snprintf(to, PATH_MAX, "%s/etc/ssh/ssh_config", udiConfig->udiMountPoint);
-        if (_shifterCore_copyFile(udiConfig->cpPath, from, to, 0, 0, 0, 0) != 0) {
-            fprintf(stderr, "FAILED to copy ssh_config to %s\n", to);
-            goto _setupImageSsh_unclean;
-        }
-        /* rely on var/empty created earlier in the setup process */
+    if (flags & VOLMAP_FLAG_READONLY) {
+        remountFlags |= MS_RDONLY;
     }
-#undef _BINDMOUNT
-    free(udiImage);
-    free(sshdConfigPath);
-    free(sshdConfigPathNew);
-    free(from);
-    free(to);
-    free(buffer);
-    free(keygenExec);
-    free(keyFileName);
-    return 0;
-_setupImageSsh_unclean:
-    if (inputFile != NULL) {
-        fclose(inputFile);
-        inputFile = NULL;
+
+    /* remount the bind-mount to get the needed mount flags */
+    ret = mount(from, to_real, "bind", remountFlags, NULL);
+    if (ret != 0) {
+        goto _bindMount_unclean;
     }
-    if (outputFile != NULL) {
-        fclose(outputFile);
-        outputFile = NULL;
+    if (mount(NULL, to_real, NULL, privateRemountFlags, NULL) != 0) {
+        perror("Failed to remount non-shared: ");
+        goto _bindMount_unclean;
+    }
+_bindMount_exit:
+    if (to_real != NULL) {
+        free(to_real);
+        to_real = NULL;
+    }
+    return ret;
+_bindMount_unclean:
+    if (to_real != NULL) {
+        ret = umount2(to_real, UMOUNT_NOFOLLOW|MNT_DETACH);
+        remove_MountList(mountCache, to_real);
+        free(to_real);
+        to_real = NULL;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: unclean exit from bind-mount routine. %s may still be mounted.\n", to);
     }
-    free(udiImage);
-    free(sshdConfigPath);
-    free(sshdConfigPathNew);
-    free(from);
-    free(to);
-    free(buffer);
-    free(keygenExec);
-    free(keyFileName);
     return 1;
 }
 
-gid_t *shifter_getgrouplist(const char *user, gid_t group, int *ngroups) {
-    int ret = 0;
-    int idx = 0;
-    gid_t *ret_groups = NULL;
-    int nret_groups = 0;
 
-    if (user == NULL || group == 0 || ngroups == NULL) {
-        goto _getgrlist_err;
-    }
-    if (strcmp(user, "root") == 0) {
-        fprintf(stderr, "FAILED: refuse to lookup groups for root\n");
-        goto _getgrlist_err;
-    }
+/**
+ * isSharedMount
+ * Determine if the string " shared:" exists in /proc/<pid>/mountinfo for the
+ * specified mountpoint.
+ *
+ * \param mountPoint the mountpoint to consider
+ *
+ * Returns:
+ * 0: not shared
+ * 1: shared
+ * -1: error
+ */
+int isSharedMount(const char *mountPoint) {
+    char *filename = _malloc(sizeof(char) * PATH_MAX);
+    char *lineBuffer = NULL;
+    size_t lineBuffer_size = 0;
+    FILE *fp = NULL;
+    pid_t pid = getpid();
+    int rc = 0;
 
-    ret = getgrouplist(user, group, NULL, &nret_groups);
-    if (ret < 0 && nret_groups > 0) {
-        if (nret_groups > 512) {
-            fprintf(stderr, "FAILED to get groups, seriously 512 groups is enough!\n");
-            goto _getgrlist_err;
-        }
+    snprintf(filename, PATH_MAX, "/proc/%d/mountinfo", pid);
+    fp = fopen(filename, "r");
 
-        /* allocate and initialize memory to be populated by getgrouplist */
-        ret_groups = (gid_t *) _malloc(sizeof(gid_t) * (nret_groups + 1));
-        memset(ret_groups, 0, sizeof(gid_t) * (nret_groups + 1));
+    if (fp == NULL) {
+        goto _err_valid_args;
+    }
+    while (!feof(fp) && !ferror(fp)) {
+        char *ptr = NULL;
+        char *svptr = NULL;
+        size_t n = getline(&lineBuffer, &lineBuffer_size, fp);
+        if (n == 0 || feof(fp) || ferror(fp) || lineBuffer == NULL) {
+            break;
+        }
+        ptr = strtok_r(lineBuffer, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+        ptr = strtok_r(NULL, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+        ptr = strtok_r(NULL, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+        ptr = strtok_r(NULL, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
+        ptr = strtok_r(NULL, " ", &svptr);
+        if (ptr == NULL) goto _err_valid_args;
 
-        ret = getgrouplist(user, group, ret_groups, &nret_groups);
-        if (ret < 0) {
-            fprintf(stderr, "FAILED to get groups correctly\n");
-            goto _getgrlist_err;
+        if (strcmp(ptr, mountPoint) == 0) {
+            ptr = strtok_r(NULL, "\0", &svptr); /* get rest of line */
+            if (strstr(ptr, " shared:") != NULL) {
+                rc = 1;
+            }
+            break;
         }
     }
+    fclose(fp);
+    fp = NULL;
+    if (lineBuffer != NULL) {
+        free(lineBuffer);
+    }
+    free(filename);
+    return rc;
+_err_valid_args:
+    if (lineBuffer != NULL) {
+        free(lineBuffer);
+        lineBuffer = NULL;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+        fp = NULL;
+    }
+    free(filename);
+    return -1;
+}
 
-    /* set default group list if none are found */
-    if (nret_groups <= 0) {
-        if (ret_groups != NULL) {
-            free(ret_groups);
-            ret_groups = NULL;
-        }
-        ret_groups = (gid_t *) _malloc(sizeof(gid_t) * 2);
-        ret_groups[0] = group;
-        ret_groups[1] = 0;
-        nret_groups = 1;
+/** shifter_getpwuid
+ *  Lookup user information based on information in shifter passwd cache.
+ *  This is useful to avoid making remote getpwuid() calls on Cray systems
+ *  or other systems where access to LDAP may be slow, difficult, or impossible
+ *  on compute nodes.
+ *
+ *  If UdiRootConfig parameter allowLibcPwdCalls is set to 1, this function
+ *  will simply call the regular getpwuid
+ *
+ */
+struct passwd *shifter_getpwuid(uid_t tgtuid, UdiRootConfig *config) {
+    FILE *input = NULL;
+    char *buffer = _malloc(sizeof(char) * PATH_MAX);
+    struct passwd *pw = NULL;
+    int found = 0;
+
+    if (config == NULL) {
+        free(buffer);
+        return NULL;
     }
-    if (ret_groups == NULL) {
-        fprintf(stderr, "FAILED: no auxilliary groups found!\n");
-        goto _getgrlist_err;
+
+    if (config->allowLibcPwdCalls == 1) {
+        free(buffer);
+        return getpwuid(tgtuid);
     }
 
-    /* just make sure no zeros snuck in */
-    for (idx = 0; idx < nret_groups; idx++) {
-        if (ret_groups[idx] == 0) {
-            ret_groups[idx] = group;
+    snprintf(buffer, PATH_MAX, "%s/passwd", config->etcPath);
+    input = fopen(buffer, "r");
+
+    if (input == NULL) {
+        fprintf(stderr, "FAILED to find shifter passwd file at %s", buffer);
+        goto _shifter_getpwuid_unclean;
+    }
+    while ((pw = fgetpwent(input)) != NULL) {
+        if (pw->pw_uid == tgtuid) {
+            found = 1;
+            break;
         }
     }
-    *ngroups = nret_groups;
-    return ret_groups;
+    fclose(input);
+    input = NULL;
 
-_getgrlist_err:
-    if (ret_groups != NULL) {
-        free(ret_groups);
-        ret_groups = NULL;
-    }
-    if (ngroups != NULL) {
-        *ngroups = 0;
-    }
+    free(buffer);
+    if (found) return pw;
     return NULL;
-}
 
-/**
-  * startSshd
-  * chroots into image and runs the secured sshd
-  */
-int startSshd(const char *user, UdiRootConfig *udiConfig) {
-    char *chrootPath = _malloc(sizeof(char) * PATH_MAX);
-    pid_t pid = 0;
+_shifter_getpwuid_unclean:
+    free(buffer);
+    return NULL;
+}
 
-    snprintf(chrootPath, PATH_MAX, "%s", udiConfig->udiMountPoint);
-    chrootPath[PATH_MAX - 1] = 0;
+struct passwd *shifter_getpwnam(const char *tgtnam, UdiRootConfig *config) {
+    FILE *input = NULL;
+    char *buffer = _malloc(sizeof(char) * PATH_MAX);
+    struct passwd *pw = NULL;
+    int found = 0;
 
-    if (chdir(chrootPath) != 0) {
-        fprintf(stderr, "FAILED to chdir to %s while attempted to start sshd\n", chrootPath);
-        goto _startSshd_unclean;
+    if (config == NULL) {
+        free(buffer);
+        return NULL;
     }
-    if (udiConfig->target_uid == 0 || udiConfig->target_gid == 0) {
-        fprintf(stderr, "FAILED to start sshd, will not start as root\n");
-        goto _startSshd_unclean;
+    if (config->allowLibcPwdCalls == 1) {
+        free(buffer);
+        return getpwnam(tgtnam);
     }
 
-    pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "FAILED to fork while attempting to start sshd\n");
-        goto _startSshd_unclean;
+    snprintf(buffer, PATH_MAX, "%s/passwd", config->etcPath);
+    input = fopen(buffer, "r");
+
+    if (input == NULL) {
+        fprintf(stderr, "FAILED to find shifter passwd file at %s", buffer);
+        goto _shifter_getpwnam_unclean;
     }
-    if (pid == 0) {
-        /* get grouplist in the external environment */
-        int nGroups = 0;
-        gid_t *gidList = shifter_getgrouplist(user, udiConfig->target_gid, &nGroups);
-        if (gidList == NULL) {
-            fprintf(stderr, "FAILED to correctly get grouplist for sshd\n");
-            exit(1);
+    while ((pw = fgetpwent(input)) != NULL) {
+        if (strcmp(pw->pw_name, tgtnam) == 0) {
+            found = 1;
+            break;
         }
+    }
+    fclose(input);
+    input = NULL;
 
-        if (chdir(chrootPath) != 0) {
-            fprintf(stderr, "FAILED to chdir to %s while attempting to start sshd\n", chrootPath);
-            exit(1);
-        }
-        if (chroot(chrootPath) != 0) {
-            fprintf(stderr, "FAILED to chroot to %s while attempting to start sshd\n", chrootPath);
-            exit(1);
-        }
-        if (chdir("/") != 0) {
-            fprintf(stderr, "FAILED to chdir following chroot\n");
-            exit(1);
-        }
-        if (gidList == NULL) {
-            fprintf(stderr, "FAILED to get groupllist for sshd, exiting!\n");
-            exit(1);
-        }
-        if (shifter_set_capability_boundingset_null() != 0) {
-            fprintf(stderr, "FAILED to restrict future capabilities\n");
-            exit(1);
-        }
-        if (setgroups(nGroups, gidList) != 0) {
-            fprintf(stderr, "FAILED to setgroups(): %s\n", strerror(errno));
-            exit(1);
-        }
-        if (setresgid(udiConfig->target_gid, udiConfig->target_gid,
-                      udiConfig->target_gid) != 0) {
-            fprintf(stderr, "FAILED to setresgid(): %s\n", strerror(errno));
-            exit(1);
-        }
-        if (setresuid(udiConfig->target_uid, udiConfig->target_uid,
-                      udiConfig->target_uid) != 0) {
-            fprintf(stderr, "FAILED to setresuid(): %s\n", strerror(errno));
-            exit(1);
-        }
-#if HAVE_DECL_PR_SET_NO_NEW_PRIVS == 1
-        /* ensure this process and its heirs cannot gain privilege */
-        /* see https://www.kernel.org/doc/Documentation/prctl/no_new_privs.txt */
-        if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
-            fprintf(stderr, "Failed to fully drop privileges: %s",
-                    strerror(errno));
-            exit(1);
-        }
-#endif
-        char **sshdArgs = (char **) _malloc(sizeof(char *) * 2);
-        sshdArgs[0] = _strdup("/opt/udiImage/sbin/sshd");
-        sshdArgs[1] = NULL;
-        execv(sshdArgs[0], sshdArgs);
-        fprintf(stderr, "FAILED to exec sshd!\n");
+    free(buffer);
+    if (found) return pw;
+    return NULL;
 
-        /* if we fell through to here, there is a problem */
-        exit(1);
-    } else {
-        int status = 0;
-        do {
-            pid_t ret = waitpid(pid, &status, 0);
-            if (ret != pid) {
-                fprintf(stderr, "waited for wrong pid: %d != %d\n", pid, ret);
-                goto _startSshd_unclean;
-            }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        if (WIFEXITED(status)) {
-            status = WEXITSTATUS(status);
-        } else {
-            status = 1;
-        }
-        free(chrootPath);
-        return status;
-    }
-    free(chrootPath);
-    return 0;
-_startSshd_unclean:
-    free(chrootPath);
-    return 1;
+_shifter_getpwnam_unclean:
+    free(buffer);
+    return NULL;
 }
 
-int _forkAndExecv(char *const *args, int silent) {
-    pid_t pid = 0;
+/** filterEtcGroup
+ *  many implementations of initgroups() do not deal with huge /etc/group
+ *  files due to a variety of limitations (like per-line limits).  this
+ *  function reads a given etcgroup file and filters the content to only
+ *  include the specified user.  Additionally some services are unwilling
+ *  to allow more than, for example, 31 groups from a group file, thus an
+ *  upperbound to explicitly include users in is included.  Stub entries
+ *  for all remaining groups will be added to provide useful group metadata
+ *
+ *  \param group_dest_fname filename of filtered group file
+ *  \param group_source_fname filename of to-be-filtered group file
+ *  \param username user to identify
+ *  \param maxGroups maximum number of groups to write out for user, 0 for unlimited
+ */
+int filterEtcGroup(const char *group_dest_fname, const char *group_source_fname, const char *username, size_t maxGroups) {
+    FILE *input = NULL;
+    FILE *output = NULL;
+    char *linePtr = NULL;
+    size_t linePtr_size = 0;
+    size_t foundGroups = 0;
 
-    pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "FAILED to fork! Exiting.\n");
-        return 1;
+    if (group_dest_fname == NULL || strlen(group_dest_fname) == 0
+            || group_source_fname == NULL || strlen(group_source_fname) == 0
+            || username == NULL || strlen(username) == 0) {
+        fprintf(stderr, "Invalid arguments, cannot filter group file.\n");
+        goto _filterEtcGroup_unclean;
     }
-    if (pid > 0) {
-        /* this is the parent */
-        int status = 0;
-        do {
-            pid_t ret = waitpid(pid, &status, 0);
-            if (ret != pid) {
-                fprintf(stderr, "This might be impossible: forked by couldn't wait, FAIL!\n");
-                return 1;
+
+    input = fopen(group_source_fname, "r");
+    output = fopen(group_dest_fname, "w");
+
+    if (input == NULL || output == NULL) {
+        fprintf(stderr, "Failed to open files, cannot filter group file.\n");
+        goto _filterEtcGroup_unclean;
+    }
+
+    while (!feof(input) && !ferror(input)) {
+        size_t nread = getline(&linePtr, &linePtr_size, input);
+        char *ptr = NULL;
+        char *svptr = NULL;
+        char *group_name = NULL;
+
+        char *token = NULL;
+        gid_t gid = 0;
+        size_t counter = 0;
+        int foundUsername = 0;
+        if (nread == 0 || linePtr == NULL) break;
+        ptr = shifter_trim(linePtr);
+        for (token = strtok_r(ptr, ":,", &svptr);
+             token != NULL;
+             token = strtok_r(NULL, ":,", &svptr)) {
+
+            switch (counter) {
+                case 0: group_name = _strdup(token);
+                        if (strcmp(group_name, username) == 0) {
+                            foundUsername = 1;
+                        }
+                        break;
+                case 1: break;
+                case 2: gid = strtoul(token, NULL, 10);
+                        break;
+                default: if (strcmp(username, token) == 0) {
+                            foundUsername = 1;
+                        }
+                        break;
             }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        if (WIFEXITED(status)) {
-            status = WEXITSTATUS(status);
-        } else {
-            status = 1;
+            counter++;
+            if (foundUsername && gid != 0) break;
         }
-        return status;
-    }
-    /* this is the child */
-    if (silent) {
-        int devNull = open("/dev/null", O_WRONLY);
-        if (devNull < 0) {
-            fprintf(stderr, "FAILED to open /dev/null: %s", strerror(errno));
-            exit(1);
+        if (group_name != NULL && gid != 0) {
+            if (foundUsername == 1 && foundGroups < maxGroups) {
+                fprintf(output, "%s:x:%d:%s\n", group_name, gid, username);
+                foundGroups++;
+            } else {
+                fprintf(output, "%s:x:%d:\n", group_name, gid);
+            }
+        }
+        if (group_name != NULL) {
+            free(group_name);
+            group_name = NULL;
         }
-        dup2(devNull, STDOUT_FILENO);
-        dup2(devNull, STDERR_FILENO);
-        close(devNull);
     }
-    execv(args[0], args);
-    fprintf(stderr, "FAILED to execvp! Exiting.\n");
-    exit(127);
-}
+    fclose(input);
+    fclose(output);
+    input = NULL;
+    output = NULL;
 
-int forkAndExecv(char *const *args) {
-    return _forkAndExecv(args, 0);
+    if (linePtr != NULL) {
+        free(linePtr);
+    }
+    return 0;
+_filterEtcGroup_unclean:
+    if (input != NULL) {
+        fclose(input);
+        input = NULL;
+    }
+    if (output != NULL) {
+        fclose(output);
+        output = NULL;
+    }
+    return 1;
 }
 
-int forkAndExecvSilent(char *const *args) {
-    return _forkAndExecv(args, 1);
+pid_t findSshd(void) {
+    return shifter_find_process_by_cmdline("/opt/udiImage/sbin/sshd");
 }
 
-int _shifterCore_bindMount(UdiRootConfig *udiConfig, MountList *mountCache,
-        const char *from, const char *to, size_t flags, int overwriteMounts)
-{
-    int ret = 0;
-    char **ptr = NULL;
-    char *to_real = NULL;
-    unsigned long mountFlags = MS_BIND;
-    unsigned long remountFlags = MS_REMOUNT|MS_BIND|MS_NOSUID;
-    unsigned long privateRemountFlags = 0;
-
-    if (udiConfig == NULL) {
-        fprintf(stderr, "FAILED to provide udiConfig!\n");
-        return 1;
-    }
-
-    privateRemountFlags =
-        udiConfig->mountPropagationStyle == VOLMAP_FLAG_SLAVE ?
-        MS_SLAVE : MS_PRIVATE;
+pid_t shifter_find_process_by_cmdline(const char *command) {
+    DIR *proc = NULL;
+    struct dirent *dirEntry = NULL;
+    char buffer[1024];
+    pid_t found = 0;
 
-    if (flags & VOLMAP_FLAG_SLAVE) {
-        privateRemountFlags = MS_SLAVE;
-    } else if (flags & VOLMAP_FLAG_PRIVATE) {
-        privateRemountFlags = MS_PRIVATE;
+    if (command == NULL || strlen(command) == 0) {
+        return -1;
     }
 
-    if (from == NULL || to == NULL || mountCache == NULL) {
-        fprintf(stderr, "INVALID input to bind-mount. Fail\n");
-        return 1;
-    }
+    proc = opendir("/proc");
 
-    to_real = realpath(to, NULL);
-    if (to_real == NULL) {
-        fprintf(stderr, "Couldn't lookup path %s, fail.\n", to);
-        return 1;
+    if (proc == NULL) {
+        return -1;
     }
+    while ((dirEntry = readdir(proc)) != NULL) {
+        size_t nread = 0;
+        FILE *cmdlineFile = NULL;
+        char *filename = NULL;
+        pid_t pid = (pid_t) strtol(dirEntry->d_name, NULL, 10);
+        if (pid == 0) {
+            continue;
+        }
+        filename = alloc_strgenf("/proc/%d/cmdline", pid);
+        if (filename != NULL) {
+            cmdlineFile = fopen(filename, "r");
+            free(filename);
+            filename = NULL;
+        }
+        if (cmdlineFile == NULL) {
+            continue;
+        } else if (feof(cmdlineFile) || ferror(cmdlineFile)) {
+            fclose(cmdlineFile);
+            cmdlineFile = NULL;
+            continue;
+        }
+        nread = fread(buffer, sizeof(char), 1024, cmdlineFile);
+        fclose(cmdlineFile);
+        cmdlineFile = NULL;
 
-    /* not interested in mounting over existing mounts, prevents
-       things from getting into a weird state later. */
-    ptr = find_MountList(mountCache, to_real);
-    if (ptr != NULL) {
-        if (overwriteMounts) {
-            int retry = 0;
-            for (retry = 0; retry < BINDMOUNT_OVERWRITE_UNMOUNT_RETRY; retry++) {
-                if (unmountTree(mountCache, to_real) != 0) {
-                    fprintf(stderr, "%s was already mounted, failed to unmount existing, fail.\n", to_real);
-                    ret = 1;
-                    goto _bindMount_exit;
-                }
-                if (validateUnmounted(to_real, 0) == 0) {
-                    break;
-                }
-                usleep(300000); /* sleep for 0.3s */
+        if (nread > 0) {
+            buffer[nread-1] = 0;
+            if (strcmp(buffer, command) == 0) {
+                found = pid;
+                break;
             }
-        } else {
-            fprintf(stderr, "%s was already mounted, not allowed to unmount existing, fail.\n", to_real);
-            ret = 1;
-            goto _bindMount_exit;
         }
     }
+    closedir(proc);
+    proc = NULL;
+    return found;
+}
 
-    if (strcmp(from, "/dev") == 0 || (flags & VOLMAP_FLAG_RECURSIVE)) {
-        mountFlags |= MS_REC;
-        remountFlags |= MS_REC;
-        privateRemountFlags = MS_PRIVATE|MS_REC;
-    }
-
-    /* perform the initial bind-mount */
-    ret = mount(from, to_real, "bind", mountFlags, NULL);
-    if (ret != 0) {
-        goto _bindMount_unclean;
+int killSshd(void) {
+    pid_t sshdPid = findSshd();
+    if (sshdPid > 2) {
+        kill(sshdPid, SIGTERM);
+        return 0;
     }
-    insert_MountList(mountCache, to_real);
+    return 1;
+}
 
-    /* if the source is exactly /dev or starts with /dev/ then
-       ALLOW device entires, otherwise remount with noDev */
-    if (strcmp(from, "/dev") != 0 && strncmp(from, "/dev/", 5) != 0) {
-        remountFlags |= MS_NODEV;
+/**
+ * _shifterCore_procStartTime
+ * Read the start time of a process (field 22 of /proc/<pid>/stat), which
+ * together with the pid identifies a process even if the pid is reused.
+ *
+ * Returns 0 on success, 1 if the process does not exist or on error.
+ */
+int _shifterCore_procStartTime(pid_t pid, unsigned long long *startTime) {
+    char path[PATH_MAX];
+    char buffer[1024];
+    char *ptr = NULL;
+    char *saveptr = NULL;
+    ssize_t nread = 0;
+    int fd = -1;
+    int field = 2;
+
+    if (pid <= 0 || startTime == NULL) return 1;
+    snprintf(path, PATH_MAX, "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 1;
+    nread = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (nread <= 0) return 1;
+    buffer[nread] = 0;
+
+    /* the command name may contain spaces and parentheses */
+    ptr = strrchr(buffer, ')');
+    if (ptr == NULL) return 1;
+    for (ptr = strtok_r(ptr + 1, " ", &saveptr); ptr != NULL;
+            ptr = strtok_r(NULL, " ", &saveptr))
+    {
+        if (++field == 22) {
+            *startTime = strtoull(ptr, NULL, 10);
+            return 0;
+        }
     }
+    return 1;
+}
 
-    if (flags & VOLMAP_FLAG_READONLY) {
-        remountFlags |= MS_RDONLY;
-    }
+/**
+ * _shifterCore_udiStateFile
+ * Path of the state file of the given kind for the UDI.  State is kept in the
+ * udiStatePath, a root-owned directory outside of the UDI, since the /var of
+ * the UDI is provided by the image.  The directory is created if needed, and
+ * the file is named after a hash of the udiMountPoint so that configurations
+ * with different UDIs can share it.
+ *
+ * Returns the path, or NULL if the state directory cannot be used.
+ */
+char *_shifterCore_udiStateFile(UdiRootConfig *udiConfig, const char *kind) {
+    const char *stateDir = UDI_STATE_PATH_DEFAULT;
+    char *parent = NULL;
+    char *ptr = NULL;
+    uint64_t hash = 0;
 
-    /* remount the bind-mount to get the needed mount flags */
-    ret = mount(from, to_real, "bind", remountFlags, NULL);
-    if (ret != 0) {
-        goto _bindMount_unclean;
-    }
-    if (mount(NULL, to_real, NULL, privateRemountFlags, NULL) != 0) {
-        perror("Failed to remount non-shared: ");
-        goto _bindMount_unclean;
+    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL || kind == NULL) {
+        return NULL;
     }
-_bindMount_exit:
-    if (to_real != NULL) {
-        free(to_real);
-        to_real = NULL;
+    if (udiConfig->udiStatePath != NULL && strlen(udiConfig->udiStatePath) > 0) {
+        stateDir = udiConfig->udiStatePath;
     }
-    return ret;
-_bindMount_unclean:
-    if (to_real != NULL) {
-        ret = umount2(to_real, UMOUNT_NOFOLLOW|MNT_DETACH);
-        remove_MountList(mountCache, to_real);
-        free(to_real);
-        to_real = NULL;
+    parent = _strdup(stateDir);
+    ptr = strrchr(parent, '/');
+    if (ptr != NULL && ptr != parent) {
+        *ptr = 0;
+        if (mkdir(parent, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "FAILED to create %s\n", parent);
+        }
     }
-    if (ret != 0) {
-        fprintf(stderr, "ERROR: unclean exit from bind-mount routine. %s may still be mounted.\n", to);
+    free(parent);
+    if (_shifterCore_checkPrivateDir(stateDir, S_IRWXG | S_IRWXO) != 0) {
+        return NULL;
     }
-    return 1;
+    hash = shifter_fnv1a64(SHIFTER_FNV1A64_INIT, udiConfig->udiMountPoint,
+            strlen(udiConfig->udiMountPoint));
+    return alloc_strgenf("%s/%s.%016llx", stateDir, kind,
+            (unsigned long long) hash);
 }
 
-
 /**
- * isSharedMount
- * Determine if the string " shared:" exists in /proc/<pid>/mountinfo for the
- * specified mountpoint.
- *
- * \param mountPoint the mountpoint to consider
+ * _shifterCore_openStateFile
+ * Open a state file for reading, only if it is a regular file owned by the
+ * effective user and not writable by group or other.
  *
- * Returns:
- * 0: not shared
- * 1: shared
- * -1: error
+ * Returns the open file, or NULL if it is missing (errno ENOENT) or cannot be
+ * trusted.
  */
-int isSharedMount(const char *mountPoint) {
-    char *filename = _malloc(sizeof(char) * PATH_MAX);
-    char *lineBuffer = NULL;
-    size_t lineBuffer_size = 0;
+FILE *_shifterCore_openStateFile(const char *path) {
+    struct stat statData;
     FILE *fp = NULL;
-    pid_t pid = getpid();
-    int rc = 0;
-
-    snprintf(filename, PATH_MAX, "/proc/%d/mountinfo", pid);
-    fp = fopen(filename, "r");
-
-    if (fp == NULL) {
-        goto _err_valid_args;
-    }
-    while (!feof(fp) && !ferror(fp)) {
-        char *ptr = NULL;
-        char *svptr = NULL;
-        size_t n = getline(&lineBuffer, &lineBuffer_size, fp);
-        if (n == 0 || feof(fp) || ferror(fp) || lineBuffer == NULL) {
-            break;
-        }
-        ptr = strtok_r(lineBuffer, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
-        ptr = strtok_r(NULL, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
-        ptr = strtok_r(NULL, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
-        ptr = strtok_r(NULL, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
-        ptr = strtok_r(NULL, " ", &svptr);
-        if (ptr == NULL) goto _err_valid_args;
+    int fd = -1;
 
-        if (strcmp(ptr, mountPoint) == 0) {
-            ptr = strtok_r(NULL, "\0", &svptr); /* get rest of line */
-            if (strstr(ptr, " shared:") != NULL) {
-                rc = 1;
-            }
-            break;
-        }
+    if (path == NULL) {
+        return NULL;
     }
-    fclose(fp);
-    fp = NULL;
-    if (lineBuffer != NULL) {
-        free(lineBuffer);
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
     }
-    free(filename);
-    return rc;
-_err_valid_args:
-    if (lineBuffer != NULL) {
-        free(lineBuffer);
-        lineBuffer = NULL;
+    if (fstat(fd, &statData) != 0 || !S_ISREG(statData.st_mode) ||
+            statData.st_uid != geteuid() ||
+            (statData.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+    {
+        fprintf(stderr, "Ignoring untrusted state file %s\n", path);
+        close(fd);
+        errno = EPERM;
+        return NULL;
     }
-    if (fp != NULL) {
-        fclose(fp);
-        fp = NULL;
+    fp = fdopen(fd, "r");
+    if (fp == NULL) {
+        close(fd);
     }
-    free(filename);
-    return -1;
-}
-
-/** shifter_getpwuid
- *  Lookup user information based on information in shifter passwd cache.
- *  This is useful to avoid making remote getpwuid() calls on Cray systems
- *  or other systems where access to LDAP may be slow, difficult, or impossible
- *  on compute nodes.
- *
- *  If UdiRootConfig parameter allowLibcPwdCalls is set to 1, this function
- *  will simply call the regular getpwuid
+    return fp;
+}
+
+/**
+ * _shifterCore_createStateFile
+ * Replace a state file with a new, empty one readable only by its owner.
  *
+ * Returns the file open for writing, or NULL on error.
  */
-struct passwd *shifter_getpwuid(uid_t tgtuid, UdiRootConfig *config) {
-    FILE *input = NULL;
-    char *buffer = _malloc(sizeof(char) * PATH_MAX);
-    struct passwd *pw = NULL;
-    int found = 0;
+FILE *_shifterCore_createStateFile(const char *path) {
+    FILE *fp = NULL;
+    int fd = -1;
 
-    if (config == NULL) {
-        free(buffer);
+    if (path == NULL) {
         return NULL;
     }
-
-    if (config->allowLibcPwdCalls == 1) {
-        free(buffer);
-        return getpwuid(tgtuid);
+    unlink(path);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        unlink(path);
     }
+    return fp;
+}
 
-    snprintf(buffer, PATH_MAX, "%s/passwd", config->etcPath);
-    input = fopen(buffer, "r");
+/**
+ * _shifterCore_recordSshd
+ * Record the pid and start time of the sshd started in the UDI so that it
+ * can be signalled directly at teardown.
+ */
+int _shifterCore_recordSshd(pid_t pid, UdiRootConfig *udiConfig) {
+    unsigned long long startTime = 0;
+    char *path = NULL;
+    FILE *fp = NULL;
+    int rc = 1;
 
-    if (input == NULL) {
-        fprintf(stderr, "FAILED to find shifter passwd file at %s", buffer);
-        goto _shifter_getpwuid_unclean;
+    if (udiConfig == NULL || _shifterCore_procStartTime(pid, &startTime) != 0) {
+        return 1;
     }
-    while ((pw = fgetpwent(input)) != NULL) {
-        if (pw->pw_uid == tgtuid) {
-            found = 1;
-            break;
-        }
+    path = _shifterCore_udiStateFile(udiConfig, SSHD_RECORD);
+    fp = _shifterCore_createStateFile(path);
+    if (fp == NULL) {
+        goto _recordSshd_out;
     }
-    fclose(input);
-    input = NULL;
+    fprintf(fp, "%d %llu\n", pid, startTime);
+    if (fclose(fp) != 0) {
+        unlink(path);
+        goto _recordSshd_out;
+    }
+    rc = 0;
+_recordSshd_out:
+    free(path);
+    return rc;
+}
 
-    free(buffer);
-    if (found) return pw;
-    return NULL;
+/**
+ * _shifterCore_readSshdRecord
+ * Read the sshd record of the UDI written by _shifterCore_recordSshd.
+ *
+ * Returns 0 if a trusted record was read, 1 otherwise.
+ */
+int _shifterCore_readSshdRecord(UdiRootConfig *udiConfig, pid_t *pid,
+        unsigned long long *startTime)
+{
+    char *path = _shifterCore_udiStateFile(udiConfig, SSHD_RECORD);
+    FILE *fp = _shifterCore_openStateFile(path);
+    int recordPid = 0;
+    int rc = 1;
 
-_shifter_getpwuid_unclean:
-    free(buffer);
-    return NULL;
+    free(path);
+    if (fp == NULL) {
+        return 1;
+    }
+    if (fscanf(fp, "%d %llu", &recordPid, startTime) == 2 && recordPid > 2) {
+        *pid = (pid_t) recordPid;
+        rc = 0;
+    }
+    fclose(fp);
+    return rc;
 }
 
-struct passwd *shifter_getpwnam(const char *tgtnam, UdiRootConfig *config) {
-    FILE *input = NULL;
-    char *buffer = _malloc(sizeof(char) * PATH_MAX);
-    struct passwd *pw = NULL;
-    int found = 0;
-
-    if (config == NULL) {
-        free(buffer);
-        return NULL;
+/**
+ * _shifterCore_isUdiSshd
+ * Check that a process is the sshd of the UDI: it runs the udiImage sshd and
+ * is chrooted into the udiMountPoint.
+ *
+ * Returns 1 if it is, 0 otherwise.
+ */
+int _shifterCore_isUdiSshd(pid_t pid, UdiRootConfig *udiConfig) {
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    char *root = NULL;
+    char *exe = NULL;
+    ssize_t len = 0;
+    int match = 0;
+
+    if (pid <= 2 || udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
+        return 0;
     }
-    if (config->allowLibcPwdCalls == 1) {
-        free(buffer);
-        return getpwnam(tgtnam);
+    root = realpath(udiConfig->udiMountPoint, NULL);
+    if (root == NULL) {
+        return 0;
     }
+    snprintf(path, PATH_MAX, "/proc/%d/root", pid);
+    len = readlink(path, target, sizeof(target) - 1);
+    if (len <= 0) {
+        goto _isUdiSshd_out;
+    }
+    target[len] = 0;
+    if (strcmp(target, root) != 0) {
+        goto _isUdiSshd_out;
+    }
+    exe = alloc_strgenf("%s%s", strcmp(root, "/") == 0 ? "" : root, SSHD_PATH);
+    snprintf(path, PATH_MAX, "/proc/%d/exe", pid);
+    len = readlink(path, target, sizeof(target) - 1);
+    if (exe == NULL || len <= 0) {
+        goto _isUdiSshd_out;
+    }
+    target[len] = 0;
+    match = strcmp(target, exe) == 0;
+_isUdiSshd_out:
+    free(root);
+    free(exe);
+    return match;
+}
 
-    snprintf(buffer, PATH_MAX, "%s/passwd", config->etcPath);
-    input = fopen(buffer, "r");
+/**
+ * _shifterCore_scanUdiSshd
+ * Search /proc for the listening sshd of the UDI, for UDIs without a trusted
+ * record.
+ */
+static pid_t _shifterCore_scanUdiSshd(UdiRootConfig *udiConfig) {
+    DIR *proc = NULL;
+    struct dirent *dirEntry = NULL;
+    char buffer[1024];
+    pid_t found = 0;
 
-    if (input == NULL) {
-        fprintf(stderr, "FAILED to find shifter passwd file at %s", buffer);
-        goto _shifter_getpwnam_unclean;
+    proc = opendir("/proc");
+    if (proc == NULL) {
+        return 0;
     }
-    while ((pw = fgetpwent(input)) != NULL) {
-        if (strcmp(pw->pw_name, tgtnam) == 0) {
-            found = 1;
-            break;
+    while (found == 0 && (dirEntry = readdir(proc)) != NULL) {
+        size_t nread = 0;
+        FILE *cmdlineFile = NULL;
+        pid_t pid = (pid_t) strtol(dirEntry->d_name, NULL, 10);
+        if (pid <= 2) {
+            continue;
+        }
+        snprintf(buffer, sizeof(buffer), "/proc/%d/cmdline", pid);
+        cmdlineFile = fopen(buffer, "r");
+        if (cmdlineFile == NULL) {
+            continue;
+        }
+        nread = fread(buffer, sizeof(char), sizeof(buffer), cmdlineFile);
+        fclose(cmdlineFile);
+        if (nread == 0) {
+            continue;
+        }
+        buffer[nread - 1] = 0;
+        /* connection processes retitle themselves "sshd: ..." */
+        if (strcmp(buffer, SSHD_PATH) == 0 &&
+                _shifterCore_isUdiSshd(pid, udiConfig))
+        {
+            found = pid;
         }
     }
-    fclose(input);
-    input = NULL;
+    closedir(proc);
+    return found;
+}
 
-    free(buffer);
-    if (found) return pw;
-    return NULL;
+/**
+ * findTrackedSshd
+ * Get the pid of the sshd recorded when the UDI was set up, if it is still
+ * the same process and the sshd of the UDI.  Without a trusted record the
+ * sshd of the UDI is searched for in /proc.
+ */
+pid_t findTrackedSshd(UdiRootConfig *udiConfig) {
+    unsigned long long recorded = 0;
+    unsigned long long startTime = 0;
+    pid_t pid = 0;
 
-_shifter_getpwnam_unclean:
-    free(buffer);
-    return NULL;
+    if (udiConfig == NULL || udiConfig->udiMountPoint == NULL) {
+        return 0;
+    }
+    if (_shifterCore_readSshdRecord(udiConfig, &pid, &recorded) != 0) {
+        return _shifterCore_scanUdiSshd(udiConfig);
+    }
+    if (_shifterCore_procStartTime(pid, &startTime) != 0 ||
+            startTime != recorded || !_shifterCore_isUdiSshd(pid, udiConfig))
+    {
+        /* the recorded sshd is gone */
+        return 0;
+    }
+    return pid;
 }
 
-/** filterEtcGroup
- *  many implementations of initgroups() do not deal with huge /etc/group
- *  files due to a variety of limitations (like per-line limits).  this
- *  function reads a given etcgroup file and filters the content to only
- *  include the specified user.  Additionally some services are unwilling
- *  to allow more than, for example, 31 groups from a group file, thus an
- *  upperbound to explicitly include users in is included.  Stub entries
- *  for all remaining groups will be added to provide useful group metadata
+/**
+ * _shifterCore_isListening
+ * Check if a process holds a listening TCP socket, by matching the socket
+ * inodes of its file descriptors against the listening sockets of its
+ * network namespace.
  *
- *  \param group_dest_fname filename of filtered group file
- *  \param group_source_fname filename of to-be-filtered group file
- *  \param username user to identify
- *  \param maxGroups maximum number of groups to write out for user, 0 for unlimited
+ * Returns 1 if it does, 0 otherwise.
  */
-int filterEtcGroup(const char *group_dest_fname, const char *group_source_fname, const char *username, size_t maxGroups) {
-    FILE *input = NULL;
-    FILE *output = NULL;
-    char *linePtr = NULL;
-    size_t linePtr_size = 0;
-    size_t foundGroups = 0;
+int _shifterCore_isListening(pid_t pid) {
+    const char *tables[] = { "tcp", "tcp6", NULL };
+    const char **table = NULL;
+    unsigned long *inodes = NULL;
+    size_t n_inodes = 0;
+    char path[PATH_MAX];
+    char target[64];
+    DIR *fdDir = NULL;
+    struct dirent *entry = NULL;
+    char *line = NULL;
+    size_t line_sz = 0;
+    int found = 0;
 
-    if (group_dest_fname == NULL || strlen(group_dest_fname) == 0
-            || group_source_fname == NULL || strlen(group_source_fname) == 0
-            || username == NULL || strlen(username) == 0) {
-        fprintf(stderr, "Invalid arguments, cannot filter group file.\n");
-        goto _filterEtcGroup_unclean;
+    snprintf(path, PATH_MAX, "/proc/%d/fd", pid);
+    fdDir = opendir(path);
+    if (fdDir == NULL) {
+        return 0;
     }
-
-    input = fopen(group_source_fname, "r");
-    output = fopen(group_dest_fname, "w");
-
-    if (input == NULL || output == NULL) {
-        fprintf(stderr, "Failed to open files, cannot filter group file.\n");
-        goto _filterEtcGroup_unclean;
+    while ((entry = readdir(fdDir)) != NULL) {
+        unsigned long inode = 0;
+        ssize_t len = 0;
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, PATH_MAX, "/proc/%d/fd/%s", pid, entry->d_name);
+        len = readlink(path, target, sizeof(target) - 1);
+        if (len <= 0) {
+            continue;
+        }
+        target[len] = 0;
+        if (sscanf(target, "socket:[%lu]", &inode) == 1) {
+            inodes = (unsigned long *) _realloc(inodes,
+                    sizeof(unsigned long) * (n_inodes + 1));
+            inodes[n_inodes++] = inode;
+        }
     }
+    closedir(fdDir);
 
-    while (!feof(input) && !ferror(input)) {
-        size_t nread = getline(&linePtr, &linePtr_size, input);
-        char *ptr = NULL;
-        char *svptr = NULL;
-        char *group_name = NULL;
+    for (table = tables; n_inodes > 0 && *table != NULL && !found; table++) {
+        FILE *fp = NULL;
+        snprintf(path, PATH_MAX, "/proc/%d/net/%s", pid, *table);
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        while (!found && getline(&line, &line_sz, fp) > 0) {
+            unsigned int state = 0;
+            unsigned long inode = 0;
+            size_t idx = 0;
+            /* sl local rem st tx:rx tr:when retrnsmt uid timeout inode */
+            if (sscanf(line, " %*s %*s %*s %x %*s %*s %*s %*u %*u %lu",
+                        &state, &inode) != 2 || state != PROC_TCP_LISTEN)
+            {
+                continue;
+            }
+            for (idx = 0; idx < n_inodes; idx++) {
+                if (inodes[idx] == inode) {
+                    found = 1;
+                    break;
+                }
+            }
+        }
+        fclose(fp);
+    }
+    free(line);
+    free(inodes);
+    return found;
+}
 
-        char *token = NULL;
-        gid_t gid = 0;
-        size_t counter = 0;
-        int foundUsername = 0;
-        if (nread == 0 || linePtr == NULL) break;
-        ptr = shifter_trim(linePtr);
-        for (token = strtok_r(ptr, ":,", &svptr);
-             token != NULL;
-             token = strtok_r(NULL, ":,", &svptr)) {
+/**
+ * _shifterCore_waitForListen
+ * Wait up to timeoutMs for a child process to listen on a TCP socket.  The
+ * wait ends as soon as the child listens or exits.
+ *
+ * Returns 0 once the child listens, 1 if it exited (and was reaped), 2 if it
+ * is still running but not listening after timeoutMs.
+ */
+int _shifterCore_waitForListen(pid_t pid, int timeoutMs) {
+    int pidFd = -1;
+    int waited = 0;
+    int rc = 2;
 
-            switch (counter) {
-                case 0: group_name = _strdup(token);
-                        if (strcmp(group_name, username) == 0) {
-                            foundUsername = 1;
-                        }
-                        break;
-                case 1: break;
-                case 2: gid = strtoul(token, NULL, 10);
-                        break;
-                default: if (strcmp(username, token) == 0) {
-                            foundUsername = 1;
-                        }
-                        break;
-            }
-            counter++;
-            if (foundUsername && gid != 0) break;
+#ifdef SYS_pidfd_open
+    pidFd = (int) syscall(SYS_pidfd_open, pid, 0);
+#endif
+    for ( ; ; ) {
+        int status = 0;
+        pid_t ret = waitpid(pid, &status, WNOHANG);
+        if (ret == pid || (ret < 0 && errno != EINTR)) {
+            rc = 1;
+            break;
         }
-        if (group_name != NULL && gid != 0) {
-            if (foundUsername == 1 && foundGroups < maxGroups) {
-                fprintf(output, "%s:x:%d:%s\n", group_name, gid, username);
-                foundGroups++;
-            } else {
-                fprintf(output, "%s:x:%d:\n", group_name, gid);
-            }
+        if (_shifterCore_isListening(pid)) {
+            rc = 0;
+            break;
         }
-        if (group_name != NULL) {
-            free(group_name);
-            group_name = NULL;
+        if (waited >= timeoutMs) {
+            break;
         }
+        /* returns as soon as the child exits */
+        _shifterCore_waitForExit(pid, pidFd, SSHD_START_POLL_MS);
+        waited += SSHD_START_POLL_MS;
     }
-    fclose(input);
-    fclose(output);
-    input = NULL;
-    output = NULL;
-
-    if (linePtr != NULL) {
-        free(linePtr);
+    if (pidFd >= 0) {
+        close(pidFd);
     }
-    return 0;
-_filterEtcGroup_unclean:
-    if (input != NULL) {
-        fclose(input);
-        input = NULL;
+    return rc;
+}
+
+/**
+ * _shifterCore_waitForExit
+ * Wait up to timeoutMs for a process to exit.  With a pidfd the exit is
+ * waited for with poll, otherwise the process is checked periodically.
+ *
+ * Returns 0 if the process exited, 1 otherwise.
+ */
+int _shifterCore_waitForExit(pid_t pid, int pidFd, int timeoutMs) {
+    if (pidFd >= 0) {
+        struct pollfd pfd;
+        int ret = 0;
+        pfd.fd = pidFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        do {
+            ret = poll(&pfd, 1, timeoutMs);
+        } while (ret < 0 && errno == EINTR);
+        return ret > 0 ? 0 : 1;
     }
-    if (output != NULL) {
-        fclose(output);
-        output = NULL;
+    for ( ; timeoutMs > 0; timeoutMs -= 10) {
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            return 0;
+        }
+        usleep(10000);
     }
     return 1;
 }
 
-pid_t findSshd(void) {
-    return shifter_find_process_by_cmdline("/opt/udiImage/sbin/sshd");
-}
-
-pid_t shifter_find_process_by_cmdline(const char *command) {
-    DIR *proc = NULL;
-    struct dirent *dirEntry = NULL;
-    char buffer[1024];
-    pid_t found = 0;
+/**
+ * _shifterCore_stopProcess
+ * Terminate a process and wait for it to exit, escalating to SIGKILL if it
+ * does not exit in time.  The process is signalled through a pidfd where
+ * available, and only if it still has the given start time, so a reused pid
+ * is never signalled.
+ *
+ * Returns 0 if the process is gone, 1 otherwise.
+ */
+int _shifterCore_stopProcess(pid_t pid, unsigned long long startTime) {
+    unsigned long long checkTime = 0;
+    int pidFd = -1;
+    int rc = 1;
 
-    if (command == NULL || strlen(command) == 0) {
-        return -1;
+    if (pid <= 2) {
+        return 0;
     }
-
-    proc = opendir("/proc");
-
-    if (proc == NULL) {
-        return -1;
+#ifdef SYS_pidfd_open
+    pidFd = (int) syscall(SYS_pidfd_open, pid, 0);
+#endif
+    /* make sure the pid (and pidfd) refers to the process expected */
+    if (_shifterCore_procStartTime(pid, &checkTime) != 0 ||
+            checkTime != startTime)
+    {
+        rc = 0;
+        goto _stopProcess_out;
     }
-    while ((dirEntry = readdir(proc)) != NULL) {
-        size_t nread = 0;
-        FILE *cmdlineFile = NULL;
-        char *filename = NULL;
-        pid_t pid = (pid_t) strtol(dirEntry->d_name, NULL, 10);
-        if (pid == 0) {
-            continue;
-        }
-        filename = alloc_strgenf("/proc/%d/cmdline", pid);
-        if (filename != NULL) {
-            cmdlineFile = fopen(filename, "r");
-            free(filename);
-            filename = NULL;
-        }
-        if (cmdlineFile == NULL) {
-            continue;
-        } else if (feof(cmdlineFile) || ferror(cmdlineFile)) {
-            fclose(cmdlineFile);
-            cmdlineFile = NULL;
-            continue;
+#ifdef SYS_pidfd_send_signal
+    if (pidFd >= 0) {
+        if (syscall(SYS_pidfd_send_signal, pidFd, SIGTERM, NULL, 0) != 0) {
+            rc = errno == ESRCH ? 0 : 1;
+            goto _stopProcess_out;
         }
-        nread = fread(buffer, sizeof(char), 1024, cmdlineFile);
-        fclose(cmdlineFile);
-        cmdlineFile = NULL;
+    } else
+#endif
+    if (kill(pid, SIGTERM) != 0) {
+        rc = errno == ESRCH ? 0 : 1;
+        goto _stopProcess_out;
+    }
+    if (_shifterCore_waitForExit(pid, pidFd, SSHD_EXIT_TIMEOUT_MS) == 0) {
+        rc = 0;
+        goto _stopProcess_out;
+    }
+    fprintf(stderr, "process %d did not exit, killing it\n", pid);
+#ifdef SYS_pidfd_send_signal
+    if (pidFd >= 0) {
+        syscall(SYS_pidfd_send_signal, pidFd, SIGKILL, NULL, 0);
+    } else
+#endif
+    kill(pid, SIGKILL);
+    rc = _shifterCore_waitForExit(pid, pidFd, SSHD_EXIT_TIMEOUT_MS);
+_stopProcess_out:
+    if (pidFd >= 0) {
+        close(pidFd);
+    }
+    return rc;
+}
 
-        if (nread > 0) {
-            buffer[nread-1] = 0;
-            if (strcmp(buffer, command) == 0) {
-                found = pid;
-                break;
-            }
-        }
+/**
+ * stopSshd
+ * Terminate the sshd of the UDI and wait for it to exit.
+ *
+ * Returns 0 if no sshd is left running, 1 otherwise.
+ */
+int stopSshd(UdiRootConfig *udiConfig) {
+    unsigned long long startTime = 0;
+    pid_t pid = findTrackedSshd(udiConfig);
+
+    if (pid <= 2) {
+        return 0;
     }
-    closedir(proc);
-    proc = NULL;
-    return found;
+    if (_shifterCore_procStartTime(pid, &startTime) != 0) {
+        return 0;
+    }
+    return _shifterCore_stopProcess(pid, startTime);
 }
 
-int killSshd(void) {
-    pid_t sshdPid = findSshd();
-    if (sshdPid > 2) {
-        kill(sshdPid, SIGTERM);
+/**
+ * _shifterCore_detachMount
+ * Lazily unmount everything mounted on path, which also detaches all mounts
+ * below it in a single operation.
+ *
+ * Returns 0 once path is no longer a mount point, 1 on error.
+ */
+int _shifterCore_detachMount(const char *path) {
+    while (umount2(path, UMOUNT_NOFOLLOW|MNT_DETACH) == 0) {
+        /* path may have been mounted over several times */
+    }
+    if (errno == EINVAL || errno == ENOENT) {
         return 0;
     }
     return 1;
 }
 
+/**
+ * _shifterCore_waitMountChange
+ * Wait up to timeoutMs for the mount table of the namespace to change, as
+ * signalled by poll on an open /proc/self/mounts.
+ */
+int _shifterCore_waitMountChange(int mountsFd, int timeoutMs) {
+    struct pollfd pfd;
+    if (mountsFd < 0) {
+        usleep(timeoutMs * 1000);
+        return 0;
+    }
+    pfd.fd = mountsFd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeoutMs) > 0 ? 0 : 1;
+}
+
 /**
  * destructUDI
  * Unmounts all aspects of the UDI, possibly killing the sshd running first.
@@ -3125,6 +5795,10 @@ int killSshd(void) {
  * linux namespace.  It should also be called when trying to get rid of an
  * existing UDI before setting up a new one in a private linux namespace.
  *
+ * The udiMount and loopMount trees are each detached with a single lazy
+ * unmount; the mounts are only walked one by one if that leaves anything
+ * behind, e.g., when the udiMountPoint itself is not a mount point.
+ *
  * \param udiConfig configuration
  * \param killSsh flag to denote whether or not the udiRoot sshd should be killed
  *     (1 for yes, 0 for no)
@@ -3134,47 +5808,458 @@ int destructUDI(UdiRootConfig *udiConfig, int killSsh) {
     char *loopMount = _malloc(sizeof(char) * PATH_MAX);
     MountList mounts;
     size_t idx = 0;
+    int mountsFd = -1;
     int rc = 1; /* assume failure */
 
     memset(&mounts, 0, sizeof(MountList));
-    if (parse_MountList(&mounts) != 0) {
-        /*error*/
-    }
 
     snprintf(udiRoot, PATH_MAX, "%s", udiConfig->udiMountPoint);
     udiRoot[PATH_MAX-1] = 0;
     snprintf(loopMount, PATH_MAX, "%s", udiConfig->loopMountPoint);
     loopMount[PATH_MAX-1] = 0;
-    for (idx = 0; idx < 10; idx++) {
 
+    /* the sshd is recognized by its root in the UDI, so stop it before
+     * unmounting */
+    if (killSsh == 1 && stopSshd(udiConfig) != 0) {
+        fprintf(stderr, "WARNING: sshd is still running\n");
+    }
+
+    mountsFd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+    for (idx = 0; idx < 10; idx++) {
         if (idx > 0) {
-            usleep(300000);
-        }
-        if (killSsh == 1) {
-            killSshd();
+            _shifterCore_waitMountChange(mountsFd, 300);
+            if (killSsh == 1) {
+                killSshd();
+            }
         }
 
-        if (unmountTree(&mounts, udiRoot) != 0) {
-            continue;
-        }
+        _shifterCore_detachMount(udiRoot);
         if (validateUnmounted(udiRoot, 1) != 0) {
-            continue;
-        }
-        if (unmountTree(&mounts, loopMount) != 0) {
-            continue;
+            free_MountList(&mounts, 0);
+            memset(&mounts, 0, sizeof(MountList));
+            if (parse_MountList(&mounts) != 0) {
+                continue;
+            }
+            if (unmountTree(&mounts, udiRoot) != 0) {
+                continue;
+            }
+            if (validateUnmounted(udiRoot, 1) != 0) {
+                continue;
+            }
         }
+        _shifterCore_detachMount(loopMount);
         if (validateUnmounted(loopMount, 0) != 0) {
             continue;
         }
         rc = 0; /* mark success */
         break;
     }
+    if (mountsFd >= 0) {
+        close(mountsFd);
+    }
     free_MountList(&mounts, 0);
     free(udiRoot);
     free(loopMount);
     return rc;
 }
 
+/**
+ * _shifterCore_writeTeardown
+ * Atomically create a teardown record in stateDir listing the sshd and the
+ * mount points of the UDI.  The record is returned open and locked; whoever
+ * holds the lock is reaping it.
+ *
+ * Returns the locked file descriptor, or -1 on error.
+ */
+int _shifterCore_writeTeardown(const char *stateDir, pid_t sshdPid,
+        unsigned long long sshdStart, UdiRootConfig *udiConfig, char **path)
+{
+    char *tmpPath = NULL;
+    char *recordPath = NULL;
+    FILE *fp = NULL;
+    int fd = -1;
+
+    tmpPath = alloc_strgenf("%s/.%sXXXXXX", stateDir, TEARDOWN_PREFIX);
+    if (tmpPath == NULL) {
+        goto _writeTeardown_unclean;
+    }
+    fd = mkstemp(tmpPath);
+    if (fd < 0) {
+        fprintf(stderr, "FAILED to create teardown record in %s\n", stateDir);
+        goto _writeTeardown_unclean;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        goto _writeTeardown_unclean;
+    }
+    fp = fdopen(dup(fd), "w");
+    if (fp == NULL) {
+        goto _writeTeardown_unclean;
+    }
+    fprintf(fp, "%s\n", TEARDOWN_HEADER);
+    if (sshdPid > 2) {
+        fprintf(fp, "sshd %d %llu\n", sshdPid, sshdStart);
+    }
+    fprintf(fp, "mount 1 %s\n", udiConfig->udiMountPoint);
+    if (udiConfig->loopMountPoint != NULL &&
+            strlen(udiConfig->loopMountPoint) > 0)
+    {
+        fprintf(fp, "mount 0 %s\n", udiConfig->loopMountPoint);
+    }
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto _writeTeardown_unclean;
+    }
+    fp = NULL;
+
+    recordPath = alloc_strgenf("%s/%s%ld.%d", stateDir, TEARDOWN_PREFIX,
+            (long) time(NULL), getpid());
+    if (recordPath == NULL || rename(tmpPath, recordPath) != 0) {
+        goto _writeTeardown_unclean;
+    }
+    free(tmpPath);
+    *path = recordPath;
+    return fd;
+
+_writeTeardown_unclean:
+    if (fd >= 0) {
+        unlink(tmpPath);
+        close(fd);
+    }
+    if (tmpPath != NULL) {
+        free(tmpPath);
+    }
+    if (recordPath != NULL) {
+        free(recordPath);
+    }
+    return -1;
+}
+
+/**
+ * _shifterCore_reapTeardown
+ * Finish the teardown described by a locked record: stop the sshd and make
+ * sure its mount points are unmounted, retrying with backoff up to attempts
+ * times.  The record is removed once the teardown is complete, and left for
+ * the next setupRoot otherwise.
+ *
+ * Returns 0 if the teardown is complete, 1 otherwise.
+ */
+int _shifterCore_reapTeardown(int fd, const char *path, int attempts) {
+    struct stat statData;
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t nread = 0;
+    pid_t sshdPid = 0;
+    unsigned long long sshdStart = 0;
+    char **mounts = NULL;
+    int *subtree = NULL;
+    size_t n_mounts = 0;
+    size_t idx = 0;
+    int attempt = 0;
+    int delay = TEARDOWN_RETRY_MS;
+    int rc = 1;
+
+    if (fstat(fd, &statData) != 0) {
+        goto _reapTeardown_out;
+    }
+    if (statData.st_nlink == 0) {
+        /* already reaped by someone else */
+        rc = 0;
+        goto _reapTeardown_out;
+    }
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        goto _reapTeardown_out;
+    }
+    fp = fdopen(dup(fd), "r");
+    if (fp == NULL) {
+        goto _reapTeardown_out;
+    }
+    nread = getline(&line, &line_sz, fp);
+    if (nread <= 0 || strncmp(line, TEARDOWN_HEADER,
+                strlen(TEARDOWN_HEADER)) != 0)
+    {
+        fprintf(stderr, "Ignoring invalid teardown record %s\n", path);
+        unlink(path);
+        rc = 0;
+        goto _reapTeardown_out;
+    }
+    while ((nread = getline(&line, &line_sz, fp)) > 0) {
+        int pid = 0;
+        int flag = 0;
+        int offset = 0;
+        if (line[nread - 1] == '\n') {
+            line[nread - 1] = 0;
+        }
+        if (sscanf(line, "sshd %d %llu", &pid, &sshdStart) == 2) {
+            sshdPid = (pid_t) pid;
+        } else if (sscanf(line, "mount %d %n", &flag, &offset) == 1 &&
+                offset > 0 && line[offset] == '/')
+        {
+            mounts = (char **) _realloc(mounts, sizeof(char *) * (n_mounts + 1));
+            subtree = (int *) _realloc(subtree, sizeof(int) * (n_mounts + 1));
+            mounts[n_mounts] = _strdup(line + offset);
+            subtree[n_mounts] = flag;
+            n_mounts++;
+        }
+    }
+
+    for (attempt = 0; attempt < attempts; attempt++) {
+        int remaining = 0;
+        if (attempt > 0) {
+            usleep(delay * 1000);
+            delay *= 2;
+        }
+        if (sshdPid > 2 && _shifterCore_stopProcess(sshdPid, sshdStart) != 0) {
+            continue;
+        }
+        for (idx = 0; idx < n_mounts; idx++) {
+            _shifterCore_detachMount(mounts[idx]);
+            if (validateUnmounted(mounts[idx], subtree[idx]) != 0) {
+                remaining++;
+            }
+        }
+        if (remaining == 0) {
+            rc = 0;
+            break;
+        }
+    }
+    if (rc == 0) {
+        unlink(path);
+    } else {
+        fprintf(stderr, "FAILED to complete teardown after %d attempts, "
+                "leaving %s for the next setup\n", attempts, path);
+    }
+
+_reapTeardown_out:
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    for (idx = 0; idx < n_mounts; idx++) {
+        free(mounts[idx]);
+    }
+    if (mounts != NULL) {
+        free(mounts);
+    }
+    if (subtree != NULL) {
+        free(subtree);
+    }
+    if (line != NULL) {
+        free(line);
+    }
+    return rc;
+}
+
+/**
+ * deferDestructUDI
+ * Fast variant of destructUDI for the job epilog.  The teardown is recorded
+ * in the teardownStatePath, the UDI and loop mount are detached from the
+ * namespace, and stopping the sshd along with any remaining cleanup is left
+ * to a background reaper.  A later setupRoot only waits for the reaper if it
+ * needs the same resources (see waitForTeardown).
+ *
+ * Returns 0 if the teardown was handed off (or completed), 1 if no record
+ * could be written, in which case the caller should use destructUDI.
+ */
+int deferDestructUDI(UdiRootConfig *udiConfig) {
+    unsigned long long sshdStart = 0;
+    pid_t sshdPid = 0;
+    pid_t pid = 0;
+    char *recordPath = NULL;
+    int fd = -1;
+    int rc = 1;
+
+    if (udiConfig == NULL || udiConfig->teardownStatePath == NULL ||
+            strlen(udiConfig->teardownStatePath) == 0 ||
+            udiConfig->udiMountPoint == NULL)
+    {
+        return 1;
+    }
+    if (_shifterCore_checkPrivateDir(udiConfig->teardownStatePath,
+                S_IWGRP | S_IWOTH) != 0)
+    {
+        return 1;
+    }
+
+    /* the sshd is checked to be chrooted into the UDI, so find it before
+     * detaching; only a verified sshd is handed to the reaper */
+    sshdPid = findTrackedSshd(udiConfig);
+    if (sshdPid > 2 && _shifterCore_procStartTime(sshdPid, &sshdStart) != 0) {
+        sshdPid = 0;
+    }
+    fd = _shifterCore_writeTeardown(udiConfig->teardownStatePath, sshdPid,
+            sshdStart, udiConfig, &recordPath);
+    if (fd < 0) {
+        return 1;
+    }
+
+    _shifterCore_detachMount(udiConfig->udiMountPoint);
+    if (udiConfig->loopMountPoint != NULL &&
+            strlen(udiConfig->loopMountPoint) > 0)
+    {
+        _shifterCore_detachMount(udiConfig->loopMountPoint);
+    }
+
+    /* the reaper inherits the locked record */
+    pid = fork();
+    if (pid == 0) {
+        int devNull = -1;
+        setsid();
+        if (fork() != 0) {
+            _exit(0);
+        }
+        devNull = open("/dev/null", O_RDWR);
+        if (devNull >= 0) {
+            dup2(devNull, STDIN_FILENO);
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+            if (devNull > STDERR_FILENO) {
+                close(devNull);
+            }
+        }
+        _exit(_shifterCore_reapTeardown(fd, recordPath, TEARDOWN_RETRIES));
+    } else if (pid > 0) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        close(fd);
+        rc = 0;
+    } else {
+        /* could not hand off, finish the teardown here */
+        rc = _shifterCore_reapTeardown(fd, recordPath, TEARDOWN_RETRIES);
+        close(fd);
+    }
+    free(recordPath);
+    return rc;
+}
+
+/**
+ * _shifterCore_teardownConflicts
+ * Check if a teardown record still holds resources the new UDI needs: any of
+ * its mount points still being mounted, or, if needSshd is set, an sshd
+ * still running.
+ *
+ * Returns 1 on conflict, 0 otherwise.
+ */
+int _shifterCore_teardownConflicts(int fd, int needSshd,
+        UdiRootConfig *udiConfig)
+{
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t nread = 0;
+    int conflict = 0;
+
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        return 1;
+    }
+    fp = fdopen(dup(fd), "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    while (conflict == 0 && (nread = getline(&line, &line_sz, fp)) > 0) {
+        unsigned long long recorded = 0;
+        unsigned long long startTime = 0;
+        int pid = 0;
+        int flag = 0;
+        int offset = 0;
+        if (line[nread - 1] == '\n') {
+            line[nread - 1] = 0;
+        }
+        if (sscanf(line, "sshd %d %llu", &pid, &recorded) == 2) {
+            if (needSshd && _shifterCore_procStartTime(pid, &startTime) == 0 &&
+                    startTime == recorded)
+            {
+                conflict = 1;
+            }
+        } else if (sscanf(line, "mount %d %n", &flag, &offset) == 1 &&
+                offset > 0)
+        {
+            const char *path = line + offset;
+            if ((strcmp(path, udiConfig->udiMountPoint) == 0 ||
+                    (udiConfig->loopMountPoint != NULL &&
+                     strcmp(path, udiConfig->loopMountPoint) == 0)) &&
+                    validateUnmounted(path, flag) != 0)
+            {
+                conflict = 1;
+            }
+        }
+    }
+    fclose(fp);
+    if (line != NULL) {
+        free(line);
+    }
+    return conflict;
+}
+
+/**
+ * waitForTeardown
+ * Called before setting up a UDI to deal with deferred teardowns of earlier
+ * UDIs.  Records whose reaper has gone away are reaped here.  Records still
+ * being reaped are only waited for (up to TEARDOWN_WAIT_MS, after which they
+ * are reaped here) if they hold the mount points of this UDI, or an sshd when
+ * needSshd is set.
+ *
+ * Returns 0 if the UDI can be set up, 1 otherwise.
+ */
+int waitForTeardown(UdiRootConfig *udiConfig, int needSshd) {
+    DIR *dirp = NULL;
+    struct dirent *entry = NULL;
+    int waited = 0;
+    int rc = 0;
+
+    if (udiConfig == NULL || udiConfig->teardownStatePath == NULL ||
+            strlen(udiConfig->teardownStatePath) == 0)
+    {
+        return 0;
+    }
+    dirp = opendir(udiConfig->teardownStatePath);
+    if (dirp == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dirp)) != NULL) {
+        char *path = NULL;
+        int fd = -1;
+        if (strncmp(entry->d_name, TEARDOWN_PREFIX,
+                    strlen(TEARDOWN_PREFIX)) != 0)
+        {
+            continue;
+        }
+        path = alloc_strgenf("%s/%s", udiConfig->teardownStatePath,
+                entry->d_name);
+        if (path == NULL) {
+            rc = 1;
+            break;
+        }
+        fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            /* reaped in the meantime */
+            free(path);
+            continue;
+        }
+        while (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            if (_shifterCore_teardownConflicts(fd, needSshd, udiConfig) == 0) {
+                break;
+            }
+            if (waited >= TEARDOWN_WAIT_MS) {
+                fprintf(stderr, "Timed out waiting for teardown %s\n", path);
+                flock(fd, LOCK_EX);
+                break;
+            }
+            usleep(50000);
+            waited += 50;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+                _shifterCore_reapTeardown(fd, path, 1) != 0 &&
+                _shifterCore_teardownConflicts(fd, needSshd, udiConfig))
+        {
+            rc = 1;
+        }
+        close(fd);
+        free(path);
+    }
+    closedir(dirp);
+    return rc;
+}
+
 /**
  * unmountTree
  * Unmount everything under a particular base path.  Uses a MountList assumed
@@ -75,20 +75,29 @@ int mountImageVFS(ImageData *imageData,
 int mountImageLoop(ImageData *imageData, UdiRootConfig *udiConfig);
 int loopMount(const char *imagePath, const char *loopMountPath, ImageFormat format, UdiRootConfig *udiConfig, int readonly);
 int destructUDI(UdiRootConfig *udiConfig, int killSshd);
+int deferDestructUDI(UdiRootConfig *udiConfig);
+int waitForTeardown(UdiRootConfig *udiConfig, int needSshd);
 int bindImageIntoUDI(const char *relpath, ImageData *imageData, UdiRootConfig *udiConfig, int copyFlag);
 int prepareSiteModifications(const char *username, const char *minNodeSpec, UdiRootConfig *udiConfig);
 int setupImageSsh(char *sshPubKey, char *username, uid_t uid, gid_t gid, UdiRootConfig *udiConfig);
 int startSshd(const char *user, UdiRootConfig *udiConfig);
+int startKeyPoolRefill(UdiRootConfig *udiConfig);
 int filterEtcGroup(const char *dest, const char *from, const char *username, size_t maxGroups);
 int remountUdiRootReadonly(UdiRootConfig *udiConfig);
 int forkAndExecv(char *const *argvs);
 int forkAndExecvSilent(char *const *argvs);
 pid_t findSshd(void);
+pid_t findTrackedSshd(UdiRootConfig *udiConfig);
 int killSshd(void);
+int stopSshd(UdiRootConfig *udiConfig);
 char **parseMounts(size_t *n_mounts);
 char *generateShifterConfigString(const char *, ImageData *, VolumeMap *, UdiRootConfig *);
 int saveShifterConfig(const char *, ImageData *, VolumeMap *, UdiRootConfig *);
 int compareShifterConfig(const char *, ImageData*, VolumeMap *, UdiRootConfig *);
+int diffShifterConfig(const char *user, ImageData *image, VolumeMap *volumeMap,
+        UdiRootConfig *udiConfig, VolumeMap *added, VolumeMap *removed);
+int updateUserMounts(ImageData *image, VolumeMap *added, VolumeMap *removed,
+        UdiRootConfig *udiConfig);
 int unmountTree(MountList *mounts, const char *base);
 int validateUnmounted(const char *path, int subtree);
 int isSharedMount(const char *);
@@ -24,6 +24,10 @@
  * See LICENSE for full text.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,26 +53,41 @@
 
 void _usage(int ret) {
     FILE *output = stdout;
-    fprintf(output, "Usage:\n shifterimg [options] <mode> <type:tag>\n\n");
+    fprintf(output, "Usage:\n shifterimg [options] <mode> <type:tag>\n");
+    fprintf(output, " shifterimg [options] lookup <type:tag> <type:tag> ...\n\n");
     fprintf(output, "    Mode: images, login, lookup, or pull\n");
     fprintf(output, "\nOptions:\n");
     fprintf(output, " --user/-u <list>    List of users allowed to access a "
             "private image\n");
     fprintf(output, " --group/-g <list>   List of groups allowed to access a "
             "private image\n");
+    fprintf(output, " --prefix/-p <repo>  Only list images with tags starting "
+            "with repo\n");
+    fprintf(output, " --since/-s <time>   Only list images pulled since time, "
+            "given as\n                     YYYY-MM-DD[THH:MM:SS] or seconds "
+            "since the epoch\n");
     fprintf(output, " --verbose/-v        Verbose output\n");
     fprintf(output, " --help/-h           Display this help\n");
     fprintf(output, "\nNote: the --user and --group options are only relevant "
-            " for image pulls\n");
+            " for image pulls,\nwhen listing images --user only lists the "
+            "images shared with the user\n");
     exit(ret);
 }
 
 void free_ImageGwState(ImageGwState *image) {
     if (image == NULL) return;
     if (image->message != NULL) free(image->message);
+    if (image->etag != NULL) free(image->etag);
     free(image);
 }
 
+void free_ImageGwLookupCache(ImageGwLookupCache *entry) {
+    if (entry == NULL) return;
+    if (entry->etag != NULL) free(entry->etag);
+    if (entry->identifier != NULL) free(entry->identifier);
+    free(entry);
+}
+
 void free_ImageGwImageRec(ImageGwImageRec *ptr, int free_struct) {
     if (ptr == NULL) return;
     char *strings[] = {
@@ -330,6 +349,10 @@ size_t handleResponseHeader(char *ptr, size_t sz, size_t nmemb, void *data) {
         if (strcasecmp(key, "Content-Length") == 0) {
             imageGw->expContentLen = strtoul(value, NULL, 10);
         }
+        if (strcasecmp(key, "ETag") == 0 && strlen(value) > 0) {
+            if (imageGw->etag != NULL) free(imageGw->etag);
+            imageGw->etag = _strdup(value);
+        }
     }
     return nmemb;
 }
@@ -517,7 +540,16 @@ ImageGwImageRec *parseImageJson(json_object *json_data) {
     return image;
 }
 
-ImageGwImageRec **parseImagesResponse(ImageGwState *imageGw) {
+/**
+ * parseImagesResponse - parse one page of an image listing
+ *
+ * If the gateway has more pages the cursor of the next one is returned in
+ * next, otherwise next is set to NULL.
+ */
+ImageGwImageRec **parseImagesResponse(ImageGwState *imageGw, char **next) {
+    if (next != NULL) {
+        *next = NULL;
+    }
     if (imageGw == NULL || !imageGw->isJsonMessage || !imageGw->messageComplete) {
         return NULL;
     }
@@ -527,7 +559,16 @@ ImageGwImageRec **parseImagesResponse(ImageGwState *imageGw) {
     size_t images_count = 0;
     size_t images_capacity = 0;
 
+    if (jObj == NULL) {
+        return NULL;
+    }
     json_object_object_foreachC(jObj, jIt) {
+        if (strcmp(jIt.key, "next") == 0 && next != NULL) {
+            if (json_object_get_type(jIt.val) == json_type_string) {
+                jsonParseString(jIt.val, next);
+            }
+            continue;
+        }
         if (strcmp(jIt.key, "list") == 0 || strcmp(jIt.key, "data") == 0) {
             enum json_type type = json_object_get_type(jIt.val);
             if (type != json_type_array) {
@@ -556,6 +597,50 @@ ImageGwImageRec **parseImagesResponse(ImageGwState *imageGw) {
     return images;
 }
 
+/**
+ * parseBatchResponse - parse the response of a batch lookup
+ *
+ * Returns an array of count records in the order of the request, with NULL
+ * for each image that was not found, or NULL if the response does not match
+ * the request.
+ */
+ImageGwImageRec **parseBatchResponse(ImageGwState *imageGw, size_t count) {
+    if (imageGw == NULL || !imageGw->isJsonMessage || !imageGw->messageComplete) {
+        return NULL;
+    }
+    json_object *jObj = json_tokener_parse(imageGw->message);
+    json_object_iter jIt;
+    ImageGwImageRec **images = NULL;
+
+    if (jObj == NULL) {
+        return NULL;
+    }
+    json_object_object_foreachC(jObj, jIt) {
+        if (strcmp(jIt.key, "images") != 0) {
+            continue;
+        }
+        if (json_object_get_type(jIt.val) != json_type_array ||
+                json_object_array_length(jIt.val) != count) {
+            break;
+        }
+        size_t idx = 0;
+        images = (ImageGwImageRec **) _malloc(sizeof(ImageGwImageRec *) * (count + 1));
+        memset(images, 0, sizeof(ImageGwImageRec *) * (count + 1));
+        for (idx = 0; idx < count; idx++) {
+            json_object *val = json_object_array_get_idx(jIt.val, idx);
+            ImageGwImageRec *image = parseImageJson(val);
+            if (image != NULL && image->identifier == NULL) {
+                free_ImageGwImageRec(image, 1);
+                image = NULL;
+            }
+            images[idx] = image;
+        }
+        break;
+    }
+    json_object_put(jObj);  /* apparently this weirdness frees the json object */
+    return images;
+}
+
 ImageGwImageRec *parseLookupResponse(ImageGwState *imageGw) {
     if (imageGw == NULL || !imageGw->isJsonMessage || !imageGw->messageComplete) {
         return NULL;
@@ -783,6 +868,258 @@ char *_prepare_pull_payload(struct options *config) {
     return ret;
 }
 
+/**
+ * _prepare_lookup_payload - build the body of a batch lookup
+ */
+char *_prepare_lookup_payload(struct options *config) {
+    size_t len = 0;
+    size_t size = 0;
+    size_t idx = 0;
+    char *ret = NULL;
+
+    if (config == NULL || config->batchImages_len == 0) return NULL;
+    ret = alloc_strcatf(ret, &len, &size, "{\"images\":[");
+    for (idx = 0; idx < config->batchImages_len && ret != NULL; idx++) {
+        char *escaped = json_escape_string(config->batchImages[idx]);
+        if (escaped == NULL) {
+            free(ret);
+            return NULL;
+        }
+        ret = alloc_strcatf(ret, &len, &size, "%s\"%s\"",
+                idx > 0 ? "," : "", escaped);
+        free(escaped);
+    }
+    if (ret != NULL) {
+        ret = alloc_strcatf(ret, &len, &size, "]}");
+    }
+    return ret;
+}
+
+/**
+ * printImages - print a page of an image listing, one line per tag sorted
+ * by tag
+ *
+ * Returns the number of lines printed.
+ */
+size_t printImages(ImageGwImageRec **images) {
+    size_t count = 0;
+    size_t lidx = 0;
+    ImageGwImageRec **ptr = NULL;
+    for (ptr = images; ptr != NULL && *ptr != NULL; ptr++) {
+        ImageGwImageRec *image = *ptr;
+        char **tagPtr = image->tag;
+        while (tagPtr && *tagPtr) {
+            count++;
+            tagPtr++;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+    ImageGwImageRec *limages = (ImageGwImageRec *) _malloc(sizeof(ImageGwImageRec) * count);
+    char **ltags = (char **) _malloc(sizeof(char *) * count);
+    for (ptr = images; ptr != NULL && *ptr != NULL; ptr++) {
+        ImageGwImageRec *image = *ptr;
+        char **tagPtr = image->tag;
+        while (tagPtr && *tagPtr) {
+            memcpy(&(limages[lidx]), image, sizeof(ImageGwImageRec));
+            ltags[lidx] = *tagPtr;
+            limages[lidx].tag = &(ltags[lidx]);
+            lidx++;
+            tagPtr++;
+        }
+    }
+    qsort(limages, count, sizeof(ImageGwImageRec), imgCompare);
+    for (lidx = 0; lidx < count; lidx++) {
+        ImageGwImageRec *image = &(limages[lidx]);
+        char *tag = image->tag[0];
+        time_t pull_time = image->last_pull;
+        struct tm time_struct;
+        char time_str[100];
+        memset(&time_struct, 0, sizeof(struct tm));
+        if (localtime_r(&pull_time, &time_struct) == NULL) {
+            /* if above generated an error, re-zero so we display obvious nonsense */
+            memset(&time_struct, 0, sizeof(struct tm));
+        }
+        strftime(time_str, 100, "%Y-%m-%dT%H:%M:%S", &time_struct);
+
+        printf("%-10s %-10s %-8s %-.10s   %s %-30s\n", image->system, image->type, image->status, image->identifier, time_str, tag);
+    }
+    fflush(stdout);
+    free(ltags);
+    free(limages);
+    return count;
+}
+
+/**
+ * lookupCachePath - get the path of the lookup cache file for an image
+ *
+ * The cache lives in a shifterimg.<uid> directory under cacheBase which must
+ * be a directory owned by the user and not accessible by anyone else, it is
+ * created if missing.  Returns NULL if the cache is disabled or unusable.
+ */
+char *lookupCachePath(const char *cacheBase, const char *system,
+        const char *type, const char *tag)
+{
+    char *cacheDir = NULL;
+    char *key = NULL;
+    char *path = NULL;
+    struct stat st;
+    uint64_t hash = SHIFTER_FNV1A64_INIT;
+
+    if (cacheBase == NULL) cacheBase = "/tmp";
+    if (strlen(cacheBase) == 0 || strcmp(cacheBase, "none") == 0) {
+        return NULL;
+    }
+    if (system == NULL || type == NULL || tag == NULL) {
+        return NULL;
+    }
+    cacheDir = alloc_strgenf("%s/shifterimg.%d", cacheBase, (int) getuid());
+    if (cacheDir == NULL) {
+        return NULL;
+    }
+    if (mkdir(cacheDir, 0700) != 0 && errno != EEXIST) {
+        goto _lookupCachePath_out;
+    }
+    if (lstat(cacheDir, &st) != 0 || !S_ISDIR(st.st_mode) ||
+            st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        goto _lookupCachePath_out;
+    }
+    key = alloc_strgenf("%s:%s:%s", system, type, tag);
+    if (key == NULL) {
+        goto _lookupCachePath_out;
+    }
+    hash = shifter_fnv1a64(hash, key, strlen(key));
+    path = alloc_strgenf("%s/lookup-%016llx", cacheDir,
+            (unsigned long long) hash);
+_lookupCachePath_out:
+    if (cacheDir != NULL) free(cacheDir);
+    if (key != NULL) free(key);
+    return path;
+}
+
+/**
+ * readLookupCache - read the cached lookup response for key from path
+ *
+ * Returns NULL if there is no entry or it belongs to a different key.
+ */
+ImageGwLookupCache *readLookupCache(const char *path, const char *key) {
+    FILE *fp = NULL;
+    char *lines[4] = { NULL, NULL, NULL, NULL };
+    size_t lineSizes[4] = { 0, 0, 0, 0 };
+    ImageGwLookupCache *entry = NULL;
+    int idx = 0;
+
+    if (path == NULL || key == NULL) {
+        return NULL;
+    }
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+    for (idx = 0; idx < 4; idx++) {
+        ssize_t nread = getline(&(lines[idx]), &(lineSizes[idx]), fp);
+        if (nread <= 0 || lines[idx][nread - 1] != '\n') {
+            goto _readLookupCache_out;
+        }
+        lines[idx][nread - 1] = 0;
+    }
+    if (strcmp(lines[0], "SHIFTERIMG_LOOKUP 1") != 0 ||
+            strcmp(lines[1], key) != 0 ||
+            strlen(lines[2]) == 0 || strlen(lines[3]) == 0) {
+        goto _readLookupCache_out;
+    }
+    entry = (ImageGwLookupCache *) _malloc(sizeof(ImageGwLookupCache));
+    entry->etag = lines[2];
+    entry->identifier = lines[3];
+    lines[2] = NULL;
+    lines[3] = NULL;
+_readLookupCache_out:
+    for (idx = 0; idx < 4; idx++) {
+        if (lines[idx] != NULL) free(lines[idx]);
+    }
+    fclose(fp);
+    return entry;
+}
+
+/**
+ * writeLookupCache - store a lookup response for key at path
+ *
+ * The entry is written to a temporary file and renamed into place so that
+ * concurrent lookups never read a partial entry.  Returns 0 on success.
+ */
+int writeLookupCache(const char *path, const char *key, const char *etag,
+        const char *identifier)
+{
+    char *tmpPath = NULL;
+    FILE *fp = NULL;
+    int ret = 1;
+
+    if (path == NULL || key == NULL || etag == NULL || identifier == NULL) {
+        return 1;
+    }
+    if (strchr(etag, '\n') != NULL || strchr(identifier, '\n') != NULL) {
+        return 1;
+    }
+    tmpPath = alloc_strgenf("%s.%d", path, (int) getpid());
+    if (tmpPath == NULL) {
+        return 1;
+    }
+    fp = fopen(tmpPath, "w");
+    if (fp == NULL) {
+        goto _writeLookupCache_out;
+    }
+    fprintf(fp, "SHIFTERIMG_LOOKUP 1\n%s\n%s\n%s\n", key, etag, identifier);
+    if (fclose(fp) != 0) {
+        unlink(tmpPath);
+        goto _writeLookupCache_out;
+    }
+    if (rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+        goto _writeLookupCache_out;
+    }
+    ret = 0;
+_writeLookupCache_out:
+    free(tmpPath);
+    return ret;
+}
+
+/**
+ * appendListArguments - add the filters and paging arguments of an image
+ * listing to the list url
+ *
+ * Frees url and returns the new one.
+ */
+char *appendListArguments(CURL *curl, char *url, struct options *config) {
+    size_t len = strlen(url);
+    size_t sz = len + 1;
+    char sep = '?';
+
+    url = alloc_strcatf(url, &len, &sz, "%climit=%d", sep, IMAGE_LIST_PAGE_SIZE);
+    sep = '&';
+    if (config->listPrefix != NULL) {
+        char *prefix = curl_easy_escape(curl, config->listPrefix, strlen(config->listPrefix));
+        if (prefix != NULL) {
+            url = alloc_strcatf(url, &len, &sz, "%cprefix=%s", sep, prefix);
+            curl_free(prefix);
+        }
+    }
+    if (config->allowed_uids_len > 0) {
+        url = alloc_strcatf(url, &len, &sz, "%cuser=%d", sep, config->allowed_uids[0]);
+    }
+    if (config->listSince > 0) {
+        url = alloc_strcatf(url, &len, &sz, "%csince=%ld", sep, (long) config->listSince);
+    }
+    if (config->listAfter != NULL) {
+        char *after = curl_easy_escape(curl, config->listAfter, strlen(config->listAfter));
+        if (after != NULL) {
+            url = alloc_strcatf(url, &len, &sz, "%cafter=%s", sep, after);
+            curl_free(after);
+        }
+    }
+    return url;
+}
+
 ImageGwState *queryGateway(char *baseUrl, char *type, char *tag, struct options *config, UdiRootConfig *udiConfig) {
     const char *modeStr = NULL;
     if (config->mode == MODE_LOOKUP) {
@@ -798,7 +1135,7 @@ ImageGwState *queryGateway(char *baseUrl, char *type, char *tag, struct options
     } else {
         modeStr = "invalid";
     }
-    const char *url = NULL;
+    char *url = NULL;
     if (tag != NULL) {
         url = alloc_strgenf("%s/api/%s/%s/%s/%s/", baseUrl, modeStr, udiConfig->system, type, tag);
     } else {
@@ -806,13 +1143,28 @@ ImageGwState *queryGateway(char *baseUrl, char *type, char *tag, struct options
     }
     CURL *curl = NULL;
     CURLcode err;
+
+    curl = curl_easy_init();
+    if (config->mode == MODE_IMAGES && url != NULL) {
+        url = appendListArguments(curl, url, config);
+    }
     char *cred = NULL;
     struct curl_slist *headers = NULL;
     char *authstr = NULL;
+    char *cachePath = NULL;
+    char *cacheKey = NULL;
+    char *condstr = NULL;
+    ImageGwLookupCache *cached = NULL;
     ImageGwState *imageGw = (ImageGwState *) _malloc(sizeof(ImageGwState));
     memset(imageGw, 0, sizeof(ImageGwState));
 
-    curl = curl_easy_init();
+    if (config->mode == MODE_LOOKUP && tag != NULL) {
+        cacheKey = alloc_strgenf("%s:%s:%s", udiConfig->system, type, tag);
+        cachePath = lookupCachePath(udiConfig->gatewayCachePath,
+                udiConfig->system, type, tag);
+        cached = readLookupCache(cachePath, cacheKey);
+    }
+
     curl_easy_setopt(curl, CURLOPT_URL, url);
 
     munge_ctx_t ctx = munge_ctx_create();
@@ -838,9 +1190,20 @@ ImageGwState *queryGateway(char *baseUrl, char *type, char *tag, struct options
     munge_ctx_destroy(ctx);
 
     headers = curl_slist_append(headers, authstr);
+    if (cached != NULL) {
+        condstr = alloc_strgenf("If-None-Match: %s", cached->etag);
+        if (condstr != NULL) {
+            headers = curl_slist_append(headers, condstr);
+        }
+    }
 
-    if (config->mode == MODE_PULL || config->mode == MODE_PULL_NONBLOCK) {
-        payload = _prepare_pull_payload(config);
+    if (config->mode == MODE_PULL || config->mode == MODE_PULL_NONBLOCK ||
+            (config->mode == MODE_LOOKUP && config->batchImages_len > 0)) {
+        if (config->mode == MODE_LOOKUP) {
+            payload = _prepare_lookup_payload(config);
+        } else {
+            payload = _prepare_pull_payload(config);
+        }
         if (payload == NULL) {
             payload = _strdup("");
         }
@@ -878,15 +1241,52 @@ ImageGwState *queryGateway(char *baseUrl, char *type, char *tag, struct options
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
     curl_easy_cleanup(curl);
 
-    if (http_code == 200) {
+    if (http_code == 304 && cached != NULL) {
+        /* image unchanged since the cached response */
+        if (config->verbose) {
+            printf("Not modified, using cached lookup\n");
+        }
+        printf("%s\n", cached->identifier);
+    } else if (http_code == 200) {
         if (imageGw->messageComplete) {
             if (config->verbose) {
                 printf("Message: %s\n", imageGw->message);
             }
-            if (config->mode == MODE_LOOKUP) {
+            if (config->mode == MODE_LOOKUP && config->batchImages_len > 0) {
+                /* print the identifiers in the order requested, but only if
+                 * all images were found */
+                size_t idx = 0;
+                size_t missing = 0;
+                ImageGwImageRec **images = parseBatchResponse(imageGw, config->batchImages_len);
+                if (images == NULL) {
+                    goto _fail_valid_args;
+                }
+                for (idx = 0; idx < config->batchImages_len; idx++) {
+                    if (images[idx] == NULL) {
+                        if (config->verbose) {
+                            printf("Image not found: %s\n", config->batchImages[idx]);
+                        }
+                        missing++;
+                    }
+                }
+                for (idx = 0; idx < config->batchImages_len; idx++) {
+                    if (missing == 0) {
+                        printf("%s\n", images[idx]->identifier);
+                    }
+                    free_ImageGwImageRec(images[idx], 1);
+                }
+                free(images);
+                if (missing > 0) {
+                    goto _fail_valid_args;
+                }
+            } else if (config->mode == MODE_LOOKUP) {
                 ImageGwImageRec *image = parseLookupResponse(imageGw);
                 if (image != NULL) {
                     printf("%s\n", image->identifier);
+                    if (imageGw->etag != NULL && cachePath != NULL) {
+                        writeLookupCache(cachePath, cacheKey, imageGw->etag,
+                                image->identifier);
+                    }
                 }
                 free_ImageGwImageRec(image, 1);
             } else if (config->mode == MODE_PULL_NONBLOCK) {
@@ -937,59 +1337,11 @@ ImageGwState *queryGateway(char *baseUrl, char *type, char *tag, struct options
                     image = NULL;
                 }
             } else if (config->mode == MODE_IMAGES) {
-                ImageGwImageRec **images = parseImagesResponse(imageGw);
-                if (images != NULL && *images != NULL) {
-                    size_t count = 0;
-                    size_t lidx = 0;
-                    ImageGwImageRec **ptr = NULL;
-                    for (ptr = images; ptr != NULL && *ptr != NULL; ptr++) {
-                        ImageGwImageRec *image = *ptr;
-                        char **tagPtr = image->tag;
-                        while (tagPtr && *tagPtr) {
-                            count++;
-                            tagPtr++;
-                        }
-                    }
-                    if (count == 0) {
-                        if (images != NULL) {
-                            for (ptr = images; ptr && *ptr; ptr++) {
-                                free_ImageGwImageRec(*ptr, 1);
-                            }
-                            free(images);
-                            images = NULL;
-                        }
-                        goto _fail_valid_args;
-                    }
-                    ImageGwImageRec *limages = (ImageGwImageRec *) _malloc(sizeof(ImageGwImageRec) * count);
-                    for (ptr = images; ptr != NULL && *ptr != NULL; ptr++) {
-                        ImageGwImageRec *image = *ptr;
-                        char **tagPtr = image->tag;
-                        while (tagPtr && *tagPtr) {
-                            memcpy(&(limages[lidx]), image, sizeof(ImageGwImageRec));
-                            limages[lidx].tag = (char **) _malloc(sizeof(char *) * 1);
-                            limages[lidx].tag[0] = *tagPtr;
-                            lidx++;
-                            tagPtr++;
-                        }
-                    }
-                    qsort(limages, count, sizeof(ImageGwImageRec), imgCompare);
-                    for (lidx = 0; lidx < count; lidx++) {
-                        ImageGwImageRec *image = &(limages[lidx]);
-                        char *tag = image->tag[0];
-                        time_t pull_time = image->last_pull;
-                        struct tm time_struct;
-                        char time_str[100];
-                        memset(&time_struct, 0, sizeof(struct tm));
-                        if (localtime_r(&pull_time, &time_struct) == NULL) {
-                            /* if above generated an error, re-zero so we display obvious nonsense */
-                            memset(&time_struct, 0, sizeof(struct tm));
-                        }
-                        strftime(time_str, 100, "%Y-%m-%dT%H:%M:%S", &time_struct);
-
-                        printf("%-10s %-10s %-8s %-.10s   %s %-30s\n", image->system, image->type, image->status, image->identifier, time_str, tag);
-                    }
-                    free(limages);
-                }
+                char *next = NULL;
+                int firstPage = config->listAfter == NULL;
+                ImageGwImageRec **images = parseImagesResponse(imageGw, &next);
+                int hasImages = images != NULL && *images != NULL;
+                size_t printed = printImages(images);
                 if (images != NULL) {
                     ImageGwImageRec **ptr = NULL;
                     for (ptr = images; ptr && *ptr; ptr++) {
@@ -998,23 +1350,40 @@ ImageGwState *queryGateway(char *baseUrl, char *type, char *tag, struct options
                     free(images);
                     images = NULL;
                 }
+                /* the caller fetches the next page until there is none */
+                if (config->listAfter != NULL) {
+                    free(config->listAfter);
+                }
+                config->listAfter = next;
+                if (firstPage && hasImages && printed == 0) {
+                    goto _fail_valid_args;
+                }
             }
         }
     } else {
         if (config->verbose) {
             printf("Got response: %ld\nMessage: %s\n", http_code, imageGw->message);
         }
+        if (http_code == 404 && cachePath != NULL) {
+            unlink(cachePath);
+        }
         free_ImageGwState(imageGw);
-        return NULL;
+        imageGw = NULL;
     }
+    goto _queryGateway_out;
 
-    return imageGw;
 _fail_valid_args:
     if (imageGw != NULL) {
         free_ImageGwState(imageGw);
         imageGw = NULL;
     }
-    return NULL;
+_queryGateway_out:
+    if (url != NULL) free(url);
+    if (cachePath != NULL) free(cachePath);
+    if (cacheKey != NULL) free(cacheKey);
+    if (condstr != NULL) free(condstr);
+    free_ImageGwLookupCache(cached);
+    return imageGw;
 }
 
 int _assignLoginCredential(const char *key, const char *value, void *_data) {
@@ -1121,6 +1490,34 @@ _finish:
     tmp = NULL;
 }
 
+/**
+ * _parse_since - parse the time given to --since
+ *
+ * Accepts a local date, a local date and time, or seconds since the epoch.
+ * Returns 0 if the time is invalid.
+ */
+time_t _parse_since(const char *arg) {
+    const char *formats[] = { "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d", NULL };
+    const char **fmt = NULL;
+    char *end = NULL;
+    long seconds = 0;
+
+    for (fmt = formats; *fmt != NULL; fmt++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(struct tm));
+        end = strptime(arg, *fmt, &tm);
+        if (end != NULL && *end == 0) {
+            tm.tm_isdst = -1;
+            return mktime(&tm);
+        }
+    }
+    seconds = strtol(arg, &end, 10);
+    if (end == arg || *end != 0 || seconds < 0) {
+        return 0;
+    }
+    return (time_t) seconds;
+}
+
 int parse_options(int argc, char **argv, struct options *config, UdiRootConfig *udiConfig) {
     int opt = 0;
     static struct option long_options[] = {
@@ -1128,6 +1525,8 @@ int parse_options(int argc, char **argv, struct options *config, UdiRootConfig *
         {"verbose", 0, 0, 'v'},
         {"user", 1, 0, 'u'},
         {"group", 1, 0, 'g'},
+        {"prefix", 1, 0, 'p'},
+        {"since", 1, 0, 's'},
         {0, 0, 0, 0}
     };
 
@@ -1136,7 +1535,7 @@ int parse_options(int argc, char **argv, struct options *config, UdiRootConfig *
 
     for ( ; ; ) {
         int longopt_index = 0;
-        opt = getopt_long(argc, argv, "hv", long_options, &longopt_index);
+        opt = getopt_long(argc, argv, "hvp:s:", long_options, &longopt_index);
         if (opt == -1) break;
 
         switch (opt) {
@@ -1152,6 +1551,17 @@ int parse_options(int argc, char **argv, struct options *config, UdiRootConfig *
             case 'g':
                 _add_allowed(GROUP_ACL, config, optarg);
                 break;
+            case 'p':
+                if (config->listPrefix != NULL) free(config->listPrefix);
+                config->listPrefix = _strdup(optarg);
+                break;
+            case 's':
+                config->listSince = _parse_since(optarg);
+                if (config->listSince == 0) {
+                    fprintf(stderr, "Invalid time for --since: %s\n", optarg);
+                    _usage(1);
+                }
+                break;
             case '?':
                 fprintf(stderr, "Missing an argument!\n");
                 _usage(1);
@@ -1187,7 +1597,22 @@ int parse_options(int argc, char **argv, struct options *config, UdiRootConfig *
         _usage(1);
     }
 
-    if (remaining > 1) {
+    if (config->mode == MODE_LOOKUP && remaining > 2) {
+        /* several images are looked up with a single request */
+        int argIdx = 0;
+        config->batchImages = (char **) _malloc(sizeof(char *) * (remaining - 1));
+        for (argIdx = optind + 1; argIdx < argc; argIdx++) {
+            char *type = NULL;
+            char *tag = NULL;
+            if (parse_ImageDescriptor(argv[argIdx], &type, &tag, udiConfig) != 0) {
+                fprintf(stderr, "FAILED to parse image descriptor: %s\n", argv[argIdx]);
+                _usage(1);
+            }
+            config->batchImages[config->batchImages_len++] = alloc_strgenf("%s:%s", type, tag);
+            free(type);
+            free(tag);
+        }
+    } else if (remaining > 1) {
         CURL *curl = curl_easy_init();
         optind++;
 
@@ -1276,6 +1701,13 @@ int main(int argc, char **argv) {
 
     for (idx = 0; idx < nGateways; idx++) {
         imgGw = queryGateway(gateways[idx], config.type, config.tag, &config, &udiConfig);
+        /* image listings are printed page by page, a gateway taking over
+         * after a failure continues from the last page */
+        while (imgGw != NULL && config.mode == MODE_IMAGES &&
+                config.listAfter != NULL) {
+            free_ImageGwState(imgGw);
+            imgGw = queryGateway(gateways[idx], config.type, config.tag, &config, &udiConfig);
+        }
         if (imgGw != NULL) {
             break;
         }
@@ -24,6 +24,9 @@
  * See LICENSE for full text.
  */
 
+/* number of images requested per page of an image listing */
+#define IMAGE_LIST_PAGE_SIZE 500
+
 enum ImageGwAction {
     MODE_LOOKUP = 0,
     MODE_PULL,
@@ -65,6 +68,15 @@ struct options {
     int *allowed_gids;
     size_t allowed_gids_len;
     size_t allowed_gids_sz;
+
+    /* type:tag of each image of a batch lookup */
+    char **batchImages;
+    size_t batchImages_len;
+
+    /* image listing filters and the cursor of the next page */
+    char *listPrefix;
+    time_t listSince;
+    char *listAfter;
 };
 
 typedef struct _ImageGwState {
@@ -74,8 +86,15 @@ typedef struct _ImageGwState {
     size_t messageLen;
     size_t messageCurr;
     int messageComplete;
+    char *etag;
 } ImageGwState;
 
+/* last lookup response of an image, revalidated with the gateway by etag */
+typedef struct _ImageGwLookupCache {
+    char *etag;
+    char *identifier;
+} ImageGwLookupCache;
+
 typedef struct _ImageGwImageRec {
     char *entryPoint;
     char **env;
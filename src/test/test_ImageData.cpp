@@ -62,6 +62,15 @@ TEST(ImageDataTestGroup, ConfigAssign_basic) {
     ret = _ImageData_assign("ENV", "PATH=/bin:/usr/bin", &image);
     CHECK(ret == 0);
 
+    ret = _ImageData_assign("DIGEST", "chunked-sha256:67108864:abcd", &image);
+    CHECK(ret == 0);
+    ret = _ImageData_assign("DIGEST_CHUNKS", "abcd,ef01", &image);
+    CHECK(ret == 0);
+
+    ret = _ImageData_assign("FORMAT", "erofs", &image);
+    CHECK(ret == 0);
+    CHECK(image.format == FORMAT_EROFS);
+
     free_ImageData(&image, 0);
 
 }
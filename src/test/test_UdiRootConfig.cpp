@@ -57,6 +57,7 @@ TEST(UdiRootConfigTestGroup, ParseUdiRootConfig_basic) {
     CHECK(strcmp(config.loopMountPoint, "/var/loopUdiMount") == 0);
     CHECK(strcmp(config.rootfsType, "tmpfs") == 0);
     CHECK(strcmp(config.system, "testSystem") == 0);
+    CHECK(config.udiImageStagingPath == NULL);
     CHECK(config.n_modules == 2);
 
     CHECK(strcmp(config.modules[0].name, "mpich") == 0);
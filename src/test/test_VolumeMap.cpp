@@ -315,6 +315,28 @@ TEST(VolumeMapTestGroup, GetVolumeMapSignature_basic) {
     free_VolumeMap(&volMap, 0);
 }
 
+TEST(VolumeMapTestGroup, GetVolumeMapMountOrder_basic) {
+    VolumeMap volMap;
+    size_t *order = NULL;
+
+    memset(&volMap, 0, sizeof(VolumeMap));
+    CHECK(getVolumeMapMountOrder(&volMap) == NULL);
+
+    CHECK(parseVolumeMapSiteFs("/a:/global/u1/sub;/b:/scratch;/c:/global;/d:/global/u1;/e:/other", &volMap) == 0);
+    order = getVolumeMapMountOrder(&volMap);
+    CHECK(order != NULL);
+
+    /* parents first, configured order kept among equals */
+    CHECK(order[0] == 1);
+    CHECK(order[1] == 2);
+    CHECK(order[2] == 4);
+    CHECK(order[3] == 3);
+    CHECK(order[4] == 0);
+
+    free(order);
+    free_VolumeMap(&volMap, 0);
+}
+
 TEST(VolumeMapTestGroup, GetVolumeMapParseLongSiteFs) {
     const char *mountStr = "/global/u1:/global/u1;"
         "/global/u2:/global/u2;"
@@ -40,10 +40,38 @@
 #include "VolumeMap.h"
 #include "MountList.h"
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 extern "C" {
 int _shifterCore_bindMount(UdiRootConfig *config, MountList *mounts, const char *from, const char *to, int ro, int overwrite);
 int _shifterCore_copyFile(const char *cpPath, const char *source, const char *dest, int keepLink, uid_t owner, gid_t group, mode_t mode);
+char *_shifterCore_stageUdiContent(UdiRootConfig *udiConfig, const char *src, const char *label, int *pinFd);
+char *_shifterCore_stageSiteEtc(UdiRootConfig *udiConfig, int *pinFd);
+int _shifterCore_readLaunchPlan(const char *path, const char *stamp,
+        char ***names, char **ops, size_t *count);
+int _shifterCore_writeLaunchPlan(const char *path, const char *stamp,
+        char **names, const char *ops, size_t count);
+int _shifterCore_procStartTime(pid_t pid, unsigned long long *startTime);
+int _shifterCore_recordSshd(pid_t pid, UdiRootConfig *udiConfig);
+int _shifterCore_readSshdRecord(UdiRootConfig *udiConfig, pid_t *pid,
+        unsigned long long *startTime);
+int _shifterCore_isUdiSshd(pid_t pid, UdiRootConfig *udiConfig);
+int _shifterCore_isListening(pid_t pid);
+char *_shifterCore_udiStateFile(UdiRootConfig *udiConfig, const char *kind);
+int _shifterCore_writeTeardown(const char *stateDir, pid_t sshdPid,
+        unsigned long long sshdStart, UdiRootConfig *udiConfig, char **path);
+int _shifterCore_reapTeardown(int fd, const char *path, int attempts);
+size_t _shifterCore_warmVolumeSources(UdiRootConfig *udiConfig);
+int _shifterCore_checkPrivateDir(const char *path, mode_t disallowed);
+char *_shifterCore_claimHostKeys(const char *poolPath);
+int _shifterCore_installHostKeys(const char *keySet, const char *etcDir,
+        uid_t owner, gid_t group);
+void _shifterCore_removeKeySet(const char *keySet);
+int _shifterCore_refillKeyPool(const char *poolPath, const char *keygen);
+int _shifterCore_teardownConflicts(int fd, int needSshd,
+        UdiRootConfig *udiConfig);
 }
 
 extern char** environ;
@@ -922,6 +950,596 @@ TEST(ShifterCoreTestGroup, validateLocalTypeIsConfigurable) {
     free_MountList(&mounts, 0);
 }
 
+TEST(ShifterCoreTestGroup, stageUdiContent_basic) {
+    UdiRootConfig config;
+    struct stat statData;
+    memset(&config, 0, sizeof(UdiRootConfig));
+    config.cpPath = strdup("/bin/cp");
+    config.chmodPath = strdup("/bin/chmod");
+
+    string srcDir = string(tmpDir) + "/src";
+    string srcFile = srcDir + "/file1";
+    string stageDir = string(tmpDir) + "/staging";
+    CHECK(mkdir(srcDir.c_str(), 0700) == 0);
+    FILE *fp = fopen(srcFile.c_str(), "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "asdf\n");
+    fclose(fp);
+    chmod(srcFile.c_str(), 0600);
+
+    int pin = -1;
+    int againPin = -1;
+    int thirdPin = -1;
+    int fourthPin = -1;
+    int otherPin = -1;
+    string mntDir = string(tmpDir) + "/stagedMnt";
+
+    /* staging is disabled without a staging path */
+    CHECK(_shifterCore_stageUdiContent(&config, srcDir.c_str(), "mod", &pin) == NULL);
+    CHECK(pin == -1);
+
+    config.udiImageStagingPath = strdup(stageDir.c_str());
+    char *staged = _shifterCore_stageUdiContent(&config, srcDir.c_str(), "mod", &pin);
+    CHECK(staged != NULL);
+    CHECK(pin >= 0);
+    CHECK(strncmp(staged, stageDir.c_str(), stageDir.length()) == 0);
+
+    /* staged copy is opened up for reading */
+    string stagedFile = string(staged) + "/file1";
+    CHECK(stat(stagedFile.c_str(), &statData) == 0);
+    CHECK((statData.st_mode & S_IROTH) != 0);
+    CHECK(stat(staged, &statData) == 0);
+    CHECK((statData.st_mode & S_IXOTH) != 0);
+
+    /* copies with another label are never pruned for this one */
+    char *other = _shifterCore_stageUdiContent(&config, srcDir.c_str(), "mod_x", &otherPin);
+    CHECK(other != NULL);
+    close(otherPin);
+
+    /* unchanged content reuses the same staged copy */
+    char *again = _shifterCore_stageUdiContent(&config, srcDir.c_str(), "mod", &againPin);
+    CHECK(again != NULL);
+    CHECK(againPin >= 0);
+    CHECK(strcmp(staged, again) == 0);
+    free(again);
+    close(againPin);
+
+    /* changed content is staged anew, the superseded copy is still pinned by
+     * the setup that staged it and is kept */
+    fp = fopen(srcFile.c_str(), "a");
+    fprintf(fp, "more\n");
+    fclose(fp);
+    again = _shifterCore_stageUdiContent(&config, srcDir.c_str(), "mod", &againPin);
+    CHECK(again != NULL);
+    CHECK(strcmp(staged, again) != 0);
+    CHECK(stat(staged, &statData) == 0);
+    close(pin);
+    close(againPin);
+
+#ifndef NOTROOT
+    /* a copy bind mounted into a container is in use as well */
+    CHECK(mkdir(mntDir.c_str(), 0755) == 0);
+    CHECK(mount(again, mntDir.c_str(), NULL, MS_BIND, NULL) == 0);
+#endif
+    fp = fopen(srcFile.c_str(), "a");
+    fprintf(fp, "third\n");
+    fclose(fp);
+    char *third = _shifterCore_stageUdiContent(&config, srcDir.c_str(), "mod", &thirdPin);
+    CHECK(third != NULL);
+    CHECK(stat(staged, &statData) != 0);
+#ifndef NOTROOT
+    CHECK(stat(again, &statData) == 0);
+    CHECK(umount(mntDir.c_str()) == 0);
+    CHECK(rmdir(mntDir.c_str()) == 0);
+#endif
+    close(thirdPin);
+
+    /* once released, superseded copies go when the next one is staged */
+    fp = fopen(srcFile.c_str(), "a");
+    fprintf(fp, "fourth\n");
+    fclose(fp);
+    char *fourth = _shifterCore_stageUdiContent(&config, srcDir.c_str(), "mod", &fourthPin);
+    CHECK(fourth != NULL);
+    CHECK(stat(again, &statData) != 0);
+    CHECK(stat(third, &statData) != 0);
+    CHECK(stat(fourth, &statData) == 0);
+    CHECK(stat(other, &statData) == 0);
+    close(fourthPin);
+
+    tmpFiles.push_back(string(fourth) + "/file1");
+    tmpFiles.push_back(string(other) + "/file1");
+    tmpFiles.push_back(srcFile);
+    tmpDirs.push_back(fourth);
+    tmpDirs.push_back(other);
+    tmpDirs.push_back(stageDir);
+    tmpDirs.push_back(srcDir);
+    free(staged);
+    free(again);
+    free(third);
+    free(fourth);
+    free(other);
+    free(config.cpPath);
+    free(config.chmodPath);
+    free(config.udiImageStagingPath);
+}
+
+TEST(ShifterCoreTestGroup, stageSiteEtc_basic) {
+    UdiRootConfig config;
+    struct stat statData;
+    memset(&config, 0, sizeof(UdiRootConfig));
+    config.cpPath = strdup("/bin/cp");
+    config.populateEtcDynamically = 0;
+
+    string etcDir = string(tmpDir) + "/siteEtc";
+    string etcFile = etcDir + "/passwd";
+    string stageDir = string(tmpDir) + "/etcStaging";
+    CHECK(mkdir(etcDir.c_str(), 0755) == 0);
+    FILE *fp = fopen(etcFile.c_str(), "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "root:x:0:0:root:/root:/bin/bash\n");
+    fclose(fp);
+    config.etcPath = strdup(etcDir.c_str());
+
+    int pin = -1;
+    int againPin = -1;
+    int thirdPin = -1;
+
+    /* staging is disabled without a staging path */
+    CHECK(_shifterCore_stageSiteEtc(&config, &pin) == NULL);
+
+    config.udiImageStagingPath = strdup(stageDir.c_str());
+    char *staged = _shifterCore_stageSiteEtc(&config, &pin);
+    CHECK(staged != NULL);
+    CHECK(pin >= 0);
+
+    /* payload includes site files, local files and an empty shadow */
+    string stagedPasswd = string(staged) + "/passwd";
+    string stagedHosts = string(staged) + "/hosts";
+    string stagedResolv = string(staged) + "/resolv.conf";
+    string stagedShadow = string(staged) + "/shadow";
+    CHECK(stat(stagedPasswd.c_str(), &statData) == 0);
+    CHECK((statData.st_mode & 0777) == 0644);
+    CHECK(stat(stagedHosts.c_str(), &statData) == 0);
+    CHECK(stat(stagedResolv.c_str(), &statData) == 0);
+    CHECK(stat(stagedShadow.c_str(), &statData) == 0);
+    CHECK(statData.st_size == 0);
+
+    /* identical inputs reuse the staged payload */
+    char *again = _shifterCore_stageSiteEtc(&config, &againPin);
+    CHECK(again != NULL);
+    CHECK(againPin >= 0);
+    CHECK(strcmp(staged, again) == 0);
+    free(again);
+    close(againPin);
+
+    /* any change in content produces a new payload, and a superseded
+     * payload still pinned by a setup copying from it is kept */
+    fp = fopen(etcFile.c_str(), "a");
+    fprintf(fp, "nobody:x:65534:65534::/:/bin/false\n");
+    fclose(fp);
+    again = _shifterCore_stageSiteEtc(&config, &againPin);
+    CHECK(again != NULL);
+    CHECK(strcmp(staged, again) != 0);
+    CHECK(stat(staged, &statData) == 0);
+
+    /* unpinned superseded payloads are pruned when a new one is staged */
+    close(pin);
+    fp = fopen(etcFile.c_str(), "a");
+    fprintf(fp, "daemon:x:1:1::/:/bin/false\n");
+    fclose(fp);
+    char *third = _shifterCore_stageSiteEtc(&config, &thirdPin);
+    CHECK(third != NULL);
+    CHECK(stat(staged, &statData) != 0);
+    CHECK(stat(again, &statData) == 0);
+    CHECK(stat(third, &statData) == 0);
+    close(againPin);
+    close(thirdPin);
+
+    const char *names[] = {"passwd", "hosts", "resolv.conf", "shadow", NULL};
+    for (const char **ptr = names; *ptr != NULL; ptr++) {
+        tmpFiles.push_back(string(again) + "/" + *ptr);
+        tmpFiles.push_back(string(third) + "/" + *ptr);
+    }
+    tmpFiles.push_back(etcFile);
+    tmpDirs.push_back(again);
+    tmpDirs.push_back(third);
+    tmpDirs.push_back(stageDir);
+    tmpDirs.push_back(etcDir);
+    free(staged);
+    free(again);
+    free(third);
+    free(config.cpPath);
+    free(config.etcPath);
+    free(config.udiImageStagingPath);
+}
+
+TEST(ShifterCoreTestGroup, launchPlan_basic) {
+    string planFile = string(tmpDir) + "/plan";
+    char *names[] = {strdup("usr"), strdup("lib64"), strdup("os-release"), NULL};
+    const char ops[] = {'d', 'l', 'f', 0};
+    char **readNames = NULL;
+    char *readOps = NULL;
+    size_t count = 0;
+
+    /* missing plan is not replayed */
+    CHECK(_shifterCore_readLaunchPlan(planFile.c_str(), "1:2", &readNames, &readOps, &count) != 0);
+
+    CHECK(_shifterCore_writeLaunchPlan(planFile.c_str(), "1:2", names, ops, 3) == 0);
+    CHECK(_shifterCore_readLaunchPlan(planFile.c_str(), "1:2", &readNames, &readOps, &count) == 0);
+    CHECK(count == 3);
+    CHECK(strcmp(readNames[0], "usr") == 0);
+    CHECK(strcmp(readNames[2], "os-release") == 0);
+    CHECK(readNames[3] == NULL);
+    CHECK(readOps[1] == 'l');
+    for (size_t idx = 0; idx < count; idx++) {
+        free(readNames[idx]);
+    }
+    free(readNames);
+    free(readOps);
+    readNames = NULL;
+    readOps = NULL;
+
+    /* changed source invalidates the plan */
+    CHECK(_shifterCore_readLaunchPlan(planFile.c_str(), "1:3", &readNames, &readOps, &count) != 0);
+    CHECK(readNames == NULL);
+
+    /* truncated plans are rejected */
+    FILE *fp = fopen(planFile.c_str(), "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "SHIFTER_LAUNCHPLAN 1 1:2\nd usr\n");
+    fclose(fp);
+    CHECK(_shifterCore_readLaunchPlan(planFile.c_str(), "1:2", &readNames, &readOps, &count) != 0);
+
+    /* a name that fails the filter rejects the whole plan */
+    fp = fopen(planFile.c_str(), "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "SHIFTER_LAUNCHPLAN 1 1:2\nd usr\nf bad$name\nl lib64\nEND\n");
+    fclose(fp);
+    CHECK(_shifterCore_readLaunchPlan(planFile.c_str(), "1:2", &readNames, &readOps, &count) != 0);
+    CHECK(readNames == NULL);
+
+    tmpFiles.push_back(planFile);
+    for (char **ptr = names; *ptr != NULL; ptr++) {
+        free(*ptr);
+    }
+}
+
+TEST(ShifterCoreTestGroup, trackedSshd_basic) {
+    UdiRootConfig config;
+    unsigned long long startTime = 0;
+    unsigned long long recorded = 0;
+    pid_t pid = 0;
+    string stateDir = string(tmpDir) + "/state";
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    config.udiMountPoint = tmpDir;
+    config.udiStatePath = (char *) stateDir.c_str();
+    tmpDirs.push_back(stateDir);
+
+    CHECK(_shifterCore_procStartTime(getpid(), &startTime) == 0);
+    CHECK(startTime > 0);
+
+    /* the record is kept in a private state directory outside the UDI */
+    CHECK(_shifterCore_recordSshd(getpid(), &config) == 0);
+    char *record = _shifterCore_udiStateFile(&config, "sshd");
+    CHECK(record != NULL);
+    CHECK(strncmp(record, stateDir.c_str(), stateDir.length()) == 0);
+    tmpFiles.push_back(record);
+    struct stat statData;
+    CHECK(stat(stateDir.c_str(), &statData) == 0);
+    CHECK((statData.st_mode & 0777) == 0700);
+    CHECK(_shifterCore_readSshdRecord(&config, &pid, &recorded) == 0);
+    CHECK(pid == getpid());
+    CHECK(recorded == startTime);
+
+    /* a recorded process that is not the sshd of the UDI is not returned */
+    CHECK(_shifterCore_isUdiSshd(getpid(), &config) == 0);
+    CHECK(findTrackedSshd(&config) == 0);
+
+    /* records anyone else could have written are not trusted */
+    CHECK(chmod(record, 0666) == 0);
+    CHECK(_shifterCore_readSshdRecord(&config, &pid, &recorded) != 0);
+    CHECK(unlink(record) == 0);
+    string target = stateDir + "/target";
+    FILE *fp = fopen(target.c_str(), "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "%d %llu\n", getpid(), startTime);
+    fclose(fp);
+    tmpFiles.push_back(target);
+    CHECK(symlink(target.c_str(), record) == 0);
+    CHECK(_shifterCore_readSshdRecord(&config, &pid, &recorded) != 0);
+
+    /* an unusable state directory fails the record */
+    CHECK(chmod(stateDir.c_str(), 0755) == 0);
+    CHECK(_shifterCore_recordSshd(getpid(), &config) != 0);
+    CHECK(chmod(stateDir.c_str(), 0700) == 0);
+
+    /* nothing to stop */
+    CHECK(stopSshd(&config) == 0);
+    free(record);
+}
+
+TEST(ShifterCoreTestGroup, isListening_basic) {
+    struct sockaddr_in addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(sock >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    CHECK(_shifterCore_isListening(getpid()) == 0);
+    CHECK(listen(sock, 1) == 0);
+    CHECK(_shifterCore_isListening(getpid()) == 1);
+    close(sock);
+    CHECK(_shifterCore_isListening(getpid()) == 0);
+}
+
+TEST(ShifterCoreTestGroup, deferredTeardown_basic) {
+    UdiRootConfig config;
+    unsigned long long startTime = 0;
+    string stateDir = string(tmpDir) + "/teardown";
+    string udiDir = string(tmpDir) + "/udi";
+    string loopDir = string(tmpDir) + "/loop";
+    char *record = NULL;
+    int status = 0;
+    int fd = -1;
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    config.udiMountPoint = (char *) udiDir.c_str();
+    config.loopMountPoint = (char *) loopDir.c_str();
+    config.teardownStatePath = (char *) stateDir.c_str();
+    CHECK(mkdir(stateDir.c_str(), 0700) == 0);
+    tmpDirs.push_back(stateDir);
+
+    /* stand-in for the sshd of the UDI */
+    pid_t child = fork();
+    if (child == 0) {
+        for ( ; ; ) {
+            pause();
+        }
+    }
+    CHECK(child > 0);
+    CHECK(_shifterCore_procStartTime(child, &startTime) == 0);
+
+    fd = _shifterCore_writeTeardown(stateDir.c_str(), child, startTime,
+            &config, &record);
+    CHECK(fd >= 0);
+    CHECK(access(record, F_OK) == 0);
+
+    /* nothing is mounted, so only a new sshd would be in the way */
+    CHECK(_shifterCore_teardownConflicts(fd, 1, &config) == 1);
+    CHECK(_shifterCore_teardownConflicts(fd, 0, &config) == 0);
+
+    CHECK(_shifterCore_reapTeardown(fd, record, 2) == 0);
+    close(fd);
+    CHECK(access(record, F_OK) != 0);
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM);
+    free(record);
+    record = NULL;
+
+    /* records left without a reaper are finished before the next setup */
+    fd = _shifterCore_writeTeardown(stateDir.c_str(), 0, 0, &config, &record);
+    CHECK(fd >= 0);
+    close(fd);
+    CHECK(waitForTeardown(&config, 1) == 0);
+    CHECK(access(record, F_OK) != 0);
+    free(record);
+
+    /* a recorded pid that is not the sshd of the UDI is not handed to the
+     * reaper */
+    string udiStateDir = string(tmpDir) + "/state";
+    config.udiStatePath = (char *) udiStateDir.c_str();
+    CHECK(mkdir(udiDir.c_str(), 0755) == 0);
+    tmpDirs.push_back(udiDir);
+    tmpDirs.push_back(udiStateDir);
+    child = fork();
+    if (child == 0) {
+        for ( ; ; ) {
+            pause();
+        }
+    }
+    CHECK(child > 0);
+    CHECK(_shifterCore_recordSshd(child, &config) == 0);
+    char *sshdRecord = _shifterCore_udiStateFile(&config, "sshd");
+    tmpFiles.push_back(sshdRecord);
+    free(sshdRecord);
+    CHECK(deferDestructUDI(&config) == 0);
+    int pending = 1;
+    for (int tries = 0; pending && tries < 100; tries++) {
+        DIR *dirp = opendir(stateDir.c_str());
+        struct dirent *entry = NULL;
+        CHECK(dirp != NULL);
+        pending = 0;
+        while ((entry = readdir(dirp)) != NULL) {
+            if (strncmp(entry->d_name, "teardown.", 9) == 0) pending = 1;
+        }
+        closedir(dirp);
+        usleep(20000);
+    }
+    CHECK(pending == 0);
+    CHECK(waitpid(child, &status, WNOHANG) == 0);
+    kill(child, SIGKILL);
+    CHECK(waitpid(child, &status, 0) == child);
+}
+
+TEST(ShifterCoreTestGroup, sshKeyPool_basic) {
+    string poolDir = string(tmpDir) + "/keypool";
+    string etcDir = string(tmpDir) + "/etc";
+    string keygen = string(tmpDir) + "/fake-keygen";
+    const char *types[] = {"dsa", "ecdsa", "rsa", "ed25519", NULL};
+    const char **typePtr = NULL;
+    struct stat statData;
+    char *keySet = NULL;
+    int count = 0;
+    FILE *fp = NULL;
+
+    CHECK(_shifterCore_checkPrivateDir(poolDir.c_str(), S_IRWXG | S_IRWXO) == 0);
+    CHECK(chmod(poolDir.c_str(), 0755) == 0);
+    CHECK(_shifterCore_checkPrivateDir(poolDir.c_str(), S_IRWXG | S_IRWXO) == 1);
+    CHECK(chmod(poolDir.c_str(), 0700) == 0);
+    CHECK(mkdir(etcDir.c_str(), 0755) == 0);
+
+    /* nothing to claim until the pool is filled */
+    CHECK(_shifterCore_claimHostKeys(poolDir.c_str()) == NULL);
+
+    /* stand-in for ssh-keygen writing the key given with -f */
+    fp = fopen(keygen.c_str(), "w");
+    CHECK(fp != NULL);
+    fprintf(fp, "#!/bin/sh\nwhile [ $# -gt 0 ]; do\n"
+            "  if [ \"$1\" = \"-f\" ]; then echo private > \"$2\"; "
+            "echo public > \"$2.pub\"; fi\n  shift\ndone\n");
+    fclose(fp);
+    CHECK(chmod(keygen.c_str(), 0755) == 0);
+    CHECK(_shifterCore_refillKeyPool(poolDir.c_str(), keygen.c_str()) == 0);
+
+    keySet = _shifterCore_claimHostKeys(poolDir.c_str());
+    CHECK(keySet != NULL);
+    CHECK(_shifterCore_installHostKeys(keySet, etcDir.c_str(), getuid(),
+                getgid()) == 0);
+    _shifterCore_removeKeySet(keySet);
+    CHECK(access(keySet, F_OK) != 0);
+    free(keySet);
+
+    for (typePtr = types; *typePtr != NULL; typePtr++) {
+        string key = etcDir + "/ssh_host_" + *typePtr + "_key";
+        string pub = key + ".pub";
+        CHECK(stat(key.c_str(), &statData) == 0);
+        CHECK((statData.st_mode & 0777) == 0600);
+        CHECK(statData.st_uid == getuid());
+        CHECK(stat(pub.c_str(), &statData) == 0);
+        CHECK((statData.st_mode & 0777) == 0644);
+        tmpFiles.push_back(key);
+        tmpFiles.push_back(pub);
+    }
+
+    /* the remaining sets are claimed once each */
+    while ((keySet = _shifterCore_claimHostKeys(poolDir.c_str())) != NULL) {
+        _shifterCore_removeKeySet(keySet);
+        free(keySet);
+        count++;
+    }
+    CHECK(count == 3);
+
+    tmpFiles.push_back(keygen);
+    tmpFiles.push_back(poolDir + "/.refill.lock");
+    tmpDirs.push_back(poolDir);
+    tmpDirs.push_back(etcDir);
+}
+
+TEST(ShifterCoreTestGroup, diffShifterConfig_basic) {
+    ImageData image;
+    VolumeMap loaded;
+    VolumeMap requested;
+    VolumeMap added;
+    VolumeMap removed;
+    UdiRootConfig config;
+    string varDir = string(tmpDir) + "/var";
+    string dirA = string(tmpDir) + "/a";
+    string dirB = string(tmpDir) + "/b";
+    string stateDir = string(tmpDir) + "/state";
+    char *record = NULL;
+
+    memset(&image, 0, sizeof(ImageData));
+    memset(&loaded, 0, sizeof(VolumeMap));
+    memset(&requested, 0, sizeof(VolumeMap));
+    memset(&added, 0, sizeof(VolumeMap));
+    memset(&removed, 0, sizeof(VolumeMap));
+    memset(&config, 0, sizeof(UdiRootConfig));
+    image.identifier = strdup("testImage");
+    config.udiMountPoint = tmpDir;
+    config.udiStatePath = (char *) stateDir.c_str();
+    CHECK(mkdir(varDir.c_str(), 0755) == 0);
+    CHECK(mkdir(dirA.c_str(), 0755) == 0);
+    CHECK(mkdir(dirB.c_str(), 0755) == 0);
+    tmpDirs.push_back(dirA);
+    tmpDirs.push_back(dirB);
+    tmpDirs.push_back(varDir);
+    tmpDirs.push_back(stateDir);
+    tmpFiles.push_back(varDir + "/shifterConfig.json");
+
+    CHECK(parseVolumeMap("/tmp:/a:ro", &loaded) == 0);
+    CHECK(saveShifterConfig("dmj", &image, &loaded, &config) == 0);
+
+    /* the volume record is kept out of the UDI */
+    record = _shifterCore_udiStateFile(&config, "volumes");
+    CHECK(record != NULL);
+    CHECK(strncmp(record, stateDir.c_str(), stateDir.length()) == 0);
+    CHECK(access(record, R_OK) == 0);
+    tmpFiles.push_back(record);
+
+    /* one volume more and one less */
+    CHECK(parseVolumeMap("/tmp:/b:perNodeCache=size=1G", &requested) == 0);
+    CHECK(diffShifterConfig("dmj", &image, &requested, &config, &added, &removed) == 0);
+    CHECK(added.n == 1);
+    CHECK(strcmp(added.to[0], "/b") == 0);
+    CHECK(added.flags[0][0].type == VOLMAP_FLAG_PERNODECACHE);
+    CHECK(removed.n == 1);
+    CHECK(strcmp(removed.to[0], "/a") == 0);
+    free_VolumeMap(&added, 0);
+    free_VolumeMap(&removed, 0);
+    memset(&added, 0, sizeof(VolumeMap));
+    memset(&removed, 0, sizeof(VolumeMap));
+
+    /* a new destination that does not exist needs a rebuild */
+    free_VolumeMap(&requested, 0);
+    memset(&requested, 0, sizeof(VolumeMap));
+    CHECK(parseVolumeMap("/tmp:/c", &requested) == 0);
+    CHECK(diffShifterConfig("dmj", &image, &requested, &config, &added, &removed) != 0);
+    free_VolumeMap(&added, 0);
+    free_VolumeMap(&removed, 0);
+    memset(&added, 0, sizeof(VolumeMap));
+    memset(&removed, 0, sizeof(VolumeMap));
+
+    /* so does a different user */
+    CHECK(diffShifterConfig("other", &image, &loaded, &config, &added, &removed) != 0);
+    free_VolumeMap(&added, 0);
+    free_VolumeMap(&removed, 0);
+    memset(&added, 0, sizeof(VolumeMap));
+    memset(&removed, 0, sizeof(VolumeMap));
+
+    /* and a record that cannot be trusted */
+    CHECK(diffShifterConfig("dmj", &image, &loaded, &config, &added, &removed) == 0);
+    free_VolumeMap(&added, 0);
+    free_VolumeMap(&removed, 0);
+    memset(&added, 0, sizeof(VolumeMap));
+    memset(&removed, 0, sizeof(VolumeMap));
+    CHECK(chmod(record, 0666) == 0);
+    CHECK(diffShifterConfig("dmj", &image, &loaded, &config, &added, &removed) != 0);
+    free_VolumeMap(&added, 0);
+    free_VolumeMap(&removed, 0);
+    memset(&added, 0, sizeof(VolumeMap));
+    memset(&removed, 0, sizeof(VolumeMap));
+
+    /* or a missing one */
+    CHECK(unlink(record) == 0);
+    CHECK(diffShifterConfig("dmj", &image, &loaded, &config, &added, &removed) != 0);
+    free_VolumeMap(&added, 0);
+    free_VolumeMap(&removed, 0);
+
+    free_VolumeMap(&loaded, 0);
+    free_VolumeMap(&requested, 0);
+    free(image.identifier);
+    free(record);
+}
+
+TEST(ShifterCoreTestGroup, warmVolumeSources_basic) {
+    UdiRootConfig config;
+    VolumeMap siteFs;
+
+    memset(&config, 0, sizeof(UdiRootConfig));
+    memset(&siteFs, 0, sizeof(VolumeMap));
+    CHECK(_shifterCore_warmVolumeSources(&config) == 0);
+
+    config.siteFs = &siteFs;
+    CHECK(parseVolumeMapSiteFs("/tmp:/tmp;/none:/cache:perNodeCache=size=100M;/does/not/exist:/missing;/usr:/usr", &siteFs) == 0);
+
+    /* per-node caches have no source to access, missing ones are ignored */
+    CHECK(_shifterCore_warmVolumeSources(&config) == 3);
+
+    free_VolumeMap(&siteFs, 0);
+}
+
 TEST(ShifterCoreTestGroup, _test_shifterconfig_str) {
     ImageData image;
     VolumeMap vmap;
@@ -27,11 +27,21 @@
 #include <CppUTest/CommandLineTestRunner.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "shifterimg.h"
+#include "utility.h"
 
 extern "C" {
 extern void _add_allowed(enum AclCredential aclType, struct options *config, const char *arg);
+extern char *lookupCachePath(const char *cacheBase, const char *system, const char *type, const char *tag);
+extern ImageGwLookupCache *readLookupCache(const char *path, const char *key);
+extern int writeLookupCache(const char *path, const char *key, const char *etag, const char *identifier);
+extern void free_ImageGwLookupCache(ImageGwLookupCache *entry);
+extern time_t _parse_since(const char *arg);
+extern char *_prepare_lookup_payload(struct options *config);
 }
 
 TEST_GROUP(ShifterimgTestGroup) {
@@ -51,6 +61,78 @@ TEST(ShifterimgTestGroup, addAllowedTest) {
     free(config.allowed_uids);
 }
 
+TEST(ShifterimgTestGroup, lookupCacheTest) {
+    char tmpDir[] = "/tmp/shifterimg.test.XXXXXX";
+    CHECK(mkdtemp(tmpDir) != NULL);
+
+    CHECK(lookupCachePath("none", "sys", "docker", "ubuntu:16.04") == NULL);
+    char *path = lookupCachePath(tmpDir, "sys", "docker", "ubuntu:16.04");
+    CHECK(path != NULL);
+    char *other = lookupCachePath(tmpDir, "sys", "docker", "ubuntu:18.04");
+    CHECK(other != NULL);
+    CHECK(strcmp(path, other) != 0);
+
+    const char *key = "sys:docker:ubuntu:16.04";
+    CHECK(readLookupCache(path, key) == NULL);
+    CHECK(writeLookupCache(path, key, "\"abc-123\"", "0123abcd") == 0);
+
+    ImageGwLookupCache *entry = readLookupCache(path, key);
+    CHECK(entry != NULL);
+    CHECK(strcmp(entry->etag, "\"abc-123\"") == 0);
+    CHECK(strcmp(entry->identifier, "0123abcd") == 0);
+    free_ImageGwLookupCache(entry);
+
+    /* an entry is only used for the key it was stored for */
+    CHECK(readLookupCache(path, "sys:docker:ubuntu:18.04") == NULL);
+
+    /* the cache directory must not be accessible by others */
+    char *cacheDir = alloc_strgenf("%s/shifterimg.%d", tmpDir, (int) getuid());
+    CHECK(chmod(cacheDir, 0755) == 0);
+    CHECK(lookupCachePath(tmpDir, "sys", "docker", "ubuntu:16.04") == NULL);
+
+    unlink(path);
+    rmdir(cacheDir);
+    rmdir(tmpDir);
+    free(cacheDir);
+    free(path);
+    free(other);
+}
+
+TEST(ShifterimgTestGroup, parseSinceTest) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(struct tm));
+    tm.tm_year = 117;
+    tm.tm_mon = 6;
+    tm.tm_mday = 14;
+    tm.tm_isdst = -1;
+    time_t day = mktime(&tm);
+
+    CHECK(_parse_since("1500000000") == 1500000000);
+    CHECK(_parse_since("2017-07-14") == day);
+    CHECK(_parse_since("2017-07-14T00:01:00") == day + 60);
+    CHECK(_parse_since("2017-07-14 junk") == 0);
+    CHECK(_parse_since("yesterday") == 0);
+    CHECK(_parse_since("-5") == 0);
+}
+
+TEST(ShifterimgTestGroup, prepareLookupPayloadTest) {
+    struct options config;
+    char *images[] = {
+        (char *) "docker:ubuntu:16.04",
+        (char *) "custom:with\"quote"
+    };
+    memset(&config, 0, sizeof(struct options));
+
+    CHECK(_prepare_lookup_payload(&config) == NULL);
+    config.batchImages = images;
+    config.batchImages_len = 2;
+    char *payload = _prepare_lookup_payload(&config);
+    CHECK(payload != NULL);
+    CHECK(strcmp(payload, "{\"images\":[\"docker:ubuntu:16.04\","
+                "\"custom:with\\\"quote\"]}") == 0);
+    free(payload);
+}
+
 int main(int argc, char **argv) {
     return CommandLineTestRunner::RunAllTests(argc, argv);
 }
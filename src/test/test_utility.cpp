@@ -350,6 +350,16 @@ TEST(UtilityTestGroup, userInputPathFilter_basic) {
     free(filtered);
 }
 
+TEST(UtilityTestGroup, userInputPathFilterBuffer_basic) {
+    char buffer[16];
+    CHECK(userInputPathFilterBuffer("benign; rm", 0, buffer, sizeof(buffer)) == buffer);
+    CHECK(strcmp(buffer, "benignrm") == 0);
+
+    /* buffer must hold the unfiltered input */
+    CHECK(userInputPathFilterBuffer("0123456789abcdef", 0, buffer, sizeof(buffer)) == NULL);
+    CHECK(userInputPathFilterBuffer(NULL, 0, buffer, sizeof(buffer)) == NULL);
+}
+
 TEST(UtilityTestGroup, allocStrgenf_basic) {
     char *myString = alloc_strgenf("This is a test: %d\n", 37*73);
     CHECK(myString != NULL)
@@ -523,6 +533,18 @@ TEST(UtilityTestGroup, dup_string_array_basic) {
     free_string_array(dup);
 }
 
+TEST(UtilityTestGroup, fnv1a64_basic) {
+    uint64_t hash = SHIFTER_FNV1A64_INIT;
+    CHECK(shifter_fnv1a64(hash, "", 0) == 0xcbf29ce484222325ULL);
+    CHECK(shifter_fnv1a64(hash, "a", 1) == 0xaf63dc4c8601ec8cULL);
+    CHECK(shifter_fnv1a64(hash, "foobar", 6) == 0x85944171f73967e8ULL);
+
+    /* hashing in pieces must match hashing in one go */
+    hash = shifter_fnv1a64(hash, "foo", 3);
+    hash = shifter_fnv1a64(hash, "bar", 3);
+    CHECK(hash == 0x85944171f73967e8ULL);
+}
+
 int main(int argc, char** argv) {
         return CommandLineTestRunner::RunAllTests(argc, argv);
 }
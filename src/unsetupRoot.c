@@ -67,6 +67,10 @@ int main(void) {
         exit(1);
     }
 
+    /* hand the slow part of the teardown to a reaper if configured */
+    if (deferDestructUDI(&udiConfig) == 0) {
+        return 0;
+    }
     destructUDI(&udiConfig, 1);
 
     return 0;
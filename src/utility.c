@@ -383,19 +383,41 @@ char *alloc_strgenf(const char *format, ...) {
  * Returns NULL if input is NULL or there is a memory allocation error
  */
 char *userInputPathFilter(const char *input, int allowSlash) {
-    ssize_t len = 0;
+    size_t len = 0;
     char *ret = NULL;
-    const char *rptr = NULL;
-    char *wptr = NULL;
     if (input == NULL) return NULL;
 
     len = strlen(input) + 1;
     ret = _malloc(sizeof(char) * len);
     if (ret == NULL) return NULL;
 
+    return userInputPathFilterBuffer(input, allowSlash, ret, len);
+}
+
+/**
+ * userInputPathFilterBuffer is userInputPathFilter writing into a caller
+ * provided buffer, for use in loops where allocating each result is wasteful
+ *
+ * Parameters:
+ *      input - the user provided string
+ *      allowSlash - flag to allow a '/' in the string (1 for yes, 0 for no)
+ *      buffer - destination for the filtered string
+ *      len - size of buffer, must be at least strlen(input) + 1
+ *
+ * Returns buffer
+ * Returns NULL if input or buffer is NULL or buffer is too small
+ */
+char *userInputPathFilterBuffer(const char *input, int allowSlash,
+        char *buffer, size_t len)
+{
+    const char *rptr = NULL;
+    char *wptr = NULL;
+    if (input == NULL || buffer == NULL) return NULL;
+    if (strlen(input) + 1 > len) return NULL;
+
     rptr = input;
-    wptr = ret;
-    while (wptr - ret < len && *rptr != 0) {
+    wptr = buffer;
+    while (*rptr != 0) {
         if (isalnum(*rptr) || *rptr == '_' || *rptr == ':' || *rptr == '.' || *rptr == '+' || *rptr == '-') {
             *wptr++ = *rptr;
         }
@@ -405,7 +427,7 @@ char *userInputPathFilter(const char *input, int allowSlash) {
         rptr++;
     }
     *wptr = 0;
-    return ret;
+    return buffer;
 }
 
 char *cleanPath(const char *path) {
@@ -641,3 +663,20 @@ void free_string_array(char **arr) {
     }
     free(arr);
 }
+
+/**
+ * shifter_fnv1a64 - accumulate data into a 64-bit FNV-1a hash
+ *
+ * Start with SHIFTER_FNV1A64_INIT and feed the returned value back in to
+ * hash several buffers as one stream.  This is not a cryptographic hash, it
+ * is only used to detect changes in root-controlled site content.
+ */
+uint64_t shifter_fnv1a64(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *ptr = (const unsigned char *) data;
+    size_t idx = 0;
+    for (idx = 0; idx < len; idx++) {
+        hash ^= (uint64_t) ptr[idx];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
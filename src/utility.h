@@ -49,12 +49,15 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define SHIFTER_FNV1A64_INIT 0xcbf29ce484222325ULL
+
 char *shifter_trim(char *);
 int shifter_parseConfig(const char *fname, char delim, void *obj, int (*assign_fp)(const char *, const char *, void *));
 int strncpy_StringArray(const char *str, size_t n, char ***wptr, char ***array, size_t *capacity, size_t allocBlock);
@@ -63,6 +66,8 @@ char *alloc_strcatf(char *string, size_t *currLen, size_t *capacity, const char
 int pathcmp(const char *a, const char *b);
 char *cleanPath(const char *path);
 char *userInputPathFilter(const char *input, int allowSlash);
+char *userInputPathFilterBuffer(const char *input, int allowSlash,
+        char *buffer, size_t len);
 int is_json_array(const char *value);
 char **split_json_array(const char *value);
 size_t _count_args(char **args);
@@ -70,6 +75,7 @@ char **merge_args(char **args1, char **args2);
 char **make_string_array(const char *value);
 char **dup_string_array(char **);
 void free_string_array(char **);
+uint64_t shifter_fnv1a64(uint64_t hash, const void *data, size_t len);
 
 #ifdef __cplusplus
 }
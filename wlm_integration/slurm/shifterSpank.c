@@ -564,7 +564,7 @@ _mem_cgrp_term:
             free(memory_cgroup_path);
         } else {
             /* move sshd into slurm proctrack */
-            int sshd_pid = findSshd();
+            int sshd_pid = findTrackedSshd(ssconfig->udiConfig);
             stepd_fd = wrap_spank_stepd_connect(ssconfig, dir, hostname, jobid,
                     SLURM_EXTERN_CONT, &protocol);
 
@@ -1182,7 +1182,7 @@ int shifterSpank_job_prolog(shifterSpank_config *ssconfig) {
         }
     }
 
-    pid = findSshd();
+    pid = findTrackedSshd(ssconfig->udiConfig);
     _log(LOG_INFO, "shifter_prolog: sshd on pid %d\n", pid);
     
 _prolog_exit_unclean: